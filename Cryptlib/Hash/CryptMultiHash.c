@@ -0,0 +1,236 @@
+/** @file
+  Multi-Digest Wrapper Implementation over OpenSSL.
+
+  Computes several SHA digests of the same data stream in one pass. The input
+  is walked in small cache-resident blocks and every selected digest is fed
+  from each block before moving on to the next one, so large buffers are only
+  pulled in from memory once no matter how many digests are requested.
+
+Copyright (c) 2009 - 2016, Intel Corporation. All rights reserved.<BR>
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#include "InternalCryptLib.h"
+#include <openssl/sha.h>
+
+//
+// Number of input bytes handed to each selected digest before moving on to the
+// next block.  It is a multiple of both the SHA-1/SHA-256 (64 bytes) and the
+// SHA-384/SHA-512 (128 bytes) block sizes, so that when an update starts on a
+// block boundary, every step but the last ends on one too.  Updates of any other
+// length, like the PE regions generate_hash() feeds in, still leave the
+// contexts holding a partial block, as they would with separate updates.  The
+// step is small enough to still be in L1 cache when the last digest reads it.
+//
+#define MULTI_HASH_STEP_SIZE  2048
+
+typedef struct {
+  UINT32      HashMask;
+  SHA_CTX     Sha1;
+  SHA256_CTX  Sha256;
+  SHA512_CTX  Sha384;
+  SHA512_CTX  Sha512;
+} MULTI_HASH_CONTEXT;
+
+/**
+  Retrieves the size, in bytes, of the context buffer required for multi-digest
+  hash operations.
+
+  @return  The size, in bytes, of the context buffer required for multi-digest
+           hash operations.
+
+**/
+UINTN
+EFIAPI
+MultiHashGetContextSize (
+  VOID
+  )
+{
+  return (UINTN) (sizeof (MULTI_HASH_CONTEXT));
+}
+
+/**
+  Initializes user-supplied memory pointed by MultiHashContext as a multi-digest
+  hash context for subsequent use.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If HashMask is zero or contains unknown bits, then return FALSE.
+
+  @param[out]  MultiHashContext  Pointer to multi-digest context being initialized.
+  @param[in]   HashMask          Bitmask of HASH_ALG_* values selecting the digests
+                                 to compute.
+
+  @retval TRUE   Multi-digest context initialization succeeded.
+  @retval FALSE  Multi-digest context initialization failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashInit (
+  OUT  VOID    *MultiHashContext,
+  IN   UINT32  HashMask
+  )
+{
+  MULTI_HASH_CONTEXT  *Context;
+
+  //
+  // Check input parameters.
+  //
+  if (MultiHashContext == NULL || HashMask == 0 || (HashMask & ~HASH_ALG_ALL) != 0) {
+    return FALSE;
+  }
+
+  Context = (MULTI_HASH_CONTEXT *) MultiHashContext;
+  Context->HashMask = HashMask;
+
+  if ((HashMask & HASH_ALG_SHA1) != 0 && !SHA1_Init (&Context->Sha1)) {
+    return FALSE;
+  }
+  if ((HashMask & HASH_ALG_SHA256) != 0 && !SHA256_Init (&Context->Sha256)) {
+    return FALSE;
+  }
+  if ((HashMask & HASH_ALG_SHA384) != 0 && !SHA384_Init (&Context->Sha384)) {
+    return FALSE;
+  }
+  if ((HashMask & HASH_ALG_SHA512) != 0 && !SHA512_Init (&Context->Sha512)) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+  Digests the input data and updates every digest selected in the multi-digest
+  context.
+
+  This function can be called multiple times to compute the digests of long or
+  discontinuous data streams. The context should be already correctly initialized
+  by MultiHashInit(), and should not be finalized by MultiHashFinal(). Behavior
+  with invalid context is undefined.
+
+  If MultiHashContext is NULL, then return FALSE.
+
+  @param[in, out]  MultiHashContext  Pointer to the multi-digest context.
+  @param[in]       Data              Pointer to the buffer containing the data to be hashed.
+  @param[in]       DataSize          Size of Data buffer in bytes.
+
+  @retval TRUE   Multi-digest data digest succeeded.
+  @retval FALSE  Multi-digest data digest failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashUpdate (
+  IN OUT  VOID        *MultiHashContext,
+  IN      CONST VOID  *Data,
+  IN      UINTN       DataSize
+  )
+{
+  MULTI_HASH_CONTEXT  *Context;
+  CONST UINT8         *Block;
+  UINTN               BlockSize;
+  UINT32              HashMask;
+
+  //
+  // Check input parameters.
+  //
+  if (MultiHashContext == NULL) {
+    return FALSE;
+  }
+
+  //
+  // Check invalid parameters, in case that only DataLength was checked in OpenSSL
+  //
+  if (Data == NULL && DataSize != 0) {
+    return FALSE;
+  }
+
+  Context  = (MULTI_HASH_CONTEXT *) MultiHashContext;
+  HashMask = Context->HashMask;
+  Block    = (CONST UINT8 *) Data;
+
+  while (DataSize > 0) {
+    BlockSize = DataSize;
+    if (BlockSize > MULTI_HASH_STEP_SIZE) {
+      BlockSize = MULTI_HASH_STEP_SIZE;
+    }
+
+    if ((HashMask & HASH_ALG_SHA256) != 0 && !CryptSha256Update (&Context->Sha256, Block, BlockSize)) {
+      return FALSE;
+    }
+    if ((HashMask & HASH_ALG_SHA1) != 0 && !CryptSha1Update (&Context->Sha1, Block, BlockSize)) {
+      return FALSE;
+    }
+    if ((HashMask & HASH_ALG_SHA384) != 0 && !SHA384_Update (&Context->Sha384, Block, BlockSize)) {
+      return FALSE;
+    }
+    if ((HashMask & HASH_ALG_SHA512) != 0 && !SHA512_Update (&Context->Sha512, Block, BlockSize)) {
+      return FALSE;
+    }
+
+    Block    += BlockSize;
+    DataSize -= BlockSize;
+  }
+
+  return TRUE;
+}
+
+/**
+  Completes computation of every digest selected in the multi-digest context.
+
+  Digests that were not selected by MultiHashInit() are left untouched in
+  HashValue. After this function has been called, the multi-digest context
+  cannot be used again.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If HashValue is NULL, then return FALSE.
+
+  @param[in, out]  MultiHashContext  Pointer to the multi-digest context.
+  @param[out]      HashValue         Pointer to a structure that receives the digest values.
+
+  @retval TRUE   Multi-digest computation succeeded.
+  @retval FALSE  Multi-digest computation failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashFinal (
+  IN OUT  VOID              *MultiHashContext,
+  OUT     MULTI_HASH_VALUE  *HashValue
+  )
+{
+  MULTI_HASH_CONTEXT  *Context;
+  UINT32              HashMask;
+
+  //
+  // Check input parameters.
+  //
+  if (MultiHashContext == NULL || HashValue == NULL) {
+    return FALSE;
+  }
+
+  Context  = (MULTI_HASH_CONTEXT *) MultiHashContext;
+  HashMask = Context->HashMask;
+
+  if ((HashMask & HASH_ALG_SHA1) != 0 && !SHA1_Final (HashValue->Sha1, &Context->Sha1)) {
+    return FALSE;
+  }
+  if ((HashMask & HASH_ALG_SHA256) != 0 && !SHA256_Final (HashValue->Sha256, &Context->Sha256)) {
+    return FALSE;
+  }
+  if ((HashMask & HASH_ALG_SHA384) != 0 && !SHA384_Final (HashValue->Sha384, &Context->Sha384)) {
+    return FALSE;
+  }
+  if ((HashMask & HASH_ALG_SHA512) != 0 && !SHA512_Final (HashValue->Sha512, &Context->Sha512)) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
@@ -140,7 +140,7 @@ Sha1Update (
   //
   // OpenSSL SHA-1 Hash Update
   //
-  return (BOOLEAN) (SHA1_Update ((SHA_CTX *) Sha1Context, Data, DataSize));
+  return CryptSha1Update (Sha1Context, Data, DataSize);
 }
 
 /**
@@ -137,9 +137,9 @@ Sha256Update (
   }
 
   //
-  // OpenSSL SHA-256 Hash Update
+  // OpenSSL SHA-256 Hash Update, using the CPU hash instructions when present
   //
-  return (BOOLEAN) (SHA256_Update ((SHA256_CTX *) Sha256Context, Data, DataSize));
+  return CryptSha256Update (Sha256Context, Data, DataSize);
 }
 
 /**
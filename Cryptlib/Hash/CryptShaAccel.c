@@ -0,0 +1,625 @@
+/** @file
+  SHA-1 and SHA-256 block processing using CPU hash instructions.
+
+  OpenSSL's portable sha1/sha256 block functions are built without assembler
+  and without any optimization, which makes them the dominant cost when large
+  images are hashed. This file provides block functions built on the x86 SHA
+  extensions (SHA-NI) and on the ARMv8 Cryptography Extensions, selected at
+  runtime from CPUID / ID_AA64ISAR0_EL1, and update routines that hand every
+  complete block to them while leaving partial blocks, padding and
+  finalization to the regular OpenSSL context code. When the CPU has no hash
+  instructions the update routines simply call into OpenSSL.
+
+Copyright (c) 2009 - 2016, Intel Corporation. All rights reserved.<BR>
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#include "InternalCryptLib.h"
+#include <openssl/sha.h>
+
+#if defined (MDE_CPU_X64)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA_ACCEL_SUPPORTED
+
+//
+// The rest of the firmware is built without SSE, so only the block functions
+// below are allowed to touch the XMM registers. They use the UEFI (Microsoft
+// x64) calling convention, under which XMM6-XMM15 are callee-saved; the
+// compiler therefore saves and restores every non-volatile vector register
+// they use, and the firmware's own XMM state survives the call. XMM0-XMM5 are
+// volatile in that convention and are never live across our callers.
+//
+#define SHA_ACCEL_ABI  __attribute__ ((ms_abi))
+#elif defined (MDE_CPU_AARCH64)
+#include <arm_neon.h>
+#define SHA_ACCEL_SUPPORTED
+#define SHA_ACCEL_ABI
+#else
+#define SHA_ACCEL_ABI
+#endif
+
+#define SHA_BLOCK_SIZE        64
+
+#define SHA_ACCEL_PROBED      0x01
+#define SHA_ACCEL_SHA1        0x02
+#define SHA_ACCEL_SHA256      0x04
+
+typedef VOID (SHA_ACCEL_ABI *SHA_BLOCK_FUNC) (UINT32 *State, CONST UINT8 *Data, UINTN Blocks);
+
+#if defined (SHA_ACCEL_SUPPORTED)
+
+static UINTN  mShaAccelFeatures = 0;
+
+static CONST UINT32  mSha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#endif
+
+#if defined (MDE_CPU_X64)
+
+#define SHA_NI_FUNC  __attribute__ ((target ("sha,sse4.1,ssse3"))) SHA_ACCEL_ABI
+
+/**
+  Checks whether the processor supports the SHA extensions.
+
+**/
+static
+UINTN
+ShaAccelProbe (
+  VOID
+  )
+{
+  UINT32  Eax;
+  UINT32  Ebx;
+  UINT32  Ecx;
+  UINT32  Edx;
+
+  if (__get_cpuid_max (0, NULL) < 7) {
+    return 0;
+  }
+
+  //
+  // SSSE3 (PSHUFB) and SSE4.1 (PBLENDW/PEXTRD) are needed around the SHA
+  // instructions themselves.
+  //
+  __cpuid (1, Eax, Ebx, Ecx, Edx);
+  if ((Ecx & bit_SSSE3) == 0 || (Ecx & bit_SSE4_1) == 0) {
+    return 0;
+  }
+
+  __cpuid_count (7, 0, Eax, Ebx, Ecx, Edx);
+  if ((Ebx & (1 << 29)) == 0) {
+    return 0;
+  }
+
+  return SHA_ACCEL_SHA1 | SHA_ACCEL_SHA256;
+}
+
+/**
+  Processes complete 64-byte blocks with the SHA-NI SHA-1 instructions.
+
+**/
+static
+SHA_NI_FUNC
+VOID
+Sha1BlocksShaNi (
+  UINT32       *State,
+  CONST UINT8  *Data,
+  UINTN        Blocks
+  )
+{
+  __m128i  Abcd;
+  __m128i  AbcdSave;
+  __m128i  E0;
+  __m128i  ESave;
+  __m128i  ENext;
+  __m128i  Msg[4];
+  __m128i  Mask;
+  UINTN    Group;
+
+  Mask = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  Abcd = _mm_loadu_si128 ((CONST __m128i *) State);
+  Abcd = _mm_shuffle_epi32 (Abcd, 0x1B);
+  E0   = _mm_set_epi32 ((INT32) State[4], 0, 0, 0);
+
+  while (Blocks-- > 0) {
+    AbcdSave = Abcd;
+    ESave    = E0;
+
+    //
+    // Twenty groups of four rounds. Message words for group N + 4 are built
+    // up in Msg[N & 3] over groups N + 1 .. N + 3.
+    //
+    for (Group = 0; Group < 20; Group++) {
+      if (Group < 4) {
+        Msg[Group] = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + Group * 16)), Mask);
+      }
+
+      if (Group == 0) {
+        E0 = _mm_add_epi32 (E0, Msg[0]);
+      } else {
+        E0 = _mm_sha1nexte_epu32 (E0, Msg[Group & 3]);
+      }
+      ENext = Abcd;
+
+      if (Group >= 3 && Group <= 18) {
+        Msg[(Group + 1) & 3] = _mm_sha1msg2_epu32 (Msg[(Group + 1) & 3], Msg[Group & 3]);
+      }
+
+      switch (Group / 5) {
+      case 0:
+        Abcd = _mm_sha1rnds4_epu32 (Abcd, E0, 0);
+        break;
+      case 1:
+        Abcd = _mm_sha1rnds4_epu32 (Abcd, E0, 1);
+        break;
+      case 2:
+        Abcd = _mm_sha1rnds4_epu32 (Abcd, E0, 2);
+        break;
+      default:
+        Abcd = _mm_sha1rnds4_epu32 (Abcd, E0, 3);
+        break;
+      }
+
+      if (Group >= 1 && Group <= 16) {
+        Msg[(Group + 3) & 3] = _mm_sha1msg1_epu32 (Msg[(Group + 3) & 3], Msg[Group & 3]);
+      }
+      if (Group >= 2 && Group <= 17) {
+        Msg[(Group + 2) & 3] = _mm_xor_si128 (Msg[(Group + 2) & 3], Msg[Group & 3]);
+      }
+
+      E0 = ENext;
+    }
+
+    E0   = _mm_sha1nexte_epu32 (E0, ESave);
+    Abcd = _mm_add_epi32 (Abcd, AbcdSave);
+
+    Data += SHA_BLOCK_SIZE;
+  }
+
+  Abcd = _mm_shuffle_epi32 (Abcd, 0x1B);
+  _mm_storeu_si128 ((__m128i *) State, Abcd);
+  State[4] = (UINT32) _mm_extract_epi32 (E0, 3);
+}
+
+/**
+  Processes complete 64-byte blocks with the SHA-NI SHA-256 instructions.
+
+**/
+static
+SHA_NI_FUNC
+VOID
+Sha256BlocksShaNi (
+  UINT32       *State,
+  CONST UINT8  *Data,
+  UINTN        Blocks
+  )
+{
+  __m128i  State0;
+  __m128i  State1;
+  __m128i  AbefSave;
+  __m128i  CdghSave;
+  __m128i  Msg[4];
+  __m128i  Wk;
+  __m128i  Tmp;
+  __m128i  Mask;
+  UINTN    Group;
+
+  Mask = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  //
+  // The instructions keep the working variables as ABEF / CDGH.
+  //
+  Tmp    = _mm_loadu_si128 ((CONST __m128i *) &State[0]);
+  State1 = _mm_loadu_si128 ((CONST __m128i *) &State[4]);
+  Tmp    = _mm_shuffle_epi32 (Tmp, 0xB1);
+  State1 = _mm_shuffle_epi32 (State1, 0x1B);
+  State0 = _mm_alignr_epi8 (Tmp, State1, 8);
+  State1 = _mm_blend_epi16 (State1, Tmp, 0xF0);
+
+  while (Blocks-- > 0) {
+    AbefSave = State0;
+    CdghSave = State1;
+
+    for (Group = 0; Group < 16; Group++) {
+      if (Group < 4) {
+        Msg[Group] = _mm_shuffle_epi8 (_mm_loadu_si128 ((CONST __m128i *) (Data + Group * 16)), Mask);
+      } else {
+        Tmp = _mm_sha256msg1_epu32 (Msg[Group & 3], Msg[(Group + 1) & 3]);
+        Tmp = _mm_add_epi32 (Tmp, _mm_alignr_epi8 (Msg[(Group + 3) & 3], Msg[(Group + 2) & 3], 4));
+        Msg[Group & 3] = _mm_sha256msg2_epu32 (Tmp, Msg[(Group + 3) & 3]);
+      }
+
+      Wk     = _mm_add_epi32 (Msg[Group & 3], _mm_loadu_si128 ((CONST __m128i *) &mSha256K[Group * 4]));
+      State1 = _mm_sha256rnds2_epu32 (State1, State0, Wk);
+      Wk     = _mm_shuffle_epi32 (Wk, 0x0E);
+      State0 = _mm_sha256rnds2_epu32 (State0, State1, Wk);
+    }
+
+    State0 = _mm_add_epi32 (State0, AbefSave);
+    State1 = _mm_add_epi32 (State1, CdghSave);
+
+    Data += SHA_BLOCK_SIZE;
+  }
+
+  Tmp    = _mm_shuffle_epi32 (State0, 0x1B);
+  State1 = _mm_shuffle_epi32 (State1, 0xB1);
+  State0 = _mm_blend_epi16 (Tmp, State1, 0xF0);
+  State1 = _mm_alignr_epi8 (State1, Tmp, 8);
+
+  _mm_storeu_si128 ((__m128i *) &State[0], State0);
+  _mm_storeu_si128 ((__m128i *) &State[4], State1);
+}
+
+#define Sha1BlocksAccel    Sha1BlocksShaNi
+#define Sha256BlocksAccel  Sha256BlocksShaNi
+
+#elif defined (MDE_CPU_AARCH64)
+
+//
+// Only the vector registers V0-V31 are used. AAPCS64 requires the low 64 bits
+// of V8-V15 to be preserved, which the compiler takes care of for us.
+//
+
+/**
+  Checks whether the processor implements the SHA1/SHA256 instructions.
+
+**/
+static
+UINTN
+ShaAccelProbe (
+  VOID
+  )
+{
+  UINT64  Isar0;
+  UINTN   Features;
+
+  __asm__ ("mrs %0, id_aa64isar0_el1" : "=r" (Isar0));
+
+  Features = 0;
+  if (((Isar0 >> 8) & 0xf) != 0) {
+    Features |= SHA_ACCEL_SHA1;
+  }
+  if (((Isar0 >> 12) & 0xf) != 0) {
+    Features |= SHA_ACCEL_SHA256;
+  }
+
+  return Features;
+}
+
+/**
+  Processes complete 64-byte blocks with the ARMv8 SHA-1 instructions.
+
+**/
+static
+VOID
+Sha1BlocksArmCe (
+  UINT32       *State,
+  CONST UINT8  *Data,
+  UINTN        Blocks
+  )
+{
+  static CONST UINT32  K[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+  uint32x4_t           Abcd;
+  uint32x4_t           AbcdSave;
+  uint32x4_t           Msg[4];
+  uint32x4_t           Wk;
+  UINT32               E0;
+  UINT32               ESave;
+  UINT32               ENext;
+  UINTN                Group;
+
+  Abcd = vld1q_u32 (State);
+  E0   = State[4];
+
+  while (Blocks-- > 0) {
+    AbcdSave = Abcd;
+    ESave    = E0;
+
+    for (Group = 0; Group < 4; Group++) {
+      Msg[Group] = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (Data + Group * 16)));
+    }
+
+    for (Group = 0; Group < 20; Group++) {
+      Wk    = vaddq_u32 (Msg[Group & 3], vdupq_n_u32 (K[Group / 5]));
+      ENext = vsha1h_u32 (vgetq_lane_u32 (Abcd, 0));
+
+      switch (Group / 5) {
+      case 0:
+        Abcd = vsha1cq_u32 (Abcd, E0, Wk);
+        break;
+      case 2:
+        Abcd = vsha1mq_u32 (Abcd, E0, Wk);
+        break;
+      default:
+        Abcd = vsha1pq_u32 (Abcd, E0, Wk);
+        break;
+      }
+      E0 = ENext;
+
+      if (Group < 16) {
+        Msg[Group & 3] = vsha1su1q_u32 (
+                           vsha1su0q_u32 (Msg[Group & 3], Msg[(Group + 1) & 3], Msg[(Group + 2) & 3]),
+                           Msg[(Group + 3) & 3]
+                           );
+      }
+    }
+
+    E0  += ESave;
+    Abcd = vaddq_u32 (Abcd, AbcdSave);
+
+    Data += SHA_BLOCK_SIZE;
+  }
+
+  vst1q_u32 (State, Abcd);
+  State[4] = E0;
+}
+
+/**
+  Processes complete 64-byte blocks with the ARMv8 SHA-256 instructions.
+
+**/
+static
+VOID
+Sha256BlocksArmCe (
+  UINT32       *State,
+  CONST UINT8  *Data,
+  UINTN        Blocks
+  )
+{
+  uint32x4_t  State0;
+  uint32x4_t  State1;
+  uint32x4_t  AbcdSave;
+  uint32x4_t  EfghSave;
+  uint32x4_t  Msg[4];
+  uint32x4_t  Wk;
+  uint32x4_t  Tmp;
+  UINTN       Group;
+
+  State0 = vld1q_u32 (&State[0]);
+  State1 = vld1q_u32 (&State[4]);
+
+  while (Blocks-- > 0) {
+    AbcdSave = State0;
+    EfghSave = State1;
+
+    for (Group = 0; Group < 4; Group++) {
+      Msg[Group] = vreinterpretq_u32_u8 (vrev32q_u8 (vld1q_u8 (Data + Group * 16)));
+    }
+
+    for (Group = 0; Group < 16; Group++) {
+      Wk = vaddq_u32 (Msg[Group & 3], vld1q_u32 (&mSha256K[Group * 4]));
+
+      if (Group < 12) {
+        Msg[Group & 3] = vsha256su1q_u32 (
+                           vsha256su0q_u32 (Msg[Group & 3], Msg[(Group + 1) & 3]),
+                           Msg[(Group + 2) & 3],
+                           Msg[(Group + 3) & 3]
+                           );
+      }
+
+      Tmp    = State0;
+      State0 = vsha256hq_u32 (State0, State1, Wk);
+      State1 = vsha256h2q_u32 (State1, Tmp, Wk);
+    }
+
+    State0 = vaddq_u32 (State0, AbcdSave);
+    State1 = vaddq_u32 (State1, EfghSave);
+
+    Data += SHA_BLOCK_SIZE;
+  }
+
+  vst1q_u32 (&State[0], State0);
+  vst1q_u32 (&State[4], State1);
+}
+
+#define Sha1BlocksAccel    Sha1BlocksArmCe
+#define Sha256BlocksAccel  Sha256BlocksArmCe
+
+#endif
+
+/**
+  Returns the block function to use for the given algorithm, or NULL when the
+  processor has no instructions for it.
+
+**/
+static
+SHA_BLOCK_FUNC
+ShaAccelGetBlockFunc (
+  IN UINTN  Algorithm
+  )
+{
+#if defined (SHA_ACCEL_SUPPORTED)
+  if ((mShaAccelFeatures & SHA_ACCEL_PROBED) == 0) {
+    mShaAccelFeatures = ShaAccelProbe () | SHA_ACCEL_PROBED;
+  }
+
+  if ((mShaAccelFeatures & Algorithm) != 0) {
+    if (Algorithm == SHA_ACCEL_SHA1) {
+      return Sha1BlocksAccel;
+    }
+    return Sha256BlocksAccel;
+  }
+#endif
+
+  return NULL;
+}
+
+/**
+  Adds the length of Blocks complete blocks to an OpenSSL bit counter.
+
+**/
+static
+VOID
+ShaAccelAddLength (
+  IN OUT SHA_LONG  *Nl,
+  IN OUT SHA_LONG  *Nh,
+  IN     UINTN     Blocks
+  )
+{
+  UINT64  Bits;
+
+  Bits  = ((UINT64) *Nh << 32) | *Nl;
+  Bits += (UINT64) Blocks * SHA_BLOCK_SIZE * 8;
+
+  *Nl = (SHA_LONG) Bits;
+  *Nh = (SHA_LONG) (Bits >> 32);
+}
+
+/**
+  Digests the input data and updates an OpenSSL SHA-1 context.
+
+  Complete blocks are processed with the CPU's SHA instructions when they are
+  available. The context stays compatible with SHA1_Update()/SHA1_Final().
+
+  @param[in, out]  Sha1Ctx   Pointer to the OpenSSL SHA-1 context.
+  @param[in]       Data      Pointer to the buffer containing the data to be hashed.
+  @param[in]       DataSize  Size of Data buffer in bytes.
+
+  @retval TRUE   SHA-1 data digest succeeded.
+  @retval FALSE  SHA-1 data digest failed.
+
+**/
+BOOLEAN
+CryptSha1Update (
+  IN OUT  VOID        *Sha1Ctx,
+  IN      CONST VOID  *Data,
+  IN      UINTN       DataSize
+  )
+{
+  SHA_CTX         *Ctx;
+  CONST UINT8     *Buffer;
+  SHA_BLOCK_FUNC  BlockFunc;
+  UINT32          State[5];
+  UINTN           Length;
+  UINTN           Blocks;
+
+  Ctx       = (SHA_CTX *) Sha1Ctx;
+  Buffer    = (CONST UINT8 *) Data;
+  BlockFunc = ShaAccelGetBlockFunc (SHA_ACCEL_SHA1);
+
+  if (BlockFunc == NULL || DataSize < SHA_BLOCK_SIZE) {
+    return (BOOLEAN) SHA1_Update (Ctx, Data, DataSize);
+  }
+
+  //
+  // Let OpenSSL complete any block it has already buffered.
+  //
+  if (Ctx->num != 0) {
+    Length = SHA_BLOCK_SIZE - Ctx->num;
+    if (!SHA1_Update (Ctx, Buffer, Length)) {
+      return FALSE;
+    }
+    Buffer   += Length;
+    DataSize -= Length;
+  }
+
+  Blocks = DataSize / SHA_BLOCK_SIZE;
+  if (Blocks > 0) {
+    State[0] = Ctx->h0;
+    State[1] = Ctx->h1;
+    State[2] = Ctx->h2;
+    State[3] = Ctx->h3;
+    State[4] = Ctx->h4;
+
+    BlockFunc (State, Buffer, Blocks);
+
+    Ctx->h0 = State[0];
+    Ctx->h1 = State[1];
+    Ctx->h2 = State[2];
+    Ctx->h3 = State[3];
+    Ctx->h4 = State[4];
+
+    ShaAccelAddLength (&Ctx->Nl, &Ctx->Nh, Blocks);
+    Buffer   += Blocks * SHA_BLOCK_SIZE;
+    DataSize -= Blocks * SHA_BLOCK_SIZE;
+  }
+
+  return (BOOLEAN) SHA1_Update (Ctx, Buffer, DataSize);
+}
+
+/**
+  Digests the input data and updates an OpenSSL SHA-256 context.
+
+  Complete blocks are processed with the CPU's SHA instructions when they are
+  available. The context stays compatible with SHA256_Update()/SHA256_Final().
+
+  @param[in, out]  Sha256Ctx  Pointer to the OpenSSL SHA-256 context.
+  @param[in]       Data       Pointer to the buffer containing the data to be hashed.
+  @param[in]       DataSize   Size of Data buffer in bytes.
+
+  @retval TRUE   SHA-256 data digest succeeded.
+  @retval FALSE  SHA-256 data digest failed.
+
+**/
+BOOLEAN
+CryptSha256Update (
+  IN OUT  VOID        *Sha256Ctx,
+  IN      CONST VOID  *Data,
+  IN      UINTN       DataSize
+  )
+{
+  SHA256_CTX      *Ctx;
+  CONST UINT8     *Buffer;
+  SHA_BLOCK_FUNC  BlockFunc;
+  UINT32          State[8];
+  UINTN           Length;
+  UINTN           Blocks;
+  UINTN           Index;
+
+  Ctx       = (SHA256_CTX *) Sha256Ctx;
+  Buffer    = (CONST UINT8 *) Data;
+  BlockFunc = ShaAccelGetBlockFunc (SHA_ACCEL_SHA256);
+
+  if (BlockFunc == NULL || DataSize < SHA_BLOCK_SIZE) {
+    return (BOOLEAN) SHA256_Update (Ctx, Data, DataSize);
+  }
+
+  //
+  // Let OpenSSL complete any block it has already buffered.
+  //
+  if (Ctx->num != 0) {
+    Length = SHA_BLOCK_SIZE - Ctx->num;
+    if (!SHA256_Update (Ctx, Buffer, Length)) {
+      return FALSE;
+    }
+    Buffer   += Length;
+    DataSize -= Length;
+  }
+
+  Blocks = DataSize / SHA_BLOCK_SIZE;
+  if (Blocks > 0) {
+    for (Index = 0; Index < 8; Index++) {
+      State[Index] = Ctx->h[Index];
+    }
+
+    BlockFunc (State, Buffer, Blocks);
+
+    for (Index = 0; Index < 8; Index++) {
+      Ctx->h[Index] = State[Index];
+    }
+
+    ShaAccelAddLength (&Ctx->Nl, &Ctx->Nh, Blocks);
+    Buffer   += Blocks * SHA_BLOCK_SIZE;
+    DataSize -= Blocks * SHA_BLOCK_SIZE;
+  }
+
+  return (BOOLEAN) SHA256_Update (Ctx, Buffer, DataSize);
+}
@@ -30,5 +30,39 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 #define OBJ_length(o) ((o)->length)
 #endif
 
+//
+// SHA-1/SHA-256 update routines that use the CPU hash instructions for
+// complete blocks when they are available (Hash/CryptShaAccel.c). The
+// contexts are regular OpenSSL SHA_CTX/SHA256_CTX structures.
+//
+BOOLEAN
+CryptSha1Update (
+  IN OUT  VOID        *Sha1Ctx,
+  IN      CONST VOID  *Data,
+  IN      UINTN       DataSize
+  );
+
+BOOLEAN
+CryptSha256Update (
+  IN OUT  VOID        *Sha256Ctx,
+  IN      CONST VOID  *Data,
+  IN      UINTN       DataSize
+  );
+
+//
+// Keep the allocations made until the matching CryptArenaResume() out of the
+// arena, for state that outlives the current CryptArenaBegin() scope
+// (SysCall/BaseMemAllocation.c).
+//
+VOID
+CryptArenaSuspend (
+  VOID
+  );
+
+VOID
+CryptArenaResume (
+  VOID
+  );
+
 #endif
 
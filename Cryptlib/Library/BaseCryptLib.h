@@ -62,6 +62,25 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 ///
 #define AES_BLOCK_SIZE      16
 
+///
+/// Digest selection bits for the multi-digest (MultiHash*) interfaces
+///
+#define HASH_ALG_SHA1    0x00000001
+#define HASH_ALG_SHA256  0x00000002
+#define HASH_ALG_SHA384  0x00000004
+#define HASH_ALG_SHA512  0x00000008
+#define HASH_ALG_ALL     (HASH_ALG_SHA1 | HASH_ALG_SHA256 | HASH_ALG_SHA384 | HASH_ALG_SHA512)
+
+///
+/// Digest values produced by MultiHashFinal()
+///
+typedef struct {
+  UINT8  Sha1[SHA1_DIGEST_SIZE];
+  UINT8  Sha256[SHA256_DIGEST_SIZE];
+  UINT8  Sha384[SHA384_DIGEST_SIZE];
+  UINT8  Sha512[SHA512_DIGEST_SIZE];
+} MULTI_HASH_VALUE;
+
 ///
 /// RSA Key Tags Definition used in RsaSetKey() function for key component identification.
 ///
@@ -893,6 +912,96 @@ Sha512HashAll (
   OUT  UINT8       *HashValue
   );
 
+/**
+  Retrieves the size, in bytes, of the context buffer required for multi-digest
+  hash operations.
+
+  @return  The size, in bytes, of the context buffer required for multi-digest
+           hash operations.
+
+**/
+UINTN
+EFIAPI
+MultiHashGetContextSize (
+  VOID
+  );
+
+/**
+  Initializes user-supplied memory pointed by MultiHashContext as a multi-digest
+  hash context for subsequent use.
+
+  The digests selected by HashMask are all computed from a single pass over the
+  data handed to MultiHashUpdate().
+
+  If MultiHashContext is NULL, then return FALSE.
+  If HashMask is zero or contains unknown bits, then return FALSE.
+
+  @param[out]  MultiHashContext  Pointer to multi-digest context being initialized.
+  @param[in]   HashMask          Bitmask of HASH_ALG_* values selecting the digests
+                                 to compute.
+
+  @retval TRUE   Multi-digest context initialization succeeded.
+  @retval FALSE  Multi-digest context initialization failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashInit (
+  OUT  VOID    *MultiHashContext,
+  IN   UINT32  HashMask
+  );
+
+/**
+  Digests the input data and updates every digest selected in the multi-digest
+  context.
+
+  This function can be called multiple times to compute the digests of long or
+  discontinuous data streams. The context should be already correctly initialized
+  by MultiHashInit(), and should not be finalized by MultiHashFinal(). Behavior
+  with invalid context is undefined.
+
+  If MultiHashContext is NULL, then return FALSE.
+
+  @param[in, out]  MultiHashContext  Pointer to the multi-digest context.
+  @param[in]       Data              Pointer to the buffer containing the data to be hashed.
+  @param[in]       DataSize          Size of Data buffer in bytes.
+
+  @retval TRUE   Multi-digest data digest succeeded.
+  @retval FALSE  Multi-digest data digest failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashUpdate (
+  IN OUT  VOID        *MultiHashContext,
+  IN      CONST VOID  *Data,
+  IN      UINTN       DataSize
+  );
+
+/**
+  Completes computation of every digest selected in the multi-digest context.
+
+  Digests that were not selected by MultiHashInit() are left untouched in
+  HashValue. After this function has been called, the multi-digest context
+  cannot be used again.
+
+  If MultiHashContext is NULL, then return FALSE.
+  If HashValue is NULL, then return FALSE.
+
+  @param[in, out]  MultiHashContext  Pointer to the multi-digest context.
+  @param[out]      HashValue         Pointer to a structure that receives the digest values.
+
+  @retval TRUE   Multi-digest computation succeeded.
+  @retval FALSE  Multi-digest computation failed.
+
+**/
+BOOLEAN
+EFIAPI
+MultiHashFinal (
+  IN OUT  VOID              *MultiHashContext,
+  OUT     MULTI_HASH_VALUE  *HashValue
+  );
+
 //=====================================================================================
 //    MAC (Message Authentication Code) Primitive
 //=====================================================================================
@@ -2000,6 +2109,24 @@ RsaPkcs1Verify (
   IN  UINTN        SigSize
   );
 
+/**
+  Makes the default RSA method use a fast public key operation for keys with the
+  public exponent 65537 and moduli of up to 4096 bits, which speeds up every RSA
+  signature verification, including RsaPkcs1Verify() and Pkcs7Verify().
+
+  RSA keys take their method when they are created, so this needs to be called
+  before any certificates are parsed.
+
+  @retval TRUE   The fast RSA public key operation is in use.
+  @retval FALSE  The default RSA method could not be replaced.
+
+**/
+BOOLEAN
+EFIAPI
+RsaFastVerifyInit (
+  VOID
+  );
+
 /**
   Retrieve the RSA Private Key from the password-protected PEM key data.
 
@@ -2467,6 +2594,98 @@ AuthenticodeVerify (
   IN  UINTN        HashSize
   );
 
+/**
+  Decodes a PE/COFF Authenticode Signature as described in "Windows Authenticode
+  Portable Executable Signature Format" and checks that it was made over the given
+  image hash, so that it can then be verified against any number of trusted
+  certificates with AuthenticodeContextVerify() without being decoded again.
+
+  If AuthData is NULL, then return NULL.
+  If ImageHash is NULL, then return NULL.
+  If this interface is not supported, then return NULL.
+
+  @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
+                           PE/COFF image to be verified.
+  @param[in]  DataSize     Size of the Authenticode Signature in bytes.
+  @param[in]  ImageHash    Pointer to the original image file hash value. The procedure
+                           for calculating the image hash value is described in Authenticode
+                           specification.
+  @param[in]  HashSize     Size of Image hash value in bytes.
+
+  @return  Pointer to the Authenticode context, to be released with
+           AuthenticodeContextFree(), or NULL if the signature is malformed or
+           does not match the image hash.
+
+**/
+VOID *
+EFIAPI
+AuthenticodeContextCreate (
+  IN  CONST UINT8  *AuthData,
+  IN  UINTN        DataSize,
+  IN  CONST UINT8  *ImageHash,
+  IN  UINTN        HashSize
+  );
+
+/**
+  Verifies the PKCS#7 signed data of an Authenticode context against a trusted
+  certificate that has already been parsed with X509ConstructCertificate().
+
+  If Context is NULL, then return FALSE.
+  If TrustedCert is NULL, then return FALSE.
+  If this interface is not supported, then return FALSE.
+
+  @param[in]  Context      Pointer to the context from AuthenticodeContextCreate().
+  @param[in]  TrustedCert  Pointer to a trusted/root X509 certificate object, which
+                           is used for certificate chain verification.
+
+  @retval  TRUE   The Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+  @retval  FALSE  This interface is not supported.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeContextVerify (
+  IN  CONST VOID  *Context,
+  IN  CONST VOID  *TrustedCert
+  );
+
+/**
+  Checks whether a trusted certificate could possibly end the certificate chain
+  of an Authenticode context's signer, by being one of the certificates carried
+  in the signature or the issuer of one of them. AuthenticodeContextVerify() can
+  only succeed for certificates this returns TRUE for.
+
+  If Context is NULL, then return FALSE.
+  If TrustedCert is NULL, then return FALSE.
+  If this interface is not supported, then return FALSE.
+
+  @param[in]  Context      Pointer to the context from AuthenticodeContextCreate().
+  @param[in]  TrustedCert  Pointer to a trusted/root X509 certificate object.
+
+  @retval  TRUE   The certificate could be part of the signer's chain.
+  @retval  FALSE  The certificate cannot verify this signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeContextMayChainTo (
+  IN  CONST VOID  *Context,
+  IN  CONST VOID  *TrustedCert
+  );
+
+/**
+  Releases an Authenticode context created by AuthenticodeContextCreate().
+
+  @param[in]  Context  Pointer to the context to release. May be NULL.
+
+**/
+VOID
+EFIAPI
+AuthenticodeContextFree (
+  IN  VOID  *Context
+  );
+
 /**
   Verifies the validity of a RFC3161 Timestamp CounterSignature embedded in PE/COFF Authenticode
   signature.
@@ -2712,4 +2931,80 @@ RandomBytes (
   IN   UINTN  Size
   );
 
+//=====================================================================================
+//    Memory Allocation
+//=====================================================================================
+
+/**
+  Starts a scope in which the small allocations made by the crypto library are
+  taken from a preallocated arena rather than the pool. The arena is emptied in
+  one step once everything allocated from it has been freed, and memory that
+  is still in use when the scope ends stays valid. Scopes may be nested.
+
+**/
+VOID
+EFIAPI
+CryptArenaBegin (
+  VOID
+  );
+
+/**
+  Ends a scope started by CryptArenaBegin().
+
+**/
+VOID
+EFIAPI
+CryptArenaEnd (
+  VOID
+  );
+
+/**
+  Retrieves the arena usage, so that its size can be checked against what
+  verification actually needs.
+
+  @param[out]  Size         Size of the arena in bytes, or 0 if it has not
+                            been allocated.
+  @param[out]  Peak         Most bytes of the arena ever in use at once.
+  @param[out]  Allocations  Number of allocations taken from the arena.
+  @param[out]  Fallbacks    Number of allocations made inside a scope that had
+                            to come from the pool.
+
+**/
+VOID
+EFIAPI
+CryptArenaGetStats (
+  OUT UINTN  *Size,
+  OUT UINTN  *Peak,
+  OUT UINTN  *Allocations,
+  OUT UINTN  *Fallbacks
+  );
+
+///
+/// Counters kept by the crypto library's malloc(), realloc() and free().
+///
+typedef struct {
+  UINTN  Allocations;       ///< Blocks allocated, not counting realloc().
+  UINTN  Frees;             ///< Blocks freed, not counting realloc().
+  UINTN  Reallocs;          ///< Calls to realloc() on an existing block.
+  UINTN  ReallocsInPlace;   ///< Reallocs that fit the block's spare capacity.
+  UINTN  ReallocCopies;     ///< Reallocs that had to move the block.
+  UINTN  BytesCopied;       ///< Bytes moved by those reallocs.
+  UINTN  BytesInUse;        ///< Bytes currently allocated, as requested.
+  UINTN  PeakBytesInUse;    ///< Most bytes ever allocated at once.
+} CRYPT_ALLOCATION_STATS;
+
+/**
+  Retrieves the allocation counters of the crypto library, so that the
+  allocations and copying done by an operation can be measured by comparing
+  the counters before and after it.
+
+  @param[out]  Stats  Receives the counters.
+
+**/
+VOID
+EFIAPI
+CryptGetAllocationStats (
+  OUT CRYPT_ALLOCATION_STATS  *Stats
+  );
+
 #endif // __BASE_CRYPT_LIB_H__
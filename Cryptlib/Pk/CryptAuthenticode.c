@@ -6,8 +6,8 @@
   This external input must be validated carefully to avoid security issue like
   buffer overflow, integer overflow.
 
-  AuthenticodeVerify() will get PE/COFF Authenticode and will do basic check for
-  data structure.
+  AuthenticodeVerify() and AuthenticodeContextCreate() will get PE/COFF Authenticode
+  and will do basic check for data structure.
 
 Copyright (c) 2011 - 2015, Intel Corporation. All rights reserved.<BR>
 This program and the accompanying materials
@@ -24,7 +24,10 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 
 #include <openssl/objects.h>
 #include <openssl/x509.h>
+#include <openssl/x509v3.h>
 #include <openssl/pkcs7.h>
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
 
 //
 // OID ASN.1 Value for SPC_INDIRECT_DATA_OBJID
@@ -33,12 +36,67 @@ UINT8 mSpcIndirectOidValue[] = {
   0x2B, 0x06, 0x01, 0x04, 0x01, 0x82, 0x37, 0x02, 0x01, 0x04
   };
 
+static BOOLEAN mDigestsAdded = FALSE;
+
+//
+// A decoded Authenticode signature whose SpcIndirectDataContent has already been
+// checked against the image hash.
+//
+typedef struct {
+  PKCS7        *Pkcs7;
+  CONST UINT8  *SpcIndirectDataContent;
+  UINTN        ContentSize;
+} AUTHENTICODE_CONTEXT;
+
 /**
-  Verifies the validity of a PE/COFF Authenticode Signature as described in "Windows
-  Authenticode Portable Executable Signature Format".
+  Fills in the state OpenSSL caches in a trusted certificate the first time it
+  is used: its decoded extensions, its public key and, for RSA keys, the
+  Montgomery context of the modulus. This is done outside any allocation arena,
+  since the certificate outlives the signature being verified.
 
-  If AuthData is NULL, then return FALSE.
-  If ImageHash is NULL, then return FALSE.
+  @param[in]  Cert  Pointer to the trusted X509 certificate object.
+
+**/
+static
+VOID
+AuthenticodePrepareTrustedCert (
+  IN  X509  *Cert
+  )
+{
+  EVP_PKEY  *Key;
+  RSA       *Rsa;
+  BN_CTX    *BnCtx;
+
+  CryptArenaSuspend ();
+
+  X509_check_purpose (Cert, -1, 0);
+
+  Key = X509_get_pubkey (Cert);
+  if (Key != NULL) {
+    if (EVP_PKEY_type (Key->type) == EVP_PKEY_RSA) {
+      Rsa = Key->pkey.rsa;
+      if (((Rsa->flags & RSA_FLAG_CACHE_PUBLIC) != 0) && (Rsa->_method_mod_n == NULL)) {
+        BnCtx = BN_CTX_new ();
+        if (BnCtx != NULL) {
+          BN_MONT_CTX_set_locked (&Rsa->_method_mod_n, CRYPTO_LOCK_RSA, Rsa->n, BnCtx);
+          BN_CTX_free (BnCtx);
+        }
+      }
+    }
+    EVP_PKEY_free (Key);
+  }
+
+  CryptArenaResume ();
+}
+
+/**
+  Decodes a PE/COFF Authenticode Signature as described in "Windows Authenticode
+  Portable Executable Signature Format" and checks that it was made over the given
+  image hash, so that it can then be verified against any number of trusted
+  certificates with AuthenticodeContextVerify() without being decoded again.
+
+  If AuthData is NULL, then return NULL.
+  If ImageHash is NULL, then return NULL.
 
   Caution: This function may receive untrusted input.
   PE/COFF Authenticode is external input, so this function will do basic check for
@@ -47,52 +105,64 @@ UINT8 mSpcIndirectOidValue[] = {
   @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
                            PE/COFF image to be verified.
   @param[in]  DataSize     Size of the Authenticode Signature in bytes.
-  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
-                           is used for certificate chain verification.
-  @param[in]  CertSize     Size of the trusted certificate in bytes.
   @param[in]  ImageHash    Pointer to the original image file hash value. The procedure
                            for calculating the image hash value is described in Authenticode
                            specification.
   @param[in]  HashSize     Size of Image hash value in bytes.
 
-  @retval  TRUE   The specified Authenticode Signature is valid.
-  @retval  FALSE  Invalid Authenticode Signature.
+  @return  Pointer to the Authenticode context, to be released with
+           AuthenticodeContextFree(), or NULL if the signature is malformed or
+           does not match the image hash.
 
 **/
-BOOLEAN
+VOID *
 EFIAPI
-AuthenticodeVerify (
+AuthenticodeContextCreate (
   IN  CONST UINT8  *AuthData,
   IN  UINTN        DataSize,
-  IN  CONST UINT8  *TrustedCert,
-  IN  UINTN        CertSize,
   IN  CONST UINT8  *ImageHash,
   IN  UINTN        HashSize
   )
 {
-  BOOLEAN      Status;
-  PKCS7        *Pkcs7;
-  CONST UINT8  *Temp;
-  CONST UINT8  *OrigAuthData;
-  UINT8        *SpcIndirectDataContent;
-  UINT8        Asn1Byte;
-  UINTN        ContentSize;
-  CONST UINT8  *SpcIndirectDataOid;
+  AUTHENTICODE_CONTEXT  *Context;
+  PKCS7                 *Pkcs7;
+  CONST UINT8           *Temp;
+  UINT8                 *SpcIndirectDataContent;
+  UINT8                 Asn1Byte;
+  UINTN                 ContentSize;
+  UINTN                 HeaderSize;
+  UINTN                 ValueSize;
+  CONST UINT8           *SpcIndirectDataOid;
 
   //
   // Check input parameters.
   //
-  if ((AuthData == NULL) || (TrustedCert == NULL) || (ImageHash == NULL)) {
-    return FALSE;
+  if ((AuthData == NULL) || (ImageHash == NULL)) {
+    return NULL;
   }
 
-  if ((DataSize > INT_MAX) || (CertSize > INT_MAX) || (HashSize > INT_MAX)) {
-    return FALSE;
+  if ((DataSize > INT_MAX) || (HashSize > INT_MAX)) {
+    return NULL;
   }
 
-  Status       = FALSE;
-  Pkcs7        = NULL;
-  OrigAuthData = AuthData;
+  //
+  // Register & Initialize necessary digest algorithms for PKCS#7 Handling.
+  // The name table entries last for good, so they are kept out of the arena,
+  // and only made once.
+  //
+  if (!mDigestsAdded) {
+    CryptArenaSuspend ();
+    mDigestsAdded = (EVP_add_digest (EVP_md5 ()) != 0) &&
+                    (EVP_add_digest (EVP_sha1 ()) != 0) &&
+                    (EVP_add_digest (EVP_sha256 ()) != 0) &&
+                    (EVP_add_digest (EVP_sha384 ()) != 0) &&
+                    (EVP_add_digest (EVP_sha512 ()) != 0) &&
+                    (EVP_add_digest_alias (SN_sha1WithRSAEncryption, SN_sha1WithRSA) != 0);
+    CryptArenaResume ();
+    if (!mDigestsAdded) {
+      return NULL;
+    }
+  }
 
   //
   // Retrieve & Parse PKCS#7 Data (DER encoding) from Authenticode Signature
@@ -100,14 +170,14 @@ AuthenticodeVerify (
   Temp  = AuthData;
   Pkcs7 = d2i_PKCS7 (NULL, &Temp, (int)DataSize);
   if (Pkcs7 == NULL) {
-    goto _Exit;
+    return NULL;
   }
 
   //
   // Check if it's PKCS#7 Signed Data (for Authenticode Scenario)
   //
   if (!PKCS7_type_is_signed (Pkcs7)) {
-    goto _Exit;
+    goto _Error;
   }
 
   //
@@ -125,11 +195,19 @@ AuthenticodeVerify (
     //
     // Un-matched SPC_INDIRECT_DATA_OBJID.
     //
-    goto _Exit;
+    goto _Error;
   }
 
+  if (Pkcs7->d.sign->contents->d.other == NULL ||
+      Pkcs7->d.sign->contents->d.other->type != V_ASN1_SEQUENCE) {
+    goto _Error;
+  }
 
   SpcIndirectDataContent = (UINT8 *)(Pkcs7->d.sign->contents->d.other->value.asn1_string->data);
+  ValueSize = (UINTN)(Pkcs7->d.sign->contents->d.other->value.asn1_string->length);
+  if (ValueSize < 4) {
+    goto _Error;
+  }
 
   //
   // Retrieve the SEQUENCE data size from ASN.1-encoded SpcIndirectDataContent.
@@ -141,20 +219,14 @@ AuthenticodeVerify (
     // Short Form of Length Encoding (Length < 128)
     //
     ContentSize = (UINTN) (Asn1Byte & 0x7F);
-    //
-    // Skip the SEQUENCE Tag;
-    //
-    SpcIndirectDataContent += 2;
+    HeaderSize  = 2;
 
   } else if ((Asn1Byte & 0x81) == 0x81) {
     //
     // Long Form of Length Encoding (128 <= Length < 255, Single Octet)
     //
     ContentSize = (UINTN) (*(UINT8 *)(SpcIndirectDataContent + 2));
-    //
-    // Skip the SEQUENCE Tag;
-    //
-    SpcIndirectDataContent += 3;
+    HeaderSize  = 3;
 
   } else if ((Asn1Byte & 0x82) == 0x82) {
     //
@@ -162,15 +234,21 @@ AuthenticodeVerify (
     //
     ContentSize = (UINTN) (*(UINT8 *)(SpcIndirectDataContent + 2));
     ContentSize = (ContentSize << 8) + (UINTN)(*(UINT8 *)(SpcIndirectDataContent + 3));
-    //
-    // Skip the SEQUENCE Tag;
-    //
-    SpcIndirectDataContent += 4;
+    HeaderSize  = 4;
 
   } else {
-    goto _Exit;
+    goto _Error;
   }
 
+  //
+  // Skip the SEQUENCE Tag, and make sure the content and the hash at its end
+  // are really there, as the context keeps pointing at them.
+  //
+  if (ContentSize > ValueSize - HeaderSize || HashSize > ContentSize) {
+    goto _Error;
+  }
+  SpcIndirectDataContent += HeaderSize;
+
   //
   // Compare the original file hash value to the digest retrieve from SpcIndirectDataContent
   // defined in Authenticode
@@ -180,19 +258,252 @@ AuthenticodeVerify (
     //
     // Un-matched PE/COFF Hash Value
     //
+    goto _Error;
+  }
+
+  Context = malloc (sizeof (*Context));
+  if (Context == NULL) {
+    goto _Error;
+  }
+
+  Context->Pkcs7                  = Pkcs7;
+  Context->SpcIndirectDataContent = SpcIndirectDataContent;
+  Context->ContentSize            = ContentSize;
+
+  return Context;
+
+_Error:
+  PKCS7_free (Pkcs7);
+
+  return NULL;
+}
+
+/**
+  Verifies the PKCS#7 signed data of an Authenticode context against a trusted
+  certificate that has already been parsed with X509ConstructCertificate().
+
+  Nothing is decoded again, so checking the same signature against several
+  trusted certificates only costs the certificate chain and signature checks.
+
+  If Context is NULL, then return FALSE.
+  If TrustedCert is NULL, then return FALSE.
+
+  @param[in]  Context      Pointer to the context from AuthenticodeContextCreate().
+  @param[in]  TrustedCert  Pointer to a trusted/root X509 certificate object, which
+                           is used for certificate chain verification.
+
+  @retval  TRUE   The Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeContextVerify (
+  IN  CONST VOID  *Context,
+  IN  CONST VOID  *TrustedCert
+  )
+{
+  CONST AUTHENTICODE_CONTEXT  *AuthContext;
+  X509_STORE                  *CertStore;
+  BIO                         *DataBio;
+  BOOLEAN                     Status;
+
+  if ((Context == NULL) || (TrustedCert == NULL)) {
+    return FALSE;
+  }
+
+  AuthContext = (CONST AUTHENTICODE_CONTEXT *) Context;
+  Status      = FALSE;
+  DataBio     = NULL;
+
+  AuthenticodePrepareTrustedCert ((X509 *) TrustedCert);
+
+  //
+  // Setup X509 Store for trusted certificate. The store takes its own
+  // reference to the certificate.
+  //
+  CertStore = X509_STORE_new ();
+  if (CertStore == NULL) {
+    goto _Exit;
+  }
+  if (!(X509_STORE_add_cert (CertStore, (X509 *) TrustedCert))) {
+    goto _Exit;
+  }
+
+  //
+  // Allow partial certificate chains, terminated by a non-self-signed but
+  // still trusted intermediate certificate. Also disable time checks.
+  //
+  X509_STORE_set_flags (CertStore,
+                        X509_V_FLAG_PARTIAL_CHAIN | X509_V_FLAG_NO_CHECK_TIME);
+
+  //
+  // OpenSSL PKCS7 Verification by default checks for SMIME (email signing) and
+  // doesn't support the extended key usage for Authenticode Code Signing.
+  // Bypass the certificate purpose checking by enabling any purposes setting.
+  //
+  X509_STORE_set_purpose (CertStore, X509_PURPOSE_ANY);
+
+  //
+  // The content is only read, so it doesn't need copying into the BIO.
+  //
+  DataBio = BIO_new_mem_buf ((VOID *) AuthContext->SpcIndirectDataContent, (int) AuthContext->ContentSize);
+  if (DataBio == NULL) {
     goto _Exit;
   }
 
   //
   // Verifies the PKCS#7 Signed Data in PE/COFF Authenticode Signature
   //
-  Status = (BOOLEAN) Pkcs7Verify (OrigAuthData, DataSize, TrustedCert, CertSize, SpcIndirectDataContent, ContentSize);
+  Status = (BOOLEAN) PKCS7_verify (AuthContext->Pkcs7, NULL, CertStore, DataBio, NULL, PKCS7_BINARY);
 
 _Exit:
+  BIO_free (DataBio);
+  X509_STORE_free (CertStore);
+
+  return Status;
+}
+
+/**
+  Checks whether a trusted certificate could possibly end the certificate chain
+  of an Authenticode context's signer, without verifying anything.
+
+  The chain is built from the certificates carried in the signature, so the
+  trusted certificate can only end it by being one of them, or by having issued
+  one of them according to X509_check_issued(), which compares subject and issuer
+  names and the authority and subject key identifiers in the same way chain
+  building does. AuthenticodeContextVerify() can only succeed when this does.
+
+  If Context is NULL, then return FALSE.
+  If TrustedCert is NULL, then return FALSE.
+
+  @param[in]  Context      Pointer to the context from AuthenticodeContextCreate().
+  @param[in]  TrustedCert  Pointer to a trusted/root X509 certificate object.
+
+  @retval  TRUE   The certificate could be part of the signer's chain.
+  @retval  FALSE  The certificate cannot verify this signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeContextMayChainTo (
+  IN  CONST VOID  *Context,
+  IN  CONST VOID  *TrustedCert
+  )
+{
+  CONST AUTHENTICODE_CONTEXT  *AuthContext;
+  STACK_OF(X509)              *Certs;
+  X509                        *Cert;
+  INTN                        Index;
+
+  if ((Context == NULL) || (TrustedCert == NULL)) {
+    return FALSE;
+  }
+
+  AuthContext = (CONST AUTHENTICODE_CONTEXT *) Context;
+  Certs       = AuthContext->Pkcs7->d.sign->cert;
+
+  AuthenticodePrepareTrustedCert ((X509 *) TrustedCert);
+
+  for (Index = 0; Index < sk_X509_num (Certs); Index++) {
+    Cert = sk_X509_value (Certs, (int) Index);
+    if (X509_check_issued ((X509 *) TrustedCert, Cert) == X509_V_OK) {
+      return TRUE;
+    }
+    if (X509_cmp ((X509 *) TrustedCert, Cert) == 0) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+  Releases an Authenticode context created by AuthenticodeContextCreate().
+
+  @param[in]  Context  Pointer to the context to release. May be NULL.
+
+**/
+VOID
+EFIAPI
+AuthenticodeContextFree (
+  IN  VOID  *Context
+  )
+{
+  AUTHENTICODE_CONTEXT  *AuthContext;
+
+  if (Context == NULL) {
+    return;
+  }
+
+  AuthContext = (AUTHENTICODE_CONTEXT *) Context;
+  PKCS7_free (AuthContext->Pkcs7);
+  free (AuthContext);
+}
+
+/**
+  Verifies the validity of a PE/COFF Authenticode Signature as described in "Windows
+  Authenticode Portable Executable Signature Format".
+
+  If AuthData is NULL, then return FALSE.
+  If ImageHash is NULL, then return FALSE.
+
+  Caution: This function may receive untrusted input.
+  PE/COFF Authenticode is external input, so this function will do basic check for
+  Authenticode data structure.
+
+  @param[in]  AuthData     Pointer to the Authenticode Signature retrieved from signed
+                           PE/COFF image to be verified.
+  @param[in]  DataSize     Size of the Authenticode Signature in bytes.
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+                           is used for certificate chain verification.
+  @param[in]  CertSize     Size of the trusted certificate in bytes.
+  @param[in]  ImageHash    Pointer to the original image file hash value. The procedure
+                           for calculating the image hash value is described in Authenticode
+                           specification.
+  @param[in]  HashSize     Size of Image hash value in bytes.
+
+  @retval  TRUE   The specified Authenticode Signature is valid.
+  @retval  FALSE  Invalid Authenticode Signature.
+
+**/
+BOOLEAN
+EFIAPI
+AuthenticodeVerify (
+  IN  CONST UINT8  *AuthData,
+  IN  UINTN        DataSize,
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertSize,
+  IN  CONST UINT8  *ImageHash,
+  IN  UINTN        HashSize
+  )
+{
+  VOID         *Context;
+  X509         *Cert;
+  CONST UINT8  *Temp;
+  BOOLEAN      Status;
+
+  if ((TrustedCert == NULL) || (CertSize > INT_MAX)) {
+    return FALSE;
+  }
+
+  Context = AuthenticodeContextCreate (AuthData, DataSize, ImageHash, HashSize);
+  if (Context == NULL) {
+    return FALSE;
+  }
+
   //
-  // Release Resources
+  // Read DER-encoded root certificate and Construct X509 Certificate
   //
-  PKCS7_free (Pkcs7);
+  Status = FALSE;
+  Temp   = TrustedCert;
+  Cert   = d2i_X509 (NULL, &Temp, (long) CertSize);
+  if (Cert != NULL) {
+    Status = AuthenticodeContextVerify (Context, Cert);
+    X509_free (Cert);
+  }
+
+  AuthenticodeContextFree (Context);
 
   return Status;
 }
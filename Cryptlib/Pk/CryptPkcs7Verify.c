@@ -719,21 +719,20 @@ _Error:
 
 /**
   Verifies the validity of a PKCS#7 signed data as described in "PKCS #7:
-  Cryptographic Message Syntax Standard". The input signed data could be wrapped
-  in a ContentInfo structure.
+  Cryptographic Message Syntax Standard" against a trusted certificate that has
+  already been parsed. The input signed data could be wrapped in a ContentInfo
+  structure.
 
-  If P7Data, TrustedCert or InData is NULL, then return FALSE.
-  If P7Length, CertLength or DataLength overflow, then return FALSE.
+  The trusted certificate is only referenced, so the same X509 object can be
+  used for any number of verifications without being decoded again.
 
-  Caution: This function may receive untrusted input.
-  UEFI Authenticated Variable is external input, so this function will do basic
-  check for PKCS#7 data structure.
+  If P7Data, TrustedCert or InData is NULL, then return FALSE.
+  If P7Length or DataLength overflow, then return FALSE.
 
   @param[in]  P7Data       Pointer to the PKCS#7 message to verify.
   @param[in]  P7Length     Length of the PKCS#7 message in bytes.
-  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+  @param[in]  TrustedCert  Pointer to a trusted/root X509 certificate object, which
                            is used for certificate chain verification.
-  @param[in]  CertLength   Length of the trusted certificate in bytes.
   @param[in]  InData       Pointer to the content to be verified.
   @param[in]  DataLength   Length of InData in bytes.
 
@@ -741,13 +740,12 @@ _Error:
   @retval  FALSE Invalid PKCS#7 signed data.
 
 **/
+static
 BOOLEAN
-EFIAPI
-Pkcs7Verify (
+Pkcs7VerifyX509 (
   IN  CONST UINT8  *P7Data,
   IN  UINTN        P7Length,
-  IN  CONST UINT8  *TrustedCert,
-  IN  UINTN        CertLength,
+  IN  CONST VOID   *TrustedCert,
   IN  CONST UINT8  *InData,
   IN  UINTN        DataLength
   )
@@ -755,7 +753,6 @@ Pkcs7Verify (
   PKCS7       *Pkcs7;
   BIO         *DataBio;
   BOOLEAN     Status;
-  X509        *Cert;
   X509_STORE  *CertStore;
   UINT8       *SignedData;
   CONST UINT8 *Temp;
@@ -766,13 +763,12 @@ Pkcs7Verify (
   // Check input parameters.
   //
   if (P7Data == NULL || TrustedCert == NULL || InData == NULL ||
-    P7Length > INT_MAX || CertLength > INT_MAX || DataLength > INT_MAX) {
+    P7Length > INT_MAX || DataLength > INT_MAX) {
     return FALSE;
   }
 
   Pkcs7     = NULL;
   DataBio   = NULL;
-  Cert      = NULL;
   CertStore = NULL;
 
   //
@@ -825,22 +821,14 @@ Pkcs7Verify (
   }
 
   //
-  // Read DER-encoded root certificate and Construct X509 Certificate
-  //
-  Temp = TrustedCert;
-  Cert = d2i_X509 (NULL, &Temp, (long) CertLength);
-  if (Cert == NULL) {
-    goto _Exit;
-  }
-
-  //
-  // Setup X509 Store for trusted certificate
+  // Setup X509 Store for trusted certificate. The store takes its own
+  // reference to the certificate.
   //
   CertStore = X509_STORE_new ();
   if (CertStore == NULL) {
     goto _Exit;
   }
-  if (!(X509_STORE_add_cert (CertStore, Cert))) {
+  if (!(X509_STORE_add_cert (CertStore, (X509 *) TrustedCert))) {
     goto _Exit;
   }
 
@@ -881,7 +869,6 @@ _Exit:
   // Release Resources
   //
   BIO_free (DataBio);
-  X509_free (Cert);
   X509_STORE_free (CertStore);
   PKCS7_free (Pkcs7);
 
@@ -892,6 +879,69 @@ _Exit:
   return Status;
 }
 
+/**
+  Verifies the validity of a PKCS#7 signed data as described in "PKCS #7:
+  Cryptographic Message Syntax Standard". The input signed data could be wrapped
+  in a ContentInfo structure.
+
+  If P7Data, TrustedCert or InData is NULL, then return FALSE.
+  If P7Length, CertLength or DataLength overflow, then return FALSE.
+
+  Caution: This function may receive untrusted input.
+  UEFI Authenticated Variable is external input, so this function will do basic
+  check for PKCS#7 data structure.
+
+  @param[in]  P7Data       Pointer to the PKCS#7 message to verify.
+  @param[in]  P7Length     Length of the PKCS#7 message in bytes.
+  @param[in]  TrustedCert  Pointer to a trusted/root certificate encoded in DER, which
+                           is used for certificate chain verification.
+  @param[in]  CertLength   Length of the trusted certificate in bytes.
+  @param[in]  InData       Pointer to the content to be verified.
+  @param[in]  DataLength   Length of InData in bytes.
+
+  @retval  TRUE  The specified PKCS#7 signed data is valid.
+  @retval  FALSE Invalid PKCS#7 signed data.
+
+**/
+BOOLEAN
+EFIAPI
+Pkcs7Verify (
+  IN  CONST UINT8  *P7Data,
+  IN  UINTN        P7Length,
+  IN  CONST UINT8  *TrustedCert,
+  IN  UINTN        CertLength,
+  IN  CONST UINT8  *InData,
+  IN  UINTN        DataLength
+  )
+{
+  BOOLEAN      Status;
+  X509         *Cert;
+  CONST UINT8  *Temp;
+
+  //
+  // Check input parameters.
+  //
+  if (P7Data == NULL || TrustedCert == NULL || InData == NULL ||
+    P7Length > INT_MAX || CertLength > INT_MAX || DataLength > INT_MAX) {
+    return FALSE;
+  }
+
+  //
+  // Read DER-encoded root certificate and Construct X509 Certificate
+  //
+  Temp = TrustedCert;
+  Cert = d2i_X509 (NULL, &Temp, (long) CertLength);
+  if (Cert == NULL) {
+    return FALSE;
+  }
+
+  Status = Pkcs7VerifyX509 (P7Data, P7Length, Cert, InData, DataLength);
+
+  X509_free (Cert);
+
+  return Status;
+}
+
 /**
   Extracts the attached content from a PKCS#7 signed data if existed. The input signed
   data could be wrapped in a ContentInfo structure.
@@ -0,0 +1,390 @@
+/** @file
+  Fast RSA public key operation for signature verification.
+
+  OpenSSL's bignum code is built without assembler and without optimization,
+  so the modular exponentiation behind every RSA signature check is far slower
+  than it needs to be. Nearly every key shim sees uses the public exponent
+  65537, for which the exponentiation is just 16 squarings and one
+  multiplication, so this file provides a Montgomery multiplication over
+  fixed-size limb arrays for that case and installs it as the bn_mod_exp of the
+  default RSA method. RSA_verify(), and with it both RsaPkcs1Verify() and the
+  PKCS#7 verification path, then use it for keys of up to 4096 bits. Any other
+  exponent or modulus is handed to BN_mod_exp_mont() as before, which keeps the
+  private key operations on OpenSSL's constant-time code.
+
+  On x86-64 processors with BMI2 and ADX the multiply-accumulate rows use MULX
+  and ADCX/ADOX, selected at runtime from CPUID. The portable rows use a double
+  width limb type, for which the compiler emits MUL/UMULH on AArch64 and a
+  single widening MUL on x86.
+
+Copyright (c) 2009 - 2016, Intel Corporation. All rights reserved.<BR>
+This program and the accompanying materials
+are licensed and made available under the terms and conditions of the BSD License
+which accompanies this distribution.  The full text of the license may be found at
+http://opensource.org/licenses/bsd-license.php
+
+THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+**/
+
+#include "InternalCryptLib.h"
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+
+#if defined (MDE_CPU_X64)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define RSA_FAST_MAX_BITS     4096
+#define RSA_FAST_MAX_LIMBS    (RSA_FAST_MAX_BITS / BN_BITS2)
+
+#if BN_BITS2 == 64
+typedef unsigned __int128  RSA_DLIMB;
+#else
+typedef UINT64             RSA_DLIMB;
+#endif
+
+//
+// Adds A * B to the K + 2 limb accumulator T.
+//
+typedef VOID (*RSA_MUL_ADD_ROW) (BN_ULONG *T, CONST BN_ULONG *A, BN_ULONG B, UINTN K);
+
+static RSA_METHOD  mRsaFastMethod;
+
+/**
+  Portable multiply-accumulate row.
+
+**/
+static
+VOID
+RsaMulAddRowGeneric (
+  BN_ULONG        *T,
+  CONST BN_ULONG  *A,
+  BN_ULONG        B,
+  UINTN           K
+  )
+{
+  RSA_DLIMB  Product;
+  BN_ULONG   Carry;
+  UINTN      Index;
+
+  Carry = 0;
+  for (Index = 0; Index < K; Index++) {
+    Product  = (RSA_DLIMB) A[Index] * B + T[Index] + Carry;
+    T[Index] = (BN_ULONG) Product;
+    Carry    = (BN_ULONG) (Product >> BN_BITS2);
+  }
+
+  Product  = (RSA_DLIMB) T[K] + Carry;
+  T[K]     = (BN_ULONG) Product;
+  T[K + 1] += (BN_ULONG) (Product >> BN_BITS2);
+}
+
+#if defined (MDE_CPU_X64)
+
+#define RSA_ADX_FUNC  __attribute__ ((target ("bmi2,adx")))
+
+/**
+  Checks whether the processor supports MULX (BMI2) and ADCX/ADOX (ADX).
+
+**/
+static
+BOOLEAN
+RsaAdxProbe (
+  VOID
+  )
+{
+  UINT32  Eax;
+  UINT32  Ebx;
+  UINT32  Ecx;
+  UINT32  Edx;
+
+  if (__get_cpuid_max (0, NULL) < 7) {
+    return FALSE;
+  }
+
+  __cpuid_count (7, 0, Eax, Ebx, Ecx, Edx);
+  return (Ebx & (1 << 8)) != 0 && (Ebx & (1 << 19)) != 0;
+}
+
+/**
+  Multiply-accumulate row using MULX, with the low halves of the products added
+  on one carry chain and the high halves on another, so that ADCX and ADOX can
+  interleave them.
+
+**/
+static
+RSA_ADX_FUNC
+VOID
+RsaMulAddRowAdx (
+  BN_ULONG        *T,
+  CONST BN_ULONG  *A,
+  BN_ULONG        B,
+  UINTN           K
+  )
+{
+  unsigned long long  Low;
+  unsigned long long  High;
+  unsigned long long  PrevHigh;
+  unsigned long long  Sum;
+  UINT8               CarryLow;
+  UINT8               CarryHigh;
+  UINTN               Index;
+
+  CarryLow  = 0;
+  CarryHigh = 0;
+  PrevHigh  = 0;
+  for (Index = 0; Index < K; Index++) {
+    Low       = _mulx_u64 (A[Index], B, &High);
+    CarryLow  = _addcarryx_u64 (CarryLow, T[Index], Low, &Sum);
+    CarryHigh = _addcarryx_u64 (CarryHigh, Sum, PrevHigh, &Sum);
+    T[Index]  = Sum;
+    PrevHigh  = High;
+  }
+
+  CarryLow  = _addcarryx_u64 (CarryLow, T[K], PrevHigh, &Sum);
+  CarryHigh = _addcarryx_u64 (CarryHigh, Sum, 0, &Sum);
+  T[K]      = Sum;
+  T[K + 1] += (BN_ULONG) CarryLow + CarryHigh;
+}
+
+#endif
+
+static RSA_MUL_ADD_ROW  mRsaMulAddRow = RsaMulAddRowGeneric;
+
+/**
+  Computes -N^-1 mod 2^BN_BITS2 for odd N by Newton iteration.
+
+**/
+static
+BN_ULONG
+RsaMontgomeryN0 (
+  BN_ULONG  N
+  )
+{
+  BN_ULONG  Inverse;
+  UINTN     Index;
+
+  //
+  // N is its own inverse modulo 8, and every step doubles the number of
+  // correct low bits.
+  //
+  Inverse = N;
+  for (Index = 0; Index < 5; Index++) {
+    Inverse *= 2 - N * Inverse;
+  }
+
+  return (BN_ULONG) 0 - Inverse;
+}
+
+/**
+  Montgomery multiplication, R = A * B / 2^(K * BN_BITS2) mod N, for A and B
+  smaller than N. R may be the same array as A or B.
+
+**/
+static
+VOID
+RsaMontMul (
+  BN_ULONG        *R,
+  CONST BN_ULONG  *A,
+  CONST BN_ULONG  *B,
+  CONST BN_ULONG  *N,
+  BN_ULONG        N0,
+  UINTN           K
+  )
+{
+  BN_ULONG  T[RSA_FAST_MAX_LIMBS + 2];
+  BN_ULONG  Borrow;
+  BN_ULONG  Diff;
+  BOOLEAN   Subtract;
+  UINTN     Index;
+  UINTN     Row;
+
+  ZeroMem (T, (K + 2) * sizeof (BN_ULONG));
+
+  for (Row = 0; Row < K; Row++) {
+    mRsaMulAddRow (T, A, B[Row], K);
+    mRsaMulAddRow (T, N, T[0] * N0, K);
+
+    //
+    // The low limb is now zero; divide by 2^BN_BITS2.
+    //
+    for (Index = 0; Index <= K; Index++) {
+      T[Index] = T[Index + 1];
+    }
+    T[K + 1] = 0;
+  }
+
+  //
+  // T is less than 2N, so at most one subtraction brings it below N.
+  //
+  Subtract = (BOOLEAN) (T[K] != 0);
+  if (!Subtract) {
+    Subtract = TRUE;
+    for (Index = K; Index-- > 0; ) {
+      if (T[Index] != N[Index]) {
+        Subtract = (BOOLEAN) (T[Index] > N[Index]);
+        break;
+      }
+    }
+  }
+
+  if (!Subtract) {
+    CopyMem (R, T, K * sizeof (BN_ULONG));
+    return;
+  }
+
+  Borrow = 0;
+  for (Index = 0; Index < K; Index++) {
+    Diff     = T[Index] - N[Index] - Borrow;
+    Borrow   = (BN_ULONG) ((T[Index] < N[Index]) || (T[Index] == N[Index] && Borrow != 0));
+    R[Index] = Diff;
+  }
+}
+
+/**
+  Computes A^65537 mod N, given RR = 2^(2 * K * BN_BITS2) mod N.
+
+**/
+static
+VOID
+RsaModExpF4 (
+  BN_ULONG        *Result,
+  CONST BN_ULONG  *A,
+  CONST BN_ULONG  *N,
+  CONST BN_ULONG  *RR,
+  UINTN           K
+  )
+{
+  BN_ULONG  AMont[RSA_FAST_MAX_LIMBS];
+  BN_ULONG  X[RSA_FAST_MAX_LIMBS];
+  BN_ULONG  One[RSA_FAST_MAX_LIMBS];
+  BN_ULONG  N0;
+  UINTN     Index;
+
+  N0 = RsaMontgomeryN0 (N[0]);
+
+  RsaMontMul (AMont, A, RR, N, N0, K);
+  CopyMem (X, AMont, K * sizeof (BN_ULONG));
+  for (Index = 0; Index < 16; Index++) {
+    RsaMontMul (X, X, X, N, N0, K);
+  }
+  RsaMontMul (X, X, AMont, N, N0, K);
+
+  ZeroMem (One, K * sizeof (BN_ULONG));
+  One[0] = 1;
+  RsaMontMul (Result, X, One, N, N0, K);
+}
+
+/**
+  Copies a BIGNUM into a K limb array.
+
+**/
+static
+VOID
+RsaLoadLimbs (
+  BN_ULONG      *Limbs,
+  CONST BIGNUM  *Bn,
+  UINTN         K
+  )
+{
+  ZeroMem (Limbs, K * sizeof (BN_ULONG));
+  CopyMem (Limbs, Bn->d, Bn->top * sizeof (BN_ULONG));
+}
+
+/**
+  bn_mod_exp for the default RSA method. The public exponent 65537 is computed
+  here when the modulus fits, and everything else is left to OpenSSL.
+
+**/
+static
+int
+RsaFastBnModExp (
+  BIGNUM        *R,
+  CONST BIGNUM  *A,
+  CONST BIGNUM  *P,
+  CONST BIGNUM  *M,
+  BN_CTX        *Ctx,
+  BN_MONT_CTX   *MontCtx
+  )
+{
+  BN_ULONG  Base[RSA_FAST_MAX_LIMBS];
+  BN_ULONG  Modulus[RSA_FAST_MAX_LIMBS];
+  BN_ULONG  RR[RSA_FAST_MAX_LIMBS];
+  BN_ULONG  Result[RSA_FAST_MAX_LIMBS];
+  UINTN     K;
+
+  //
+  // The Montgomery context, which the RSA code keeps with the key, already
+  // has R^2 mod N for the same R as ours.
+  //
+  if (!BN_is_word (P, RSA_F4) || MontCtx == NULL || !BN_is_odd (M) ||
+      BN_is_negative (M) || BN_is_negative (A) || BN_ucmp (A, M) >= 0 ||
+      BN_num_bits (M) > RSA_FAST_MAX_BITS) {
+    return BN_mod_exp_mont (R, A, P, M, Ctx, MontCtx);
+  }
+
+  K = (UINTN) M->top;
+  if (MontCtx->ri != (int) (K * BN_BITS2) || MontCtx->RR.top > M->top ||
+      BN_is_negative (&MontCtx->RR)) {
+    return BN_mod_exp_mont (R, A, P, M, Ctx, MontCtx);
+  }
+
+  RsaLoadLimbs (Base, A, K);
+  RsaLoadLimbs (Modulus, M, K);
+  RsaLoadLimbs (RR, &MontCtx->RR, K);
+
+  RsaModExpF4 (Result, Base, Modulus, RR, K);
+
+  if (bn_wexpand (R, (int) K) == NULL) {
+    return 0;
+  }
+  CopyMem (R->d, Result, K * sizeof (BN_ULONG));
+  R->top = (int) K;
+  R->neg = 0;
+  bn_correct_top (R);
+
+  return 1;
+}
+
+/**
+  Makes the default RSA method use the fast public key operation for keys with
+  the public exponent 65537, and picks the fastest multiplication the processor
+  supports.
+
+  RSA keys take their method when they are created, so this needs to be called
+  before any certificates are parsed.
+
+  @retval TRUE   The fast RSA public key operation is in use.
+  @retval FALSE  The default RSA method could not be replaced.
+
+**/
+BOOLEAN
+EFIAPI
+RsaFastVerifyInit (
+  VOID
+  )
+{
+  CONST RSA_METHOD  *Default;
+
+  Default = RSA_PKCS1_SSLeay ();
+  if (Default == NULL) {
+    return FALSE;
+  }
+
+#if defined (MDE_CPU_X64)
+  if (RsaAdxProbe ()) {
+    mRsaMulAddRow = RsaMulAddRowAdx;
+  }
+#endif
+
+  CopyMem (&mRsaFastMethod, Default, sizeof (mRsaFastMethod));
+  mRsaFastMethod.name       = "PKCS#1 RSA with fast public key operations";
+  mRsaFastMethod.bn_mod_exp = RsaFastBnModExp;
+
+  RSA_set_default_method (&mRsaFastMethod);
+
+  return TRUE;
+}
@@ -2,6 +2,24 @@
   Base Memory Allocation Routines Wrapper for Crypto library over OpenSSL
   during PEI & DXE phases.
 
+  Every block handed out is preceded by a header recording the size that was
+  asked for and the capacity actually reserved. Pool allocations are rounded
+  up to geometric size classes, so that the buffers OpenSSL grows a little at
+  a time can usually be grown in place, and when they can't, realloc() only
+  copies what the old block really held.
+
+  Decoding a signature and its certificate chain makes thousands of small,
+  short-lived allocations, and each AllocatePool()/FreePool() is a call into
+  the firmware. Between CryptArenaBegin() and CryptArenaEnd(), small
+  allocations are instead carved out of one preallocated arena. The arena is
+  rewound as soon as nothing allocated from it is still in use, which is
+  normally when the outermost scope ends. Anything that does outlive the scope
+  just keeps its space until it is freed, so allocations made from the arena
+  are never handed out twice, but the end of the outermost scope still gives
+  back everything after the last such block. Otherwise a table OpenSSL sets up
+  once and keeps would leave each later scope starting higher in the arena than
+  the one before.
+
 Copyright (c) 2009 - 2012, Intel Corporation. All rights reserved.<BR>
 This program and the accompanying materials
 are licensed and made available under the terms and conditions of the BSD License
@@ -13,7 +31,348 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 
 **/
 
-#include <OpenSslSupport.h>
+#include "InternalCryptLib.h"
+
+//
+// Size of the arena, and of the largest allocation taken from it; bigger ones
+// go straight to the pool.
+//
+#define CRYPT_ARENA_SIZE            (256 * 1024)
+#define CRYPT_ARENA_MAX_ALLOCATION  (16 * 1024)
+
+//
+// Pool allocations below this size are rounded up to the next of two size
+// classes per power of two (..., 64, 96, 128, 192, ...), which leaves at most
+// a third of the block unused. Larger ones are rounded up to whole pages.
+//
+#define CRYPT_POOL_MIN_CAPACITY     16
+#define CRYPT_POOL_CLASS_LIMIT      (64 * 1024)
+#define CRYPT_POOL_PAGE_SIZE        4096
+
+//
+// Anything bigger than this is refused, which keeps the header small and the
+// size calculations below from overflowing.
+//
+#define CRYPT_MAX_ALLOCATION        0x40000000
+
+//
+// Precedes every allocation, and keeps the memory handed out 8-byte aligned.
+//
+typedef struct {
+  UINT32  Size;
+  UINT32  Capacity;
+} CRYPT_ALLOCATION_HEADER;
+
+#define CRYPT_ALIGN(Size)    (((Size) + sizeof (CRYPT_ALLOCATION_HEADER) - 1) & ~(sizeof (CRYPT_ALLOCATION_HEADER) - 1))
+#define CRYPT_HEADER(Ptr)    ((CRYPT_ALLOCATION_HEADER *) (Ptr) - 1)
+#define CRYPT_ARENA_NO_LAST  ((UINTN) -1)
+
+//
+// Marks a freed arena block, which can't be handed out again until the arena
+// is rewound past it. No allocation is ever this big.
+//
+#define CRYPT_ARENA_FREED    ((UINT32) -1)
+
+static UINT8  *mArenaBase       = NULL;
+static UINTN  mArenaTop         = 0;
+static UINTN  mArenaLast        = CRYPT_ARENA_NO_LAST;
+static UINTN  mArenaLive        = 0;
+static UINTN  mArenaDepth       = 0;
+static UINTN  mArenaSuspended   = 0;
+static UINTN  mArenaPeak        = 0;
+static UINTN  mArenaAllocations = 0;
+static UINTN  mArenaFallbacks   = 0;
+
+static CRYPT_ALLOCATION_STATS  mAllocationStats;
+
+//
+// Checks the header rather than the block itself, since an empty block at the
+// very end of the arena starts just past it.
+//
+static
+BOOLEAN
+ArenaOwns (
+  IN VOID  *Ptr
+  )
+{
+  return mArenaBase != NULL &&
+         (UINT8 *) CRYPT_HEADER (Ptr) >= mArenaBase &&
+         (UINT8 *) CRYPT_HEADER (Ptr) < mArenaBase + CRYPT_ARENA_SIZE;
+}
+
+static
+VOID
+ArenaUpdatePeak (
+  VOID
+  )
+{
+  if (mArenaTop > mArenaPeak) {
+    mArenaPeak = mArenaTop;
+  }
+}
+
+static
+VOID *
+ArenaAllocate (
+  IN UINTN  Size
+  )
+{
+  CRYPT_ALLOCATION_HEADER  *Header;
+  UINTN                    Capacity;
+
+  Capacity = CRYPT_ALIGN (Size);
+  if (sizeof (CRYPT_ALLOCATION_HEADER) + Capacity > CRYPT_ARENA_SIZE - mArenaTop) {
+    return NULL;
+  }
+
+  Header           = (CRYPT_ALLOCATION_HEADER *) (mArenaBase + mArenaTop);
+  Header->Size     = (UINT32) Size;
+  Header->Capacity = (UINT32) Capacity;
+  mArenaLast       = mArenaTop;
+  mArenaTop       += sizeof (CRYPT_ALLOCATION_HEADER) + Capacity;
+  mArenaLive++;
+  mArenaAllocations++;
+  ArenaUpdatePeak ();
+
+  return Header + 1;
+}
+
+//
+// The most recent arena allocation has nothing after it, so it can grow up to
+// the end of the arena.
+//
+static
+BOOLEAN
+ArenaExtend (
+  IN CRYPT_ALLOCATION_HEADER  *Header,
+  IN UINTN                    Size
+  )
+{
+  UINTN  Capacity;
+
+  if ((UINT8 *) Header != mArenaBase + mArenaLast) {
+    return FALSE;
+  }
+
+  Capacity = CRYPT_ALIGN (Size);
+  if (Capacity > CRYPT_ARENA_SIZE - mArenaLast - sizeof (CRYPT_ALLOCATION_HEADER)) {
+    return FALSE;
+  }
+
+  Header->Capacity = (UINT32) Capacity;
+  mArenaTop        = mArenaLast + sizeof (CRYPT_ALLOCATION_HEADER) + Capacity;
+  ArenaUpdatePeak ();
+
+  return TRUE;
+}
+
+static
+VOID
+ArenaFree (
+  IN CRYPT_ALLOCATION_HEADER  *Header
+  )
+{
+  Header->Size = CRYPT_ARENA_FREED;
+  mArenaLive--;
+
+  if (mArenaLive == 0) {
+    mArenaTop  = 0;
+    mArenaLast = CRYPT_ARENA_NO_LAST;
+  } else if ((UINT8 *) Header == mArenaBase + mArenaLast) {
+    mArenaTop  = mArenaLast;
+    mArenaLast = CRYPT_ARENA_NO_LAST;
+  }
+}
+
+//
+// Arena blocks lie end to end from the start of the arena up to the top, so
+// walking them finds the last one still in use, and the top can come down to
+// just past it.
+//
+static
+VOID
+ArenaTrim (
+  VOID
+  )
+{
+  CRYPT_ALLOCATION_HEADER  *Header;
+  UINTN                    Offset;
+  UINTN                    Top;
+  UINTN                    Last;
+
+  Top  = 0;
+  Last = CRYPT_ARENA_NO_LAST;
+  for (Offset = 0; Offset < mArenaTop; Offset += sizeof (CRYPT_ALLOCATION_HEADER) + Header->Capacity) {
+    Header = (CRYPT_ALLOCATION_HEADER *) (mArenaBase + Offset);
+    if (Header->Size != CRYPT_ARENA_FREED) {
+      Last = Offset;
+      Top  = Offset + sizeof (CRYPT_ALLOCATION_HEADER) + Header->Capacity;
+    }
+  }
+
+  mArenaTop  = Top;
+  mArenaLast = Last;
+}
+
+static
+UINTN
+PoolCapacity (
+  IN UINTN  Size
+  )
+{
+  UINTN  Class;
+
+  if (Size >= CRYPT_POOL_CLASS_LIMIT) {
+    return (Size + CRYPT_POOL_PAGE_SIZE - 1) & ~((UINTN) CRYPT_POOL_PAGE_SIZE - 1);
+  }
+
+  Class = CRYPT_POOL_MIN_CAPACITY;
+  while (Class < Size) {
+    if (Class + Class / 2 >= Size) {
+      return Class + Class / 2;
+    }
+    Class *= 2;
+  }
+
+  return Class;
+}
+
+static
+VOID *
+PoolAllocate (
+  IN UINTN  Size
+  )
+{
+  CRYPT_ALLOCATION_HEADER  *Header;
+  UINTN                    Capacity;
+
+  Capacity = PoolCapacity (Size);
+  Header   = AllocatePool (sizeof (CRYPT_ALLOCATION_HEADER) + Capacity);
+  if (Header == NULL) {
+    return NULL;
+  }
+
+  Header->Size     = (UINT32) Size;
+  Header->Capacity = (UINT32) Capacity;
+
+  return Header + 1;
+}
+
+static
+VOID
+StatsAdd (
+  IN UINTN  Size
+  )
+{
+  mAllocationStats.BytesInUse += Size;
+  if (mAllocationStats.BytesInUse > mAllocationStats.PeakBytesInUse) {
+    mAllocationStats.PeakBytesInUse = mAllocationStats.BytesInUse;
+  }
+}
+
+/**
+  Starts allocating small blocks from the arena, until the matching
+  CryptArenaEnd(). Scopes may be nested.
+
+**/
+VOID
+EFIAPI
+CryptArenaBegin (
+  VOID
+  )
+{
+  if (mArenaBase == NULL) {
+    mArenaBase = AllocatePool (CRYPT_ARENA_SIZE);
+  }
+
+  mArenaDepth++;
+}
+
+/**
+  Ends a scope started by CryptArenaBegin(). Once the outermost scope has ended
+  and everything allocated from the arena has been freed, the arena is empty
+  again; if some of it is still in use, only what comes after the last block
+  in use is given back.
+
+**/
+VOID
+EFIAPI
+CryptArenaEnd (
+  VOID
+  )
+{
+  if (mArenaDepth > 0) {
+    mArenaDepth--;
+    if (mArenaDepth == 0 && mArenaLive > 0) {
+      ArenaTrim ();
+    }
+  }
+}
+
+/**
+  Returns how much of the arena has been used and how often it could not be.
+
+  @param[out]  Size         Size of the arena in bytes.
+  @param[out]  Peak         Most bytes of the arena ever in use at once.
+  @param[out]  Allocations  Number of allocations taken from the arena.
+  @param[out]  Fallbacks    Number of allocations made inside a scope that went
+                            to the pool, because they were too big or the
+                            arena was full.
+
+**/
+VOID
+EFIAPI
+CryptArenaGetStats (
+  OUT UINTN  *Size,
+  OUT UINTN  *Peak,
+  OUT UINTN  *Allocations,
+  OUT UINTN  *Fallbacks
+  )
+{
+  *Size        = mArenaBase != NULL ? CRYPT_ARENA_SIZE : 0;
+  *Peak        = mArenaPeak;
+  *Allocations = mArenaAllocations;
+  *Fallbacks   = mArenaFallbacks;
+}
+
+/**
+  Sends allocations to the pool even inside an arena scope, for state that is
+  kept after the scope ends. Calls nest, and each one must be matched by a call
+  to CryptArenaResume().
+
+**/
+VOID
+CryptArenaSuspend (
+  VOID
+  )
+{
+  mArenaSuspended++;
+}
+
+VOID
+CryptArenaResume (
+  VOID
+  )
+{
+  if (mArenaSuspended > 0) {
+    mArenaSuspended--;
+  }
+}
+
+/**
+  Retrieves the counters kept by malloc(), realloc() and free().
+
+  @param[out]  Stats  Receives the counters since the image was loaded.
+
+**/
+VOID
+EFIAPI
+CryptGetAllocationStats (
+  OUT CRYPT_ALLOCATION_STATS  *Stats
+  )
+{
+  CopyMem (Stats, &mAllocationStats, sizeof (*Stats));
+}
 
 //
 // -- Memory-Allocation Routines --
@@ -22,27 +381,105 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 /* Allocates memory blocks */
 void *malloc (size_t size)
 {
-  return AllocatePool ((UINTN) size);
+  VOID  *Ptr;
+
+  if (size > CRYPT_MAX_ALLOCATION) {
+    return NULL;
+  }
+
+  Ptr = NULL;
+  if (mArenaDepth > 0 && mArenaSuspended == 0 && mArenaBase != NULL) {
+    if (size <= CRYPT_ARENA_MAX_ALLOCATION) {
+      Ptr = ArenaAllocate ((UINTN) size);
+    }
+    if (Ptr == NULL) {
+      mArenaFallbacks++;
+    }
+  }
+
+  if (Ptr == NULL) {
+    Ptr = PoolAllocate ((UINTN) size);
+    if (Ptr == NULL) {
+      return NULL;
+    }
+  }
+
+  mAllocationStats.Allocations++;
+  StatsAdd ((UINTN) size);
+
+  return Ptr;
 }
 
 /* Reallocate memory blocks */
 void *realloc (void *ptr, size_t size)
 {
+  CRYPT_ALLOCATION_HEADER  *Header;
+  VOID                     *NewPtr;
+  UINTN                    OldSize;
+
+  if (ptr == NULL) {
+    return malloc (size);
+  }
+
+  if (size > CRYPT_MAX_ALLOCATION) {
+    return NULL;
+  }
+
+  mAllocationStats.Reallocs++;
+
+  Header  = CRYPT_HEADER (ptr);
+  OldSize = Header->Size;
+
+  if (size <= Header->Capacity ||
+      (ArenaOwns (ptr) && ArenaExtend (Header, (UINTN) size))) {
+    Header->Size = (UINT32) size;
+    mAllocationStats.ReallocsInPlace++;
+    mAllocationStats.BytesInUse -= OldSize;
+    StatsAdd ((UINTN) size);
+    return ptr;
+  }
+
+  NewPtr = malloc (size);
+  if (NewPtr == NULL) {
+    return NULL;
+  }
+
+  CopyMem (NewPtr, ptr, OldSize);
+  mAllocationStats.ReallocCopies++;
+  mAllocationStats.BytesCopied += OldSize;
+
   //
-  // BUG: hardcode OldSize == size! We have no any knowledge about
-  // memory size of original pointer ptr.
+  // The new block was counted as an allocation of its own, so this one is
+  // counted as freed.
   //
-  return ReallocatePool (ptr, (UINTN) size, (UINTN) size);
+  free (ptr);
+  mAllocationStats.Allocations--;
+  mAllocationStats.Frees--;
+
+  return NewPtr;
 }
 
 /* De-allocates or frees a memory block */
 void free (void *ptr)
 {
+  CRYPT_ALLOCATION_HEADER  *Header;
+
   //
   // In Standard C, free() handles a null pointer argument transparently. This
   // is not true of FreePool() below, so protect it.
   //
-  if (ptr != NULL) {
-    FreePool (ptr);
+  if (ptr == NULL) {
+    return;
   }
+
+  Header = CRYPT_HEADER (ptr);
+  mAllocationStats.Frees++;
+  mAllocationStats.BytesInUse -= Header->Size;
+
+  if (ArenaOwns (ptr)) {
+    ArenaFree (Header);
+    return;
+  }
+
+  FreePool (Header);
 }
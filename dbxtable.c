@@ -0,0 +1,286 @@
+/*
+ * Turn the EFI_SIGNATURE_LIST file given as VENDOR_DBX_FILE into a header
+ * holding its SHA-1 and SHA-256 hashes as sorted arrays, along with a Bloom
+ * filter over all of them, so that shim can look an image up in vendor_dbx
+ * without parsing or sorting anything when it starts.
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHA1_DIGEST_SIZE	20
+#define SHA256_DIGEST_SIZE	32
+
+/*
+ * Bits of filter per hash, and how many bits each hash sets.  16 and 4 give
+ * a false positive rate of about 0.25%.
+ */
+#define BLOOM_BITS_PER_DIGEST	16
+#define BLOOM_HASHES		4
+#define BLOOM_MIN_BITS		64
+
+#define ESL_HEADER_SIZE		28	/* SignatureType + 3 UINT32 sizes */
+#define GUID_SIZE		16
+
+/* EFI_CERT_SHA1_GUID and EFI_CERT_SHA256_GUID as they are laid out in memory */
+static const uint8_t sha1_guid[GUID_SIZE] = {
+	0x12, 0xa5, 0x6c, 0x82, 0x10, 0xcf, 0xc9, 0x4a,
+	0xb1, 0x87, 0xbe, 0x01, 0x49, 0x66, 0x31, 0xbd
+};
+static const uint8_t sha256_guid[GUID_SIZE] = {
+	0x26, 0x16, 0xc4, 0xc1, 0x4c, 0x50, 0x92, 0x40,
+	0xac, 0xa9, 0x41, 0xf9, 0x36, 0x93, 0x43, 0x28
+};
+
+struct digests {
+	const char *name;
+	const char *ident;
+	const uint8_t *guid;
+	size_t size;
+	uint8_t *data;
+	size_t count;
+};
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint8_t *read_file(const char *path, size_t *sizep)
+{
+	FILE *f;
+	uint8_t *buf = NULL;
+	size_t size = 0, alloc = 0, n;
+
+	f = fopen(path, "rb");
+	if (!f)
+		err(1, "Could not open \"%s\"", path);
+
+	do {
+		if (size == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			buf = realloc(buf, alloc);
+			if (!buf)
+				err(1, "Could not allocate memory");
+		}
+		n = fread(buf + size, 1, alloc - size, f);
+		size += n;
+	} while (n > 0);
+
+	if (ferror(f))
+		err(1, "Could not read \"%s\"", path);
+	fclose(f);
+
+	*sizep = size;
+	return buf;
+}
+
+static size_t digest_size;
+
+static int compare_digests(const void *a, const void *b)
+{
+	return memcmp(a, b, digest_size);
+}
+
+static void sort_digests(struct digests *d)
+{
+	size_t i, n = 0;
+
+	if (d->count == 0)
+		return;
+
+	digest_size = d->size;
+	qsort(d->data, d->count, d->size, compare_digests);
+
+	/* Duplicates would only make the table bigger */
+	for (i = 0; i < d->count; i++) {
+		if (n > 0 && !memcmp(d->data + (n - 1) * d->size,
+				     d->data + i * d->size, d->size))
+			continue;
+		memmove(d->data + n * d->size, d->data + i * d->size, d->size);
+		n++;
+	}
+	d->count = n;
+}
+
+/*
+ * Walk the signature lists.  Unlike shim, which skips whatever it can't
+ * use, a malformed file is an error here, since it would otherwise leave
+ * hashes quietly missing from the table.
+ */
+static void parse_esl(const char *path, const uint8_t *db, size_t dbsize,
+		      struct digests *lists, int nlists)
+{
+	uint32_t list_size, header_size, sig_size;
+	size_t offset = 0, entries, i;
+	const uint8_t *sig;
+	int pass, l;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (offset = 0; offset < dbsize; offset += list_size) {
+			const uint8_t *esl = db + offset;
+
+			if (dbsize - offset < ESL_HEADER_SIZE)
+				errx(1, "%s: truncated signature list at offset %zu",
+				     path, offset);
+
+			list_size = get_le32(esl + 16);
+			header_size = get_le32(esl + 20);
+			sig_size = get_le32(esl + 24);
+
+			if (list_size < ESL_HEADER_SIZE ||
+			    list_size > dbsize - offset ||
+			    header_size > list_size - ESL_HEADER_SIZE)
+				errx(1, "%s: invalid signature list at offset %zu",
+				     path, offset);
+
+			for (l = 0; l < nlists; l++) {
+				struct digests *d = &lists[l];
+
+				if (memcmp(esl, d->guid, GUID_SIZE))
+					continue;
+				if (sig_size < GUID_SIZE + d->size)
+					errx(1, "%s: %s signature list at offset %zu has %u byte entries",
+					     path, d->name, offset, sig_size);
+
+				entries = (list_size - ESL_HEADER_SIZE -
+					   header_size) / sig_size;
+				sig = esl + ESL_HEADER_SIZE + header_size;
+				for (i = 0; i < entries; i++, sig += sig_size) {
+					if (pass == 1)
+						memcpy(d->data + d->count * d->size,
+						       sig + GUID_SIZE, d->size);
+					d->count++;
+				}
+			}
+		}
+
+		if (pass == 1)
+			break;
+
+		for (l = 0; l < nlists; l++) {
+			lists[l].data = calloc(lists[l].count ? lists[l].count : 1,
+					       lists[l].size);
+			if (!lists[l].data)
+				err(1, "Could not allocate memory");
+			lists[l].count = 0;
+		}
+	}
+}
+
+static void write_digests(FILE *out, struct digests *d)
+{
+	size_t i, j;
+
+	fprintf(out, "#define VENDOR_DBX_%s_COUNT %zu\n", d->name, d->count);
+	fprintf(out, "static UINT8 vendor_dbx_%s[%zu][%zu] __attribute__((__unused__))",
+		d->ident, d->count, d->size);
+	if (d->count == 0) {
+		fprintf(out, ";\n\n");
+		return;
+	}
+
+	fprintf(out, " = {\n");
+	for (i = 0; i < d->count; i++) {
+		fprintf(out, "\t{");
+		for (j = 0; j < d->size; j++)
+			fprintf(out, "%s0x%02x", j ? ", " : " ",
+				d->data[i * d->size + j]);
+		fprintf(out, " },\n");
+	}
+	fprintf(out, "};\n\n");
+}
+
+/*
+ * The hashes are already uniformly distributed, so the filter's hash
+ * functions are simply successive 32-bit words of each one.  This must
+ * match bloom_may_contain() in trust.c.
+ */
+static void write_bloom(FILE *out, struct digests *lists, int nlists)
+{
+	size_t total = 0, bits = BLOOM_MIN_BITS, i;
+	uint32_t *bloom, bit;
+	int l, k;
+
+	for (l = 0; l < nlists; l++)
+		total += lists[l].count;
+	while (bits < total * BLOOM_BITS_PER_DIGEST)
+		bits *= 2;
+
+	bloom = calloc(bits / 32, sizeof(*bloom));
+	if (!bloom)
+		err(1, "Could not allocate memory");
+
+	for (l = 0; l < nlists; l++) {
+		for (i = 0; i < lists[l].count; i++) {
+			uint8_t *digest = lists[l].data + i * lists[l].size;
+
+			for (k = 0; k < BLOOM_HASHES; k++) {
+				bit = get_le32(digest + k * 4) & (bits - 1);
+				bloom[bit / 32] |= 1U << (bit % 32);
+			}
+		}
+	}
+
+	fprintf(out, "#define VENDOR_DBX_BLOOM_BITS %zu\n", bits);
+	fprintf(out, "#define VENDOR_DBX_BLOOM_HASHES %d\n", BLOOM_HASHES);
+	fprintf(out, "static UINT32 vendor_dbx_bloom[%zu] __attribute__((__unused__)) = {",
+		bits / 32);
+	for (i = 0; i < bits / 32; i++)
+		fprintf(out, "%s0x%08x,", i % 6 ? " " : "\n\t", bloom[i]);
+	fprintf(out, "\n};\n\n");
+
+	free(bloom);
+}
+
+int main(int argc, char *argv[])
+{
+	struct digests lists[] = {
+		{ "SHA1", "sha1", sha1_guid, SHA1_DIGEST_SIZE, NULL, 0 },
+		{ "SHA256", "sha256", sha256_guid, SHA256_DIGEST_SIZE, NULL, 0 },
+	};
+	int nlists = sizeof(lists) / sizeof(lists[0]);
+	uint8_t *db;
+	size_t dbsize;
+	FILE *out;
+	int l;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <vendor dbx file> <header>\n",
+			argv[0]);
+		return 1;
+	}
+
+	db = read_file(argv[1], &dbsize);
+	parse_esl(argv[1], db, dbsize, lists, nlists);
+	for (l = 0; l < nlists; l++)
+		sort_digests(&lists[l]);
+
+	out = fopen(argv[2], "w");
+	if (!out)
+		err(1, "Could not open \"%s\"", argv[2]);
+
+	fprintf(out, "/* Generated by dbxtable from %s; do not edit. */\n\n",
+		argv[1]);
+	for (l = 0; l < nlists; l++)
+		write_digests(out, &lists[l]);
+	write_bloom(out, lists, nlists);
+
+	if (fclose(out) != 0) {
+		unlink(argv[2]);
+		err(1, "Could not write \"%s\"", argv[2]);
+	}
+
+	for (l = 0; l < nlists; l++)
+		free(lists[l].data);
+	free(db);
+
+	return 0;
+}
@@ -33,6 +33,11 @@
 
 #include <efi.h>
 #include <efilib.h>
+#include "fwtrace.h"
+#include "timeline.h"
+#include "timestamp.h"
+#include "console.h"
+#include "httpboot.h"
 #include "str.h"
 #include "Http.h"
 #include "Ip4Config2.h"
@@ -428,13 +433,18 @@ configure_http (EFI_HTTP_PROTOCOL *http, BOOLEAN is_ip6)
 	return uefi_call_wrapper(http->Configure, 2, http, &http_mode);
 }
 
+/*
+ * Send a request for uri, and for just the given byte range of it if range
+ * isn't NULL
+ */
 static EFI_STATUS
-send_http_request (EFI_HTTP_PROTOCOL *http, CHAR8 *hostname, CHAR8 *uri)
+send_http_request (EFI_HTTP_PROTOCOL *http, EFI_HTTP_METHOD method,
+		   CHAR8 *hostname, CHAR8 *uri, CHAR8 *range)
 {
 	EFI_HTTP_TOKEN tx_token;
 	EFI_HTTP_MESSAGE tx_message;
 	EFI_HTTP_REQUEST_DATA request;
-	EFI_HTTP_HEADER headers[3];
+	EFI_HTTP_HEADER headers[4];
 	BOOLEAN request_done;
 	CHAR16 *Url = NULL;
 	EFI_STATUS status;
@@ -445,7 +455,7 @@ send_http_request (EFI_HTTP_PROTOCOL *http, CHAR8 *hostname, CHAR8 *uri)
 	if (!Url)
 		return EFI_OUT_OF_RESOURCES;
 
-	request.Method = HttpMethodGet;
+	request.Method = method;
 	request.Url = Url;
 
 	/* Prepare the HTTP headers */
@@ -455,9 +465,11 @@ send_http_request (EFI_HTTP_PROTOCOL *http, CHAR8 *hostname, CHAR8 *uri)
 	headers[1].FieldValue = (CHAR8 *)"*/*";
 	headers[2].FieldName = (CHAR8 *)"User-Agent";
 	headers[2].FieldValue = (CHAR8 *)"UefiHttpBoot/1.0";
+	headers[3].FieldName = (CHAR8 *)"Range";
+	headers[3].FieldValue = range;
 
 	tx_message.Data.Request = &request;
-	tx_message.HeaderCount = 3;
+	tx_message.HeaderCount = range ? 4 : 3;
 	tx_message.Headers = headers;
 	tx_message.BodyLength = 0;
 	tx_message.Body = NULL;
@@ -507,26 +519,309 @@ no_event:
 	return status;
 }
 
+static CHAR8
+to_lower (CHAR8 c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c + 'a' - 'A';
+	return c;
+}
+
+/*
+ * Compare an HTTP header field name, ignoring case as RFC 7230 says to
+ */
+static BOOLEAN
+header_name_is (CONST CHAR8 *name, CONST CHAR8 *want)
+{
+	while (*name && to_lower(*name) == to_lower(*want)) {
+		name++;
+		want++;
+	}
+	return *name == *want;
+}
+
+/*
+ * Whether a Transfer-Encoding value ends with "chunked", which RFC 7230
+ * says it must if chunked is used at all
+ */
+static BOOLEAN
+is_chunked (CONST CHAR8 *value)
+{
+	CONST CHAR8 *chunked = (CHAR8 *)"chunked";
+	UINTN len = strlena(value);
+	UINTN i;
+
+	while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+		len--;
+	if (len < 7)
+		return FALSE;
+
+	value += len - 7;
+	for (i = 0; i < 7; i++) {
+		if (to_lower(value[i]) != chunked[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Read a decimal number, refusing an empty one or one that doesn't fit
+ */
+static BOOLEAN
+parse_decimal (CONST CHAR8 **str, UINTN *value)
+{
+	CONST CHAR8 *p = *str;
+	UINTN n = 0;
+
+	if (*p < '0' || *p > '9')
+		return FALSE;
+	for (; *p >= '0' && *p <= '9'; p++) {
+		if (n > (~(UINTN)0 - (*p - '0')) / 10)
+			return FALSE;
+		n = n * 10 + *p - '0';
+	}
+
+	*str = p;
+	*value = n;
+	return TRUE;
+}
+
+/*
+ * Whether a Content-Range value, "bytes first-last/size" with size
+ * possibly "*", is for exactly the bytes from first to last
+ */
+static BOOLEAN
+content_range_is (CONST CHAR8 *value, UINTN first, UINTN last)
+{
+	CONST CHAR8 *unit = (CHAR8 *)"bytes";
+	UINTN i, n;
+
+	while (*value == ' ' || *value == '\t')
+		value++;
+	for (i = 0; i < 5; i++) {
+		if (to_lower(value[i]) != unit[i])
+			return FALSE;
+	}
+	value += 5;
+	if (*value != ' ')
+		return FALSE;
+	while (*value == ' ')
+		value++;
+
+	if (!parse_decimal(&value, &n) || n != first || *value++ != '-')
+		return FALSE;
+	if (!parse_decimal(&value, &n) || n != last || *value++ != '/')
+		return FALSE;
+	if (*value == '*')
+		return TRUE;
+	return parse_decimal(&value, &n) && n > last;
+}
+
+/*
+ * The firmware hands us the body of a chunked response as it was sent, so
+ * it has to be decoded here.  The decoder is fed the body as it arrives and
+ * moves the data down over the chunk headers in place.
+ */
+typedef enum {
+	CHUNK_SIZE,
+	CHUNK_EXTENSION,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER,
+	CHUNK_DONE
+} chunk_state_t;
+
+typedef struct {
+	chunk_state_t state;
+	UINTN size;		/* of the chunk being read, or what's left of it */
+	UINTN digits;
+	BOOLEAN line_empty;
+} chunk_decoder_t;
+
+static EFI_STATUS
+chunk_size_done (chunk_decoder_t *decoder)
+{
+	if (decoder->digits == 0)
+		return EFI_PROTOCOL_ERROR;
+
+	if (decoder->size == 0) {
+		decoder->state = CHUNK_TRAILER;
+		decoder->line_empty = TRUE;
+	} else {
+		decoder->state = CHUNK_DATA;
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * Decode len bytes at data, leaving the decoded body at the same address
+ * and its length in decoded
+ */
+static EFI_STATUS
+decode_chunks (chunk_decoder_t *decoder, CHAR8 *data, UINTN len,
+	       UINTN *decoded)
+{
+	CHAR8 *in = data, *end = data + len, *out = data;
+	EFI_STATUS status;
+	UINTN n;
+	CHAR8 c;
+
+	while (in < end && decoder->state != CHUNK_DONE) {
+		if (decoder->state == CHUNK_DATA) {
+			n = end - in;
+			if (n > decoder->size)
+				n = decoder->size;
+			if (out != in)
+				CopyMem(out, in, n);
+			out += n;
+			in += n;
+			decoder->size -= n;
+			if (decoder->size == 0)
+				decoder->state = CHUNK_DATA_END;
+			continue;
+		}
+
+		c = *in++;
+		switch (decoder->state) {
+		case CHUNK_SIZE:
+			if (c == '\n') {
+				status = chunk_size_done(decoder);
+				if (EFI_ERROR(status))
+					return status;
+			} else if (c == ';' || c == ' ' || c == '\t') {
+				decoder->state = CHUNK_EXTENSION;
+			} else if (c != '\r') {
+				if (c >= '0' && c <= '9')
+					c -= '0';
+				else if (c >= 'a' && c <= 'f')
+					c -= 'a' - 10;
+				else if (c >= 'A' && c <= 'F')
+					c -= 'A' - 10;
+				else
+					return EFI_PROTOCOL_ERROR;
+				if (decoder->size > (UINTN)-1 >> 4)
+					return EFI_PROTOCOL_ERROR;
+				decoder->size = decoder->size << 4 | c;
+				decoder->digits++;
+			}
+			break;
+		case CHUNK_EXTENSION:
+			if (c == '\n') {
+				status = chunk_size_done(decoder);
+				if (EFI_ERROR(status))
+					return status;
+			}
+			break;
+		case CHUNK_DATA_END:
+			if (c == '\n') {
+				decoder->state = CHUNK_SIZE;
+				decoder->size = 0;
+				decoder->digits = 0;
+			} else if (c != '\r') {
+				return EFI_PROTOCOL_ERROR;
+			}
+			break;
+		case CHUNK_TRAILER:
+			if (c == '\n') {
+				if (decoder->line_empty)
+					decoder->state = CHUNK_DONE;
+				decoder->line_empty = TRUE;
+			} else if (c != '\r') {
+				decoder->line_empty = FALSE;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	*decoded = out - data;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Ask for the next part of the response, with up to body_length bytes of
+ * the body (if any) going straight to body
+ */
+static EFI_STATUS
+http_receive_start (EFI_HTTP_PROTOCOL *http, EFI_HTTP_TOKEN *rx_token,
+		    BOOLEAN *response_done, VOID *body, UINTN body_length)
+{
+	EFI_HTTP_MESSAGE *rx_message = rx_token->Message;
+	EFI_STATUS status;
+
+	rx_message->BodyLength = body_length;
+	rx_message->Body = body;
+
+	rx_token->Status = EFI_NOT_READY;
+	*response_done = FALSE;
+
+	status = uefi_call_wrapper(http->Response, 2, http, rx_token);
+	if (EFI_ERROR(status))
+		perror(L"HTTP response failed: %r\n", status);
+
+	return status;
+}
+
+/*
+ * Ask for the next part of the response and wait for it
+ */
 static EFI_STATUS
-receive_http_response(EFI_HTTP_PROTOCOL *http, VOID **buffer, UINT64 *buf_size)
+http_receive (EFI_HTTP_PROTOCOL *http, EFI_HTTP_TOKEN *rx_token,
+	      BOOLEAN *response_done, VOID *body, UINTN *body_length)
+{
+	EFI_HTTP_MESSAGE *rx_message = rx_token->Message;
+	EFI_STATUS status;
+
+	status = http_receive_start(http, rx_token, response_done, body,
+				    *body_length);
+	if (EFI_ERROR(status))
+		return status;
+
+	while (!*response_done)
+		uefi_call_wrapper(http->Poll, 1, http);
+
+	if (EFI_ERROR(rx_token->Status)) {
+		perror(L"HTTP response: %r\n", rx_token->Status);
+		return rx_token->Status;
+	}
+
+	*body_length = rx_message->BodyLength;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Without a Content-Length, start with this much room, and keep at least
+ * HTTP_MIN_WINDOW free for the next part of the body
+ */
+#define HTTP_INITIAL_BUFFER	(4 * 1024 * 1024)
+#define HTTP_MIN_WINDOW		(64 * 1024)
+
+static EFI_STATUS
+receive_http_response(EFI_HTTP_PROTOCOL *http, VOID **buffer, UINT64 *buf_size,
+		      httpboot_progress_t progress, VOID *context)
 {
 	EFI_HTTP_TOKEN rx_token;
 	EFI_HTTP_MESSAGE rx_message;
 	EFI_HTTP_RESPONSE_DATA response;
 	EFI_HTTP_STATUS_CODE http_status;
 	BOOLEAN response_done;
-	UINTN i, downloaded;
-	CHAR8 rx_buffer[9216];
+	BOOLEAN chunked = FALSE;
+	chunk_decoder_t decoder;
+	UINTN i, downloaded, capacity, received, decoded;
+	UINT64 content_length = 0;
+	UINT64 start, ticks, frequency;
+	CHAR8 *data = NULL, *new_data;
 	EFI_STATUS status;
 	EFI_STATUS event_status;
 
-	/* Initialize the rx message and buffer */
+	*buffer = NULL;
+
+	/* Initialize the rx message */
 	response.StatusCode = HTTP_STATUS_UNSUPPORTED_STATUS;
 	rx_message.Data.Response = &response;
 	rx_message.HeaderCount = 0;
-	rx_message.Headers = 0;
-	rx_message.BodyLength = sizeof(rx_buffer);
-	rx_message.Body = rx_buffer;
+	rx_message.Headers = NULL;
 
 	rx_token.Status = EFI_NOT_READY;
 	rx_token.Message = &rx_message;
@@ -543,25 +838,18 @@ receive_http_response(EFI_HTTP_PROTOCOL *http, VOID **buffer, UINT64 *buf_size)
 		goto no_event;
 	}
 
-	/* Notify the firmware to receive the HTTP messages */
-	status = uefi_call_wrapper(http->Response, 2, http, &rx_token);
-	if (EFI_ERROR(status)) {
-		perror(L"HTTP response failed: %r\n", status);
-		goto error;
-	}
-
-	/* Wait for the response */
-	while (!response_done)
-		uefi_call_wrapper(http->Poll, 1, http);
-
-	if (EFI_ERROR(rx_token.Status)) {
-		perror(L"HTTP response: %r\n", rx_token.Status);
-		status = rx_token.Status;
+	/*
+	 * Get just the headers first, so we know how big the body is before
+	 * we have to say where it goes
+	 */
+	start = read_timestamp();
+	received = 0;
+	status = http_receive(http, &rx_token, &response_done, NULL, &received);
+	if (EFI_ERROR(status))
 		goto error;
-	}
 
 	/* Check the HTTP status code */
-	http_status = rx_token.Message->Data.Response->StatusCode;
+	http_status = rx_message.Data.Response->StatusCode;
 	if (http_status != HTTP_STATUS_200_OK) {
 		perror(L"HTTP Status Code: %d\n",
 		       convert_http_status_code(http_status));
@@ -571,65 +859,104 @@ receive_http_response(EFI_HTTP_PROTOCOL *http, VOID **buffer, UINT64 *buf_size)
 
 	/* Check the length of the file */
 	for (i = 0; i < rx_message.HeaderCount; i++) {
-		if (!strcmpa(rx_message.Headers[i].FieldName, (CHAR8 *)"Content-Length")) {
-			*buf_size = ascii_to_int(rx_message.Headers[i].FieldValue);
-		}
+		if (header_name_is(rx_message.Headers[i].FieldName,
+				   (CHAR8 *)"Content-Length"))
+			content_length =
+				ascii_to_int(rx_message.Headers[i].FieldValue);
+		else if (header_name_is(rx_message.Headers[i].FieldName,
+					(CHAR8 *)"Transfer-Encoding") &&
+			 is_chunked(rx_message.Headers[i].FieldValue))
+			chunked = TRUE;
 	}
 
-	if (*buf_size == 0) {
-		perror(L"Failed to get Content-Lenght\n");
+	if (rx_message.Headers)
+		FreePool(rx_message.Headers);
+	rx_message.Headers = NULL;
+	rx_message.HeaderCount = 0;
+	rx_message.Data.Response = NULL;
+
+	if (chunked) {
+		/* the length, if it was sent at all, is of the encoded body */
+		capacity = HTTP_INITIAL_BUFFER;
+		ZeroMem(&decoder, sizeof(decoder));
+		decoder.state = CHUNK_SIZE;
+	} else if (content_length) {
+		capacity = content_length;
+		if (capacity != content_length) {
+			status = EFI_BAD_BUFFER_SIZE;
+			goto error;
+		}
+	} else {
+		perror(L"Failed to get Content-Length\n");
+		status = EFI_PROTOCOL_ERROR;
 		goto error;
 	}
 
-	*buffer = AllocatePool(*buf_size);
-	if (!*buffer) {
+	data = AllocatePool(capacity);
+	if (!data) {
 		perror(L"Failed to allocate new rx buffer\n");
+		status = EFI_OUT_OF_RESOURCES;
 		goto error;
 	}
 
-	downloaded = rx_message.BodyLength;
-
-	CopyMem(*buffer, rx_buffer, downloaded);
-
-	/* Retreive the rest of the message */
-	while (downloaded < *buf_size) {
-		if (rx_message.Headers) {
-			FreePool(rx_message.Headers);
-		}
-		rx_message.Headers = NULL;
-		rx_message.HeaderCount = 0;
-		rx_message.Data.Response = NULL;
-		rx_message.BodyLength = sizeof(rx_buffer);
-		rx_message.Body = rx_buffer;
-
-		rx_token.Status = EFI_NOT_READY;
-		response_done = FALSE;
-
-		status = uefi_call_wrapper(http->Response, 2, http, &rx_token);
-		if (EFI_ERROR(status)) {
-			perror(L"HTTP response failed: %r\n", status);
-			goto error;
+	/*
+	 * Receive the body straight into place, offering the firmware all of
+	 * the space that is left each time
+	 */
+	downloaded = 0;
+	while (chunked ? decoder.state != CHUNK_DONE :
+			 downloaded < content_length) {
+		if (chunked && capacity - downloaded < HTTP_MIN_WINDOW) {
+			new_data = AllocatePool(capacity * 2);
+			if (!new_data) {
+				perror(L"Failed to grow rx buffer\n");
+				status = EFI_OUT_OF_RESOURCES;
+				goto error;
+			}
+			CopyMem(new_data, data, downloaded);
+			FreePool(data);
+			data = new_data;
+			capacity *= 2;
 		}
 
-		while (!response_done)
-			uefi_call_wrapper(http->Poll, 1, http);
-
-		if (EFI_ERROR(rx_token.Status)) {
-			perror(L"HTTP response: %r\n", rx_token.Status);
-			status = rx_token.Status;
+		received = capacity - downloaded;
+		status = http_receive(http, &rx_token, &response_done,
+				      data + downloaded, &received);
+		if (EFI_ERROR(status))
 			goto error;
-		}
 
-		if (rx_message.BodyLength + downloaded > *buf_size) {
+		if (received > capacity - downloaded) {
 			status = EFI_BAD_BUFFER_SIZE;
 			goto error;
 		}
 
-		CopyMem(*buffer + downloaded, rx_buffer, rx_message.BodyLength);
+		if (chunked) {
+			status = decode_chunks(&decoder, data + downloaded,
+					       received, &decoded);
+			if (EFI_ERROR(status)) {
+				perror(L"Bad chunked HTTP response\n");
+				goto error;
+			}
+			received = decoded;
+		}
+
+		downloaded += received;
 
-		downloaded += rx_message.BodyLength;
+		if (progress && !chunked)
+			progress(context, data, downloaded, content_length);
 	}
 
+	*buffer = data;
+	*buf_size = downloaded;
+
+	ticks = read_timestamp() - start;
+	frequency = verbose ? timestamp_frequency() : 0;
+	if (ticks && frequency)
+		dprint(L"HTTP: %d bytes%s in %d ms, %d KiB/s\n",
+		       (UINT32)downloaded, chunked ? L" (chunked)" : L"",
+		       (UINT32)(ticks * 1000 / frequency),
+		       (UINT32)(downloaded * frequency / ticks / 1024));
+
 error:
 	event_status = uefi_call_wrapper(BS->CloseEvent, 1, rx_token.Event);
 	if (EFI_ERROR(event_status)) {
@@ -638,87 +965,613 @@ error:
 	}
 
 no_event:
-	if (EFI_ERROR(status) && *buffer)
-		FreePool(*buffer);
+	if (rx_message.Headers)
+		FreePool(rx_message.Headers);
+	if (EFI_ERROR(status) && data)
+		FreePool(data);
 
 	return status;
 }
 
+#ifndef HTTPBOOT_STREAMS
+#define HTTPBOOT_STREAMS	1
+#endif
+
+#if HTTPBOOT_STREAMS > 1
+/*
+ * With HTTPBOOT_STREAMS set to more than one, an image is fetched in that
+ * many ranges over as many connections at once, as long as the server
+ * honours Range requests and each range would be at least this big
+ */
+#define HTTP_MIN_RANGE		(1024 * 1024)
+
+typedef struct {
+	EFI_HANDLE handle;
+	EFI_HTTP_PROTOCOL *http;
+	EFI_HTTP_TOKEN rx_token;
+	EFI_HTTP_MESSAGE rx_message;
+	EFI_HTTP_RESPONSE_DATA response;
+	BOOLEAN response_done;
+	UINTN offset;		/* of its range in the file */
+	UINTN length;		/* of its range */
+	UINTN downloaded;	/* of its range so far */
+	UINT64 start;
+} http_stream_t;
+
+/*
+ * Write a number out in decimal, returning where it ends
+ */
+static CHAR8 *
+int_to_ascii (CHAR8 *str, UINTN value)
+{
+	CHAR8 digits[24];
+	UINTN n = 0;
+
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	while (n)
+		*str++ = digits[--n];
+	*str = '\0';
+	return str;
+}
+
+/*
+ * Find out how big the file is without fetching it.  Sets length to 0 if
+ * the server won't say.
+ */
 static EFI_STATUS
-http_fetch (EFI_HANDLE image, EFI_HANDLE device,
-	    CHAR8 *hostname, CHAR8 *uri, BOOLEAN is_ip6,
-	    VOID **buffer, UINT64 *buf_size)
+http_head (EFI_HTTP_PROTOCOL *http, CHAR8 *hostname, CHAR8 *uri,
+	   UINTN *length)
+{
+	EFI_HTTP_TOKEN rx_token;
+	EFI_HTTP_MESSAGE rx_message;
+	EFI_HTTP_RESPONSE_DATA response;
+	BOOLEAN response_done;
+	UINTN i, received = 0;
+	EFI_STATUS status;
+	EFI_STATUS event_status;
+
+	*length = 0;
+
+	status = send_http_request(http, HttpMethodHead, hostname, uri, NULL);
+	if (EFI_ERROR(status))
+		return status;
+
+	response.StatusCode = HTTP_STATUS_UNSUPPORTED_STATUS;
+	rx_message.Data.Response = &response;
+	rx_message.HeaderCount = 0;
+	rx_message.Headers = NULL;
+
+	rx_token.Message = &rx_message;
+	rx_token.Event = NULL;
+	status = uefi_call_wrapper(BS->CreateEvent, 5,
+				   EVT_NOTIFY_SIGNAL,
+				   TPL_NOTIFY,
+				   httpnotify,
+				   &response_done,
+				   &rx_token.Event);
+	if (EFI_ERROR(status)) {
+		perror(L"Failed to Create Event for HTTP response: %r\n", status);
+		return status;
+	}
+
+	status = http_receive(http, &rx_token, &response_done, NULL,
+			      &received);
+	if (!EFI_ERROR(status) && response.StatusCode != HTTP_STATUS_200_OK)
+		status = EFI_UNSUPPORTED;
+
+	for (i = 0; !EFI_ERROR(status) && i < rx_message.HeaderCount; i++) {
+		if (header_name_is(rx_message.Headers[i].FieldName,
+				   (CHAR8 *)"Content-Length")) {
+			*length = ascii_to_int(rx_message.Headers[i].FieldValue);
+		} else if (header_name_is(rx_message.Headers[i].FieldName,
+					  (CHAR8 *)"Transfer-Encoding") &&
+			   is_chunked(rx_message.Headers[i].FieldValue)) {
+			*length = 0;
+			break;
+		}
+	}
+
+	event_status = uefi_call_wrapper(BS->CloseEvent, 1, rx_token.Event);
+	if (EFI_ERROR(event_status)) {
+		perror(L"Failed to close Event for HTTP response: %r\n",
+		       event_status);
+	}
+
+	if (rx_message.Headers)
+		FreePool(rx_message.Headers);
+
+	return status;
+}
+
+/*
+ * Open a new connection and ask for the stream's range of the file over it
+ */
+static EFI_STATUS
+http_stream_open (EFI_SERVICE_BINDING *service, http_stream_t *stream,
+		  BOOLEAN is_ip6, CHAR8 *hostname, CHAR8 *uri)
 {
-	EFI_GUID http_binding_guid = EFI_HTTP_SERVICE_BINDING_PROTOCOL_GUID;
 	EFI_GUID http_protocol_guid = EFI_HTTP_PROTOCOL_GUID;
+	CHAR8 range[64], *end;
+	EFI_STATUS status;
+
+	status = uefi_call_wrapper(service->CreateChild, 2, service,
+				   &stream->handle);
+	if (EFI_ERROR(status))
+		return status;
+
+	status = uefi_call_wrapper(BS->HandleProtocol, 3, stream->handle,
+				   &http_protocol_guid,
+				   (VOID **)&stream->http);
+	if (EFI_ERROR(status))
+		return status;
+
+	status = configure_http(stream->http, is_ip6);
+	if (EFI_ERROR(status))
+		return status;
+
+	status = uefi_call_wrapper(BS->CreateEvent, 5,
+				   EVT_NOTIFY_SIGNAL,
+				   TPL_NOTIFY,
+				   httpnotify,
+				   &stream->response_done,
+				   &stream->rx_token.Event);
+	if (EFI_ERROR(status))
+		return status;
+
+	stream->response.StatusCode = HTTP_STATUS_UNSUPPORTED_STATUS;
+	stream->rx_message.Data.Response = &stream->response;
+	stream->rx_token.Message = &stream->rx_message;
+
+	/* "bytes=first-last", where last is inclusive */
+	CopyMem(range, "bytes=", 6);
+	end = int_to_ascii(range + 6, stream->offset);
+	*end++ = '-';
+	int_to_ascii(end, stream->offset + stream->length - 1);
+
+	return send_http_request(stream->http, HttpMethodGet, hostname, uri,
+				 range);
+}
+
+/*
+ * Wait for the headers of the response to a stream's request, and check
+ * that it is just the range that was asked for
+ */
+static EFI_STATUS
+http_stream_headers (http_stream_t *stream)
+{
+	EFI_HTTP_MESSAGE *rx_message = &stream->rx_message;
+	UINTN i, received = 0, length = 0;
+	BOOLEAN chunked = FALSE, in_range = FALSE;
+	EFI_STATUS status;
+
+	status = http_receive(stream->http, &stream->rx_token,
+			      &stream->response_done, NULL, &received);
+	if (EFI_ERROR(status))
+		return status;
+
+	for (i = 0; i < rx_message->HeaderCount; i++) {
+		if (header_name_is(rx_message->Headers[i].FieldName,
+				   (CHAR8 *)"Content-Length"))
+			length = ascii_to_int(rx_message->Headers[i].FieldValue);
+		else if (header_name_is(rx_message->Headers[i].FieldName,
+					(CHAR8 *)"Content-Range"))
+			in_range = content_range_is(rx_message->Headers[i].FieldValue,
+						    stream->offset,
+						    stream->offset + stream->length - 1);
+		else if (header_name_is(rx_message->Headers[i].FieldName,
+					(CHAR8 *)"Transfer-Encoding") &&
+			 is_chunked(rx_message->Headers[i].FieldValue))
+			chunked = TRUE;
+	}
+
+	if (rx_message->Headers)
+		FreePool(rx_message->Headers);
+	rx_message->Headers = NULL;
+	rx_message->HeaderCount = 0;
+	rx_message->Data.Response = NULL;
+
+	if (stream->response.StatusCode != HTTP_STATUS_206_PARTIAL_CONTENT) {
+		dprint(L"HTTP range request got status %d\n",
+		       (UINT32)convert_http_status_code(stream->response.StatusCode));
+		return EFI_UNSUPPORTED;
+	}
+
+	/*
+	 * The body is received straight into its place in the file, so a
+	 * server that sends some other part of it than was asked for must
+	 * not be believed
+	 */
+	if (chunked || length != stream->length || !in_range) {
+		dprint(L"HTTP range response is not for bytes %d-%d\n",
+		       (UINT32)stream->offset,
+		       (UINT32)(stream->offset + stream->length - 1));
+		return EFI_UNSUPPORTED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Ask for as much of the rest of the stream's range as will come
+ */
+static EFI_STATUS
+http_stream_receive (http_stream_t *stream, CHAR8 *data)
+{
+	return http_receive_start(stream->http, &stream->rx_token,
+				  &stream->response_done,
+				  data + stream->offset + stream->downloaded,
+				  stream->length - stream->downloaded);
+}
+
+static VOID
+http_stream_close (EFI_SERVICE_BINDING *service, http_stream_t *stream)
+{
+	/* this cancels any response still pending, so it goes first */
+	if (stream->handle)
+		uefi_call_wrapper(service->DestroyChild, 2, service,
+				  stream->handle);
+	if (stream->rx_token.Event)
+		uefi_call_wrapper(BS->CloseEvent, 1, stream->rx_token.Event);
+	if (stream->rx_message.Headers)
+		FreePool(stream->rx_message.Headers);
+}
+
+/*
+ * Fetch the file in ranges over several connections at once.  If that
+ * can't be done, returns EFI_UNSUPPORTED without having used http for
+ * anything but a HEAD request, so the file can be fetched over it in one
+ * piece instead.
+ */
+static EFI_STATUS
+http_fetch_ranges (EFI_SERVICE_BINDING *service, EFI_HTTP_PROTOCOL *http,
+		   CHAR8 *hostname, CHAR8 *uri, BOOLEAN is_ip6,
+		   VOID **buffer, UINT64 *buf_size,
+		   httpboot_progress_t progress, VOID *context)
+{
+	http_stream_t streams[HTTPBOOT_STREAMS];
+	http_stream_t *stream;
+	UINTN i, nstreams, size, part, active, received;
+	UINTN available, reported = 0;
+	UINT64 start, ticks, frequency;
+	CHAR8 *data;
+	EFI_STATUS status;
+
+	status = http_head(http, hostname, uri, &size);
+	if (EFI_ERROR(status) || size == 0) {
+		dprint(L"HTTP: no size from HEAD (%r), using one stream\n",
+		       status);
+		return EFI_UNSUPPORTED;
+	}
+
+	nstreams = size / HTTP_MIN_RANGE;
+	if (nstreams > HTTPBOOT_STREAMS)
+		nstreams = HTTPBOOT_STREAMS;
+	if (nstreams < 2)
+		return EFI_UNSUPPORTED;
+
+	data = AllocatePool(size);
+	if (!data) {
+		perror(L"Failed to allocate new rx buffer\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	/*
+	 * Send all of the requests before waiting for any of the responses,
+	 * so that the server is working on them all at once
+	 */
+	ZeroMem(streams, sizeof(streams));
+	part = size / nstreams;
+	start = read_timestamp();
+	for (i = 0; i < nstreams; i++) {
+		stream = &streams[i];
+		stream->offset = i * part;
+		stream->length = i == nstreams - 1 ? size - stream->offset
+						   : part;
+		status = http_stream_open(service, stream, is_ip6, hostname,
+					  uri);
+		if (EFI_ERROR(status))
+			break;
+	}
+
+	for (i = 0; !EFI_ERROR(status) && i < nstreams; i++)
+		status = http_stream_headers(&streams[i]);
+
+	if (EFI_ERROR(status)) {
+		dprint(L"HTTP: could not fetch %d ranges (%r), using one stream\n",
+		       (UINT32)nstreams, status);
+		status = EFI_UNSUPPORTED;
+		goto done;
+	}
+
+	timeline_mark("http receive");
+	for (i = 0; !EFI_ERROR(status) && i < nstreams; i++) {
+		streams[i].start = read_timestamp();
+		status = http_stream_receive(&streams[i], data);
+	}
+
+	frequency = verbose ? timestamp_frequency() : 0;
+	active = nstreams;
+	while (!EFI_ERROR(status) && active) {
+		for (i = 0; i < nstreams; i++) {
+			stream = &streams[i];
+			if (stream->downloaded == stream->length)
+				continue;
+
+			uefi_call_wrapper(stream->http->Poll, 1, stream->http);
+			if (!stream->response_done)
+				continue;
+
+			status = stream->rx_token.Status;
+			if (EFI_ERROR(status)) {
+				perror(L"HTTP response: %r\n", status);
+				break;
+			}
+
+			received = stream->rx_message.BodyLength;
+			if (received > stream->length - stream->downloaded) {
+				status = EFI_BAD_BUFFER_SIZE;
+				break;
+			}
+			stream->downloaded += received;
+
+			if (stream->downloaded < stream->length) {
+				status = http_stream_receive(stream, data);
+				if (EFI_ERROR(status))
+					break;
+				continue;
+			}
+
+			active--;
+			ticks = read_timestamp() - stream->start;
+			if (ticks && frequency)
+				dprint(L"HTTP stream %d: %d bytes in %d ms, %d KiB/s\n",
+				       (UINT32)i, (UINT32)stream->length,
+				       (UINT32)(ticks * 1000 / frequency),
+				       (UINT32)(stream->length * frequency /
+						ticks / 1024));
+		}
+
+		/* everything up to the first range that isn't finished */
+		available = 0;
+		for (i = 0; i < nstreams; i++) {
+			available += streams[i].downloaded;
+			if (streams[i].downloaded < streams[i].length)
+				break;
+		}
+		if (progress && available > reported) {
+			progress(context, data, available, size);
+			reported = available;
+		}
+	}
+
+	if (EFI_ERROR(status))
+		goto done;
+
+	*buffer = data;
+	*buf_size = size;
+
+	ticks = read_timestamp() - start;
+	if (ticks && frequency)
+		dprint(L"HTTP: %d bytes over %d streams in %d ms, %d KiB/s\n",
+		       (UINT32)size, (UINT32)nstreams,
+		       (UINT32)(ticks * 1000 / frequency),
+		       (UINT32)(size * frequency / ticks / 1024));
+
+done:
+	for (i = 0; i < nstreams; i++)
+		http_stream_close(service, &streams[i]);
+	if (EFI_ERROR(status))
+		FreePool(data);
+
+	return status;
+}
+#endif /* HTTPBOOT_STREAMS > 1 */
+
+/*
+ * What has been set up to fetch over HTTP is kept until the next stage is
+ * started, so that fetching from the same server again doesn't have to
+ * find the NIC, set its address, or make a new connection
+ */
+static struct {
+	EFI_MAC_ADDRESS mac_addr;
+	EFI_HANDLE nic;
+	BOOLEAN ip_set;
+	BOOLEAN is_ip6;
+	IPv4_DEVICE_PATH ip4_node;
+	IPv6_DEVICE_PATH ip6_node;
 	EFI_SERVICE_BINDING *service;
 	EFI_HANDLE http_handle;
 	EFI_HTTP_PROTOCOL *http;
+	CHAR8 *hostname;	/* that http is connected to */
+} session;
+
+static VOID
+close_http_child (VOID)
+{
 	EFI_STATUS status;
-	EFI_STATUS child_status;
 
-	*buffer = NULL;
-	*buf_size = 0;
+	if (session.http_handle) {
+		status = uefi_call_wrapper(session.service->DestroyChild, 2,
+					   session.service,
+					   session.http_handle);
+		if (EFI_ERROR(status))
+			perror(L"Failed to destroy HTTP child: %r\n", status);
+	}
+	if (session.hostname)
+		FreePool(session.hostname);
+
+	session.service = NULL;
+	session.http_handle = NULL;
+	session.http = NULL;
+	session.hostname = NULL;
+}
+
+/*
+ * Let go of the HTTP connection and forget what was set up, before the
+ * next stage gets the chance to take over the NIC
+ */
+VOID
+httpboot_session_close (VOID)
+{
+	close_http_child();
+	ZeroMem(&session, sizeof(session));
+}
+
+/*
+ * Get an HTTP child for talking to hostname, reusing the one from the last
+ * fetch if that was from the same server
+ */
+static EFI_STATUS
+http_session_open (EFI_HANDLE image, EFI_HANDLE device, CHAR8 *hostname,
+		   BOOLEAN is_ip6, BOOLEAN *reused)
+{
+	EFI_GUID http_binding_guid = EFI_HTTP_SERVICE_BINDING_PROTOCOL_GUID;
+	EFI_GUID http_protocol_guid = EFI_HTTP_PROTOCOL_GUID;
+	UINTN len;
+	EFI_STATUS status;
+
+	*reused = FALSE;
+	if (session.http) {
+		if (strcmpa(session.hostname, hostname) == 0) {
+			*reused = TRUE;
+			return EFI_SUCCESS;
+		}
+		close_http_child();
+	}
+
+	len = strlena(hostname) + 1;
+	session.hostname = AllocatePool(len);
+	if (!session.hostname)
+		return EFI_OUT_OF_RESOURCES;
+	CopyMem(session.hostname, hostname, len);
 
 	/* Open HTTP Service Binding Protocol */
 	status = uefi_call_wrapper(BS->OpenProtocol, 6, device,
-				   &http_binding_guid, (VOID **)&service,
+				   &http_binding_guid,
+				   (VOID **)&session.service,
 				   image, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
 	if (EFI_ERROR (status))
-		return status;
+		goto error;
 
 	/* Create the ChildHandle from the Service Binding */
 	/* Set the handle to NULL to request a new handle */
-	http_handle = NULL;
-	status = uefi_call_wrapper(service->CreateChild, 2, service,
-				   &http_handle);
+	session.http_handle = NULL;
+	status = uefi_call_wrapper(session.service->CreateChild, 2,
+				   session.service, &session.http_handle);
 	if (EFI_ERROR (status))
-		return status;
+		goto error;
 
 	/* Get the http protocol */
-	status = uefi_call_wrapper(BS->HandleProtocol, 3, http_handle,
-				   &http_protocol_guid, (VOID **)&http);
+	status = uefi_call_wrapper(BS->HandleProtocol, 3, session.http_handle,
+				   &http_protocol_guid,
+				   (VOID **)&session.http);
 	if (EFI_ERROR (status)) {
 		perror(L"Failed to get http\n");
 		goto error;
 	}
 
-	status = configure_http(http, is_ip6);
+	status = configure_http(session.http, is_ip6);
 	if (EFI_ERROR (status)) {
 		perror(L"Failed to configure http: %r\n", status);
 		goto error;
 	}
 
-	status = send_http_request(http, hostname, uri);
+	return EFI_SUCCESS;
+
+error:
+	close_http_child();
+	return status;
+}
+
+/*
+ * Tell whoever is following the download that it is starting over
+ */
+static VOID
+restart_progress (httpboot_progress_t progress, VOID *context)
+{
+	if (progress)
+		progress(context, NULL, 0, 0);
+}
+
+static EFI_STATUS
+http_get (EFI_SERVICE_BINDING *service, EFI_HTTP_PROTOCOL *http,
+	  CHAR8 *hostname, CHAR8 *uri, BOOLEAN is_ip6,
+	  VOID **buffer, UINT64 *buf_size,
+	  httpboot_progress_t progress, VOID *context)
+{
+	EFI_STATUS status;
+
+	*buffer = NULL;
+	*buf_size = 0;
+
+	timeline_mark("http request");
+#if HTTPBOOT_STREAMS > 1
+	status = http_fetch_ranges(service, http, hostname, uri, is_ip6,
+				   buffer, buf_size, progress, context);
+	if (status != EFI_UNSUPPORTED)
+		return status;
+	restart_progress(progress, context);
+#endif
+	status = send_http_request(http, HttpMethodGet, hostname, uri, NULL);
 	if (EFI_ERROR(status)) {
 		perror(L"Failed to send HTTP request: %r\n", status);
-		goto error;
+		return status;
 	}
 
-	status = receive_http_response(http, buffer, buf_size);
-	if (EFI_ERROR(status)) {
+	timeline_mark("http receive");
+	status = receive_http_response(http, buffer, buf_size, progress,
+				       context);
+	if (EFI_ERROR(status))
 		perror(L"Failed to receive HTTP response: %r\n", status);
-		goto error;
-	}
 
-error:
-	child_status = uefi_call_wrapper(service->DestroyChild, 2, service,
-					 http_handle);
+	return status;
+}
 
-	if (EFI_ERROR(status)) {
+static EFI_STATUS
+http_fetch (EFI_HANDLE image, EFI_HANDLE device,
+	    CHAR8 *hostname, CHAR8 *uri, BOOLEAN is_ip6,
+	    VOID **buffer, UINT64 *buf_size,
+	    httpboot_progress_t progress, VOID *context)
+{
+	BOOLEAN reused;
+	EFI_STATUS status;
+
+	status = http_session_open(image, device, hostname, is_ip6, &reused);
+	if (EFI_ERROR (status))
 		return status;
-	} else if (EFI_ERROR(child_status)) {
-		return child_status;
+
+	status = http_get(session.service, session.http, hostname, uri,
+			  is_ip6, buffer, buf_size, progress, context);
+	if (EFI_ERROR(status) && reused) {
+		/* the server may have closed the connection while it was idle */
+		dprint(L"HTTP: kept connection failed (%r), reconnecting\n",
+		       status);
+		close_http_child();
+		restart_progress(progress, context);
+		status = http_session_open(image, device, hostname, is_ip6,
+					   &reused);
+		if (!EFI_ERROR(status))
+			status = http_get(session.service, session.http,
+					  hostname, uri, is_ip6, buffer,
+					  buf_size, progress, context);
 	}
 
-	return EFI_SUCCESS;
+	/* there's no telling what state a failed connection was left in */
+	if (EFI_ERROR(status))
+		close_http_child();
+
+	return status;
 }
 
 EFI_STATUS
-httpboot_fetch_buffer (EFI_HANDLE image, VOID **buffer, UINT64 *buf_size)
+httpboot_fetch_buffer (EFI_HANDLE image, VOID **buffer, UINT64 *buf_size,
+		       httpboot_progress_t progress, VOID *context)
 {
 	EFI_STATUS status;
-	EFI_HANDLE nic;
 	CHAR8 *next_loader = NULL;
 	CHAR8 *next_uri = NULL;
 	CHAR8 *hostname = NULL;
@@ -744,26 +1597,48 @@ httpboot_fetch_buffer (EFI_HANDLE image, VOID **buffer, UINT64 *buf_size)
 
 	/* Get the handle that associates with the NIC we are using and
 	   also supports the HTTP service binding protocol */
-	nic = get_nic_handle(&mac_addr);
-	if (!nic) {
-		goto error;
+	if (!session.nic ||
+	    CompareMem(&session.mac_addr, &mac_addr, sizeof(mac_addr))) {
+		httpboot_session_close();
+		session.nic = get_nic_handle(&mac_addr);
+		if (!session.nic) {
+			status = EFI_NOT_FOUND;
+			goto error;
+		}
+		CopyMem(&session.mac_addr, &mac_addr, sizeof(mac_addr));
 	}
 
+	timeline_mark("http");
+
 	/* UEFI stops DHCP after fetching the image and stores the related
 	   information in the device path node. We have to set up the
 	   connection on our own for the further operations. */
-	if (!is_ip6)
-		status = set_ip4(nic, &ip4_node);
-	else
-		status = set_ip6(nic, &ip6_node);
-	if (EFI_ERROR (status)) {
-		perror(L"Failed to set IP for HTTPBoot: %r\n", status);
-		goto error;
+	if (!session.ip_set || session.is_ip6 != is_ip6 ||
+	    (!is_ip6 && CompareMem(&session.ip4_node, &ip4_node,
+				   sizeof(ip4_node))) ||
+	    (is_ip6 && CompareMem(&session.ip6_node, &ip6_node,
+				  sizeof(ip6_node)))) {
+		close_http_child();
+		session.ip_set = FALSE;
+
+		if (!is_ip6)
+			status = set_ip4(session.nic, &ip4_node);
+		else
+			status = set_ip6(session.nic, &ip6_node);
+		if (EFI_ERROR (status)) {
+			perror(L"Failed to set IP for HTTPBoot: %r\n", status);
+			goto error;
+		}
+
+		session.ip_set = TRUE;
+		session.is_ip6 = is_ip6;
+		CopyMem(&session.ip4_node, &ip4_node, sizeof(ip4_node));
+		CopyMem(&session.ip6_node, &ip6_node, sizeof(ip6_node));
 	}
 
 	/* Use HTTP protocl to fetch the remote file */
-	status = http_fetch (image, nic, hostname, next_uri, is_ip6,
-			     buffer, buf_size);
+	status = http_fetch (image, session.nic, hostname, next_uri, is_ip6,
+			     buffer, buf_size, progress, context);
 	if (EFI_ERROR (status)) {
 		perror(L"Failed to fetch image: %r\n", status);
 		goto error;
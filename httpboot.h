@@ -34,8 +34,23 @@
 #ifndef _HTTPBOOT_H_
 #define _HTTPBOOT_H_
 
-BOOLEAN find_httpboot (EFI_DEVICE_PATH *devpath);
+BOOLEAN find_httpboot (EFI_HANDLE device);
 
-EFI_STATUS httpboot_fetch_buffer (EFI_HANDLE image, VOID **buffer, UINT64 *buf_size);
+/*
+ * Called each time more of the body arrives, with the buffer it is going
+ * into, how much of it is there and how big it will be, so that the image
+ * can be worked on while the rest of it is downloaded.  Only used when
+ * the server sends a Content-Length.  When the download has to start
+ * again, over a new connection or a single one instead of several, it is
+ * called with a NULL buffer and received and total of 0 first, and
+ * anything worked out from the earlier calls must be thrown away: the
+ * buffer it was about is gone, and what comes next may not be the same.
+ */
+typedef VOID (*httpboot_progress_t) (VOID *context, VOID *buffer,
+				     UINTN received, UINTN total);
+
+EFI_STATUS httpboot_fetch_buffer (EFI_HANDLE image, VOID **buffer, UINT64 *buf_size,
+				  httpboot_progress_t progress, VOID *context);
+VOID httpboot_session_close (VOID);
 
 #endif
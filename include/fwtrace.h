@@ -0,0 +1,81 @@
+#ifndef SHIM_FWTRACE_H
+#define SHIM_FWTRACE_H
+
+#if defined(ENABLE_FW_TRACE)
+
+#include <efi.h>
+#include <efilib.h>
+
+#include <timestamp.h>
+
+/*
+ * When shim is built with ENABLE_FW_TRACE, every uefi_call_wrapper() in a
+ * file that includes this header counts the call and the time spent in it
+ * against the firmware service it called.  The service is named after the
+ * last member in the call's function expression, so BS->AllocatePool is
+ * "AllocatePool", fh->Read is "Read" and tpm2->HashLogExtendEvent is
+ * "HashLogExtendEvent".
+ *
+ * Before starting the next stage, shim writes what it has collected to the
+ * volatile variable ShimFirmwareTrace under SHIM_LOCK_GUID, with boot
+ * services and runtime access, so the OS can read it from efivarfs.  It
+ * holds a fw_trace_header_t followed by count fw_trace_entry_t, all
+ * little endian, with the entries in the order the services were first
+ * called.
+ *
+ * Times are in read_timestamp() ticks, and ticks_per_second says how fast
+ * those run; see timestamp.h.  A service's ticks include any firmware calls
+ * shim made while it ran (from a security policy hook during LoadImage,
+ * say), but total_ticks counts that time only once.
+ */
+#define FW_TRACE_VARIABLE	L"ShimFirmwareTrace"
+#define FW_TRACE_VERSION	1
+#define FW_TRACE_SERVICES	64
+#define FW_TRACE_NAME_SIZE	32
+
+typedef struct {
+	UINT32 version;
+	UINT32 count;
+	UINT64 ticks_per_second;
+	UINT64 total_calls;
+	UINT64 total_ticks;
+} __attribute__((packed)) fw_trace_header_t;
+
+typedef struct {
+	CHAR8 name[FW_TRACE_NAME_SIZE];	/* NUL terminated */
+	UINT64 calls;
+	UINT64 ticks;
+	UINT64 max_ticks;		/* the slowest single call */
+} __attribute__((packed)) fw_trace_entry_t;
+
+typedef struct {
+	fw_trace_entry_t *service;
+	UINT64 start;
+} fw_trace_call_t;
+
+extern fw_trace_call_t fw_trace_enter(fw_trace_entry_t **service,
+				      const char *func);
+extern void fw_trace_leave(fw_trace_call_t *call);
+extern EFI_STATUS fw_trace_export(UINT8 **data, UINTN *size);
+
+/*
+ * Replace uefi_call_wrapper() with one that does the counting.  That only
+ * works where gnu-efi's own version is a plain call, which on x86_64 needs
+ * a compiler that supports ms_abi.
+ */
+#if defined(__x86_64__) && !defined(HAVE_USE_MS_ABI)
+#error ENABLE_FW_TRACE needs GNU_EFI_USE_MS_ABI and a compiler that supports it
+#endif
+
+#undef uefi_call_wrapper
+#define uefi_call_wrapper(func, va_num, ...) ({				\
+		static fw_trace_entry_t *__fw_trace_service;		\
+		fw_trace_call_t __fw_trace_call				\
+			__attribute__((__cleanup__(fw_trace_leave))) =	\
+			fw_trace_enter(&__fw_trace_service, #func);	\
+		(func)(__VA_ARGS__);					\
+	})
+
+#endif /* ENABLE_FW_TRACE */
+
+#endif /* SHIM_FWTRACE_H */
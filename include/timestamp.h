@@ -0,0 +1,38 @@
+#ifndef SHIM_TIMESTAMP_H
+#define SHIM_TIMESTAMP_H
+
+#include <efi.h>
+#include <efilib.h>
+
+/*
+ * Read the CPU's timestamp counter: the TSC on x86, the generic timer's
+ * virtual count on ARM.  Both count from reset and need no setting up, so
+ * this can be used from the very start of efi_main().
+ */
+static inline UINT64
+read_timestamp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	UINT32 lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((UINT64)hi << 32) | lo;
+#elif defined(__aarch64__)
+	UINT64 count;
+
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r" (count));
+	return count;
+#elif defined(__arm__)
+	UINT32 lo, hi;
+
+	__asm__ __volatile__("isb; mrrc p15, 1, %0, %1, c14"
+			     : "=r" (lo), "=r" (hi));
+	return ((UINT64)hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+extern UINT64 timestamp_frequency(void);
+
+#endif /* SHIM_TIMESTAMP_H */
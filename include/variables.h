@@ -31,6 +31,29 @@ CreateTimeBasedPayload (
 			);
 EFI_STATUS
 SetSecureVariable(CHAR16 *var, UINT8 *Data, UINTN len, EFI_GUID owner, UINT32 options, int createtimebased);
+/*
+ * Which variables variable_snapshot_init() copies: every variable with the
+ * GUID, or just the one called name
+ */
+typedef struct {
+	EFI_GUID *guid;
+	CHAR16 *name;
+} variable_snapshot_filter_t;
+
+EFI_STATUS
+variable_snapshot_init(variable_snapshot_filter_t *filters, UINTN nfilters);
+void
+variable_snapshot_free(void);
+void
+variable_snapshot_stats(UINTN *calls_made, UINTN *calls_saved);
+EFI_STATUS
+read_variable(CHAR16 *var, EFI_GUID *owner, UINT32 *attributes, UINTN *len,
+	      void *data);
+EFI_STATUS
+set_variable(CHAR16 *var, EFI_GUID *owner, UINT32 attributes, UINTN len,
+	     void *data);
+EFI_STATUS
+delete_variable(CHAR16 *var, EFI_GUID *owner);
 EFI_STATUS
 get_variable(CHAR16 *var, UINT8 **data, UINTN *len, EFI_GUID owner);
 EFI_STATUS
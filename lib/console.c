@@ -6,6 +6,7 @@
  */
 #include <efi.h>
 #include <efilib.h>
+#include <fwtrace.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <console.h>
@@ -40,6 +40,7 @@
 
 #include <efi.h>
 #include <efilib.h>
+#include <fwtrace.h>
 
 #include <guid.h>
 #include <execute.h>
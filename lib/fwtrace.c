@@ -0,0 +1,130 @@
+/*
+ * fwtrace.c - count the calls shim makes into the firmware and time them
+ *
+ * Only built into anything when ENABLE_FW_TRACE is set; see fwtrace.h.
+ */
+#if defined(ENABLE_FW_TRACE)
+
+#include <efi.h>
+#include <efilib.h>
+
+#include <fwtrace.h>
+
+static fw_trace_entry_t services[FW_TRACE_SERVICES];
+static UINT32 nservices;
+static UINT64 total_calls;
+static UINT64 total_ticks;
+static UINTN depth;
+
+/*
+ * Turn a function expression like "BS->AllocatePool" into the name of the
+ * service it calls.
+ */
+static void
+service_name(const char *func, CHAR8 *name)
+{
+	const char *start = func, *p;
+	UINTN i;
+
+	for (p = func; *p; p++) {
+		if (*p == '.')
+			start = p + 1;
+		else if (p[0] == '-' && p[1] == '>')
+			start = p + 2;
+	}
+
+	for (i = 0; i < FW_TRACE_NAME_SIZE - 1; i++) {
+		if (start[i] == '\0' || start[i] == ' ' || start[i] == ')')
+			break;
+		name[i] = start[i];
+	}
+	name[i] = '\0';
+}
+
+static fw_trace_entry_t *
+find_service(const char *func)
+{
+	CHAR8 name[FW_TRACE_NAME_SIZE];
+	UINT32 i;
+
+	service_name(func, name);
+	for (i = 0; i < nservices; i++) {
+		if (strcmpa(services[i].name, name) == 0)
+			return &services[i];
+	}
+
+	/*
+	 * Keep the last slot for everything that didn't fit; there are
+	 * nowhere near that many services that shim calls.
+	 */
+	if (nservices == FW_TRACE_SERVICES - 1) {
+		i = FW_TRACE_SERVICES - 1;
+		if (services[i].name[0] == '\0')
+			CopyMem(services[i].name, "(other)", sizeof("(other)"));
+		return &services[i];
+	}
+
+	CopyMem(services[nservices].name, name, sizeof(name));
+	return &services[nservices++];
+}
+
+fw_trace_call_t
+fw_trace_enter(fw_trace_entry_t **service, const char *func)
+{
+	fw_trace_call_t call;
+
+	if (!*service)
+		*service = find_service(func);
+
+	depth++;
+	call.service = *service;
+	call.start = read_timestamp();
+	return call;
+}
+
+void
+fw_trace_leave(fw_trace_call_t *call)
+{
+	UINT64 ticks = read_timestamp() - call->start;
+	fw_trace_entry_t *service = call->service;
+
+	service->calls++;
+	service->ticks += ticks;
+	if (ticks > service->max_ticks)
+		service->max_ticks = ticks;
+
+	total_calls++;
+	if (--depth == 0)
+		total_ticks += ticks;
+}
+
+/*
+ * Return everything counted so far in the format described in fwtrace.h,
+ * in a buffer the caller must free.
+ */
+EFI_STATUS
+fw_trace_export(UINT8 **data, UINTN *size)
+{
+	fw_trace_header_t *header;
+	UINTN nentries = nservices;
+
+	if (services[FW_TRACE_SERVICES - 1].calls)
+		nentries = FW_TRACE_SERVICES;
+
+	*size = sizeof(*header) + nentries * sizeof(services[0]);
+	*data = AllocateZeroPool(*size);
+	if (!*data)
+		return EFI_OUT_OF_RESOURCES;
+
+	header = (fw_trace_header_t *)*data;
+	header->version = FW_TRACE_VERSION;
+	header->count = nentries;
+	header->ticks_per_second = timestamp_frequency();
+	header->total_calls = total_calls;
+	header->total_ticks = total_ticks;
+	CopyMem(header + 1, services, nentries * sizeof(services[0]));
+
+	return EFI_SUCCESS;
+}
+
+#endif /* ENABLE_FW_TRACE */
@@ -8,6 +8,7 @@
 
 #include <efi.h>
 #include <efilib.h>
+#include <fwtrace.h>
 
 #include <guid.h>
 #include <variables.h>
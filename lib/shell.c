@@ -7,6 +7,7 @@
  */
 #include <efi.h>
 #include <efilib.h>
+#include <fwtrace.h>
 
 #include <shell.h>
 
@@ -6,6 +6,7 @@
 
 #include <efi.h>
 #include <efilib.h>
+#include <fwtrace.h>
 
 #include <console.h>
 #include <simple_file.h>
@@ -0,0 +1,42 @@
+/*
+ * timestamp.c - how fast the counter read_timestamp() returns runs
+ */
+#include <efi.h>
+#include <efilib.h>
+
+#include <timestamp.h>
+
+static UINT64 frequency;
+
+/*
+ * Return the number of read_timestamp() ticks per second.  ARM tells us in
+ * CNTFRQ; on x86 it's measured against BS->Stall() the first time it's
+ * asked for, which costs a millisecond and is good to a percent or so.
+ */
+UINT64
+timestamp_frequency(void)
+{
+	if (frequency)
+		return frequency;
+
+#if defined(__aarch64__)
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r" (frequency));
+#elif defined(__arm__)
+	{
+		UINT32 cntfrq;
+
+		__asm__ __volatile__("mrc p15, 0, %0, c14, c0, 0"
+				     : "=r" (cntfrq));
+		frequency = cntfrq;
+	}
+#else
+	{
+		UINT64 start = read_timestamp();
+
+		uefi_call_wrapper(BS->Stall, 1, 1000);
+		frequency = (read_timestamp() - start) * 1000;
+	}
+#endif
+
+	return frequency;
+}
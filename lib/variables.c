@@ -21,6 +21,7 @@
  */
 #include <efi.h>
 #include <efilib.h>
+#include <fwtrace.h>
 
 #include <efiauthenticated.h>
 
@@ -163,13 +164,13 @@ SetSecureVariable(CHAR16 *var, UINT8 *Data, UINTN len, EFI_GUID owner,
 		return efi_status;
 	}
 
-	efi_status = uefi_call_wrapper(RT->SetVariable, 5, var, &owner,
-				       EFI_VARIABLE_NON_VOLATILE
-				       | EFI_VARIABLE_RUNTIME_ACCESS 
-				       | EFI_VARIABLE_BOOTSERVICE_ACCESS
-				       | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS
-				       | options,
-				       DataSize, Cert);
+	efi_status = set_variable(var, &owner,
+				  EFI_VARIABLE_NON_VOLATILE
+				  | EFI_VARIABLE_RUNTIME_ACCESS 
+				  | EFI_VARIABLE_BOOTSERVICE_ACCESS
+				  | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS
+				  | options,
+				  DataSize, Cert);
 
 	return efi_status;
 }
@@ -210,6 +211,352 @@ SETOSIndicationsAndReboot(UINT64 indications)
 	return EFI_SUCCESS;
 }
 
+/*
+ * A copy of the variables an image reads most, taken once with
+ * GetNextVariableName() so that reading them again doesn't mean calling
+ * into the firmware, which on some machines goes through SMM every time.
+ * Variables written through set_variable() and delete_variable() are kept
+ * up to date; anything else that might write them, like another image, has
+ * to be preceded by variable_snapshot_free().
+ */
+typedef struct {
+	CHAR16 *name;
+	EFI_GUID guid;
+	UINT32 attributes;
+	UINT8 *data;
+	UINTN size;
+} snapshot_var_t;
+
+/* Give up on firmware that never stops returning names */
+#define SNAPSHOT_MAX_NAMES	4096
+/* Most variables fit, so they only take one GetVariable() call */
+#define SNAPSHOT_READ_SIZE	4096
+
+static variable_snapshot_filter_t *snapshot_filters;
+static UINTN snapshot_nfilters;
+static snapshot_var_t *snapshot_vars;
+static UINTN snapshot_count;
+static UINTN snapshot_alloc;
+static BOOLEAN snapshot_active;
+static UINTN snapshot_calls_made;
+static UINTN snapshot_calls_saved;
+
+static BOOLEAN
+snapshot_wanted(CHAR16 *var, EFI_GUID *owner)
+{
+	UINTN i;
+
+	for (i = 0; i < snapshot_nfilters; i++) {
+		if (CompareMem(snapshot_filters[i].guid, owner,
+			       sizeof(*owner)))
+			continue;
+		if (!snapshot_filters[i].name ||
+		    StrCmp(snapshot_filters[i].name, var) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Whether the snapshot has the final word on a variable, including on it
+ * not existing
+ */
+static BOOLEAN
+snapshot_covers(CHAR16 *var, EFI_GUID *owner)
+{
+	return snapshot_active && snapshot_wanted(var, owner);
+}
+
+static snapshot_var_t *
+snapshot_find(CHAR16 *var, EFI_GUID *owner)
+{
+	UINTN i;
+
+	for (i = 0; i < snapshot_count; i++) {
+		if (CompareMem(&snapshot_vars[i].guid, owner, sizeof(*owner)) == 0 &&
+		    StrCmp(snapshot_vars[i].name, var) == 0)
+			return &snapshot_vars[i];
+	}
+
+	return NULL;
+}
+
+static void
+snapshot_remove(snapshot_var_t *v)
+{
+	FreePool(v->name);
+	if (v->data)
+		FreePool(v->data);
+	*v = snapshot_vars[--snapshot_count];
+}
+
+/*
+ * Read a variable from the firmware into the snapshot, replacing any copy
+ * it already has
+ */
+static EFI_STATUS
+snapshot_read(CHAR16 *var, EFI_GUID *owner)
+{
+	snapshot_var_t *v, *vars;
+	UINT32 attributes = 0;
+	UINT8 *data;
+	UINTN size = SNAPSHOT_READ_SIZE;
+	EFI_STATUS efi_status;
+
+	data = AllocatePool(size);
+	if (!data)
+		return EFI_OUT_OF_RESOURCES;
+
+	snapshot_calls_made++;
+	efi_status = uefi_call_wrapper(RT->GetVariable, 5, var, owner,
+				       &attributes, &size, data);
+	if (efi_status == EFI_BUFFER_TOO_SMALL) {
+		FreePool(data);
+		data = AllocatePool(size);
+		if (!data)
+			return EFI_OUT_OF_RESOURCES;
+
+		snapshot_calls_made++;
+		efi_status = uefi_call_wrapper(RT->GetVariable, 5, var, owner,
+					       &attributes, &size, data);
+	}
+
+	v = snapshot_find(var, owner);
+	if (efi_status != EFI_SUCCESS) {
+		FreePool(data);
+		if (v)
+			snapshot_remove(v);
+		return efi_status == EFI_NOT_FOUND ? EFI_SUCCESS : efi_status;
+	}
+
+	if (!v) {
+		if (snapshot_count == snapshot_alloc) {
+			vars = ReallocatePool(snapshot_vars,
+					      snapshot_alloc * sizeof(*vars),
+					      (snapshot_alloc + 16) * sizeof(*vars));
+			if (!vars) {
+				FreePool(data);
+				return EFI_OUT_OF_RESOURCES;
+			}
+			snapshot_vars = vars;
+			snapshot_alloc += 16;
+		}
+
+		v = &snapshot_vars[snapshot_count];
+		v->name = AllocatePool(StrSize(var));
+		if (!v->name) {
+			FreePool(data);
+			return EFI_OUT_OF_RESOURCES;
+		}
+		CopyMem(v->name, var, StrSize(var));
+		v->guid = *owner;
+		v->data = NULL;
+		snapshot_count++;
+	}
+
+	if (v->data)
+		FreePool(v->data);
+	v->attributes = attributes;
+	v->data = data;
+	v->size = size;
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Read every variable that matches one of the filters, which must stay
+ * valid until variable_snapshot_free().  If anything goes wrong, there's
+ * no snapshot and every read goes to the firmware as before.
+ */
+EFI_STATUS
+variable_snapshot_init(variable_snapshot_filter_t *filters, UINTN nfilters)
+{
+	CHAR16 *name, *new_name;
+	UINTN name_alloc = 256, name_size, names;
+	EFI_GUID guid;
+	EFI_STATUS efi_status;
+
+	variable_snapshot_free();
+
+	name = AllocateZeroPool(name_alloc);
+	if (!name)
+		return EFI_OUT_OF_RESOURCES;
+
+	snapshot_filters = filters;
+	snapshot_nfilters = nfilters;
+
+	for (names = 0; names < SNAPSHOT_MAX_NAMES; ) {
+		name_size = name_alloc;
+		snapshot_calls_made++;
+		efi_status = uefi_call_wrapper(RT->GetNextVariableName, 3,
+					       &name_size, name, &guid);
+		if (efi_status == EFI_BUFFER_TOO_SMALL) {
+			/* The last name has to be passed back in, so keep it */
+			new_name = AllocateZeroPool(name_size);
+			if (!new_name) {
+				efi_status = EFI_OUT_OF_RESOURCES;
+				break;
+			}
+			CopyMem(new_name, name, name_alloc);
+			FreePool(name);
+			name = new_name;
+			name_alloc = name_size;
+			continue;
+		}
+		if (efi_status != EFI_SUCCESS)
+			break;
+
+		names++;
+
+		if (snapshot_wanted(name, &guid)) {
+			efi_status = snapshot_read(name, &guid);
+			if (efi_status != EFI_SUCCESS)
+				break;
+		}
+	}
+	if (names == SNAPSHOT_MAX_NAMES)
+		efi_status = EFI_ABORTED;
+
+	FreePool(name);
+
+	if (efi_status != EFI_NOT_FOUND) {
+		variable_snapshot_free();
+		return efi_status;
+	}
+
+	snapshot_active = TRUE;
+	return EFI_SUCCESS;
+}
+
+void
+variable_snapshot_free(void)
+{
+	while (snapshot_count)
+		snapshot_remove(&snapshot_vars[snapshot_count - 1]);
+	if (snapshot_vars)
+		FreePool(snapshot_vars);
+
+	snapshot_vars = NULL;
+	snapshot_alloc = 0;
+	snapshot_filters = NULL;
+	snapshot_nfilters = 0;
+	snapshot_active = FALSE;
+}
+
+/*
+ * How many firmware calls reading and writing variables took, including
+ * taking the snapshot, and how many reads it answered instead
+ */
+void
+variable_snapshot_stats(UINTN *calls_made, UINTN *calls_saved)
+{
+	*calls_made = snapshot_calls_made;
+	*calls_saved = snapshot_calls_saved;
+}
+
+/*
+ * GetVariable(), answered from the snapshot if it has the variable
+ */
+EFI_STATUS
+read_variable(CHAR16 *var, EFI_GUID *owner, UINT32 *attributes, UINTN *len,
+	      void *data)
+{
+	snapshot_var_t *v;
+
+	if (!snapshot_covers(var, owner)) {
+		snapshot_calls_made++;
+		return uefi_call_wrapper(RT->GetVariable, 5, var, owner,
+					 attributes, len, data);
+	}
+
+	snapshot_calls_saved++;
+
+	v = snapshot_find(var, owner);
+	if (!v)
+		return EFI_NOT_FOUND;
+
+	if (attributes)
+		*attributes = v->attributes;
+	if (*len < v->size) {
+		*len = v->size;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	*len = v->size;
+	CopyMem(data, v->data, v->size);
+	return EFI_SUCCESS;
+}
+
+/*
+ * SetVariable(), keeping the snapshot's copy in step.  Like the firmware,
+ * a write without any access attributes deletes the variable.  A write
+ * with any attributes other than those and non-volatile may not leave the
+ * variable holding exactly what was written, so it is read back instead.
+ */
+EFI_STATUS
+set_variable(CHAR16 *var, EFI_GUID *owner, UINT32 attributes, UINTN len,
+	     void *data)
+{
+	const UINT32 access = EFI_VARIABLE_BOOTSERVICE_ACCESS |
+			      EFI_VARIABLE_RUNTIME_ACCESS;
+	snapshot_var_t *v;
+	UINT8 *copy;
+	EFI_STATUS efi_status;
+
+	snapshot_calls_made++;
+	efi_status = uefi_call_wrapper(RT->SetVariable, 5, var, owner,
+				       attributes, len, data);
+	if (efi_status != EFI_SUCCESS || !snapshot_covers(var, owner))
+		return efi_status;
+
+	v = snapshot_find(var, owner);
+	if (len == 0 || !(attributes & access)) {
+		if (v)
+			snapshot_remove(v);
+		return efi_status;
+	}
+
+	copy = NULL;
+	if (v && !(attributes & ~(access | EFI_VARIABLE_NON_VOLATILE)))
+		copy = AllocatePool(len);
+	if (!copy) {
+		if (snapshot_read(var, owner) != EFI_SUCCESS)
+			variable_snapshot_free();
+		return efi_status;
+	}
+
+	CopyMem(copy, data, len);
+	FreePool(v->data);
+	v->attributes = attributes;
+	v->data = copy;
+	v->size = len;
+
+	return efi_status;
+}
+
+/*
+ * LibDeleteVariable(), without reading the variable first when the
+ * snapshot already knows whether it exists.  The delete has to carry the
+ * attributes the variable really has, or firmware that checks them will
+ * refuse it; shim deletes variables precisely because their attributes
+ * aren't the ones it set.
+ */
+EFI_STATUS
+delete_variable(CHAR16 *var, EFI_GUID *owner)
+{
+	snapshot_var_t *v;
+
+	if (!snapshot_covers(var, owner))
+		return LibDeleteVariable(var, owner);
+
+	v = snapshot_find(var, owner);
+	if (!v)
+		return EFI_NOT_FOUND;
+
+	return set_variable(var, owner, v->attributes, 0, NULL);
+}
+
 EFI_STATUS
 get_variable_attr(CHAR16 *var, UINT8 **data, UINTN *len, EFI_GUID owner,
 		  UINT32 *attributes)
@@ -218,8 +565,7 @@ get_variable_attr(CHAR16 *var, UINT8 **data, UINTN *len, EFI_GUID owner,
 
 	*len = 0;
 
-	efi_status = uefi_call_wrapper(RT->GetVariable, 5, var, &owner,
-				       NULL, len, NULL);
+	efi_status = read_variable(var, &owner, NULL, len, NULL);
 	if (efi_status != EFI_BUFFER_TOO_SMALL)
 		return efi_status;
 
@@ -227,8 +573,7 @@ get_variable_attr(CHAR16 *var, UINT8 **data, UINTN *len, EFI_GUID owner,
 	if (!*data)
 		return EFI_OUT_OF_RESOURCES;
 	
-	efi_status = uefi_call_wrapper(RT->GetVariable, 5, var, &owner,
-				       attributes, len, *data);
+	efi_status = read_variable(var, &owner, attributes, len, *data);
 
 	if (efi_status != EFI_SUCCESS) {
 		FreePool(*data);
@@ -286,8 +631,8 @@ variable_is_setupmode(int default_return)
 	UINTN DataSize = sizeof(SetupMode);
 	EFI_STATUS status;
 
-	status = uefi_call_wrapper(RT->GetVariable, 5, L"SetupMode", &GV_GUID, NULL,
-				   &DataSize, &SetupMode);
+	status = read_variable(L"SetupMode", &GV_GUID, NULL, &DataSize,
+			       &SetupMode);
 	if (EFI_ERROR(status))
 		return default_return;
 
@@ -303,8 +648,8 @@ variable_is_secureboot(void)
 	EFI_STATUS status;
 
 	DataSize = sizeof(SecureBoot);
-	status = uefi_call_wrapper(RT->GetVariable, 5, L"SecureBoot", &GV_GUID, NULL,
-				   &DataSize, &SecureBoot);
+	status = read_variable(L"SecureBoot", &GV_GUID, NULL, &DataSize,
+			       &SecureBoot);
 	if (EFI_ERROR(status))
 		return 0;
 
@@ -37,6 +37,7 @@
 #include <string.h>
 #include "netboot.h"
 #include "str.h"
+#include "timestamp.h"
 
 #define ntohs(x) __builtin_bswap16(x)	/* supported both by GCC and clang */
 #define htons(x) ntohs(x)
@@ -44,6 +45,25 @@
 static EFI_PXE_BASE_CODE *pxe;
 static EFI_IP_ADDRESS tftp_addr;
 static CHAR8 *full_path;
+static UINT32 link_mtu;
+
+/*
+ * TFTP block sizes: the one every server supports, and the largest RFC 2348
+ * allows.  Each block is sent with an IP header, an 8 byte UDP header and a
+ * 4 byte TFTP header.
+ */
+#define TFTP_DEFAULT_BLKSIZE	512
+#define TFTP_MAX_BLKSIZE	65464
+#define UDP_TFTP_HEADER_SIZE	(8 + 4)
+#define IP4_HEADER_SIZE		20
+#define IP6_HEADER_SIZE		40
+#define DEFAULT_MTU		1500
+
+/*
+ * The RFC 2347 error code a server sends when it won't accept the options
+ * it was asked for
+ */
+#define TFTP_ERROR_OPTIONS	8
 
 
 typedef struct {
@@ -52,6 +72,35 @@ typedef struct {
 	UINT8 Data[1];
 } EFI_DHCP6_PACKET_OPTION;
 
+/*
+ * Find the MTU of the network interface under the PXE device, which may be
+ * a child of the handle that has SNP on it.  Returns 0 if it isn't known.
+ */
+static UINT32 find_link_mtu(EFI_HANDLE device)
+{
+	EFI_DEVICE_PATH *devpath;
+	EFI_HANDLE snp_handle;
+	EFI_SIMPLE_NETWORK *snp;
+	EFI_STATUS status;
+
+	devpath = DevicePathFromHandle(device);
+	if (!devpath)
+		return 0;
+
+	status = uefi_call_wrapper(BS->LocateDevicePath, 3,
+				   &SimpleNetworkProtocol, &devpath,
+				   &snp_handle);
+	if (status != EFI_SUCCESS)
+		return 0;
+
+	status = uefi_call_wrapper(BS->HandleProtocol, 3, snp_handle,
+				   &SimpleNetworkProtocol, (VOID **)&snp);
+	if (status != EFI_SUCCESS || !snp || !snp->Mode)
+		return 0;
+
+	return snp->Mode->MaxPacketSize;
+}
+
 /*
  * usingNetboot
  * Returns TRUE if we identify a protocol that is enabled and Providing us with
@@ -78,6 +127,8 @@ BOOLEAN findNetboot(EFI_HANDLE device)
 		return FALSE;
 	}
 
+	link_mtu = find_link_mtu(device);
+
 	/*
 	 * We've located a pxe protocol handle thats been started and has
 	 * received an ACK, meaning its something we'll be able to get
@@ -307,38 +358,135 @@ EFI_STATUS parseNetbootinfo(EFI_HANDLE image_handle)
 	return rc;
 }
 
-EFI_STATUS FetchNetbootimage(EFI_HANDLE image_handle, VOID **buffer, UINT64 *bufsiz)
+/*
+ * The largest TFTP block that fits in one packet on this link, so that the
+ * transfer takes as few round trips as it can without IP fragmentation
+ */
+static UINTN tftp_block_size(void)
+{
+	UINTN mtu = link_mtu ? link_mtu : DEFAULT_MTU;
+	UINTN overhead = UDP_TFTP_HEADER_SIZE;
+
+	overhead += pxe->Mode->UsingIpv6 ? IP6_HEADER_SIZE : IP4_HEADER_SIZE;
+	if (mtu < overhead + TFTP_DEFAULT_BLKSIZE)
+		return TFTP_DEFAULT_BLKSIZE;
+	if (mtu - overhead > TFTP_MAX_BLKSIZE)
+		return TFTP_MAX_BLKSIZE;
+	return mtu - overhead;
+}
+
+static EFI_STATUS tftp_read(VOID **buffer, UINT64 *bufsiz, UINTN blksz)
 {
 	EFI_STATUS rc;
-	EFI_PXE_BASE_CODE_TFTP_OPCODE read = EFI_PXE_BASE_CODE_TFTP_READ_FILE;
-	BOOLEAN overwrite = FALSE;
-	BOOLEAN nobuffer = FALSE;
-	UINTN blksz = 512;
+	UINT64 size;
 
-	Print(L"Fetching Netboot Image\n");
-	if (*buffer == NULL) {
-		*buffer = AllocatePool(4096 * 1024);
+	for (;;) {
+		size = *bufsiz;
+		rc = uefi_call_wrapper(pxe->Mtftp, 10, pxe,
+				       EFI_PXE_BASE_CODE_TFTP_READ_FILE,
+				       *buffer, FALSE, &size, &blksz,
+				       &tftp_addr, full_path, NULL, FALSE);
+		if (rc != EFI_BUFFER_TOO_SMALL)
+			break;
+
+		/*
+		 * The file grew since we asked for its size, or the server
+		 * wouldn't say.  Every retry reads the whole file again, so
+		 * grow to what the firmware says is needed if it told us,
+		 * and otherwise to at least twice the size.
+		 */
+		if (size <= *bufsiz)
+			size = *bufsiz * 2;
+		FreePool(*buffer);
+		*buffer = AllocatePool(size);
 		if (!*buffer)
-			return EFI_OUT_OF_RESOURCES; 
-		*bufsiz = 4096 * 1024;
+			return EFI_OUT_OF_RESOURCES;
+		*bufsiz = size;
 	}
 
-try_again:
-	rc = uefi_call_wrapper(pxe->Mtftp, 10, pxe, read, *buffer, overwrite,
-				bufsiz, &blksz, &tftp_addr, full_path, NULL, nobuffer);
+	if (rc == EFI_SUCCESS)
+		*bufsiz = size;
+	return rc;
+}
 
-	if (rc == EFI_BUFFER_TOO_SMALL) {
-		/* try again, doubling buf size */
-		*bufsiz *= 2;
-		FreePool(*buffer);
-		*buffer = AllocatePool(*bufsiz);
+/*
+ * Whether a transfer failed because the blksize and tsize options couldn't
+ * be agreed on: either the server refused them, or it answered with an
+ * OACK the firmware rejected, in which case the firmware sends the error
+ * and none is received.  Anything else, like the file not being there,
+ * would fail the same way with 512 byte blocks.
+ */
+static BOOLEAN tftp_options_failed(EFI_STATUS rc)
+{
+	if (rc == EFI_PROTOCOL_ERROR)
+		return TRUE;
+	if (rc != EFI_TFTP_ERROR)
+		return FALSE;
+	return !pxe->Mode->TftpErrorReceived ||
+	       pxe->Mode->TftpError.ErrorCode == TFTP_ERROR_OPTIONS;
+}
+
+EFI_STATUS FetchNetbootimage(EFI_HANDLE image_handle, VOID **buffer, UINT64 *bufsiz)
+{
+	EFI_STATUS rc;
+	UINTN blksz = tftp_block_size();
+	UINT64 filesize = 0;
+	UINT64 start, ticks, frequency;
+
+	Print(L"Fetching Netboot Image\n");
+	timeline_mark("tftp");
+
+	/*
+	 * Ask for the size first (the tsize option), so the image can be
+	 * read into a buffer of the right size in one pass
+	 */
+	rc = uefi_call_wrapper(pxe->Mtftp, 10, pxe,
+			       EFI_PXE_BASE_CODE_TFTP_GET_FILE_SIZE, NULL,
+			       FALSE, &filesize, &blksz, &tftp_addr,
+			       full_path, NULL, FALSE);
+	if (rc != EFI_SUCCESS || filesize == 0) {
+		dprint(L"TFTP server did not give the file size: %r\n", rc);
+		filesize = 4096 * 1024;
+	}
+
+	if (*buffer == NULL || *bufsiz < filesize) {
+		if (*buffer)
+			FreePool(*buffer);
+		*buffer = AllocatePool(filesize);
 		if (!*buffer)
 			return EFI_OUT_OF_RESOURCES;
-		goto try_again;
+		*bufsiz = filesize;
 	}
 
-	if (rc != EFI_SUCCESS && *buffer) {
-		FreePool(*buffer);
+	start = read_timestamp();
+	rc = tftp_read(buffer, bufsiz, blksz);
+	if (tftp_options_failed(rc) && blksz > TFTP_DEFAULT_BLKSIZE) {
+		/*
+		 * The server, or something between us and it, won't do
+		 * large blocks, so try again the way we always used to
+		 */
+		dprint(L"TFTP with %d byte blocks failed: %r, retrying with %d\n",
+		       (UINT32)blksz, rc, TFTP_DEFAULT_BLKSIZE);
+		blksz = TFTP_DEFAULT_BLKSIZE;
+		start = read_timestamp();
+		rc = tftp_read(buffer, bufsiz, blksz);
 	}
-	return rc;
+
+	if (rc != EFI_SUCCESS) {
+		if (*buffer) {
+			FreePool(*buffer);
+			*buffer = NULL;
+		}
+		return rc;
+	}
+
+	ticks = read_timestamp() - start;
+	frequency = verbose ? timestamp_frequency() : 0;
+	if (ticks && frequency)
+		dprint(L"TFTP: %d bytes in %d ms with %d byte blocks (MTU %d), %d KiB/s\n",
+		       (UINT32)*bufsiz, (UINT32)(ticks * 1000 / frequency),
+		       (UINT32)blksz, link_mtu,
+		       (UINT32)(*bufsiz * frequency / ticks / 1024));
+
+	return EFI_SUCCESS;
 }
@@ -53,7 +53,12 @@
 #define FALLBACK L"\\fb" EFI_ARCH L".efi"
 #define MOK_MANAGER L"\\mm" EFI_ARCH L".efi"
 
-#define OID_EKU_MODSIGN "1.3.6.1.4.1.2312.16.1.2"
+/* How much of the second stage to read in before hashing what has arrived */
+#define LOAD_CHUNK_SIZE (1024 * 1024)
+
+#ifndef EFI_FILE_PROTOCOL_REVISION2
+#define EFI_FILE_PROTOCOL_REVISION2 0x00020000
+#endif
 
 static EFI_SYSTEM_TABLE *systab;
 static EFI_HANDLE global_image_handle;
@@ -100,6 +105,59 @@ int loader_is_participating;
 UINT8 user_insecure_mode;
 UINT8 ignore_db;
 
+/*
+ * Authenticode digests calculated for the images we load, as decided by
+ * find_hash_algorithms(), and how many images each one was calculated for
+ */
+static UINT32 image_hash_algorithms = HASH_ALG_SHA256 | HASH_ALG_SHA1;
+static UINT32 sha256_hash_count;
+static UINT32 sha1_hash_count;
+
+/*
+ * How many trust anchors were looked at, and how many of those were
+ * actually verified against, for the image being checked
+ */
+static UINT32 anchors_considered;
+static UINT32 anchors_tried;
+
+/* The anchor the last signature checked was verified against */
+static trust_list_id_t verified_list;
+static UINTN verified_anchor;
+
+/* How the last image that passed was verified */
+static verification_method_t last_verification_method;
+
+/*
+ * What shim_verify() decided about the buffers it has been handed, so that
+ * grub asking again about the same one doesn't mean verifying it again
+ */
+typedef struct {
+	UINT8 sha256hash[SHA256_DIGEST_SIZE];	/* of the whole buffer */
+	UINT32 size;
+	UINT32 generation;			/* trust_store_generation() */
+	EFI_STATUS status;
+	verification_method_t method;
+} verify_result_t;
+
+#define VERIFY_RESULTS 8
+
+static verify_result_t verify_results[VERIFY_RESULTS];
+static UINTN verify_results_count;
+static UINTN verify_results_next;
+static UINT32 verify_result_hits;
+static UINT32 verify_result_misses;
+
+/*
+ * The variables shim reads while it starts up, which are read once and
+ * then served from memory until shim starts another image
+ */
+static variable_snapshot_filter_t snapshot_filters[] = {
+	{ &SHIM_LOCK_GUID, NULL },
+	{ &SIG_DB, NULL },
+	{ &GV_GUID, L"SecureBoot" },
+	{ &GV_GUID, L"SetupMode" },
+};
+
 typedef enum {
 	DATA_FOUND,
 	DATA_NOT_FOUND,
@@ -374,249 +432,114 @@ drain_openssl_errors(void)
 		err = ERR_get_error();
 }
 
-static BOOLEAN verify_x509(UINT8 *Cert, UINTN CertSize)
-{
-	UINTN length;
-
-	if (!Cert || CertSize < 4)
-		return FALSE;
-
-	/*
-	 * A DER encoding x509 certificate starts with SEQUENCE(0x30),
-	 * the number of length bytes, and the number of value bytes.
-	 * The size of a x509 certificate is usually between 127 bytes
-	 * and 64KB. For convenience, assume the number of value bytes
-	 * is 2, i.e. the second byte is 0x82.
-	 */
-	if (Cert[0] != 0x30 || Cert[1] != 0x82)
-		return FALSE;
-
-	length = Cert[2]<<8 | Cert[3];
-	if (length != (CertSize - 4))
-		return FALSE;
-
-	return TRUE;
-}
-
-static BOOLEAN verify_eku(UINT8 *Cert, UINTN CertSize)
-{
-	X509 *x509;
-	CONST UINT8 *Temp = Cert;
-	EXTENDED_KEY_USAGE *eku;
-	ASN1_OBJECT *module_signing;
-
-	module_signing = OBJ_nid2obj(OBJ_create(OID_EKU_MODSIGN, NULL, NULL));
-
-	x509 = d2i_X509 (NULL, &Temp, (long) CertSize);
-	if (x509 != NULL) {
-		eku = X509_get_ext_d2i(x509, NID_ext_key_usage, NULL, NULL);
-
-		if (eku) {
-			int i = 0;
-			for (i = 0; i < sk_ASN1_OBJECT_num(eku); i++) {
-				ASN1_OBJECT *key_usage = sk_ASN1_OBJECT_value(eku, i);
-
-				if (OBJ_cmp(module_signing, key_usage) == 0)
-					return FALSE;
-			}
-			EXTENDED_KEY_USAGE_free(eku);
-		}
-
-		X509_free(x509);
-	}
-
-	OBJ_cleanup();
-
-	return TRUE;
-}
-
-static CHECK_STATUS check_db_cert_in_ram(EFI_SIGNATURE_LIST *CertList,
-					 UINTN dbsize,
-					 WIN_CERTIFICATE_EFI_PKCS *data,
-					 UINT8 *hash, CHAR16 *dbname,
-					 EFI_GUID guid)
-{
-	EFI_SIGNATURE_DATA *Cert;
-	UINTN CertSize;
-	BOOLEAN IsFound = FALSE;
-	EFI_GUID CertType = X509_GUID;
-
-	while ((dbsize > 0) && (dbsize >= CertList->SignatureListSize)) {
-		if (CompareGuid (&CertList->SignatureType, &CertType) == 0) {
-			Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) CertList + sizeof (EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize);
-			CertSize = CertList->SignatureSize - sizeof(EFI_GUID);
-			if (verify_x509(Cert->SignatureData, CertSize)) {
-				if (verify_eku(Cert->SignatureData, CertSize)) {
-					IsFound = AuthenticodeVerify (data->CertData,
-								      data->Hdr.dwLength - sizeof(data->Hdr),
-								      Cert->SignatureData,
-								      CertSize,
-								      hash, SHA256_DIGEST_SIZE);
-					if (IsFound) {
-						tpm_measure_variable(dbname, guid, CertSize, Cert->SignatureData);
-						return DATA_FOUND;
-						drain_openssl_errors();
-					} else {
-						LogError(L"AuthenticodeVerify(): %d\n", IsFound);
-					}
-				}
-			} else if (verbose) {
-				console_notify(L"Not a DER encoding x.509 Certificate");
-			}
-		}
-
-		dbsize -= CertList->SignatureListSize;
-		CertList = (EFI_SIGNATURE_LIST *) ((UINT8 *) CertList + CertList->SignatureListSize);
-	}
-
-	return DATA_NOT_FOUND;
-}
-
-static CHECK_STATUS check_db_cert(CHAR16 *dbname, EFI_GUID guid,
-				  WIN_CERTIFICATE_EFI_PKCS *data, UINT8 *hash)
+/*
+ * Check a signature against the certificates in one of the trust store's
+ * lists.  Only the certificates that could be in the signature's chain
+ * are actually verified against.
+ */
+static CHECK_STATUS check_trust_list(trust_list_id_t id,
+				     trust_signature_t *sig)
 {
-	CHECK_STATUS rc;
-	EFI_STATUS efi_status;
-	EFI_SIGNATURE_LIST *CertList;
-	UINTN dbsize = 0;
-	UINT8 *db;
+	trust_list_t *list = trust_store_get(id);
+	trust_anchor_t *anchor;
+	BOOLEAN IsFound;
+	UINTN i;
 
-	efi_status = get_variable(dbname, &db, &dbsize, guid);
-	if (efi_status != EFI_SUCCESS)
+	if (!list)
 		return VAR_NOT_FOUND;
 
-	CertList = (EFI_SIGNATURE_LIST *)db;
-
-	rc = check_db_cert_in_ram(CertList, dbsize, data, hash, dbname, guid);
-
-	FreePool(db);
-
-	return rc;
-}
-
-/*
- * Check a hash against an EFI_SIGNATURE_LIST in a buffer
- */
-static CHECK_STATUS check_db_hash_in_ram(EFI_SIGNATURE_LIST *CertList,
-					 UINTN dbsize, UINT8 *data,
-					 int SignatureSize, EFI_GUID CertType,
-					 CHAR16 *dbname, EFI_GUID guid)
-{
-	EFI_SIGNATURE_DATA *Cert;
-	UINTN CertCount, Index;
-	BOOLEAN IsFound = FALSE;
-
-	while ((dbsize > 0) && (dbsize >= CertList->SignatureListSize)) {
-		CertCount = (CertList->SignatureListSize -sizeof (EFI_SIGNATURE_LIST) - CertList->SignatureHeaderSize) / CertList->SignatureSize;
-		Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) CertList + sizeof (EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize);
-		if (CompareGuid(&CertList->SignatureType, &CertType) == 0) {
-			for (Index = 0; Index < CertCount; Index++) {
-				if (CompareMem (Cert->SignatureData, data, SignatureSize) == 0) {
-					//
-					// Find the signature in database.
-					//
-					IsFound = TRUE;
-					tpm_measure_variable(dbname, guid, SignatureSize, data);
-					break;
-				}
+	for (i = 0; i < list->count; i++) {
+		anchor = &list->anchors[i];
+		anchors_considered++;
+		if (!trust_anchor_may_verify(sig, anchor))
+			continue;
 
-				Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) Cert + CertList->SignatureSize);
-			}
-			if (IsFound) {
-				break;
-			}
+		anchors_tried++;
+		IsFound = trust_anchor_verify(sig, anchor);
+		if (IsFound) {
+			tpm_measure_variable(list->name, list->guid,
+					     anchor->der_size, anchor->der);
+			verified_list = id;
+			verified_anchor = i;
+			return DATA_FOUND;
+		} else {
+			LogError(L"AuthenticodeContextVerify(): %d\n", IsFound);
 		}
-
-		dbsize -= CertList->SignatureListSize;
-		CertList = (EFI_SIGNATURE_LIST *) ((UINT8 *) CertList + CertList->SignatureListSize);
 	}
 
-	if (IsFound)
-		return DATA_FOUND;
-
 	return DATA_NOT_FOUND;
 }
 
 /*
- * Check a hash against an EFI_SIGNATURE_LIST in a UEFI variable
+ * Check a hash against one of the trust store's hash indexes
  */
-static CHECK_STATUS check_db_hash(CHAR16 *dbname, EFI_GUID guid, UINT8 *data,
-				  int SignatureSize, EFI_GUID CertType)
+static CHECK_STATUS check_trust_hash(trust_list_id_t id, UINT8 *data,
+				     int SignatureSize, EFI_GUID CertType)
 {
-	EFI_STATUS efi_status;
-	EFI_SIGNATURE_LIST *CertList;
-	UINTN dbsize = 0;
-	UINT8 *db;
+	trust_list_t *list = trust_store_get(id);
 
-	efi_status = get_variable(dbname, &db, &dbsize, guid);
-
-	if (efi_status != EFI_SUCCESS) {
+	if (!list)
 		return VAR_NOT_FOUND;
-	}
 
-	CertList = (EFI_SIGNATURE_LIST *)db;
-
-	CHECK_STATUS rc = check_db_hash_in_ram(CertList, dbsize, data,
-					       SignatureSize, CertType,
-					       dbname, guid);
-	FreePool(db);
-	return rc;
+	if (!trust_list_has_digest(list, CertType, data, SignatureSize))
+		return DATA_NOT_FOUND;
 
+	tpm_measure_variable(list->name, list->guid, SignatureSize, data);
+	return DATA_FOUND;
 }
 
 /*
  * Check whether the binary signature or hash are present in dbx or the
- * built-in blacklist
+ * built-in blacklist.  sha1hash is NULL when no SHA-1 digest was computed.
  */
-static EFI_STATUS check_blacklist (WIN_CERTIFICATE_EFI_PKCS *cert,
+static EFI_STATUS check_blacklist (trust_signature_t *sig,
 				   UINT8 *sha256hash, UINT8 *sha1hash)
 {
-	EFI_GUID secure_var = EFI_IMAGE_SECURITY_DATABASE_GUID;
-	EFI_GUID shim_var = SHIM_LOCK_GUID;
-	EFI_SIGNATURE_LIST *dbx = (EFI_SIGNATURE_LIST *)vendor_dbx;
+	/*
+	 * Without the trust store there's no telling whether the binary or
+	 * its signer has been revoked
+	 */
+	if (!trust_store_get(TRUST_DBX)) {
+		LogError(L"Certificate lists are not loaded\n");
+		return EFI_SECURITY_VIOLATION;
+	}
 
-	if (check_db_hash_in_ram(dbx, vendor_dbx_size, sha256hash,
-				 SHA256_DIGEST_SIZE, EFI_CERT_SHA256_GUID,
-				 L"dbx", secure_var) ==
-				DATA_FOUND) {
+	if (check_trust_hash(TRUST_VENDOR_DBX, sha256hash, SHA256_DIGEST_SIZE,
+			     EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		LogError(L"binary sha256hash found in vendor dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash_in_ram(dbx, vendor_dbx_size, sha1hash,
-				 SHA1_DIGEST_SIZE, EFI_CERT_SHA1_GUID,
-				 L"dbx", secure_var) ==
-				DATA_FOUND) {
+	if (sha1hash &&
+	    check_trust_hash(TRUST_VENDOR_DBX, sha1hash, SHA1_DIGEST_SIZE,
+			     EFI_CERT_SHA1_GUID) == DATA_FOUND) {
 		LogError(L"binary sha1hash found in vendor dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert && check_db_cert_in_ram(dbx, vendor_dbx_size, cert,
-					 sha256hash, L"dbx",
-					 secure_var) == DATA_FOUND) {
+	if (sig && check_trust_list(TRUST_VENDOR_DBX, sig) == DATA_FOUND) {
 		LogError(L"cert sha256hash found in vendor dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash(L"dbx", secure_var, sha256hash, SHA256_DIGEST_SIZE,
-			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+	if (check_trust_hash(TRUST_DBX, sha256hash, SHA256_DIGEST_SIZE,
+			     EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		LogError(L"binary sha256hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash(L"dbx", secure_var, sha1hash, SHA1_DIGEST_SIZE,
-			  EFI_CERT_SHA1_GUID) == DATA_FOUND) {
+	if (sha1hash &&
+	    check_trust_hash(TRUST_DBX, sha1hash, SHA1_DIGEST_SIZE,
+			     EFI_CERT_SHA1_GUID) == DATA_FOUND) {
 		LogError(L"binary sha1hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert && check_db_cert(L"dbx", secure_var, cert, sha256hash) ==
-				DATA_FOUND) {
+	if (sig && check_trust_list(TRUST_DBX, sig) == DATA_FOUND) {
 		LogError(L"cert sha256hash found in system dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (check_db_hash(L"MokListX", shim_var, sha256hash, SHA256_DIGEST_SIZE,
-			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+	if (check_trust_hash(TRUST_MOK_LIST_X, sha256hash, SHA256_DIGEST_SIZE,
+			     EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		LogError(L"binary sha256hash found in Mok dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
-	if (cert && check_db_cert(L"MokListX", shim_var, cert, sha256hash) ==
-				DATA_FOUND) {
+	if (sig && check_trust_list(TRUST_MOK_LIST_X, sig) == DATA_FOUND) {
 		LogError(L"cert sha256hash found in Mok dbx\n");
 		return EFI_SECURITY_VIOLATION;
 	}
@@ -627,60 +550,58 @@ static EFI_STATUS check_blacklist (WIN_CERTIFICATE_EFI_PKCS *cert,
 
 static void update_verification_method(verification_method_t method)
 {
+	last_verification_method = method;
 	if (verification_method == VERIFIED_BY_NOTHING)
 		verification_method = method;
 }
 
 /*
- * Check whether the binary signature or hash are present in db or MokList
+ * Check whether the binary signature or hash are present in db or MokList.
+ * sha1hash is NULL when no SHA-1 digest was computed.
  */
-static EFI_STATUS check_whitelist (WIN_CERTIFICATE_EFI_PKCS *cert,
+static EFI_STATUS check_whitelist (trust_signature_t *sig,
 				   UINT8 *sha256hash, UINT8 *sha1hash)
 {
-	EFI_GUID secure_var = EFI_IMAGE_SECURITY_DATABASE_GUID;
-	EFI_GUID shim_var = SHIM_LOCK_GUID;
-
 	if (!ignore_db) {
-		if (check_db_hash(L"db", secure_var, sha256hash, SHA256_DIGEST_SIZE,
-					EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+		if (check_trust_hash(TRUST_DB, sha256hash, SHA256_DIGEST_SIZE,
+				     EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 			update_verification_method(VERIFIED_BY_HASH);
 			return EFI_SUCCESS;
 		} else {
-			LogError(L"check_db_hash(db, sha256hash) != DATA_FOUND\n");
+			LogError(L"check_trust_hash(db, sha256hash) != DATA_FOUND\n");
 		}
-		if (check_db_hash(L"db", secure_var, sha1hash, SHA1_DIGEST_SIZE,
-					EFI_CERT_SHA1_GUID) == DATA_FOUND) {
+		if (sha1hash &&
+		    check_trust_hash(TRUST_DB, sha1hash, SHA1_DIGEST_SIZE,
+				     EFI_CERT_SHA1_GUID) == DATA_FOUND) {
 			verification_method = VERIFIED_BY_HASH;
 			update_verification_method(VERIFIED_BY_HASH);
 			return EFI_SUCCESS;
 		} else {
-			LogError(L"check_db_hash(db, sha1hash) != DATA_FOUND\n");
+			LogError(L"check_trust_hash(db, sha1hash) != DATA_FOUND\n");
 		}
-		if (cert && check_db_cert(L"db", secure_var, cert, sha256hash)
-					== DATA_FOUND) {
+		if (sig && check_trust_list(TRUST_DB, sig) == DATA_FOUND) {
 			verification_method = VERIFIED_BY_CERT;
 			update_verification_method(VERIFIED_BY_CERT);
 			return EFI_SUCCESS;
 		} else {
-			LogError(L"check_db_cert(db, sha256hash) != DATA_FOUND\n");
+			LogError(L"check_trust_list(db) != DATA_FOUND\n");
 		}
 	}
 
-	if (check_db_hash(L"MokList", shim_var, sha256hash, SHA256_DIGEST_SIZE,
-			  EFI_CERT_SHA256_GUID) == DATA_FOUND) {
+	if (check_trust_hash(TRUST_MOK_LIST, sha256hash, SHA256_DIGEST_SIZE,
+			     EFI_CERT_SHA256_GUID) == DATA_FOUND) {
 		verification_method = VERIFIED_BY_HASH;
 		update_verification_method(VERIFIED_BY_HASH);
 		return EFI_SUCCESS;
 	} else {
-		LogError(L"check_db_hash(MokList, sha256hash) != DATA_FOUND\n");
+		LogError(L"check_trust_hash(MokList, sha256hash) != DATA_FOUND\n");
 	}
-	if (cert && check_db_cert(L"MokList", shim_var, cert, sha256hash) ==
-				DATA_FOUND) {
+	if (sig && check_trust_list(TRUST_MOK_LIST, sig) == DATA_FOUND) {
 		verification_method = VERIFIED_BY_CERT;
 		update_verification_method(VERIFIED_BY_CERT);
 		return EFI_SUCCESS;
 	} else {
-		LogError(L"check_db_cert(MokList, sha256hash) != DATA_FOUND\n");
+		LogError(L"check_trust_list(MokList) != DATA_FOUND\n");
 	}
 
 	update_verification_method(VERIFIED_BY_NOTHING);
@@ -721,6 +642,70 @@ static BOOLEAN secure_mode (void)
 	return TRUE;
 }
 
+/*
+ * Check whether an EFI_SIGNATURE_LIST buffer contains a list of CertType
+ */
+static BOOLEAN esl_has_type(EFI_SIGNATURE_LIST *CertList, UINTN dbsize,
+			    EFI_GUID CertType)
+{
+	while ((dbsize > 0) && (dbsize >= CertList->SignatureListSize) &&
+	       CertList->SignatureListSize) {
+		if (CompareGuid(&CertList->SignatureType, &CertType) == 0)
+			return TRUE;
+
+		dbsize -= CertList->SignatureListSize;
+		CertList = (EFI_SIGNATURE_LIST *) ((UINT8 *) CertList + CertList->SignatureListSize);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Check whether a UEFI variable holding EFI_SIGNATURE_LISTs contains a list
+ * of CertType
+ */
+static BOOLEAN var_has_type(CHAR16 *dbname, EFI_GUID guid, EFI_GUID CertType)
+{
+	EFI_STATUS efi_status;
+	UINTN dbsize = 0;
+	UINT8 *db;
+	BOOLEAN found;
+
+	efi_status = get_variable(dbname, &db, &dbsize, guid);
+	if (efi_status != EFI_SUCCESS)
+		return FALSE;
+
+	found = esl_has_type((EFI_SIGNATURE_LIST *)db, dbsize, CertType);
+	FreePool(db);
+
+	return found;
+}
+
+/*
+ * Work out which Authenticode digests need to be calculated for the images
+ * we load.  SHA-256 is always required.  SHA-1 is only consumed when a
+ * TPM 1.2 is handed the image digest by tpm_log_pe() (TPM 2.0 hashes the
+ * image itself), and by SHA-1 entries in vendor_dbx, dbx and db.  MokList
+ * and MokListX are only ever searched for SHA-256 hashes, so SHA-1 entries
+ * in them don't count.
+ */
+static void find_hash_algorithms(void)
+{
+	EFI_GUID secure_var = EFI_IMAGE_SECURITY_DATABASE_GUID;
+	UINT32 algorithms = HASH_ALG_SHA256;
+
+	if (tpm_needs_sha1_digest() ||
+	    esl_has_type((EFI_SIGNATURE_LIST *)vendor_dbx, vendor_dbx_size,
+			 EFI_CERT_SHA1_GUID) ||
+	    var_has_type(L"dbx", secure_var, EFI_CERT_SHA1_GUID) ||
+	    var_has_type(L"db", secure_var, EFI_CERT_SHA1_GUID))
+		algorithms |= HASH_ALG_SHA1;
+
+	image_hash_algorithms = algorithms;
+	dprint(L"SHA-1 image digests %a\n",
+	       (algorithms & HASH_ALG_SHA1) ? "required" : "not required");
+}
+
 #define check_size_line(data, datasize_in, hashbase, hashsize, l) ({	\
 	if ((unsigned long)hashbase >					\
 			(unsigned long)data + datasize_in) {		\
@@ -740,17 +725,72 @@ static BOOLEAN secure_mode (void)
 #define check_size(d,ds,h,hs) check_size_line(d,ds,h,hs,__LINE__)
 
 /*
- * Calculate the SHA1 and SHA256 hashes of a binary
+ * A range of a binary covered by its Authenticode hash
  */
+typedef struct {
+	unsigned int offset;
+	unsigned int size;
+} hash_region_t;
 
-static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
-				 PE_COFF_LOADER_IMAGE_CONTEXT *context,
-				 UINT8 *sha256hash, UINT8 *sha1hash)
+/*
+ * An Authenticode hash that is fed with the binary as it becomes available
+ */
+typedef struct {
+	void *ctx;
+	UINT32 algorithms;
+	hash_region_t *regions;
+	unsigned int count;
+	unsigned int region;
+	unsigned int region_done;
+} hash_stream_t;
+
+/*
+ * Digests of a binary calculated while it was being read in
+ */
+typedef struct {
+	BOOLEAN valid;
+	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+	UINT8 sha1hash[SHA1_DIGEST_SIZE];
+	/* Used while the binary is being read */
+	hash_stream_t hs;
+	BOOLEAN hashing;
+	BOOLEAN failed;
+} image_digests_t;
+
+static void hash_stream_free (hash_stream_t *hs)
+{
+	if (hs->ctx)
+		FreePool(hs->ctx);
+	if (hs->regions)
+		FreePool(hs->regions);
+	hs->ctx = NULL;
+	hs->regions = NULL;
+}
 
+static void add_hash_region(hash_region_t *regions, unsigned int *count,
+			    char *data, char *hashbase, unsigned int hashsize)
+{
+	if (hashsize == 0)
+		return;
+
+	regions[*count].offset = hashbase - data;
+	regions[*count].size = hashsize;
+	(*count)++;
+}
+
+/*
+ * Work out which ranges of a binary make up its Authenticode hash, in the
+ * order they have to be hashed.  Only the image headers are looked at, so
+ * this works before the rest of the file has been read.
+ */
+static EFI_STATUS get_hash_regions (char *data, unsigned int datasize_in,
+				    PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				    hash_region_t **regionsp,
+				    unsigned int *countp)
 {
-	unsigned int sha256ctxsize, sha1ctxsize;
 	unsigned int size = datasize_in;
-	void *sha256ctx = NULL, *sha1ctx = NULL;
+	hash_region_t *regions = NULL;
+	unsigned int count = 0;
 	char *hashbase;
 	unsigned int hashsize;
 	unsigned int SumOfBytesHashed, SumOfSectionBytes;
@@ -775,35 +815,21 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 	}
 	PEHdr_offset = DosHdr->e_lfanew;
 
-	sha256ctxsize = Sha256GetContextSize();
-	sha256ctx = AllocatePool(sha256ctxsize);
-
-	sha1ctxsize = Sha1GetContextSize();
-	sha1ctx = AllocatePool(sha1ctxsize);
-
-	if (!sha256ctx || !sha1ctx) {
-		perror(L"Unable to allocate memory for hash context\n");
+	/* Three header ranges, the sections and the trailing data */
+	regions = AllocatePool(sizeof(*regions) *
+			(context->PEHdr->Pe32.FileHeader.NumberOfSections + 4));
+	if (!regions) {
+		perror(L"Unable to allocate memory for hash regions\n");
 		return EFI_OUT_OF_RESOURCES;
 	}
 
-	if (!Sha256Init(sha256ctx) || !Sha1Init(sha1ctx)) {
-		perror(L"Unable to initialise hash\n");
-		status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
-
 	/* Hash start to checksum */
 	hashbase = data;
 	hashsize = (char *)&context->PEHdr->Pe32.OptionalHeader.CheckSum -
 		hashbase;
 	check_size(data, datasize_in, hashbase, hashsize);
 
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
+	add_hash_region(regions, &count, data, hashbase, hashsize);
 
 	/* Hash post-checksum to start of certificate table */
 	hashbase = (char *)&context->PEHdr->Pe32.OptionalHeader.CheckSum +
@@ -811,12 +837,7 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 	hashsize = (char *)context->SecDir - hashbase;
 	check_size(data, datasize_in, hashbase, hashsize);
 
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
+	add_hash_region(regions, &count, data, hashbase, hashsize);
 
 	/* Hash end of certificate table to end of image header */
 	EFI_IMAGE_DATA_DIRECTORY *dd = context->SecDir + 1;
@@ -829,12 +850,7 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 	}
 	check_size(data, datasize_in, hashbase, hashsize);
 
-	if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-	    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-		perror(L"Unable to generate hash\n");
-		status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
+	add_hash_region(regions, &count, data, hashbase, hashsize);
 
 	/* Sort sections */
 	SumOfBytesHashed = context->SizeOfHeaders;
@@ -914,12 +930,7 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 		hashsize  = (unsigned int) Section->SizeOfRawData;
 		check_size(data, datasize_in, hashbase, hashsize);
 
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-			perror(L"Unable to generate hash\n");
-			status = EFI_OUT_OF_RESOURCES;
-			goto done;
-		}
+		add_hash_region(regions, &count, data, hashbase, hashsize);
 		SumOfBytesHashed += Section->SizeOfRawData;
 	}
 
@@ -940,12 +951,7 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 		}
 		check_size(data, datasize_in, hashbase, hashsize);
 
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-			perror(L"Unable to generate hash\n");
-			status = EFI_OUT_OF_RESOURCES;
-			goto done;
-		}
+		add_hash_region(regions, &count, data, hashbase, hashsize);
 
 		SumOfBytesHashed += hashsize;
 	}
@@ -958,31 +964,158 @@ static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
 
 		check_size(data, datasize_in, hashbase, hashsize);
 
-		if (!(Sha256Update(sha256ctx, hashbase, hashsize)) ||
-		    !(Sha1Update(sha1ctx, hashbase, hashsize))) {
-			perror(L"Unable to generate hash\n");
-			status = EFI_OUT_OF_RESOURCES;
-			goto done;
-		}
+		add_hash_region(regions, &count, data, hashbase, hashsize);
 
 		SumOfBytesHashed += hashsize;
 	}
 #endif
 
-	if (!(Sha256Final(sha256ctx, sha256hash)) ||
-	    !(Sha1Final(sha1ctx, sha1hash))) {
-		perror(L"Unable to finalise hash\n");
-		status = EFI_OUT_OF_RESOURCES;
-		goto done;
-	}
+	*regionsp = regions;
+	*countp = count;
+	regions = NULL;
 
 done:
 	if (SectionHeader)
 		FreePool(SectionHeader);
-	if (sha1ctx)
-		FreePool(sha1ctx);
-	if (sha256ctx)
-		FreePool(sha256ctx);
+	if (regions)
+		FreePool(regions);
+
+	return status;
+}
+
+/*
+ * Set up a hash stream for a binary whose headers have already been read
+ */
+static EFI_STATUS hash_stream_init (hash_stream_t *hs, char *data,
+				    unsigned int datasize,
+				    PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				    UINT32 algorithms)
+{
+	EFI_STATUS status;
+
+	ZeroMem(hs, sizeof(*hs));
+	hs->algorithms = algorithms;
+
+	status = get_hash_regions(data, datasize, context, &hs->regions,
+				  &hs->count);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	/*
+	 * All of the digests are fed from the same pass over the image, so
+	 * each region is only read from memory once.
+	 */
+	hs->ctx = AllocatePool(MultiHashGetContextSize());
+	if (!hs->ctx) {
+		perror(L"Unable to allocate memory for hash context\n");
+		hash_stream_free(hs);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	if (!MultiHashInit(hs->ctx, algorithms)) {
+		perror(L"Unable to initialise hash\n");
+		hash_stream_free(hs);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Hash everything covered by the hash regions that lies within the first
+ * "available" bytes of the binary and hasn't been hashed yet.  The regions
+ * are sorted by file offset, so the bytes that have arrived but can't be
+ * hashed yet are never more than one region behind the reader.
+ */
+static EFI_STATUS hash_stream_feed (hash_stream_t *hs, char *data,
+				    unsigned int available)
+{
+	hash_region_t *region;
+	unsigned int start, end;
+
+	while (hs->region < hs->count) {
+		region = &hs->regions[hs->region];
+		start = region->offset + hs->region_done;
+		end = region->offset + region->size;
+
+		if (start >= available)
+			break;
+		if (end > available)
+			end = available;
+
+		if (!MultiHashUpdate(hs->ctx, data + start, end - start)) {
+			perror(L"Unable to generate hash\n");
+			return EFI_OUT_OF_RESOURCES;
+		}
+
+		hs->region_done += end - start;
+		if (hs->region_done == region->size) {
+			hs->region++;
+			hs->region_done = 0;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Finish a hash stream that has been fed the whole binary
+ */
+static EFI_STATUS hash_stream_final (hash_stream_t *hs, UINT8 *sha256hash,
+				     UINT8 *sha1hash)
+{
+	MULTI_HASH_VALUE hashvalue;
+
+	if (hs->region != hs->count) {
+		perror(L"Image hash is incomplete\n");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (sha1hash && !(hs->algorithms & HASH_ALG_SHA1)) {
+		perror(L"SHA-1 image hash was not calculated\n");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (!MultiHashFinal(hs->ctx, &hashvalue)) {
+		perror(L"Unable to finalise hash\n");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	CopyMem(sha256hash, hashvalue.Sha256, SHA256_DIGEST_SIZE);
+	sha256_hash_count++;
+	if (sha1hash) {
+		CopyMem(sha1hash, hashvalue.Sha1, SHA1_DIGEST_SIZE);
+		sha1_hash_count++;
+	}
+	dprint(L"Image digests: SHA-256%s (%d SHA-256, %d SHA-1 so far)\n",
+	       sha1hash ? L", SHA-1" : L"", sha256_hash_count,
+	       sha1_hash_count);
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Calculate the SHA1 and SHA256 hashes of a binary.  If sha1hash is NULL
+ * only the SHA256 hash is calculated.
+ */
+static EFI_STATUS generate_hash (char *data, unsigned int datasize_in,
+				 PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				 UINT8 *sha256hash, UINT8 *sha1hash)
+{
+	hash_stream_t hs;
+	EFI_STATUS status;
+
+	status = hash_stream_init(&hs, data, datasize_in, context,
+				  sha1hash ? HASH_ALG_SHA256 | HASH_ALG_SHA1
+					   : HASH_ALG_SHA256);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = hash_stream_feed(&hs, data, datasize_in);
+	if (status == EFI_SUCCESS)
+		status = hash_stream_final(&hs, sha256hash, sha1hash);
+
+	hash_stream_free(&hs);
 
 	return status;
 }
@@ -1002,7 +1135,7 @@ static EFI_STATUS verify_mok (void) {
 
 	if (!EFI_ERROR(status) && attributes & EFI_VARIABLE_RUNTIME_ACCESS) {
 		perror(L"MokList is compromised!\nErase all keys in MokList!\n");
-		if (LibDeleteVariable(L"MokList", &shim_lock_guid) != EFI_SUCCESS) {
+		if (delete_variable(L"MokList", &shim_lock_guid) != EFI_SUCCESS) {
 			perror(L"Failed to erase MokList\n");
                         return EFI_SECURITY_VIOLATION;
 		}
@@ -1014,57 +1147,53 @@ static EFI_STATUS verify_mok (void) {
 	return EFI_SUCCESS;
 }
 
+#if defined(ENABLE_VERIFY_CACHE)
 /*
- * Check that the signature is valid and matches the binary
+ * Whether a binary's signature was already verified with this trust store.
+ * The anchor that verified it is measured again, so that the TPM log is
+ * the same as if the signature had been checked.  Only call this once
+ * verify_mok() and check_blacklist() have passed: the cache is keyed on
+ * the image hash, which doesn't cover the signature, so it says nothing
+ * about whether the certificates this copy is signed with are revoked.
  */
-static EFI_STATUS verify_buffer (char *data, int datasize,
-				 PE_COFF_LOADER_IMAGE_CONTEXT *context,
-				 UINT8 *sha256hash, UINT8 *sha1hash)
+static EFI_STATUS check_verify_cache(UINT8 *sha256hash)
 {
-	EFI_STATUS status = EFI_SECURITY_VIOLATION;
-	WIN_CERTIFICATE_EFI_PKCS *cert = NULL;
-	unsigned int size = datasize;
-	EFI_GUID shim_var = SHIM_LOCK_GUID;
+	trust_list_id_t id;
+	trust_list_t *list;
+	trust_anchor_t *anchor;
+	UINTN index;
+
+	if (!verify_cache_lookup(sha256hash, &id, &index))
+		return EFI_NOT_FOUND;
+
+	if (id != TRUST_DB && id != TRUST_MOK_LIST &&
+	    id != TRUST_SHIM_CERT && id != TRUST_VENDOR_CERT)
+		return EFI_NOT_FOUND;
+	if (id == TRUST_DB && ignore_db)
+		return EFI_NOT_FOUND;
+
+	list = trust_store_get(id);
+	if (!list || index >= list->count)
+		return EFI_NOT_FOUND;
+
+	anchor = &list->anchors[index];
+	tpm_measure_variable(list->name, list->guid, anchor->der_size,
+			     anchor->der);
+	update_verification_method(VERIFIED_BY_CERT);
+	dprint(L"Signature was verified on an earlier boot\n");
 
-	if (context->SecDir->Size != 0) {
-		if (context->SecDir->Size >= size) {
-			perror(L"Certificate Database size is too large\n");
-			return EFI_INVALID_PARAMETER;
-		}
-
-		cert = ImageAddress (data, size,
-				     context->SecDir->VirtualAddress);
-
-		if (!cert) {
-			perror(L"Certificate located outside the image\n");
-			return EFI_INVALID_PARAMETER;
-		}
-
-		if (cert->Hdr.dwLength > context->SecDir->Size) {
-			perror(L"Certificate list size is inconsistent with PE headers");
-			return EFI_INVALID_PARAMETER;
-		}
-
-		if (cert->Hdr.wCertificateType !=
-		    WIN_CERT_TYPE_PKCS_SIGNED_DATA) {
-			perror(L"Unsupported certificate type %x\n",
-				cert->Hdr.wCertificateType);
-			return EFI_UNSUPPORTED;
-		}
-	}
-
-	/*
-	 * Clear OpenSSL's error log, because we get some DSO unimplemented
-	 * errors during its intialization, and we don't want those to look
-	 * like they're the reason for validation failures.
-	 */
-	drain_openssl_errors();
+	return EFI_SUCCESS;
+}
+#endif /* defined(ENABLE_VERIFY_CACHE) */
 
-	status = generate_hash(data, datasize, context, sha256hash, sha1hash);
-	if (status != EFI_SUCCESS) {
-		LogError(L"generate_hash: %r\n", status);
-		return status;
-	}
+/*
+ * Check the binary's hashes and signature against the trust store.  sig is
+ * NULL if the binary isn't signed.
+ */
+static EFI_STATUS check_trust(trust_signature_t *sig, UINT8 *sha256hash,
+			      UINT8 *sha1hash)
+{
+	EFI_STATUS status;
 
 	/*
 	 * Check that the MOK database hasn't been modified
@@ -1078,18 +1207,23 @@ static EFI_STATUS verify_buffer (char *data, int datasize,
 	/*
 	 * Ensure that the binary isn't blacklisted
 	 */
-	status = check_blacklist(cert, sha256hash, sha1hash);
+	status = check_blacklist(sig, sha256hash, sha1hash);
 	if (status != EFI_SUCCESS) {
 		perror(L"Binary is blacklisted\n");
 		LogError(L"Binary is blacklisted: %r\n", status);
 		return status;
 	}
 
+#if defined(ENABLE_VERIFY_CACHE)
+	if (sig && check_verify_cache(sha256hash) == EFI_SUCCESS)
+		return EFI_SUCCESS;
+#endif
+
 	/*
 	 * Check whether the binary is whitelisted in any of the firmware
 	 * databases
 	 */
-	status = check_whitelist(cert, sha256hash, sha1hash);
+	status = check_whitelist(sig, sha256hash, sha1hash);
 	if (status == EFI_SUCCESS) {
 		drain_openssl_errors();
 		return status;
@@ -1097,41 +1231,31 @@ static EFI_STATUS verify_buffer (char *data, int datasize,
 		LogError(L"check_whitelist(): %r\n", status);
 	}
 
-	if (cert) {
+	if (sig) {
 #if defined(ENABLE_SHIM_CERT)
 		/*
 		 * Check against the shim build key
 		 */
-		if (sizeof(shim_cert) &&
-		    AuthenticodeVerify(cert->CertData,
-			       cert->Hdr.dwLength - sizeof(cert->Hdr),
-			       shim_cert, sizeof(shim_cert), sha256hash,
-			       SHA256_DIGEST_SIZE)) {
+		if (check_trust_list(TRUST_SHIM_CERT, sig) == DATA_FOUND) {
 			update_verification_method(VERIFIED_BY_CERT);
-			tpm_measure_variable(L"Shim", shim_var, sizeof(shim_cert), shim_cert);
 			status = EFI_SUCCESS;
 			drain_openssl_errors();
 			return status;
 		} else {
-			LogError(L"AuthenticodeVerify(shim_cert) failed\n");
+			LogError(L"check_trust_list(shim_cert) failed\n");
 		}
 #endif /* defined(ENABLE_SHIM_CERT) */
 
 		/*
 		 * And finally, check against shim's built-in key
 		 */
-		if (vendor_cert_size &&
-		    AuthenticodeVerify(cert->CertData,
-				       cert->Hdr.dwLength - sizeof(cert->Hdr),
-				       vendor_cert, vendor_cert_size,
-				       sha256hash, SHA256_DIGEST_SIZE)) {
+		if (check_trust_list(TRUST_VENDOR_CERT, sig) == DATA_FOUND) {
 			update_verification_method(VERIFIED_BY_CERT);
-			tpm_measure_variable(L"Shim", shim_var, vendor_cert_size, vendor_cert);
 			status = EFI_SUCCESS;
 			drain_openssl_errors();
 			return status;
 		} else {
-			LogError(L"AuthenticodeVerify(vendor_cert) failed\n");
+			LogError(L"check_trust_list(vendor_cert) failed\n");
 		}
 	}
 
@@ -1142,6 +1266,101 @@ static EFI_STATUS verify_buffer (char *data, int datasize,
 	return status;
 }
 
+/*
+ * Check that the signature is valid and matches the binary.
+ *
+ * sha256hash and sha1hash must already hold the Authenticode digests of
+ * this buffer as produced by generate_hash(); they are not recomputed here.
+ */
+static EFI_STATUS verify_buffer (char *data, int datasize,
+				 PE_COFF_LOADER_IMAGE_CONTEXT *context,
+				 UINT8 *sha256hash, UINT8 *sha1hash)
+{
+	EFI_STATUS status = EFI_SECURITY_VIOLATION;
+	WIN_CERTIFICATE_EFI_PKCS *cert = NULL;
+	trust_signature_t sig;
+	unsigned int size = datasize;
+	UINTN arena_size, arena_peak, arena_allocations, arena_fallbacks;
+	CRYPT_ALLOCATION_STATS alloc_before, alloc_after;
+
+	if (context->SecDir->Size != 0) {
+		if (context->SecDir->Size >= size) {
+			perror(L"Certificate Database size is too large\n");
+			return EFI_INVALID_PARAMETER;
+		}
+
+		cert = ImageAddress (data, size,
+				     context->SecDir->VirtualAddress);
+
+		if (!cert) {
+			perror(L"Certificate located outside the image\n");
+			return EFI_INVALID_PARAMETER;
+		}
+
+		if (cert->Hdr.dwLength > context->SecDir->Size) {
+			perror(L"Certificate list size is inconsistent with PE headers");
+			return EFI_INVALID_PARAMETER;
+		}
+
+		if (cert->Hdr.wCertificateType !=
+		    WIN_CERT_TYPE_PKCS_SIGNED_DATA) {
+			perror(L"Unsupported certificate type %x\n",
+				cert->Hdr.wCertificateType);
+			return EFI_UNSUPPORTED;
+		}
+	}
+
+	/*
+	 * Clear OpenSSL's error log, because we get some DSO unimplemented
+	 * errors during its intialization, and we don't want those to look
+	 * like they're the reason for validation failures.
+	 */
+	drain_openssl_errors();
+
+	/*
+	 * Everything OpenSSL allocates while decoding and checking the
+	 * signature is gone again by the time we're done, so take it from
+	 * Cryptlib's arena instead of making a pool call for each piece.
+	 */
+	CryptGetAllocationStats(&alloc_before);
+	CryptArenaBegin();
+
+	if (cert)
+		trust_signature_init(&sig, cert->CertData,
+				     cert->Hdr.dwLength - sizeof(cert->Hdr),
+				     sha256hash);
+
+	anchors_considered = 0;
+	anchors_tried = 0;
+	verified_list = TRUST_LIST_COUNT;
+	status = check_trust(cert ? &sig : NULL, sha256hash, sha1hash);
+	dprint(L"Verified against %d of %d trust anchors\n", anchors_tried,
+	       anchors_considered);
+
+	if (cert)
+		trust_signature_free(&sig);
+
+#if defined(ENABLE_VERIFY_CACHE)
+	if (status == EFI_SUCCESS && cert && verified_list != TRUST_LIST_COUNT)
+		verify_cache_add(sha256hash, verified_list, verified_anchor);
+#endif
+
+	CryptArenaEnd();
+	CryptArenaGetStats(&arena_size, &arena_peak, &arena_allocations,
+			   &arena_fallbacks);
+	dprint(L"Crypto arena: peak %d of %d KiB, %d allocations, %d from the pool\n",
+	       (UINT32)(arena_peak / 1024), (UINT32)(arena_size / 1024),
+	       (UINT32)arena_allocations, (UINT32)arena_fallbacks);
+	CryptGetAllocationStats(&alloc_after);
+	dprint(L"Crypto allocations: %d, %d reallocs, %d moved (%d bytes copied)\n",
+	       (UINT32)(alloc_after.Allocations - alloc_before.Allocations),
+	       (UINT32)(alloc_after.Reallocs - alloc_before.Reallocs),
+	       (UINT32)(alloc_after.ReallocCopies - alloc_before.ReallocCopies),
+	       (UINT32)(alloc_after.BytesCopied - alloc_before.BytesCopied));
+
+	return status;
+}
+
 /*
  * Read the binary header and grab appropriate information from it
  */
@@ -1218,6 +1437,11 @@ static EFI_STATUS read_header(void *data, unsigned int datasize,
 		return EFI_UNSUPPORTED;
 	}
 
+	if (SectionHeaderOffset > context->SizeOfHeaders) {
+		perror(L"Image section headers are outside of the image header\n");
+		return EFI_UNSUPPORTED;
+	}
+
 	if ((context->SizeOfHeaders - SectionHeaderOffset) / EFI_IMAGE_SIZEOF_SECTION_HEADER
 			< (UINT32)context->NumberOfSections) {
 		perror(L"Image sections overflow section headers\n");
@@ -1277,7 +1501,7 @@ static EFI_STATUS read_header(void *data, unsigned int datasize,
  * Once the image has been loaded it needs to be validated and relocated
  */
 static EFI_STATUS handle_image (void *data, unsigned int datasize,
-				EFI_LOADED_IMAGE *li)
+				EFI_LOADED_IMAGE *li, image_digests_t *digests)
 {
 	EFI_STATUS efi_status;
 	char *buffer;
@@ -1289,8 +1513,11 @@ static EFI_STATUS handle_image (void *data, unsigned int datasize,
 	EFI_PHYSICAL_ADDRESS alloc_address;
 	int found_entry_point = 0;
 	UINT8 sha1hash[SHA1_DIGEST_SIZE];
+	UINT8 *wanted_sha1hash = NULL;
 	UINT8 sha256hash[SHA256_DIGEST_SIZE];
 
+	timeline_mark("hash");
+
 	/*
 	 * The binary header contains relevant context and section pointers
 	 */
@@ -1300,20 +1527,36 @@ static EFI_STATUS handle_image (void *data, unsigned int datasize,
 		return efi_status;
 	}
 
+	/*
+	 * Only calculate the SHA-1 hash if something is going to use it
+	 */
+	ZeroMem(sha1hash, SHA1_DIGEST_SIZE);
+	if (image_hash_algorithms & HASH_ALG_SHA1)
+		wanted_sha1hash = sha1hash;
+
 	/*
 	 * We only need to verify the binary if we're in secure mode
 	 */
-	efi_status = generate_hash(data, datasize, &context, sha256hash,
-				   sha1hash);
-	if (efi_status != EFI_SUCCESS)
-		return efi_status;
+	if (digests && digests->valid) {
+		dprint(L"Using image digests calculated during load\n");
+		CopyMem(sha256hash, digests->sha256hash, SHA256_DIGEST_SIZE);
+		if (wanted_sha1hash)
+			CopyMem(sha1hash, digests->sha1hash, SHA1_DIGEST_SIZE);
+	} else {
+		efi_status = generate_hash(data, datasize, &context,
+					   sha256hash, wanted_sha1hash);
+		if (efi_status != EFI_SUCCESS)
+			return efi_status;
+	}
 
 	/* Measure the binary into the TPM */
+	timeline_mark("measure");
 	tpm_log_pe((EFI_PHYSICAL_ADDRESS)(UINTN)data, datasize, sha1hash, 4);
 
 	if (secure_mode ()) {
+		timeline_mark("verify");
 		efi_status = verify_buffer(data, datasize, &context,
-					   sha256hash, sha1hash);
+					   sha256hash, wanted_sha1hash);
 
 		if (EFI_ERROR(efi_status)) {
 			console_error(L"Verification failed", efi_status);
@@ -1338,6 +1581,8 @@ static EFI_STATUS handle_image (void *data, unsigned int datasize,
 	 *
 	 * We only support one page size, so if it's zero, nerf it to 4096.
 	 */
+	timeline_mark("relocate");
+
 	alignment = context.SectionAlignment;
 	if (!alignment)
 		alignment = 4096;
@@ -1661,34 +1906,152 @@ static EFI_STATUS generate_path(EFI_LOADED_IMAGE *li, CHAR16 *ImagePath,
 		goto error;
 	}
 
-	*PathName[0] = '\0';
-	if (StrnCaseCmp(bootpath, ImagePath, StrLen(bootpath)))
-		StrCat(*PathName, bootpath);
-	StrCat(*PathName, ImagePath);
+	*PathName[0] = '\0';
+	if (StrnCaseCmp(bootpath, ImagePath, StrLen(bootpath)))
+		StrCat(*PathName, bootpath);
+	StrCat(*PathName, ImagePath);
+
+error:
+	FreePool(bootpath);
+
+	return efi_status;
+}
+
+/*
+ * Start hashing a binary that is still being read in.  Returns EFI_NOT_READY
+ * until enough of it has arrived to work out the hash regions.  Any other
+ * error just means the binary gets hashed by handle_image() instead, which
+ * is also where problems with it get reported.
+ */
+static EFI_STATUS hash_stream_start (hash_stream_t *hs, char *data,
+				     unsigned int available,
+				     unsigned int datasize)
+{
+	PE_COFF_LOADER_IMAGE_CONTEXT context;
+	EFI_IMAGE_DOS_HEADER *DosHdr = (void *)data;
+	unsigned long hdrsize = sizeof(EFI_IMAGE_OPTIONAL_HEADER_UNION);
+	UINT8 saved_in_protocol = in_protocol;
+	EFI_STATUS status;
+
+	if (available < sizeof(*DosHdr))
+		return EFI_NOT_READY;
+	if (DosHdr->e_magic == EFI_IMAGE_DOS_SIGNATURE)
+		hdrsize += DosHdr->e_lfanew;
+	if (available < hdrsize)
+		return EFI_NOT_READY;
+
+	in_protocol = 1;
+	status = read_header(data, datasize, &context);
+	/*
+	 * read_header() only guarantees the section table ends inside
+	 * SizeOfHeaders, but check its end too since hash_stream_init()
+	 * walks it
+	 */
+	if (status == EFI_SUCCESS &&
+	    (available < context.SizeOfHeaders ||
+	     available < (UINTN)((char *)context.FirstSection - data) +
+			 context.NumberOfSections *
+			 EFI_IMAGE_SIZEOF_SECTION_HEADER))
+		status = EFI_NOT_READY;
+	if (status == EFI_SUCCESS)
+		status = hash_stream_init(hs, data, datasize, &context,
+					  image_hash_algorithms);
+	in_protocol = saved_in_protocol;
+
+	return status;
+}
+
+static void image_digests_init (image_digests_t *digests)
+{
+	ZeroMem(digests, sizeof(*digests));
+}
+
+/*
+ * Hash whatever has arrived of a binary that is being read in
+ */
+static void image_digests_update (image_digests_t *digests, char *data,
+				  UINTN available, UINTN filesize)
+{
+	EFI_STATUS status;
+
+	if (!digests || digests->failed)
+		return;
+
+	if (!digests->hashing) {
+		status = hash_stream_start(&digests->hs, data, available,
+					   filesize);
+		if (status == EFI_SUCCESS)
+			digests->hashing = TRUE;
+		else if (status != EFI_NOT_READY)
+			digests->failed = TRUE;
+	}
+
+	if (digests->hashing &&
+	    hash_stream_feed(&digests->hs, data, available) != EFI_SUCCESS) {
+		hash_stream_free(&digests->hs);
+		digests->hashing = FALSE;
+		digests->failed = TRUE;
+	}
+}
+
+/*
+ * Finish hashing a binary once reading it has stopped.  A short read
+ * changes the size the hash regions were worked out for, so the digests
+ * are only trusted if the whole file arrived.
+ */
+static void image_digests_finish (image_digests_t *digests, UINTN datasize,
+				  UINTN filesize)
+{
+	if (!digests)
+		return;
+
+	if (digests->hashing && datasize == filesize &&
+	    hash_stream_final(&digests->hs, digests->sha256hash,
+			      (image_hash_algorithms & HASH_ALG_SHA1) ?
+				digests->sha1hash : NULL) == EFI_SUCCESS)
+		digests->valid = TRUE;
+
+	hash_stream_free(&digests->hs);
+	digests->hashing = FALSE;
+}
+
+#if defined(ENABLE_HTTPBOOT)
+/*
+ * Hash an HTTP download as it arrives, so that very little of the hashing
+ * is left to do once the last of it is in.  If the download starts over,
+ * so does the hash: its place in the old buffer means nothing for the new
+ * one.
+ */
+static VOID hash_download (VOID *context, VOID *buffer, UINTN received,
+			   UINTN total)
+{
+	image_digests_t *digests = context;
 
-error:
-	FreePool(bootpath);
+	if (!buffer) {
+		hash_stream_free(&digests->hs);
+		image_digests_init(digests);
+		return;
+	}
 
-	return efi_status;
+	image_digests_update(digests, buffer, received, total);
 }
+#endif
 
 /*
- * Open the second stage bootloader and read it into a buffer
+ * Open a file and find out how big it is
  */
-static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
-			      int *datasize, CHAR16 *PathName)
+static EFI_STATUS open_image_file (EFI_HANDLE device, CHAR16 *PathName,
+				   EFI_FILE **rootp, EFI_FILE **filep,
+				   UINTN *filesize)
 {
 	EFI_GUID simple_file_system_protocol = SIMPLE_FILE_SYSTEM_PROTOCOL;
 	EFI_GUID file_info_id = EFI_FILE_INFO_ID;
 	EFI_STATUS efi_status;
-	EFI_HANDLE device;
 	EFI_FILE_INFO *fileinfo = NULL;
 	EFI_FILE_IO_INTERFACE *drive;
-	EFI_FILE *root, *grub;
+	EFI_FILE *root = NULL, *grub = NULL;
 	UINTN buffersize = sizeof(EFI_FILE_INFO);
 
-	device = li->DeviceHandle;
-
 	/*
 	 * Open the device
 	 */
@@ -1752,9 +2115,304 @@ static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
 		goto error;
 	}
 
-	buffersize = fileinfo->FileSize;
+	*filesize = fileinfo->FileSize;
+	*rootp = root;
+	*filep = grub;
+	FreePool(fileinfo);
+
+	return EFI_SUCCESS;
+error:
+	if (fileinfo)
+		FreePool(fileinfo);
+	if (grub)
+		uefi_call_wrapper(grub->Close, 1, grub);
+	if (root)
+		uefi_call_wrapper(root->Close, 1, root);
+	return efi_status;
+}
+
+/*
+ * The second stage being read in with EFI_FILE_PROTOCOL revision 2
+ * asynchronous reads, while shim gets on with measuring and mirroring the
+ * MOK state and setting up OpenSSL.  Each completed chunk queues the next
+ * one from its notification function, so the disk stays busy without shim
+ * having to poll it.  offset, busy and status are updated at TPL_CALLBACK.
+ */
+typedef struct {
+	EFI_HANDLE device;
+	CHAR16 *PathName;
+	EFI_FILE *root;
+	EFI_FILE *file;
+	char *buffer;
+	UINTN filesize;
+	UINTN offset;
+	BOOLEAN busy;
+	EFI_STATUS status;
+	EFI_FILE_IO_TOKEN token;
+	EFI_EVENT progress;
+} prefetch_t;
+
+static prefetch_t *prefetch;
+
+/*
+ * Queue a read of the next chunk.  Called at TPL_CALLBACK, or before the
+ * first read has been queued.
+ */
+static void prefetch_read (prefetch_t *pf)
+{
+	EFI_STATUS efi_status;
+
+	pf->token.Status = EFI_SUCCESS;
+	pf->token.BufferSize = pf->filesize - pf->offset;
+	if (pf->token.BufferSize > LOAD_CHUNK_SIZE)
+		pf->token.BufferSize = LOAD_CHUNK_SIZE;
+	pf->token.Buffer = pf->buffer + pf->offset;
+
+	efi_status = uefi_call_wrapper(pf->file->ReadEx, 2, pf->file,
+				       &pf->token);
+	if (EFI_ERROR(efi_status)) {
+		pf->status = efi_status;
+		pf->busy = FALSE;
+	}
+}
+
+static VOID EFIAPI
+prefetch_notify (EFI_EVENT Event, VOID *Context)
+{
+	prefetch_t *pf = Context;
+
+	if (EFI_ERROR(pf->token.Status)) {
+		pf->status = pf->token.Status;
+		pf->busy = FALSE;
+	} else if (pf->token.BufferSize == 0) {
+		/* The file is shorter than it claimed to be */
+		pf->busy = FALSE;
+	} else {
+		pf->offset += pf->token.BufferSize;
+		if (pf->offset < pf->filesize)
+			prefetch_read(pf);
+		else
+			pf->busy = FALSE;
+	}
+
+	uefi_call_wrapper(BS->SignalEvent, 1, pf->progress);
+}
+
+/*
+ * Wait for any read that is still in flight and throw the prefetch away
+ */
+static void prefetch_discard (void)
+{
+	prefetch_t *pf = prefetch;
+	EFI_TPL old_tpl;
+	BOOLEAN busy;
+	UINTN index;
+
+	if (!pf)
+		return;
+	prefetch = NULL;
+
+	for (;;) {
+		old_tpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+		busy = pf->busy;
+		uefi_call_wrapper(BS->RestoreTPL, 1, old_tpl);
+		if (!busy)
+			break;
+		uefi_call_wrapper(BS->WaitForEvent, 3, 1, &pf->progress,
+				  &index);
+	}
+
+	if (pf->token.Event)
+		uefi_call_wrapper(BS->CloseEvent, 1, pf->token.Event);
+	if (pf->progress)
+		uefi_call_wrapper(BS->CloseEvent, 1, pf->progress);
+	if (pf->file)
+		uefi_call_wrapper(pf->file->Close, 1, pf->file);
+	if (pf->root)
+		uefi_call_wrapper(pf->root->Close, 1, pf->root);
+	if (pf->buffer)
+		FreePool(pf->buffer);
+	if (pf->PathName)
+		FreePool(pf->PathName);
+	FreePool(pf);
+}
+
+/*
+ * Start reading the second stage in the background.  If the firmware's
+ * file protocol doesn't support asynchronous I/O nothing happens, and
+ * load_image() reads it synchronously later on.
+ */
+static void prefetch_second_stage (EFI_HANDLE image_handle)
+{
+	EFI_GUID loaded_image_protocol = LOADED_IMAGE_PROTOCOL;
+	EFI_LOADED_IMAGE *li;
+	EFI_STATUS efi_status;
+	prefetch_t *pf;
+	CHAR16 *ImagePath;
+
+	efi_status = uefi_call_wrapper(BS->HandleProtocol, 3, image_handle,
+				       &loaded_image_protocol, (void **)&li);
+	if (efi_status != EFI_SUCCESS)
+		return;
+
+	/* Network boot fetches the image itself */
+	if (findNetboot(li->DeviceHandle))
+		return;
+
+	pf = AllocateZeroPool(sizeof(*pf));
+	if (!pf)
+		return;
+
+	ImagePath = should_use_fallback(image_handle) ? FALLBACK : second_stage;
+	efi_status = generate_path(li, ImagePath, &pf->PathName);
+	if (efi_status != EFI_SUCCESS)
+		goto error;
+
+	/*
+	 * Problems opening the file get reported when load_image() tries
+	 * again, so keep quiet about them here
+	 */
+	in_protocol = 1;
+	efi_status = open_image_file(li->DeviceHandle, pf->PathName,
+				     &pf->root, &pf->file, &pf->filesize);
+	in_protocol = 0;
+	if (efi_status != EFI_SUCCESS)
+		goto error;
+
+	if (pf->file->Revision < EFI_FILE_PROTOCOL_REVISION2 ||
+	    pf->filesize == 0) {
+		dprint(L"Asynchronous file I/O is not available\n");
+		goto error;
+	}
+
+	pf->device = li->DeviceHandle;
+	pf->buffer = AllocatePool(pf->filesize);
+	if (!pf->buffer)
+		goto error;
+
+	efi_status = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+				       &pf->progress);
+	if (efi_status != EFI_SUCCESS)
+		goto error;
+
+	efi_status = uefi_call_wrapper(BS->CreateEvent, 5, EVT_NOTIFY_SIGNAL,
+				       TPL_CALLBACK, prefetch_notify, pf,
+				       &pf->token.Event);
+	if (efi_status != EFI_SUCCESS)
+		goto error;
+
+	pf->busy = TRUE;
+	prefetch = pf;
+	prefetch_read(pf);
+	if (EFI_ERROR(pf->status)) {
+		dprint(L"Asynchronous read failed: %r\n", pf->status);
+		prefetch_discard();
+	}
+	return;
+
+error:
+	prefetch = pf;
+	prefetch_discard();
+}
+
+/*
+ * Hand over the second stage if it has been read in the background,
+ * hashing it as the chunks complete.  Returns EFI_NOT_FOUND if the file
+ * has to be read synchronously instead.
+ */
+static EFI_STATUS load_prefetched_image (EFI_HANDLE device, CHAR16 *PathName,
+					 void **data, int *datasize,
+					 image_digests_t *digests)
+{
+	prefetch_t *pf = prefetch;
+	UINTN available, ready = 0, index;
+	BOOLEAN busy, first = TRUE;
+	EFI_STATUS status;
+	EFI_TPL old_tpl;
+
+	if (!pf)
+		return EFI_NOT_FOUND;
+
+	/*
+	 * Something else is being loaded.  Reads may still be landing in
+	 * the prefetch buffer, so stop them before falling back.
+	 */
+	if (pf->device != device || StrCmp(pf->PathName, PathName)) {
+		prefetch_discard();
+		return EFI_NOT_FOUND;
+	}
+
+	for (;;) {
+		old_tpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+		available = pf->offset;
+		busy = pf->busy;
+		status = pf->status;
+		uefi_call_wrapper(BS->RestoreTPL, 1, old_tpl);
+
+		if (first) {
+			ready = available;
+			first = FALSE;
+		}
+		if (EFI_ERROR(status))
+			break;
+
+		image_digests_update(digests, pf->buffer, available,
+				     pf->filesize);
+		if (!busy)
+			break;
+
+		uefi_call_wrapper(BS->WaitForEvent, 3, 1, &pf->progress,
+				  &index);
+	}
+
+	if (EFI_ERROR(status)) {
+		dprint(L"Asynchronous read of %s failed: %r\n", PathName,
+		       status);
+		image_digests_finish(digests, 0, pf->filesize);
+		prefetch_discard();
+		return EFI_NOT_FOUND;
+	}
+
+	dprint(L"%s: %d of %d KiB were already read when it was needed\n",
+	       PathName, (UINT32)(ready / 1024), (UINT32)(pf->filesize / 1024));
+
+	image_digests_finish(digests, available, pf->filesize);
+	*data = pf->buffer;
+	*datasize = available;
+	pf->buffer = NULL;
+	prefetch_discard();
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Open the second stage bootloader and read it into a buffer.  If digests
+ * is not NULL the binary is hashed a chunk at a time as it is read, while
+ * each chunk is still in the cache, and digests->valid says whether that
+ * worked.
+ */
+static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
+			      int *datasize, CHAR16 *PathName,
+			      image_digests_t *digests)
+{
+	EFI_STATUS efi_status;
+	EFI_FILE *root = NULL, *grub = NULL;
+	UINTN buffersize, filesize, offset;
+
+	if (digests)
+		image_digests_init(digests);
+
+	efi_status = load_prefetched_image(li->DeviceHandle, PathName, data,
+					   datasize, digests);
+	if (efi_status != EFI_NOT_FOUND)
+		return efi_status;
+
+	efi_status = open_image_file(li->DeviceHandle, PathName, &root, &grub,
+				     &filesize);
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
 
-	*data = AllocatePool(buffersize);
+	*data = AllocatePool(filesize);
 
 	if (!*data) {
 		perror(L"Unable to allocate file buffer\n");
@@ -1763,39 +2421,103 @@ static EFI_STATUS load_image (EFI_LOADED_IMAGE *li, void **data,
 	}
 
 	/*
-	 * Perform the actual read
+	 * Perform the actual read, a chunk at a time.  Once the headers are
+	 * in, the hash regions are fed with whatever has arrived after each
+	 * chunk; since they're sorted by file offset, only the bytes that
+	 * belong to a region that isn't complete yet have to wait.
 	 */
-	efi_status = uefi_call_wrapper(grub->Read, 3, grub, &buffersize,
-				       *data);
+	for (offset = 0; offset < filesize; offset += buffersize) {
+		buffersize = filesize - offset;
+		if (buffersize > LOAD_CHUNK_SIZE)
+			buffersize = LOAD_CHUNK_SIZE;
 
-	if (efi_status == EFI_BUFFER_TOO_SMALL) {
-		FreePool(*data);
-		*data = AllocatePool(buffersize);
 		efi_status = uefi_call_wrapper(grub->Read, 3, grub,
-					       &buffersize, *data);
-	}
+					       &buffersize,
+					       (char *)*data + offset);
+		if (efi_status != EFI_SUCCESS) {
+			perror(L"Unexpected return from read: %r, offset %x buffersize %x\n",
+			       efi_status, offset, buffersize);
+			goto error;
+		}
+		if (buffersize == 0)
+			break;
 
-	if (efi_status != EFI_SUCCESS) {
-		perror(L"Unexpected return from initial read: %r, buffersize %x\n", efi_status, buffersize);
-		goto error;
+		image_digests_update(digests, *data, offset + buffersize,
+				     filesize);
 	}
 
-	*datasize = buffersize;
+	*datasize = offset;
+	image_digests_finish(digests, offset, filesize);
 
-	FreePool(fileinfo);
+	uefi_call_wrapper(grub->Close, 1, grub);
+	uefi_call_wrapper(root->Close, 1, root);
 
 	return EFI_SUCCESS;
 error:
+	image_digests_finish(digests, 0, filesize);
+
 	if (*data) {
 		FreePool(*data);
 		*data = NULL;
 	}
 
-	if (fileinfo)
-		FreePool(fileinfo);
+	uefi_call_wrapper(grub->Close, 1, grub);
+	uefi_call_wrapper(root->Close, 1, root);
 	return efi_status;
 }
 
+/*
+ * Forget every shim_verify() result, because the trust store they were
+ * worked out with is being replaced
+ */
+static void verify_results_clear(void)
+{
+	ZeroMem(verify_results, sizeof(verify_results));
+	verify_results_count = 0;
+	verify_results_next = 0;
+}
+
+static verify_result_t *verify_results_find(UINT8 *sha256hash, UINT32 size)
+{
+	UINT32 generation = trust_store_generation();
+	UINTN i;
+
+	for (i = 0; i < verify_results_count; i++) {
+		if (verify_results[i].size == size &&
+		    verify_results[i].generation == generation &&
+		    !CompareMem(verify_results[i].sha256hash, sha256hash,
+				SHA256_DIGEST_SIZE))
+			return &verify_results[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Only a buffer that was checked against the trust store and passed or
+ * failed is remembered; anything else, like running out of memory, could
+ * turn out differently next time.
+ */
+static void verify_results_add(UINT8 *sha256hash, UINT32 size,
+			       EFI_STATUS status, verification_method_t method)
+{
+	verify_result_t *result;
+
+	if (status != EFI_SUCCESS && status != EFI_SECURITY_VIOLATION)
+		return;
+
+	result = &verify_results[verify_results_next];
+	verify_results_next = (verify_results_next + 1) % VERIFY_RESULTS;
+	if (verify_results_count < VERIFY_RESULTS)
+		verify_results_count++;
+
+	CopyMem(result->sha256hash, sha256hash, SHA256_DIGEST_SIZE);
+	result->size = size;
+	result->generation = trust_store_generation();
+	result->status = status;
+	result->method = method;
+}
+
 /*
  * Protocol entry point. If secure boot is enabled, verify that the provided
  * buffer is signed with a trusted key.
@@ -1805,7 +2527,11 @@ EFI_STATUS shim_verify (void *buffer, UINT32 size)
 	EFI_STATUS status = EFI_SUCCESS;
 	PE_COFF_LOADER_IMAGE_CONTEXT context;
 	UINT8 sha1hash[SHA1_DIGEST_SIZE];
+	UINT8 *wanted_sha1hash = NULL;
 	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+	UINT8 buffer_hash[SHA256_DIGEST_SIZE];
+	BOOLEAN have_buffer_hash;
+	verify_result_t *result;
 
 	loader_is_participating = 1;
 	in_protocol = 1;
@@ -1813,15 +2539,44 @@ EFI_STATUS shim_verify (void *buffer, UINT32 size)
 	if (!secure_mode())
 		goto done;
 
+	/*
+	 * Hashing the buffer once is much cheaper than parsing it, working
+	 * out its Authenticode digests and checking its signature again
+	 */
+	have_buffer_hash = Sha256HashAll(buffer, size, buffer_hash);
+	if (have_buffer_hash) {
+		result = verify_results_find(buffer_hash, size);
+		if (result) {
+			verify_result_hits++;
+			dprint(L"Verify result cached: %r (%d hits, %d misses)\n",
+			       result->status, verify_result_hits,
+			       verify_result_misses);
+			if (result->status == EFI_SUCCESS)
+				update_verification_method(result->method);
+			status = result->status;
+			goto done;
+		}
+		verify_result_misses++;
+	}
+
 	status = read_header(buffer, size, &context);
 	if (status != EFI_SUCCESS)
 		goto done;
 
-	status = generate_hash(buffer, size, &context, sha256hash, sha1hash);
+	if (image_hash_algorithms & HASH_ALG_SHA1)
+		wanted_sha1hash = sha1hash;
+
+	status = generate_hash(buffer, size, &context, sha256hash,
+			       wanted_sha1hash);
 	if (status != EFI_SUCCESS)
 		goto done;
 
-	status = verify_buffer(buffer, size, &context, sha256hash, sha1hash);
+	last_verification_method = VERIFIED_BY_NOTHING;
+	status = verify_buffer(buffer, size, &context, sha256hash,
+			       wanted_sha1hash);
+	if (have_buffer_hash)
+		verify_results_add(buffer_hash, size, status,
+				   last_verification_method);
 done:
 	in_protocol = 0;
 	return status;
@@ -1852,6 +2607,52 @@ static EFI_STATUS shim_read_header(void *data, unsigned int datasize,
 	return status;
 }
 
+#if defined(ENABLE_FW_TRACE)
+/*
+ * Leave the OS a record of the firmware calls we made and how long they
+ * took; see fwtrace.h for its format
+ */
+static void export_fw_trace(void)
+{
+	fw_trace_header_t *header;
+	fw_trace_entry_t *entries;
+	UINT8 *data;
+	UINTN size;
+	UINT32 i;
+	EFI_STATUS efi_status;
+
+	efi_status = fw_trace_export(&data, &size);
+	if (EFI_ERROR(efi_status)) {
+		perror(L"Could not collect the firmware trace: %r\n",
+		       efi_status);
+		return;
+	}
+
+	header = (fw_trace_header_t *)data;
+	entries = (fw_trace_entry_t *)(header + 1);
+	dprint(L"Firmware: %d calls, %d us\n", (UINT32)header->total_calls,
+	       (UINT32)(header->total_ticks * 1000000 /
+			header->ticks_per_second));
+	for (i = 0; i < header->count; i++)
+		dprint(L"  %a: %d calls, %d us, slowest %d us\n",
+		       entries[i].name, (UINT32)entries[i].calls,
+		       (UINT32)(entries[i].ticks * 1000000 /
+				header->ticks_per_second),
+		       (UINT32)(entries[i].max_ticks * 1000000 /
+				header->ticks_per_second));
+
+	efi_status = set_variable(FW_TRACE_VARIABLE, &SHIM_LOCK_GUID,
+				  EFI_VARIABLE_BOOTSERVICE_ACCESS
+				  | EFI_VARIABLE_RUNTIME_ACCESS,
+				  size, data);
+	if (EFI_ERROR(efi_status))
+		perror(L"Failed to set %s: %r\n", FW_TRACE_VARIABLE,
+		       efi_status);
+
+	FreePool(data);
+}
+#endif
+
 /*
  * Load and run an EFI executable
  */
@@ -1865,6 +2666,10 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 	UINT64 sourcesize = 0;
 	void *data = NULL;
 	int datasize;
+	image_digests_t digests;
+	UINTN calls_made, calls_saved;
+
+	image_digests_init(&digests);
 
 	/*
 	 * We need to refer to the loaded image protocol on the running
@@ -1889,6 +2694,7 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 	}
 
 	if (findNetboot(li->DeviceHandle)) {
+		timeline_mark("netboot");
 		efi_status = parseNetbootinfo(image_handle);
 		if (efi_status != EFI_SUCCESS) {
 			perror(L"Netboot parsing failed: %r\n", efi_status);
@@ -1905,11 +2711,19 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 #if  defined(ENABLE_HTTPBOOT)
 	} else if (find_httpboot(li->DeviceHandle)) {
 		efi_status = httpboot_fetch_buffer (image_handle, &sourcebuffer,
-						    &sourcesize);
+						    &sourcesize, hash_download,
+						    &digests);
 		if (efi_status != EFI_SUCCESS) {
+			hash_stream_free(&digests.hs);
 			perror(L"Unable to fetch HTTP image: %r\n", efi_status);
 			return efi_status;
 		}
+		/*
+		 * The download only succeeds once everything the server said
+		 * it would send has arrived, and that is the size the digests
+		 * were started for.
+		 */
+		image_digests_finish(&digests, sourcesize, sourcesize);
 		data = sourcebuffer;
 		datasize = sourcesize;
 #endif
@@ -1917,7 +2731,9 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 		/*
 		 * Read the new executable off disk
 		 */
-		efi_status = load_image(li, &data, &datasize, PathName);
+		timeline_mark("load");
+		efi_status = load_image(li, &data, &datasize, PathName,
+					&digests);
 
 		if (efi_status != EFI_SUCCESS) {
 			perror(L"Failed to load image %s: %r\n", PathName, efi_status);
@@ -1936,7 +2752,7 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 	/*
 	 * Verify and, if appropriate, relocate and execute the executable
 	 */
-	efi_status = handle_image(data, datasize, li);
+	efi_status = handle_image(data, datasize, li, &digests);
 
 	if (efi_status != EFI_SUCCESS) {
 		perror(L"Failed to load image: %r\n", efi_status);
@@ -1948,10 +2764,39 @@ EFI_STATUS start_image(EFI_HANDLE image_handle, CHAR16 *ImagePath)
 
 	loader_is_participating = 0;
 
+	/*
+	 * The binary may change variables behind our back, so stop
+	 * answering reads from the snapshot
+	 */
+	variable_snapshot_stats(&calls_made, &calls_saved);
+	dprint(L"Variables: %d firmware calls made, %d saved by the snapshot\n",
+	       (UINT32)calls_made, (UINT32)calls_saved);
+	variable_snapshot_free();
+
+#if defined(ENABLE_HTTPBOOT)
+	/*
+	 * The next stage may take over the NIC, so don't leave it an HTTP
+	 * connection it doesn't know about
+	 */
+	httpboot_session_close();
+#endif
+
+#if defined(ENABLE_FW_TRACE)
+	export_fw_trace();
+#endif
+
+	timeline_mark("entry_point");
+	timeline_export();
+
 	/*
 	 * The binary is trusted and relocated. Run it
 	 */
+#if defined(ENABLE_FW_TRACE)
+	/* not a firmware call, so don't count it as one */
+	efi_status = entry_point(image_handle, systab);
+#else
 	efi_status = uefi_call_wrapper(entry_point, 2, image_handle, systab);
+#endif
 
 	/*
 	 * Restore our original loaded image values
@@ -1971,6 +2816,37 @@ done:
  * Load and run grub. If that fails because grub isn't trusted, load and
  * run MokManager.
  */
+/*
+ * (Re)build the trust store from the current certificate lists
+ */
+static EFI_STATUS load_trust_store(void)
+{
+	UINT8 *shim_cert_data = NULL;
+	UINTN shim_cert_size = 0;
+	EFI_STATUS efi_status;
+
+#if defined(ENABLE_SHIM_CERT)
+	shim_cert_data = shim_cert;
+	shim_cert_size = sizeof(shim_cert);
+#endif
+
+	efi_status = trust_store_init(vendor_cert, vendor_cert_size,
+				      vendor_dbx, vendor_dbx_size,
+				      shim_cert_data, shim_cert_size);
+	verify_results_clear();
+
+	if (efi_status != EFI_SUCCESS) {
+		perror(L"Failed to load certificate lists: %r\n", efi_status);
+		return efi_status;
+	}
+
+#if defined(ENABLE_VERIFY_CACHE)
+	verify_cache_init(user_insecure_mode, ignore_db);
+#endif
+
+	return efi_status;
+}
+
 EFI_STATUS init_grub(EFI_HANDLE image_handle)
 {
 	EFI_STATUS efi_status;
@@ -1986,6 +2862,11 @@ EFI_STATUS init_grub(EFI_HANDLE image_handle)
 			return efi_status;
 		}
 
+		/* MokManager may have changed MokList or MokListX */
+		efi_status = load_trust_store();
+		if (efi_status != EFI_SUCCESS)
+			return efi_status;
+
 		efi_status = start_image(image_handle,
 					 use_fb ? FALLBACK : second_stage);
 	}
@@ -2119,11 +3000,10 @@ EFI_STATUS mirror_mok_list()
 	}
 
 	if (FullDataSize) {
-		efi_status = uefi_call_wrapper(RT->SetVariable, 5, L"MokListRT",
-					       &shim_lock_guid,
-					       EFI_VARIABLE_BOOTSERVICE_ACCESS
-					       | EFI_VARIABLE_RUNTIME_ACCESS,
-					       FullDataSize, FullData);
+		efi_status = set_variable(L"MokListRT", &shim_lock_guid,
+					  EFI_VARIABLE_BOOTSERVICE_ACCESS
+					  | EFI_VARIABLE_RUNTIME_ACCESS,
+					  FullDataSize, FullData);
 		if (efi_status != EFI_SUCCESS) {
 			perror(L"Failed to set MokListRT: %r\n", efi_status);
 		}
@@ -2147,11 +3027,10 @@ EFI_STATUS mirror_mok_list_x()
 	if (efi_status != EFI_SUCCESS)
 		return efi_status;
 
-	efi_status = uefi_call_wrapper(RT->SetVariable, 5, L"MokListXRT",
-				       &shim_lock_guid,
-				       EFI_VARIABLE_BOOTSERVICE_ACCESS
-				       | EFI_VARIABLE_RUNTIME_ACCESS,
-				       DataSize, Data);
+	efi_status = set_variable(L"MokListXRT", &shim_lock_guid,
+				  EFI_VARIABLE_BOOTSERVICE_ACCESS
+				  | EFI_VARIABLE_RUNTIME_ACCESS,
+				  DataSize, Data);
 	if (efi_status != EFI_SUCCESS) {
 		console_error(L"Failed to set MokListRT", efi_status);
 	}
@@ -2178,21 +3057,18 @@ EFI_STATUS mirror_mok_sb_state()
 		efi_status = get_variable(L"MokSBStateRT", &Data_RT,
 					  &DataSize_RT, shim_lock_guid);
 		if (efi_status == EFI_SUCCESS) {
-			efi_status = uefi_call_wrapper(RT->SetVariable, 5,
-						L"MokSBStateRT",
-						&shim_lock_guid,
-						EFI_VARIABLE_BOOTSERVICE_ACCESS
-						| EFI_VARIABLE_RUNTIME_ACCESS
-						| EFI_VARIABLE_NON_VOLATILE,
-						0, NULL);
+			efi_status = set_variable(L"MokSBStateRT",
+						  &shim_lock_guid,
+						  EFI_VARIABLE_BOOTSERVICE_ACCESS
+						  | EFI_VARIABLE_RUNTIME_ACCESS
+						  | EFI_VARIABLE_NON_VOLATILE,
+						  0, NULL);
 		}
 
-		efi_status = uefi_call_wrapper(RT->SetVariable, 5,
-					       L"MokSBStateRT",
-					       &shim_lock_guid,
-					       EFI_VARIABLE_BOOTSERVICE_ACCESS
-					       | EFI_VARIABLE_RUNTIME_ACCESS,
-					       DataSize, Data);
+		efi_status = set_variable(L"MokSBStateRT", &shim_lock_guid,
+					  EFI_VARIABLE_BOOTSERVICE_ACCESS
+					  | EFI_VARIABLE_RUNTIME_ACCESS,
+					  DataSize, Data);
 		if (efi_status != EFI_SUCCESS) {
 			console_error(L"Failed to set MokSBStateRT", efi_status);
 		}
@@ -2211,9 +3087,8 @@ static BOOLEAN check_var(CHAR16 *varname)
 	UINT32 MokVar;
 	UINT32 attributes;
 
-	efi_status = uefi_call_wrapper(RT->GetVariable, 5, varname,
-				       &shim_lock_guid, &attributes,
-				       &size, (void *)&MokVar);
+	efi_status = read_variable(varname, &shim_lock_guid, &attributes,
+				   &size, (void *)&MokVar);
 
 	if (efi_status == EFI_SUCCESS || efi_status == EFI_BUFFER_TOO_SMALL)
 		return TRUE;
@@ -2240,6 +3115,10 @@ EFI_STATUS check_mok_request(EFI_HANDLE image_handle)
 			perror(L"Failed to start MokManager: %r\n", efi_status);
 			return efi_status;
 		}
+
+		/* MokManager may have changed MokList or MokListX */
+		if (secure_mode())
+			return load_trust_store();
 	}
 
 	return EFI_SUCCESS;
@@ -2259,8 +3138,8 @@ static EFI_STATUS check_mok_sb (void)
 	user_insecure_mode = 0;
 	ignore_db = 0;
 
-	status = uefi_call_wrapper(RT->GetVariable, 5, L"MokSBState", &shim_lock_guid,
-				   &attributes, &MokSBStateSize, &MokSBState);
+	status = read_variable(L"MokSBState", &shim_lock_guid, &attributes,
+			       &MokSBStateSize, &MokSBState);
 	if (status != EFI_SUCCESS)
 		return EFI_SECURITY_VIOLATION;
 
@@ -2270,7 +3149,7 @@ static EFI_STATUS check_mok_sb (void)
 	 */
 	if (attributes & EFI_VARIABLE_RUNTIME_ACCESS) {
 		perror(L"MokSBState is compromised! Clearing it\n");
-		if (LibDeleteVariable(L"MokSBState", &shim_lock_guid) != EFI_SUCCESS) {
+		if (delete_variable(L"MokSBState", &shim_lock_guid) != EFI_SUCCESS) {
 			perror(L"Failed to erase MokSBState\n");
 		}
 		status = EFI_SECURITY_VIOLATION;
@@ -2295,8 +3174,8 @@ static EFI_STATUS check_mok_db (void)
 	UINTN MokDBStateSize = sizeof(MokDBState);
 	UINT32 attributes;
 
-	status = uefi_call_wrapper(RT->GetVariable, 5, L"MokDBState", &shim_lock_guid,
-				   &attributes, &MokDBStateSize, &MokDBState);
+	status = read_variable(L"MokDBState", &shim_lock_guid, &attributes,
+			       &MokDBStateSize, &MokDBState);
 	if (status != EFI_SUCCESS)
 		return EFI_SECURITY_VIOLATION;
 
@@ -2308,7 +3187,7 @@ static EFI_STATUS check_mok_db (void)
 	 */
 	if (attributes & EFI_VARIABLE_RUNTIME_ACCESS) {
 		perror(L"MokDBState is compromised! Clearing it\n");
-		if (LibDeleteVariable(L"MokDBState", &shim_lock_guid) != EFI_SUCCESS) {
+		if (delete_variable(L"MokDBState", &shim_lock_guid) != EFI_SUCCESS) {
 			perror(L"Failed to erase MokDBState\n");
 		}
 		status = EFI_SECURITY_VIOLATION;
@@ -2331,11 +3210,10 @@ static EFI_STATUS mok_ignore_db()
 	check_mok_db();
 
 	if (ignore_db) {
-		efi_status = uefi_call_wrapper(RT->SetVariable, 5, L"MokIgnoreDB",
-				&shim_lock_guid,
-				EFI_VARIABLE_BOOTSERVICE_ACCESS
-				| EFI_VARIABLE_RUNTIME_ACCESS,
-				DataSize, (void *)&Data);
+		efi_status = set_variable(L"MokIgnoreDB", &shim_lock_guid,
+					  EFI_VARIABLE_BOOTSERVICE_ACCESS
+					  | EFI_VARIABLE_RUNTIME_ACCESS,
+					  DataSize, (void *)&Data);
 		if (efi_status != EFI_SUCCESS) {
 			perror(L"Failed to set MokIgnoreDB: %r\n", efi_status);
 		}
@@ -2718,6 +3596,13 @@ init_openssl(void)
 	ERR_load_RAND_strings();
 	ERR_load_DSO_strings();
 	ERR_load_OCSP_strings();
+
+	/*
+	 * Before any keys are parsed, since they keep the RSA method they
+	 * were created with
+	 */
+	if (!RsaFastVerifyInit())
+		LogError(L"Could not install the fast RSA verification method\n");
 }
 
 static SHIM_LOCK shim_lock_interface;
@@ -2785,9 +3670,34 @@ shim_init(void)
 	dprinta(shim_version);
 
 	/* Set the second stage loader */
+	timeline_mark("set_second_stage");
 	set_second_stage (global_image_handle);
 
+	find_hash_algorithms();
+
+	/*
+	 * Start reading the second stage now, so that it can come in while
+	 * the rest of shim's setup happens
+	 */
+	prefetch_second_stage(global_image_handle);
+
+	/*
+	 * OpenSSL is set up while the second stage is being read
+	 */
+	timeline_mark("init_openssl");
+	init_openssl();
+
 	if (secure_mode()) {
+		timeline_mark("load_trust_store");
+
+		/*
+		 * Parse the certificates images are verified against once,
+		 * rather than for every image
+		 */
+		status = load_trust_store();
+		if (status != EFI_SUCCESS)
+			return status;
+
 		if (vendor_cert_size || vendor_dbx_size) {
 			/*
 			 * If shim includes its own certificates then ensure
@@ -2808,6 +3718,21 @@ shim_init(void)
 void
 shim_fini(void)
 {
+	/*
+	 * Drop the prefetched second stage if nothing used it
+	 */
+	prefetch_discard();
+
+#if defined(ENABLE_HTTPBOOT)
+	/*
+	 * Don't leave an HTTP connection behind if the second stage failed
+	 * to start, or returned
+	 */
+	httpboot_session_close();
+#endif
+
+	trust_store_free();
+
 	if (secure_mode()) {
 		/*
 		 * Remove our protocols
@@ -2885,6 +3810,8 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 	EFI_STATUS efi_status;
 	EFI_HANDLE image_handle;
 
+	timeline_mark("init");
+
 	verification_method = VERIFIED_BY_NOTHING;
 
 	vendor_cert_size = cert_table.vendor_cert_size;
@@ -2908,7 +3835,15 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 	 */
 	InitializeLib(image_handle, systab);
 
-	init_openssl();
+	/*
+	 * Read the variables we care about once, rather than asking the
+	 * firmware every time
+	 */
+	efi_status = variable_snapshot_init(snapshot_filters,
+					    sizeof(snapshot_filters) /
+					    sizeof(snapshot_filters[0]));
+	if (efi_status != EFI_SUCCESS)
+		dprint(L"Could not take a variable snapshot: %r\n", efi_status);
 
 	/*
 	 * if SHIM_DEBUG is set, wait for a debugger to attach.
@@ -2918,6 +3853,7 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 	/*
 	 * Measure the MOK variables
 	 */
+	timeline_mark("measure_mok");
 	efi_status = measure_mok();
 	if (efi_status != EFI_SUCCESS && efi_status != EFI_NOT_FOUND) {
 		Print(L"Something has gone seriously wrong: %r\n", efi_status);
@@ -2932,6 +3868,7 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 	 * Check whether the user has configured the system to run in
 	 * insecure mode
 	 */
+	timeline_mark("check_mok_sb");
 	check_mok_sb();
 
 	efi_status = shim_init();
@@ -2955,12 +3892,14 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 	/*
 	 * Enter MokManager if necessary
 	 */
+	timeline_mark("check_mok_request");
 	efi_status = check_mok_request(image_handle);
 
 	/*
 	 * Copy the MOK list to a runtime variable so the kernel can
 	 * make use of it
 	 */
+	timeline_mark("mirror_mok");
 	efi_status = mirror_mok_list();
 
 	efi_status = mirror_mok_list_x();
@@ -2980,6 +3919,7 @@ efi_main (EFI_HANDLE passed_image_handle, EFI_SYSTEM_TABLE *passed_systab)
 	/*
 	 * Hand over control to the second stage bootloader
 	 */
+	timeline_mark("init_grub");
 	efi_status = init_grub(image_handle);
 
 	shim_fini();
@@ -4,6 +4,7 @@
 #include <efi.h>
 #include <efilib.h>
 
+#include "fwtrace.h"
 #include "PeImage.h"
 
 extern EFI_GUID SHIM_LOCK_GUID;
@@ -112,6 +113,9 @@ extern VOID ClearErrors(VOID);
 #include "httpboot.h"
 #include "replacements.h"
 #include "tpm.h"
+#include "trust.h"
+#include "verify_cache.h"
+#include "timeline.h"
 #include "ucs2.h"
 
 #include "guid.h"
@@ -0,0 +1,194 @@
+/*
+ * Print how long each step of the last boot took in shim, from the
+ * ShimBootTimeline variable it leaves behind, and what firmware calls it
+ * made if it was built with ENABLE_FW_TRACE.  See timeline.h and
+ * include/fwtrace.h for the formats.
+ *
+ * usage: showtimeline [efivarfs directory]
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define EFIVARFS		"/sys/firmware/efi/efivars"
+#define SHIM_LOCK_GUID		"605dab50-e046-4300-abb6-3dd810dd8b23"
+
+#define TIMELINE_VERSION	1
+#define TIMELINE_HEADER_SIZE	16	/* version, count, ticks_per_second */
+#define TIMELINE_NAME_SIZE	24
+#define TIMELINE_ENTRY_SIZE	(8 + TIMELINE_NAME_SIZE)
+
+#define FW_TRACE_VERSION	1
+#define FW_TRACE_HEADER_SIZE	32	/* and total_calls, total_ticks */
+#define FW_TRACE_NAME_SIZE	32
+#define FW_TRACE_ENTRY_SIZE	(FW_TRACE_NAME_SIZE + 3 * 8)
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+/*
+ * Read a variable from efivarfs, leaving out the attributes at the start.
+ * Returns NULL if it doesn't exist.
+ */
+static uint8_t *read_variable(const char *dir, const char *name,
+			      size_t *sizep)
+{
+	char path[4096];
+	FILE *f;
+	uint8_t *buf = NULL;
+	size_t size = 0, alloc = 0, n;
+
+	snprintf(path, sizeof(path), "%s/%s-%s", dir, name, SHIM_LOCK_GUID);
+	f = fopen(path, "rb");
+	if (!f) {
+		if (errno == ENOENT)
+			return NULL;
+		err(1, "Could not open \"%s\"", path);
+	}
+
+	do {
+		if (size == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			buf = realloc(buf, alloc);
+			if (!buf)
+				err(1, "Could not allocate memory");
+		}
+		n = fread(buf + size, 1, alloc - size, f);
+		size += n;
+	} while (n > 0);
+
+	if (ferror(f))
+		err(1, "Could not read \"%s\"", path);
+	fclose(f);
+
+	if (size < 4)
+		errx(1, "\"%s\" is too short", path);
+
+	*sizep = size - 4;
+	memmove(buf, buf + 4, size - 4);
+	return buf;
+}
+
+static double ms(uint64_t ticks, uint64_t ticks_per_second)
+{
+	return (double)ticks * 1000.0 / (double)ticks_per_second;
+}
+
+static void show_timeline(const uint8_t *data, size_t size)
+{
+	uint32_t count, i;
+	uint64_t frequency, first, last, ticks;
+	const uint8_t *entry;
+	char name[TIMELINE_NAME_SIZE];
+
+	if (size < TIMELINE_HEADER_SIZE ||
+	    get_le32(data) != TIMELINE_VERSION)
+		errx(1, "ShimBootTimeline has an unknown format");
+
+	count = get_le32(data + 4);
+	frequency = get_le64(data + 8);
+	if (count == 0 || frequency == 0 ||
+	    size != TIMELINE_HEADER_SIZE + (size_t)count * TIMELINE_ENTRY_SIZE)
+		errx(1, "ShimBootTimeline is malformed");
+
+	data += TIMELINE_HEADER_SIZE;
+	first = get_le64(data);
+	last = get_le64(data + (count - 1) * TIMELINE_ENTRY_SIZE);
+
+	printf("shim started %.3f ms after reset\n\n", ms(first, frequency));
+	printf("%12s %12s  %s\n", "at (ms)", "took (ms)", "step");
+	for (i = 0; i < count; i++) {
+		entry = data + i * TIMELINE_ENTRY_SIZE;
+		ticks = get_le64(entry);
+		memcpy(name, entry + 8, sizeof(name));
+		name[sizeof(name) - 1] = '\0';
+
+		if (i + 1 < count)
+			printf("%12.3f %12.3f  %s\n", ms(ticks - first, frequency),
+			       ms(get_le64(entry + TIMELINE_ENTRY_SIZE) - ticks,
+				  frequency), name);
+		else
+			printf("%12.3f %12s  %s\n", ms(ticks - first, frequency),
+			       "", name);
+	}
+	printf("\nshim took %.3f ms before starting the next stage\n",
+	       ms(last - first, frequency));
+}
+
+static void show_fw_trace(const uint8_t *data, size_t size)
+{
+	uint32_t count, i;
+	uint64_t frequency;
+	const uint8_t *entry;
+	char name[FW_TRACE_NAME_SIZE];
+
+	if (size < FW_TRACE_HEADER_SIZE || get_le32(data) != FW_TRACE_VERSION)
+		errx(1, "ShimFirmwareTrace has an unknown format");
+
+	count = get_le32(data + 4);
+	frequency = get_le64(data + 8);
+	if (frequency == 0 ||
+	    size != FW_TRACE_HEADER_SIZE + (size_t)count * FW_TRACE_ENTRY_SIZE)
+		errx(1, "ShimFirmwareTrace is malformed");
+
+	printf("\n%llu firmware calls took %.3f ms\n\n",
+	       (unsigned long long)get_le64(data + 16),
+	       ms(get_le64(data + 24), frequency));
+	printf("%8s %12s %12s  %s\n", "calls", "took (ms)", "slowest (ms)",
+	       "service");
+
+	data += FW_TRACE_HEADER_SIZE;
+	for (i = 0; i < count; i++) {
+		entry = data + i * FW_TRACE_ENTRY_SIZE;
+		memcpy(name, entry, sizeof(name));
+		name[sizeof(name) - 1] = '\0';
+		printf("%8llu %12.3f %12.3f  %s\n",
+		       (unsigned long long)get_le64(entry + FW_TRACE_NAME_SIZE),
+		       ms(get_le64(entry + FW_TRACE_NAME_SIZE + 8), frequency),
+		       ms(get_le64(entry + FW_TRACE_NAME_SIZE + 16), frequency),
+		       name);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = EFIVARFS;
+	uint8_t *data;
+	size_t size;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [efivarfs directory]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2)
+		dir = argv[1];
+
+	data = read_variable(dir, "ShimBootTimeline", &size);
+	if (!data)
+		errx(1, "No ShimBootTimeline in %s; was this boot via shim?",
+		     dir);
+	show_timeline(data, size);
+	free(data);
+
+	data = read_variable(dir, "ShimFirmwareTrace", &size);
+	if (data) {
+		show_fw_trace(data, size);
+		free(data);
+	}
+
+	return 0;
+}
@@ -0,0 +1,490 @@
+/*
+ * Benchmark of shim's image loading path: the header checks, Authenticode
+ * hash, signature verification against the trust store and relocation
+ * that every image shim starts goes through, run on the build host
+ * against the mock firmware in firmware.c (see harness.h).  For each image
+ * it prints the throughput, the time each step took and how many firmware
+ * calls and allocations were made, and the same for loading the trust
+ * store.
+ *
+ * usage: bench-verify [-qRsv] [-n iterations] [-d db] [-x dbx] [-m MokList]
+ *		       [-X MokListX] [-H hashes] image...
+ *
+ * The trust store files can be EFI_SIGNATURE_LISTs or DER certificates,
+ * and each option can be given more than once.  -H adds that many random
+ * SHA-256 hashes to dbx, to see how its size matters.  Each image is
+ * loaded the given number of times and the fastest run is reported.  -s
+ * leaves out shim's variable snapshot, so every variable read goes to the
+ * firmware, -q hides what shim prints and -v makes shim verbose and lists
+ * every step and firmware service for each image.  -R gives MokList
+ * runtime access, as if something other than MokManager had written it,
+ * and fails unless shim erases it.
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+#define EFI_VARIABLE_NON_VOLATILE				0x00000001
+#define EFI_VARIABLE_BOOTSERVICE_ACCESS				0x00000002
+#define EFI_VARIABLE_RUNTIME_ACCESS				0x00000004
+#define EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS	0x00000020
+
+#define SHA256_DIGEST_SIZE	32
+
+typedef struct {
+	uint32_t data1;
+	uint16_t data2;
+	uint16_t data3;
+	uint8_t data4[8];
+} guid_t;
+
+typedef struct {
+	guid_t type;
+	uint32_t list_size;
+	uint32_t header_size;
+	uint32_t signature_size;
+} __attribute__((packed)) signature_list_t;
+
+static const guid_t cert_x509_guid = {
+	0xa5c059a1, 0x94e4, 0x4aa7, { 0x87, 0xb5, 0xab, 0x15, 0x5c, 0x2b, 0xf0, 0x72 }
+};
+static const guid_t cert_sha256_guid = {
+	0xc1c41626, 0x504c, 0x4092, { 0xac, 0xa9, 0x41, 0xf9, 0x36, 0x93, 0x43, 0x28 }
+};
+
+typedef struct {
+	const char *name;
+	int guid;
+	unsigned int attributes;
+	unsigned char *data;
+	size_t size;
+	unsigned int files;
+} trust_var_t;
+
+enum { DB, DBX, MOK_LIST, MOK_LIST_X, TRUST_VARS };
+
+static trust_var_t trust_vars[TRUST_VARS] = {
+	[DB] = { "db", HARNESS_VARIABLE_SECURITY,
+		 EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+		 EFI_VARIABLE_RUNTIME_ACCESS |
+		 EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS },
+	[DBX] = { "dbx", HARNESS_VARIABLE_SECURITY,
+		  EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+		  EFI_VARIABLE_RUNTIME_ACCESS |
+		  EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS },
+	[MOK_LIST] = { "MokList", HARNESS_VARIABLE_SHIM_LOCK,
+		       EFI_VARIABLE_NON_VOLATILE |
+		       EFI_VARIABLE_BOOTSERVICE_ACCESS },
+	[MOK_LIST_X] = { "MokListX", HARNESS_VARIABLE_SHIM_LOCK,
+			 EFI_VARIABLE_NON_VOLATILE |
+			 EFI_VARIABLE_BOOTSERVICE_ACCESS },
+};
+
+static int quiet;
+
+void *
+harness_host_alloc(unsigned long size, unsigned long align)
+{
+	void *p;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (posix_memalign(&p, align, size ? size : 1))
+		return NULL;
+	return p;
+}
+
+void
+harness_host_free(void *p)
+{
+	free(p);
+}
+
+void
+harness_host_print(const char *text, unsigned long len)
+{
+	if (!quiet)
+		fwrite(text, 1, len, stderr);
+}
+
+unsigned long long
+harness_host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned char *
+read_file(const char *path, size_t *size)
+{
+	unsigned char *data = NULL;
+	size_t alloc = 0, n;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		err(1, "Could not open %s", path);
+
+	*size = 0;
+	do {
+		if (*size == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			data = realloc(data, alloc);
+			if (!data)
+				err(1, "Could not allocate memory");
+		}
+		n = fread(data + *size, 1, alloc - *size, f);
+		*size += n;
+	} while (n);
+
+	if (ferror(f))
+		err(1, "Could not read %s", path);
+	fclose(f);
+	return data;
+}
+
+/*
+ * Append one EFI_SIGNATURE_LIST of count signatures of the given size to
+ * a variable, and return where the first signature's data goes
+ */
+static unsigned char *
+add_signature_list(trust_var_t *var, const guid_t *type,
+		   size_t signature_size, size_t count)
+{
+	size_t entry_size = sizeof(guid_t) + signature_size;
+	size_t list_size = sizeof(signature_list_t) + entry_size * count;
+	signature_list_t *list;
+	unsigned char *data;
+
+	if (list_size > UINT32_MAX)
+		errx(1, "Signature list for %s is too big", var->name);
+
+	data = realloc(var->data, var->size + list_size);
+	if (!data)
+		err(1, "Could not allocate memory");
+	var->data = data;
+
+	list = (signature_list_t *)(var->data + var->size);
+	memset(list, 0, list_size);
+	list->type = *type;
+	list->list_size = list_size;
+	list->header_size = 0;
+	list->signature_size = entry_size;
+	var->size += list_size;
+
+	/* every signature is owned by the all zero GUID */
+	return (unsigned char *)(list + 1) + sizeof(guid_t);
+}
+
+/*
+ * A DER certificate is a SEQUENCE, and no EFI_SIGNATURE_LIST type GUID in
+ * use starts with that byte
+ */
+static void
+add_file(trust_var_t *var, const char *path)
+{
+	unsigned char *data, *sig;
+	size_t size;
+
+	data = read_file(path, &size);
+	if (size >= 2 && data[0] == 0x30 && data[1] >= 0x80) {
+		sig = add_signature_list(var, &cert_x509_guid, size, 1);
+		memcpy(sig, data, size);
+	} else {
+		sig = realloc(var->data, var->size + size);
+		if (!sig)
+			err(1, "Could not allocate memory");
+		var->data = sig;
+		memcpy(var->data + var->size, data, size);
+		var->size += size;
+	}
+	var->files++;
+	free(data);
+}
+
+static void
+add_random_hashes(trust_var_t *var, size_t count)
+{
+	size_t entry = sizeof(guid_t) + SHA256_DIGEST_SIZE, i, j;
+	unsigned char *sig;
+
+	if (!count)
+		return;
+
+	sig = add_signature_list(var, &cert_sha256_guid, SHA256_DIGEST_SIZE,
+				 count);
+	for (i = 0; i < count; i++, sig += entry) {
+		for (j = 0; j < SHA256_DIGEST_SIZE; j++)
+			sig[j] = rand();
+	}
+}
+
+static void
+set_variable(const char *name, int guid, unsigned int attributes,
+	     const void *data, size_t size)
+{
+	unsigned long long status;
+
+	status = harness_set_variable(name, guid, attributes, data, size);
+	if (status)
+		errx(1, "Could not set %s: 0x%llx", name, status);
+}
+
+static const char *
+status_string(unsigned long long status)
+{
+	static char buf[32];
+
+	switch (status & ~(1ULL << 63)) {
+	case 0: return "ok";
+	case 1: return "load error";
+	case 2: return "invalid";
+	case 3: return "unsupported";
+	case 9: return "no memory";
+	case 14: return "not found";
+	case 15: return "denied";
+	case 26: return "violation";
+	}
+	snprintf(buf, sizeof(buf), "0x%llx", status);
+	return buf;
+}
+
+static unsigned long long
+total_calls(const struct harness_stats *stats)
+{
+	unsigned long long total = 0;
+	unsigned int i;
+
+	for (i = 0; i < HARNESS_SERVICES; i++)
+		total += stats->calls[i];
+	return total;
+}
+
+static unsigned long long
+step_ns(const struct harness_stats *stats, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < stats->nsteps; i++) {
+		if (!strcmp(stats->steps[i].name, name))
+			return stats->steps[i].ns;
+	}
+	return 0;
+}
+
+static void
+print_details(const struct harness_stats *stats)
+{
+	unsigned int i;
+
+	for (i = 0; i < stats->nsteps; i++)
+		printf("    %-24s %10.1f us\n", stats->steps[i].name,
+		       stats->steps[i].ns / 1e3);
+	for (i = 0; i < HARNESS_SERVICES; i++) {
+		if (stats->calls[i])
+			printf("    %-24s %10llu calls\n",
+			       harness_service_name(i), stats->calls[i]);
+	}
+	printf("    pool: %llu allocations, %llu KiB, peak %llu KiB\n",
+	       stats->pool_allocations, stats->pool_bytes / 1024,
+	       stats->pool_peak / 1024);
+	printf("    pages: %llu allocations, %llu pages\n",
+	       stats->page_allocations, stats->pages);
+	printf("    crypto: %llu allocations, %llu reallocs (%llu bytes copied)\n",
+	       stats->crypt_allocations, stats->crypt_reallocs,
+	       stats->crypt_bytes_copied);
+	printf("    arena: %llu allocations, %llu from the pool, peak so far %llu KiB\n",
+	       stats->arena_allocations, stats->arena_fallbacks,
+	       stats->arena_peak / 1024);
+}
+
+/*
+ * Things real firmware wouldn't have been so forgiving about
+ */
+static void
+check_leftovers(const char *name, const struct harness_stats *stats)
+{
+	if (stats->pool_bad_frees)
+		printf("%s: %llu FreePool() calls on memory that wasn't from the pool\n",
+		       name, stats->pool_bad_frees);
+	if (stats->status && stats->pages_left)
+		printf("%s: %llu pages still allocated after the load failed\n",
+		       name, stats->pages_left);
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-qRsv] [-n iterations] [-d db] [-x dbx] [-m MokList]\n"
+		"\t\t[-X MokListX] [-H hashes] image...\n", name);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct harness_stats stats, best;
+	unsigned long long status, hashes = 0, total_ns = 0, total_bytes = 0;
+	unsigned int iterations = 5, i, failures = 0;
+	int snapshot = 1, verbosity = 0, planted = 0, c, v;
+	unsigned int attributes;
+	unsigned long mok_size;
+	unsigned char secure_boot = 1, setup_mode = 0;
+	unsigned char *image, *copy;
+	const char *name;
+	size_t size;
+
+	while ((c = getopt(argc, argv, "d:x:m:X:H:n:qRsv")) != -1) {
+		switch (c) {
+		case 'd':
+			add_file(&trust_vars[DB], optarg);
+			break;
+		case 'x':
+			add_file(&trust_vars[DBX], optarg);
+			break;
+		case 'm':
+			add_file(&trust_vars[MOK_LIST], optarg);
+			break;
+		case 'X':
+			add_file(&trust_vars[MOK_LIST_X], optarg);
+			break;
+		case 'H':
+			hashes = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			if (!iterations)
+				iterations = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'R':
+			planted = 1;
+			break;
+		case 's':
+			snapshot = 0;
+			break;
+		case 'v':
+			verbosity = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	if (planted) {
+		if (!trust_vars[MOK_LIST].size)
+			errx(1, "-R needs a MokList to plant");
+		trust_vars[MOK_LIST].attributes |= EFI_VARIABLE_RUNTIME_ACCESS;
+	}
+
+	srand(1);
+	add_random_hashes(&trust_vars[DBX], hashes);
+
+	set_variable("SecureBoot", HARNESS_VARIABLE_GLOBAL,
+		     EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+		     &secure_boot, sizeof(secure_boot));
+	set_variable("SetupMode", HARNESS_VARIABLE_GLOBAL,
+		     EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+		     &setup_mode, sizeof(setup_mode));
+	for (v = 0; v < TRUST_VARS; v++) {
+		if (trust_vars[v].size)
+			set_variable(trust_vars[v].name, trust_vars[v].guid,
+				     trust_vars[v].attributes,
+				     trust_vars[v].data, trust_vars[v].size);
+	}
+
+	status = harness_init(snapshot, verbosity);
+	if (status)
+		errx(1, "shim is not in secure mode: %s", status_string(status));
+
+	status = harness_load_trust_store(&stats);
+	printf("trust store:");
+	for (v = 0; v < TRUST_VARS; v++)
+		printf(" %s %zu bytes%s", trust_vars[v].name,
+		       trust_vars[v].size, v < TRUST_VARS - 1 ? "," : "");
+	if (hashes)
+		printf(" (%llu random hashes in dbx)", hashes);
+	printf("\n  %s in %.1f us, %llu firmware calls, %llu pool allocations (%llu KiB), %llu crypto allocations\n",
+	       status_string(status), stats.ns / 1e3, total_calls(&stats),
+	       stats.pool_allocations, stats.pool_bytes / 1024,
+	       stats.crypt_allocations);
+	if (verbosity)
+		print_details(&stats);
+	check_leftovers("trust store", &stats);
+	if (status)
+		return 1;
+
+	printf("%-20s %8s %-11s %8s %9s %9s %9s %9s %6s %6s %6s %6s\n",
+	       "image", "KiB", "result", "MB/s", "total us", "hash us",
+	       "verify us", "reloc us", "calls", "pool", "crypto", "arena");
+
+	for (; optind < argc; optind++) {
+		image = read_file(argv[optind], &size);
+		name = strrchr(argv[optind], '/');
+		name = name ? name + 1 : argv[optind];
+
+		/*
+		 * shim writes the load address into the headers of the file
+		 * it was given, so each load needs a freshly read copy
+		 */
+		copy = malloc(size);
+		if (!copy)
+			err(1, "%s", argv[optind]);
+		for (i = 0; i < iterations; i++) {
+			memcpy(copy, image, size);
+			status = harness_load_image(copy, size, &stats);
+			if (i == 0 || stats.ns < best.ns)
+				best = stats;
+		}
+		free(copy);
+		free(image);
+
+		printf("%-20.20s %8zu %-11s %8.1f %9.1f %9.1f %9.1f %9.1f %6llu %6llu %6llu %6llu\n",
+		       name, size / 1024, status_string(status),
+		       best.ns ? size * 1e3 / best.ns : 0.0, best.ns / 1e3,
+		       step_ns(&best, "hash") / 1e3,
+		       step_ns(&best, "verify") / 1e3,
+		       step_ns(&best, "relocate") / 1e3, total_calls(&best),
+		       best.pool_allocations, best.crypt_allocations,
+		       best.arena_allocations);
+		if (verbosity)
+			print_details(&best);
+		check_leftovers(name, &best);
+
+		if (status)
+			failures++;
+		total_ns += best.ns;
+		total_bytes += size;
+	}
+
+	if (planted &&
+	    !harness_get_variable("MokList", HARNESS_VARIABLE_SHIM_LOCK,
+				  &attributes, &mok_size)) {
+		printf("MokList with runtime access wasn't erased (attributes 0x%x, %lu bytes)\n",
+		       attributes, mok_size);
+		failures++;
+	}
+
+	if (total_ns)
+		printf("%-20s %8llu %-11s %8.1f %9.1f\n", "total",
+		       total_bytes / 1024, failures ? "failures" : "ok",
+		       total_bytes * 1e3 / total_ns, total_ns / 1e3);
+
+	harness_fini();
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,641 @@
+/*
+ * firmware.c - a mock of the UEFI services shim's image loading path uses
+ *
+ * Boot services, runtime services and the console are all here, each call
+ * counted against the service it went to.  Memory comes from the host
+ * program, variables live in a list in memory, there are no protocols
+ * other than the loaded image one on the image's own handle, and the
+ * console "presses" enter whenever it is asked for a key, so that error
+ * boxes go away again by themselves.  Anything else fails with
+ * EFI_UNSUPPORTED.
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "firmware.h"
+
+/*
+ * tpm.c expects shim.c to share this, but shim.c has its own static copy,
+ * so in shim itself the reference is never resolved; give it something to
+ * point at here.
+ */
+UINT8 in_protocol;
+
+/* normally from the linker script, and only printed by debug_hook() */
+char _text, _data;
+
+firmware_counters_t firmware_counters;
+
+#define count(service)	(firmware_counters.calls[(service)]++)
+
+static const char *service_names[HARNESS_SERVICES] = {
+	[HARNESS_ALLOCATE_POOL] = "AllocatePool",
+	[HARNESS_FREE_POOL] = "FreePool",
+	[HARNESS_ALLOCATE_PAGES] = "AllocatePages",
+	[HARNESS_FREE_PAGES] = "FreePages",
+	[HARNESS_HANDLE_PROTOCOL] = "HandleProtocol",
+	[HARNESS_LOCATE_HANDLE_BUFFER] = "LocateHandleBuffer",
+	[HARNESS_LOCATE_PROTOCOL] = "LocateProtocol",
+	[HARNESS_WAIT_FOR_EVENT] = "WaitForEvent",
+	[HARNESS_STALL] = "Stall",
+	[HARNESS_GET_VARIABLE] = "GetVariable",
+	[HARNESS_GET_NEXT_VARIABLE_NAME] = "GetNextVariableName",
+	[HARNESS_SET_VARIABLE] = "SetVariable",
+	[HARNESS_GET_TIME] = "GetTime",
+	[HARNESS_OUTPUT_STRING] = "OutputString",
+	[HARNESS_CONSOLE] = "(console)",
+	[HARNESS_OTHER] = "(other)",
+};
+
+const char *
+harness_service_name(unsigned int service)
+{
+	if (service >= HARNESS_SERVICES)
+		return NULL;
+	return service_names[service];
+}
+
+static EFI_HANDLE image_handle;
+static EFI_LOADED_IMAGE *loaded_image;
+
+/*
+ * Memory
+ */
+#define POOL_MAGIC	0x6c6f6f506b636f4dULL	/* "MockPool" */
+
+typedef struct {
+	UINT64 magic;
+	UINT64 size;
+} pool_header_t;
+
+typedef struct page_allocation {
+	struct page_allocation *next;
+	EFI_PHYSICAL_ADDRESS address;
+	UINTN pages;
+} page_allocation_t;
+
+static page_allocation_t *page_allocations;
+
+static EFI_STATUS EFIAPI
+allocate_pool(EFI_MEMORY_TYPE type, UINTN size, VOID **buffer)
+{
+	pool_header_t *header;
+
+	count(HARNESS_ALLOCATE_POOL);
+	if (!buffer)
+		return EFI_INVALID_PARAMETER;
+
+	header = harness_host_alloc(sizeof(*header) + size, 16);
+	if (!header)
+		return EFI_OUT_OF_RESOURCES;
+	header->magic = POOL_MAGIC;
+	header->size = size;
+	*buffer = header + 1;
+
+	firmware_counters.pool_allocations++;
+	firmware_counters.pool_bytes += size;
+	firmware_counters.pool_live += size;
+	if (firmware_counters.pool_live > firmware_counters.pool_peak)
+		firmware_counters.pool_peak = firmware_counters.pool_live;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Real firmware might crash on a buffer that didn't come from the pool;
+ * this one counts it and carries on.
+ */
+static EFI_STATUS EFIAPI
+free_pool(VOID *buffer)
+{
+	pool_header_t *header = (pool_header_t *)buffer - 1;
+
+	count(HARNESS_FREE_POOL);
+	if (!buffer || header->magic != POOL_MAGIC) {
+		firmware_counters.pool_bad_frees++;
+		return EFI_INVALID_PARAMETER;
+	}
+
+	header->magic = 0;
+	firmware_counters.pool_live -= header->size;
+	harness_host_free(header);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+allocate_pages(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE memory_type,
+	       UINTN pages, EFI_PHYSICAL_ADDRESS *memory)
+{
+	page_allocation_t *allocation;
+	VOID *buffer;
+
+	count(HARNESS_ALLOCATE_PAGES);
+	if (!memory || !pages)
+		return EFI_INVALID_PARAMETER;
+	if (type == AllocateAddress)
+		return EFI_NOT_FOUND;
+
+	allocation = harness_host_alloc(sizeof(*allocation), 16);
+	if (!allocation)
+		return EFI_OUT_OF_RESOURCES;
+	buffer = harness_host_alloc(pages * EFI_PAGE_SIZE, EFI_PAGE_SIZE);
+	if (!buffer) {
+		harness_host_free(allocation);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	allocation->address = (EFI_PHYSICAL_ADDRESS)(UINTN)buffer;
+	allocation->pages = pages;
+	allocation->next = page_allocations;
+	page_allocations = allocation;
+	*memory = allocation->address;
+
+	firmware_counters.page_allocations++;
+	firmware_counters.pages += pages;
+	firmware_counters.pages_live += pages;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS
+release_pages(page_allocation_t **link)
+{
+	page_allocation_t *allocation = *link;
+
+	*link = allocation->next;
+	firmware_counters.pages_live -= allocation->pages;
+	harness_host_free((VOID *)(UINTN)allocation->address);
+	harness_host_free(allocation);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+free_pages(EFI_PHYSICAL_ADDRESS memory, UINTN pages)
+{
+	page_allocation_t **link;
+
+	count(HARNESS_FREE_PAGES);
+	for (link = &page_allocations; *link; link = &(*link)->next) {
+		if ((*link)->address == memory && (*link)->pages == pages)
+			return release_pages(link);
+	}
+	return EFI_NOT_FOUND;
+}
+
+UINT64
+firmware_release_pages(void)
+{
+	UINT64 pages = firmware_counters.pages_live;
+
+	while (page_allocations)
+		release_pages(&page_allocations);
+	return pages;
+}
+
+/*
+ * Protocols, events and time
+ */
+static EFI_STATUS EFIAPI
+handle_protocol(EFI_HANDLE handle, EFI_GUID *protocol, VOID **interface)
+{
+	EFI_GUID loaded_image_protocol = LOADED_IMAGE_PROTOCOL;
+
+	count(HARNESS_HANDLE_PROTOCOL);
+	if (!protocol || !interface)
+		return EFI_INVALID_PARAMETER;
+	if (handle == image_handle && loaded_image &&
+	    !CompareMem(protocol, &loaded_image_protocol, sizeof(EFI_GUID))) {
+		*interface = loaded_image;
+		return EFI_SUCCESS;
+	}
+	return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI
+locate_handle_buffer(EFI_LOCATE_SEARCH_TYPE search_type, EFI_GUID *protocol,
+		     VOID *search_key, UINTN *no_handles, EFI_HANDLE **buffer)
+{
+	count(HARNESS_LOCATE_HANDLE_BUFFER);
+	if (!no_handles || !buffer)
+		return EFI_INVALID_PARAMETER;
+	*no_handles = 0;
+	*buffer = NULL;
+	return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI
+locate_protocol(EFI_GUID *protocol, VOID *registration, VOID **interface)
+{
+	count(HARNESS_LOCATE_PROTOCOL);
+	if (!interface)
+		return EFI_INVALID_PARAMETER;
+	*interface = NULL;
+	return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI
+wait_for_event(UINTN number_of_events, EFI_EVENT *event, UINTN *index)
+{
+	count(HARNESS_WAIT_FOR_EVENT);
+	if (index)
+		*index = 0;
+	return EFI_SUCCESS;
+}
+
+/*
+ * timestamp_frequency() times one of these, so it has to really wait
+ */
+static EFI_STATUS EFIAPI
+stall(UINTN microseconds)
+{
+	unsigned long long end;
+
+	count(HARNESS_STALL);
+	end = harness_host_ns() + microseconds * 1000ULL;
+	while (harness_host_ns() < end)
+		;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+get_time(EFI_TIME *time, EFI_TIME_CAPABILITIES *capabilities)
+{
+	count(HARNESS_GET_TIME);
+	if (!time)
+		return EFI_INVALID_PARAMETER;
+	ZeroMem(time, sizeof(*time));
+	time->Year = 2020;
+	time->Month = 1;
+	time->Day = 1;
+	time->TimeZone = EFI_UNSPECIFIED_TIMEZONE;
+	if (capabilities) {
+		capabilities->Resolution = 1;
+		capabilities->Accuracy = 50000000;
+		capabilities->SetsToZero = FALSE;
+	}
+	return EFI_SUCCESS;
+}
+
+/*
+ * Variables
+ */
+typedef struct variable {
+	struct variable *next;
+	CHAR16 *name;
+	EFI_GUID guid;
+	UINT32 attributes;
+	UINTN size;
+	UINT8 *data;
+} variable_t;
+
+static variable_t *variables;
+
+static variable_t **
+find_variable(CHAR16 *name, EFI_GUID *guid)
+{
+	variable_t **link;
+
+	for (link = &variables; *link; link = &(*link)->next) {
+		if (!StrCmp((*link)->name, name) &&
+		    !CompareMem(&(*link)->guid, guid, sizeof(EFI_GUID)))
+			break;
+	}
+	return link;
+}
+
+/*
+ * As in EDK2, a variable that exists can only be written, or deleted, with
+ * the attributes it already has, unless no attributes are given at all.
+ * No size or no access attributes deletes it.
+ */
+EFI_STATUS
+firmware_set_variable(CHAR16 *name, EFI_GUID *guid, UINT32 attributes,
+		      UINTN size, VOID *data)
+{
+	variable_t **link, *var;
+	UINT8 *new_data = NULL;
+	UINTN old_size = 0;
+
+	if (!name || !name[0] || !guid || (size && !data))
+		return EFI_INVALID_PARAMETER;
+
+	link = find_variable(name, guid);
+	var = *link;
+	if (var && attributes &&
+	    (attributes & ~EFI_VARIABLE_APPEND_WRITE) != var->attributes)
+		return EFI_INVALID_PARAMETER;
+
+	if (!(attributes & (EFI_VARIABLE_BOOTSERVICE_ACCESS |
+			    EFI_VARIABLE_RUNTIME_ACCESS)))
+		size = 0;
+	if (!size) {
+		if (!var)
+			return (attributes & EFI_VARIABLE_APPEND_WRITE) ?
+				EFI_SUCCESS : EFI_NOT_FOUND;
+		if (attributes & EFI_VARIABLE_APPEND_WRITE)
+			return EFI_SUCCESS;
+		*link = var->next;
+		harness_host_free(var->data);
+		harness_host_free(var->name);
+		harness_host_free(var);
+		return EFI_SUCCESS;
+	}
+
+	if (var && (attributes & EFI_VARIABLE_APPEND_WRITE))
+		old_size = var->size;
+	new_data = harness_host_alloc(old_size + size, 16);
+	if (!new_data)
+		return EFI_OUT_OF_RESOURCES;
+	if (old_size)
+		CopyMem(new_data, var->data, old_size);
+	CopyMem(new_data + old_size, data, size);
+
+	if (!var) {
+		var = harness_host_alloc(sizeof(*var), 16);
+		if (var)
+			var->name = harness_host_alloc(StrSize(name), 16);
+		if (!var || !var->name) {
+			if (var)
+				harness_host_free(var);
+			harness_host_free(new_data);
+			return EFI_OUT_OF_RESOURCES;
+		}
+		CopyMem(var->name, name, StrSize(name));
+		var->guid = *guid;
+		var->data = NULL;
+		var->next = NULL;
+		*link = var;
+	}
+
+	if (var->data)
+		harness_host_free(var->data);
+	var->attributes = attributes & ~EFI_VARIABLE_APPEND_WRITE;
+	var->data = new_data;
+	var->size = old_size + size;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+firmware_get_variable(CHAR16 *name, EFI_GUID *guid, UINT32 *attributes,
+		      UINTN *size, VOID *data)
+{
+	variable_t *var;
+
+	if (!name || !guid || !size)
+		return EFI_INVALID_PARAMETER;
+
+	var = *find_variable(name, guid);
+	if (!var)
+		return EFI_NOT_FOUND;
+
+	/* EDK2 returns the attributes even when the buffer is too small */
+	if (attributes)
+		*attributes = var->attributes;
+	if (*size < var->size) {
+		*size = var->size;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	if (!data)
+		return EFI_INVALID_PARAMETER;
+
+	CopyMem(data, var->data, var->size);
+	*size = var->size;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+get_variable(CHAR16 *name, EFI_GUID *guid, UINT32 *attributes,
+	     UINTN *size, VOID *data)
+{
+	count(HARNESS_GET_VARIABLE);
+	return firmware_get_variable(name, guid, attributes, size, data);
+}
+
+static EFI_STATUS EFIAPI
+get_next_variable_name(UINTN *name_size, CHAR16 *name, EFI_GUID *guid)
+{
+	variable_t *var;
+
+	count(HARNESS_GET_NEXT_VARIABLE_NAME);
+	if (!name_size || !name || !guid)
+		return EFI_INVALID_PARAMETER;
+
+	if (name[0] == 0) {
+		var = variables;
+	} else {
+		var = *find_variable(name, guid);
+		if (!var)
+			return EFI_INVALID_PARAMETER;
+		var = var->next;
+	}
+	if (!var)
+		return EFI_NOT_FOUND;
+
+	if (*name_size < StrSize(var->name)) {
+		*name_size = StrSize(var->name);
+		return EFI_BUFFER_TOO_SMALL;
+	}
+	*name_size = StrSize(var->name);
+	CopyMem(name, var->name, *name_size);
+	*guid = var->guid;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+set_variable(CHAR16 *name, EFI_GUID *guid, UINT32 attributes, UINTN size,
+	     VOID *data)
+{
+	count(HARNESS_SET_VARIABLE);
+	return firmware_set_variable(name, guid, attributes, size, data);
+}
+
+/*
+ * Console
+ */
+static EFI_STATUS EFIAPI
+con_output_string(SIMPLE_TEXT_OUTPUT_INTERFACE *this, CHAR16 *string)
+{
+	char buf[256];
+	UINTN len = 0;
+
+	count(HARNESS_OUTPUT_STRING);
+	for (; *string; string++) {
+		if (*string == L'\r')
+			continue;
+		buf[len++] = *string < 0x80 ? (char)*string : '?';
+		if (len == sizeof(buf)) {
+			harness_host_print(buf, len);
+			len = 0;
+		}
+	}
+	if (len)
+		harness_host_print(buf, len);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_reset(SIMPLE_TEXT_OUTPUT_INTERFACE *this, BOOLEAN extended)
+{
+	count(HARNESS_CONSOLE);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_test_string(SIMPLE_TEXT_OUTPUT_INTERFACE *this, CHAR16 *string)
+{
+	count(HARNESS_CONSOLE);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_query_mode(SIMPLE_TEXT_OUTPUT_INTERFACE *this, UINTN mode,
+	       UINTN *columns, UINTN *rows)
+{
+	count(HARNESS_CONSOLE);
+	if (mode != 0)
+		return EFI_UNSUPPORTED;
+	*columns = 80;
+	*rows = 25;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_set_mode(SIMPLE_TEXT_OUTPUT_INTERFACE *this, UINTN mode)
+{
+	count(HARNESS_CONSOLE);
+	return mode == 0 ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI
+con_set_attribute(SIMPLE_TEXT_OUTPUT_INTERFACE *this, UINTN attribute)
+{
+	count(HARNESS_CONSOLE);
+	this->Mode->Attribute = attribute;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_clear_screen(SIMPLE_TEXT_OUTPUT_INTERFACE *this)
+{
+	count(HARNESS_CONSOLE);
+	this->Mode->CursorColumn = 0;
+	this->Mode->CursorRow = 0;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_set_cursor_position(SIMPLE_TEXT_OUTPUT_INTERFACE *this, UINTN column,
+			UINTN row)
+{
+	count(HARNESS_CONSOLE);
+	this->Mode->CursorColumn = column;
+	this->Mode->CursorRow = row;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_enable_cursor(SIMPLE_TEXT_OUTPUT_INTERFACE *this, BOOLEAN enable)
+{
+	count(HARNESS_CONSOLE);
+	this->Mode->CursorVisible = enable;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_in_reset(SIMPLE_INPUT_INTERFACE *this, BOOLEAN extended)
+{
+	count(HARNESS_CONSOLE);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI
+con_read_key_stroke(SIMPLE_INPUT_INTERFACE *this, EFI_INPUT_KEY *key)
+{
+	count(HARNESS_CONSOLE);
+	key->ScanCode = SCAN_NULL;
+	key->UnicodeChar = CHAR_CARRIAGE_RETURN;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Everything else
+ */
+static EFI_STATUS EFIAPI
+unsupported(void)
+{
+	count(HARNESS_OTHER);
+	return EFI_UNSUPPORTED;
+}
+
+static void
+fill_unsupported(EFI_TABLE_HEADER *header, UINTN size)
+{
+	VOID **slot = (VOID **)(header + 1);
+	VOID **end = (VOID **)((UINT8 *)header + size);
+
+	while (slot < end)
+		*slot++ = (VOID *)unsupported;
+}
+
+static SIMPLE_TEXT_OUTPUT_MODE con_mode;
+static SIMPLE_TEXT_OUTPUT_INTERFACE con_out;
+static SIMPLE_INPUT_INTERFACE con_in;
+static EFI_BOOT_SERVICES boot_services;
+static EFI_RUNTIME_SERVICES runtime_services;
+static EFI_SYSTEM_TABLE system_table;
+
+EFI_SYSTEM_TABLE *
+firmware_init(EFI_HANDLE handle, EFI_LOADED_IMAGE *image)
+{
+	image_handle = handle;
+	loaded_image = image;
+
+	con_mode.MaxMode = 1;
+	con_mode.CursorVisible = TRUE;
+	con_out.Reset = con_reset;
+	con_out.OutputString = con_output_string;
+	con_out.TestString = con_test_string;
+	con_out.QueryMode = con_query_mode;
+	con_out.SetMode = con_set_mode;
+	con_out.SetAttribute = con_set_attribute;
+	con_out.ClearScreen = con_clear_screen;
+	con_out.SetCursorPosition = con_set_cursor_position;
+	con_out.EnableCursor = con_enable_cursor;
+	con_out.Mode = &con_mode;
+	con_in.Reset = con_in_reset;
+	con_in.ReadKeyStroke = con_read_key_stroke;
+	con_in.WaitForKey = NULL;
+
+	boot_services.Hdr.Signature = EFI_BOOT_SERVICES_SIGNATURE;
+	boot_services.Hdr.HeaderSize = sizeof(boot_services);
+	fill_unsupported(&boot_services.Hdr, sizeof(boot_services));
+	boot_services.AllocatePool = allocate_pool;
+	boot_services.FreePool = free_pool;
+	boot_services.AllocatePages = allocate_pages;
+	boot_services.FreePages = free_pages;
+	boot_services.HandleProtocol = handle_protocol;
+	boot_services.LocateHandleBuffer = locate_handle_buffer;
+	boot_services.LocateProtocol = locate_protocol;
+	boot_services.WaitForEvent = wait_for_event;
+	boot_services.Stall = stall;
+
+	runtime_services.Hdr.Signature = EFI_RUNTIME_SERVICES_SIGNATURE;
+	runtime_services.Hdr.HeaderSize = sizeof(runtime_services);
+	fill_unsupported(&runtime_services.Hdr, sizeof(runtime_services));
+	runtime_services.GetTime = get_time;
+	runtime_services.GetVariable = get_variable;
+	runtime_services.GetNextVariableName = get_next_variable_name;
+	runtime_services.SetVariable = set_variable;
+
+	system_table.Hdr.Signature = EFI_SYSTEM_TABLE_SIGNATURE;
+	system_table.Hdr.HeaderSize = sizeof(system_table);
+	system_table.FirmwareVendor = L"shim test harness";
+	system_table.ConIn = &con_in;
+	system_table.ConOut = &con_out;
+	system_table.StdErr = &con_out;
+	system_table.BootServices = &boot_services;
+	system_table.RuntimeServices = &runtime_services;
+
+	return &system_table;
+}
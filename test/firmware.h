@@ -0,0 +1,49 @@
+/*
+ * A mock of just enough UEFI firmware to run shim's image loading path on
+ * the build host; see harness.h.  Built with shim's own compiler flags.
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+#ifndef SHIM_TEST_FIRMWARE_H
+#define SHIM_TEST_FIRMWARE_H
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "harness.h"
+
+typedef struct {
+	UINT64 calls[HARNESS_SERVICES];
+	UINT64 pool_allocations;
+	UINT64 pool_bytes;
+	UINT64 pool_live;		/* bytes allocated and not freed yet */
+	UINT64 pool_peak;		/* the most pool_live has been */
+	UINT64 pool_bad_frees;
+	UINT64 page_allocations;
+	UINT64 pages;
+	UINT64 pages_live;
+} firmware_counters_t;
+
+extern firmware_counters_t firmware_counters;
+
+/*
+ * Set up the system table, with loaded_image installed on image_handle
+ */
+EFI_SYSTEM_TABLE *firmware_init(EFI_HANDLE image_handle,
+				EFI_LOADED_IMAGE *loaded_image);
+
+/*
+ * Read or change the variable store without counting it as a firmware call
+ */
+EFI_STATUS firmware_get_variable(CHAR16 *name, EFI_GUID *guid,
+				 UINT32 *attributes, UINTN *size, VOID *data);
+EFI_STATUS firmware_set_variable(CHAR16 *name, EFI_GUID *guid,
+				 UINT32 attributes, UINTN size, VOID *data);
+
+/*
+ * Free every page allocation that is still outstanding, and return how
+ * many pages that was
+ */
+UINT64 firmware_release_pages(void);
+
+#endif /* SHIM_TEST_FIRMWARE_H */
@@ -0,0 +1,244 @@
+/*
+ * harness.c - shim's image loading path, built to run on the build host
+ *
+ * This is shim.c itself, and timeline.c so that the steps shim marks while
+ * it loads an image can be timed, with entry points that set shim up the
+ * way efi_main() does and then load the trust store, or an image, the way
+ * shim does before it starts the next stage.  firmware.c is underneath;
+ * see harness.h for the other side.
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+
+#include "shim.c"
+#include "timeline.c"
+
+#include "firmware.h"
+
+static UINT8 harness_image_handle;
+static EFI_LOADED_IMAGE harness_loaded_image;
+static UINT64 ticks_per_second;
+
+static firmware_counters_t counters_before;
+static CRYPT_ALLOCATION_STATS crypt_before;
+static UINTN arena_allocations_before, arena_fallbacks_before;
+static UINT64 start_ticks;
+
+static unsigned long long
+ticks_to_ns(UINT64 ticks)
+{
+	if (!ticks_per_second)
+		return 0;
+	return ticks / ticks_per_second * 1000000000ULL +
+	       ticks % ticks_per_second * 1000000000ULL / ticks_per_second;
+}
+
+static void
+stats_begin(void)
+{
+	UINTN size, peak;
+
+	counters_before = firmware_counters;
+	firmware_counters.pool_peak = firmware_counters.pool_live;
+	CryptGetAllocationStats(&crypt_before);
+	CryptArenaGetStats(&size, &peak, &arena_allocations_before,
+			   &arena_fallbacks_before);
+
+	/* only this call's steps are wanted, and it mustn't fill up */
+	timeline_count = 0;
+	start_ticks = read_timestamp();
+}
+
+static void
+stats_end(struct harness_stats *stats, EFI_STATUS status)
+{
+	UINT64 end = read_timestamp(), next;
+	CRYPT_ALLOCATION_STATS crypt_after;
+	UINTN size, peak, allocations, fallbacks;
+	UINT32 i;
+
+	ZeroMem(stats, sizeof(*stats));
+	stats->status = status;
+	stats->ns = ticks_to_ns(end - start_ticks);
+
+	for (i = 0; i < timeline_count && i < HARNESS_STEPS; i++) {
+		next = i + 1 < timeline_count ? timeline[i + 1].ticks : end;
+		CopyMem(stats->steps[i].name, timeline[i].name,
+			HARNESS_STEP_NAME_SIZE < TIMELINE_NAME_SIZE ?
+			HARNESS_STEP_NAME_SIZE : TIMELINE_NAME_SIZE);
+		stats->steps[i].name[HARNESS_STEP_NAME_SIZE - 1] = '\0';
+		stats->steps[i].ns = ticks_to_ns(next - timeline[i].ticks);
+	}
+	stats->nsteps = i;
+
+	for (i = 0; i < HARNESS_SERVICES; i++)
+		stats->calls[i] = firmware_counters.calls[i] -
+				  counters_before.calls[i];
+	stats->pool_allocations = firmware_counters.pool_allocations -
+				  counters_before.pool_allocations;
+	stats->pool_bytes = firmware_counters.pool_bytes -
+			    counters_before.pool_bytes;
+	stats->pool_peak = firmware_counters.pool_peak -
+			   counters_before.pool_live;
+	stats->pool_bad_frees = firmware_counters.pool_bad_frees -
+				counters_before.pool_bad_frees;
+	stats->page_allocations = firmware_counters.page_allocations -
+				  counters_before.page_allocations;
+	stats->pages = firmware_counters.pages - counters_before.pages;
+	stats->pages_left = firmware_counters.pages_live -
+			    counters_before.pages_live;
+
+	CryptGetAllocationStats(&crypt_after);
+	stats->crypt_allocations = crypt_after.Allocations -
+				   crypt_before.Allocations;
+	stats->crypt_reallocs = crypt_after.Reallocs - crypt_before.Reallocs;
+	stats->crypt_bytes_copied = crypt_after.BytesCopied -
+				    crypt_before.BytesCopied;
+
+	CryptArenaGetStats(&size, &peak, &allocations, &fallbacks);
+	stats->arena_peak = peak;
+	stats->arena_allocations = allocations - arena_allocations_before;
+	stats->arena_fallbacks = fallbacks - arena_fallbacks_before;
+}
+
+static EFI_GUID *
+variable_name(const char *name, int guid, CHAR16 *name16, UINTN size)
+{
+	EFI_GUID *guids[] = {
+		[HARNESS_VARIABLE_GLOBAL] = &GV_GUID,
+		[HARNESS_VARIABLE_SECURITY] = &SIG_DB,
+		[HARNESS_VARIABLE_SHIM_LOCK] = &SHIM_LOCK_GUID,
+	};
+	UINTN i;
+
+	if (guid < 0 || guid >= (int)(sizeof(guids) / sizeof(guids[0])))
+		return NULL;
+
+	for (i = 0; name[i]; i++) {
+		if (i == size - 1)
+			return NULL;
+		name16[i] = name[i];
+	}
+	name16[i] = L'\0';
+
+	return guids[guid];
+}
+
+unsigned long long
+harness_set_variable(const char *name, int guid, unsigned int attributes,
+		     const void *data, unsigned long size)
+{
+	CHAR16 name16[64];
+	EFI_GUID *owner;
+
+	owner = variable_name(name, guid, name16,
+			      sizeof(name16) / sizeof(name16[0]));
+	if (!owner)
+		return EFI_INVALID_PARAMETER;
+
+	return firmware_set_variable(name16, owner, attributes, size,
+				     (VOID *)data);
+}
+
+unsigned long long
+harness_get_variable(const char *name, int guid, unsigned int *attributes,
+		     unsigned long *size)
+{
+	CHAR16 name16[64];
+	EFI_GUID *owner;
+	EFI_STATUS efi_status;
+	UINT32 attrs = 0;
+	UINTN len = 0;
+
+	owner = variable_name(name, guid, name16,
+			      sizeof(name16) / sizeof(name16[0]));
+	if (!owner)
+		return EFI_INVALID_PARAMETER;
+
+	efi_status = firmware_get_variable(name16, owner, &attrs, &len, NULL);
+	if (efi_status == EFI_BUFFER_TOO_SMALL || efi_status == EFI_SUCCESS) {
+		*attributes = attrs;
+		*size = len;
+		return EFI_SUCCESS;
+	}
+	return efi_status;
+}
+
+/*
+ * What efi_main() and shim_init() do before the trust store is loaded,
+ * without the parts that look for the next stage or install protocols
+ */
+unsigned long long
+harness_init(int snapshot, int verbosity)
+{
+	EFI_STATUS efi_status;
+
+	vendor_cert_size = cert_table.vendor_cert_size;
+	vendor_dbx_size = cert_table.vendor_dbx_size;
+	vendor_cert = (UINT8 *)&cert_table + cert_table.vendor_cert_offset;
+	vendor_dbx = (UINT8 *)&cert_table + cert_table.vendor_dbx_offset;
+
+	global_image_handle = &harness_image_handle;
+	systab = firmware_init(global_image_handle, &harness_loaded_image);
+	InitializeLib(global_image_handle, systab);
+
+	if (snapshot) {
+		efi_status = variable_snapshot_init(snapshot_filters,
+						    sizeof(snapshot_filters) /
+						    sizeof(snapshot_filters[0]));
+		if (efi_status != EFI_SUCCESS)
+			return efi_status;
+	}
+
+	check_mok_sb();
+	setup_verbosity();
+	if (verbosity)
+		verbose = verbosity;
+	find_hash_algorithms();
+	init_openssl();
+
+	ticks_per_second = timestamp_frequency();
+
+	return secure_mode() ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+unsigned long long
+harness_load_trust_store(struct harness_stats *stats)
+{
+	EFI_STATUS efi_status;
+
+	stats_begin();
+	timeline_mark("load_trust_store");
+	efi_status = load_trust_store();
+	stats_end(stats, efi_status);
+
+	return efi_status;
+}
+
+/*
+ * Check, hash, verify and relocate an image as start_image() does once it
+ * has read it, then throw the loaded copy away again
+ */
+unsigned long long
+harness_load_image(const void *data, unsigned long size,
+		   struct harness_stats *stats)
+{
+	EFI_LOADED_IMAGE li;
+	EFI_STATUS efi_status;
+
+	ZeroMem(&li, sizeof(li));
+
+	stats_begin();
+	efi_status = handle_image((void *)data, size, &li, NULL);
+	stats_end(stats, efi_status);
+	firmware_release_pages();
+
+	return efi_status;
+}
+
+void
+harness_fini(void)
+{
+	trust_store_free();
+	variable_snapshot_free();
+}
@@ -0,0 +1,108 @@
+/*
+ * The interface between bench-verify, which is an ordinary program for the
+ * build host, and harness.o, which is shim's image loading path and a mock
+ * of the firmware underneath it, built with the same compiler flags as
+ * shim itself.  The two sides don't share any other headers, so only plain
+ * C types are used here.
+ *
+ * Everything in harness.o other than the harness_* functions below is
+ * local to it, so the copies of memcpy(), malloc() and OpenSSL that shim
+ * carries don't get mixed up with the host's.  In the other direction,
+ * harness.o calls the harness_host_* functions, which bench-verify
+ * provides, for memory, console output and the time.
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+#ifndef SHIM_TEST_HARNESS_H
+#define SHIM_TEST_HARNESS_H
+
+/*
+ * The firmware services the mock counts calls to, named after the member
+ * of the system table that is called, as ENABLE_FW_TRACE does
+ */
+enum harness_service {
+	HARNESS_ALLOCATE_POOL,
+	HARNESS_FREE_POOL,
+	HARNESS_ALLOCATE_PAGES,
+	HARNESS_FREE_PAGES,
+	HARNESS_HANDLE_PROTOCOL,
+	HARNESS_LOCATE_HANDLE_BUFFER,
+	HARNESS_LOCATE_PROTOCOL,
+	HARNESS_WAIT_FOR_EVENT,
+	HARNESS_STALL,
+	HARNESS_GET_VARIABLE,
+	HARNESS_GET_NEXT_VARIABLE_NAME,
+	HARNESS_SET_VARIABLE,
+	HARNESS_GET_TIME,
+	HARNESS_OUTPUT_STRING,
+	HARNESS_CONSOLE,	/* every other ConOut and ConIn call */
+	HARNESS_OTHER,		/* everything the mock doesn't implement */
+	HARNESS_SERVICES
+};
+
+#define HARNESS_VARIABLE_GLOBAL		0	/* EFI_GLOBAL_VARIABLE */
+#define HARNESS_VARIABLE_SECURITY	1	/* db and dbx */
+#define HARNESS_VARIABLE_SHIM_LOCK	2	/* MokList, MokListX, ... */
+
+#define HARNESS_STEPS		8
+#define HARNESS_STEP_NAME_SIZE	24
+
+/*
+ * What one harness_load_trust_store() or harness_load_image() call did.
+ * The steps are the timeline_mark()s shim made during the call, each
+ * lasting until the next one or the end of the call.
+ */
+struct harness_stats {
+	unsigned long long status;		/* the EFI_STATUS returned */
+	unsigned long long ns;
+	unsigned int nsteps;
+	struct {
+		char name[HARNESS_STEP_NAME_SIZE];
+		unsigned long long ns;
+	} steps[HARNESS_STEPS];
+	unsigned long long calls[HARNESS_SERVICES];
+	unsigned long long pool_allocations;
+	unsigned long long pool_bytes;
+	unsigned long long pool_peak;		/* above what was in use before */
+	unsigned long long pool_bad_frees;	/* FreePool() of something else */
+	unsigned long long page_allocations;
+	unsigned long long pages;
+	unsigned long long pages_left;		/* allocated and not freed */
+	unsigned long long crypt_allocations;
+	unsigned long long crypt_reallocs;
+	unsigned long long crypt_bytes_copied;
+	unsigned long long arena_peak;		/* the most ever, not just this call */
+	unsigned long long arena_allocations;
+	unsigned long long arena_fallbacks;
+};
+
+/*
+ * Variables must all be set before harness_init(), which reads them the
+ * way efi_main() does.  Names are ASCII.  Each returns an EFI_STATUS;
+ * harness_init() fails if the variables don't put shim in secure mode,
+ * since then it wouldn't verify anything.  harness_get_variable() can be
+ * called at any time, to see what shim left in the store; it doesn't
+ * count as a firmware call.
+ */
+extern unsigned long long harness_set_variable(const char *name, int guid,
+					       unsigned int attributes,
+					       const void *data,
+					       unsigned long size);
+extern unsigned long long harness_get_variable(const char *name, int guid,
+					       unsigned int *attributes,
+					       unsigned long *size);
+extern unsigned long long harness_init(int snapshot, int verbose);
+extern unsigned long long harness_load_trust_store(struct harness_stats *stats);
+extern unsigned long long harness_load_image(const void *data,
+					     unsigned long size,
+					     struct harness_stats *stats);
+extern void harness_fini(void);
+extern const char *harness_service_name(unsigned int service);
+
+/* provided by the host program */
+extern void *harness_host_alloc(unsigned long size, unsigned long align);
+extern void harness_host_free(void *p);
+extern void harness_host_print(const char *text, unsigned long len);
+extern unsigned long long harness_host_ns(void);
+
+#endif /* SHIM_TEST_HARNESS_H */
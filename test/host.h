@@ -0,0 +1,69 @@
+/*
+ * Lets single Cryptlib source files be built into programs that run on the
+ * build host.  The host's C library stands in for the EDK2 and gnu-efi
+ * definitions that InternalCryptLib.h would otherwise pull in, and the
+ * test program provides AllocatePool() and FreePool().
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+#ifndef SHIM_TEST_HOST_H
+#define SHIM_TEST_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t UINT8;
+typedef int8_t INT8;
+typedef uint16_t UINT16;
+typedef int16_t INT16;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint64_t UINT64;
+typedef int64_t INT64;
+typedef uintptr_t UINTN;
+typedef intptr_t INTN;
+typedef unsigned char BOOLEAN;
+typedef char CHAR8;
+typedef uint16_t CHAR16;
+typedef void VOID;
+
+typedef struct {
+	UINT16 Year;
+	UINT8 Month;
+	UINT8 Day;
+	UINT8 Hour;
+	UINT8 Minute;
+	UINT8 Second;
+	UINT8 Pad1;
+	UINT32 Nanosecond;
+	INT16 TimeZone;
+	UINT8 Daylight;
+	UINT8 Pad2;
+} EFI_TIME;
+
+#define TRUE	1
+#define FALSE	0
+#define OPTIONAL
+#define EFIAPI
+
+#if defined(__x86_64__)
+#define MDE_CPU_X64
+#elif defined(__aarch64__)
+#define MDE_CPU_AARCH64
+#elif defined(__i386__)
+#define MDE_CPU_IA32
+#endif
+
+#define CopyMem(dest, src, len)		memmove((dest), (src), (len))
+#define ZeroMem(buf, len)		memset((buf), 0, (len))
+#define SetMem(buf, len, value)		memset((buf), (value), (len))
+
+extern VOID *AllocatePool(UINTN size);
+extern VOID FreePool(VOID *buf);
+
+/* keep InternalCryptLib.h, and with it the gnu-efi headers, out */
+#define __INTERNAL_CRYPT_LIB_H__
+#include <Library/BaseCryptLib.h>
+
+#endif /* SHIM_TEST_HOST_H */
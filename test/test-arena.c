@@ -0,0 +1,399 @@
+/*
+ * Tests for the malloc(), realloc() and free() that OpenSSL uses inside
+ * shim, in Cryptlib/SysCall/BaseMemAllocation.c: the pool size classes,
+ * growing blocks in place, the arena that CryptArenaBegin() and
+ * CryptArenaEnd() put small allocations in, and the counters they keep.
+ * AllocatePool() and FreePool() count the calls that would go to the
+ * firmware, which is what the arena is there to save.
+ *
+ * usage: test-arena [-b]
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Keep the host's allocator for the test itself */
+#define malloc	crypt_malloc
+#define realloc	crypt_realloc
+#define free	crypt_free
+void *crypt_malloc(size_t size);
+void *crypt_realloc(void *ptr, size_t size);
+void crypt_free(void *ptr);
+#include "SysCall/BaseMemAllocation.c"
+#undef malloc
+#undef realloc
+#undef free
+
+#define STRESS_BLOCKS	512
+#define STRESS_ROUNDS	200000
+#define BENCH_ROUNDS	2000
+#define BENCH_BLOCKS	1500
+
+static unsigned int pool_allocations;
+static unsigned int pool_frees;
+static unsigned int failures;
+
+VOID *
+AllocatePool(UINTN size)
+{
+	pool_allocations++;
+	return malloc(size);
+}
+
+VOID
+FreePool(VOID *buf)
+{
+	pool_frees++;
+	free(buf);
+}
+
+#define check(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			printf("FAIL: " __VA_ARGS__);			\
+			printf("\n");					\
+			failures++;					\
+		}							\
+	} while (0)
+
+static unsigned int
+pool_live(void)
+{
+	return pool_allocations - pool_frees;
+}
+
+static BOOLEAN
+in_arena(void *ptr)
+{
+	return ArenaOwns(ptr);
+}
+
+static void
+test_pool(void)
+{
+	CRYPT_ALLOCATION_STATS before, after;
+	unsigned int calls;
+	UINT8 *p, *q;
+	UINTN i;
+
+	check(PoolCapacity(1) == 16 && PoolCapacity(17) == 24 &&
+	      PoolCapacity(65) == 96 && PoolCapacity(97) == 128 &&
+	      PoolCapacity(65536) == 65536 && PoolCapacity(65537) == 69632,
+	      "pool size classes");
+	for (i = 1; i < 200000; i += 7)
+		check(PoolCapacity(i) >= i &&
+		      (i >= CRYPT_POOL_CLASS_LIMIT || PoolCapacity(i) <= i + i / 2 + 16),
+		      "pool capacity %u for %u bytes", (UINT32)PoolCapacity(i),
+		      (UINT32)i);
+
+	CryptGetAllocationStats(&before);
+	calls = pool_allocations;
+	p = crypt_malloc(65);
+	check(p && pool_allocations == calls + 1 && !in_arena(p),
+	      "malloc() outside a scope goes to the pool");
+	check(((UINTN)p & 7) == 0, "pool blocks are 8 byte aligned");
+	for (i = 0; i < 65; i++)
+		p[i] = i;
+
+	q = crypt_realloc(p, 96);
+	check(q == p && pool_allocations == calls + 1,
+	      "realloc() within the size class stays in place");
+	q = crypt_realloc(p, 97);
+	check(q != p && pool_allocations == calls + 2 && pool_frees > 0,
+	      "realloc() past the size class moves the block");
+	for (i = 0; i < 65 && q; i++)
+		if (q[i] != i)
+			break;
+	check(i == 65, "realloc() keeps the contents when moving");
+	crypt_free(q);
+	crypt_free(NULL);
+
+	check(crypt_malloc(CRYPT_MAX_ALLOCATION + 1) == NULL,
+	      "malloc() refuses more than CRYPT_MAX_ALLOCATION");
+
+	CryptGetAllocationStats(&after);
+	check(after.Allocations == before.Allocations + 1 &&
+	      after.Frees == before.Frees + 1 &&
+	      after.Reallocs == before.Reallocs + 2 &&
+	      after.ReallocsInPlace == before.ReallocsInPlace + 1 &&
+	      after.ReallocCopies == before.ReallocCopies + 1 &&
+	      after.BytesCopied == before.BytesCopied + 96 &&
+	      after.BytesInUse == before.BytesInUse &&
+	      after.PeakBytesInUse >= before.BytesInUse + 97,
+	      "allocation counters");
+}
+
+static void
+test_arena(void)
+{
+	UINTN size, peak, allocations, fallbacks, fallbacks_before, i;
+	UINT8 *blocks[1000], *first, *p, *q, *big, *kept;
+	unsigned int calls;
+
+	CryptArenaBegin();
+	calls = pool_allocations;
+	for (i = 0; i < 1000; i++) {
+		blocks[i] = crypt_malloc(100 + i % 7);
+		check(blocks[i] && in_arena(blocks[i]) &&
+		      ((UINTN)blocks[i] & 7) == 0,
+		      "arena allocation %u", (UINT32)i);
+		memset(blocks[i], i & 0xff, 100 + i % 7);
+	}
+	check(pool_allocations == calls,
+	      "small allocations in a scope make no pool calls");
+	for (i = 0; i < 1000; i++) {
+		check(blocks[i][0] == (i & 0xff) &&
+		      blocks[i][99 + i % 7] == (i & 0xff),
+		      "arena block %u was overwritten", (UINT32)i);
+	}
+	first = blocks[0];
+	for (i = 1000; i-- > 0; )
+		crypt_free(blocks[i]);
+	CryptArenaGetStats(&size, &peak, &allocations, &fallbacks);
+	check(size == CRYPT_ARENA_SIZE && peak >= 1000 * 104 &&
+	      allocations >= 1000, "arena statistics");
+	fallbacks_before = fallbacks;
+
+	p = crypt_malloc(10);
+	check(p == first, "the arena rewinds once everything is freed");
+
+	q = crypt_realloc(p, 8000);
+	check(q == p && pool_allocations == calls,
+	      "the last arena allocation grows in place");
+	crypt_free(q);
+
+	big = crypt_malloc(CRYPT_ARENA_MAX_ALLOCATION + 1);
+	check(big && !in_arena(big) && pool_allocations == calls + 1,
+	      "large allocations in a scope go to the pool");
+	crypt_free(big);
+
+	for (i = 0; i < 20; i++)
+		blocks[i] = crypt_malloc(CRYPT_ARENA_MAX_ALLOCATION);
+	check(in_arena(blocks[0]) && !in_arena(blocks[19]),
+	      "allocations go to the pool once the arena is full");
+	for (i = 0; i < 20; i++)
+		crypt_free(blocks[i]);
+	CryptArenaGetStats(&size, &peak, &allocations, &fallbacks);
+	check(fallbacks > fallbacks_before + 1 && peak <= CRYPT_ARENA_SIZE,
+	      "arena fallbacks are counted");
+
+	CryptArenaSuspend();
+	p = crypt_malloc(10);
+	check(!in_arena(p), "suspending the arena sends allocations to the pool");
+	crypt_free(p);
+	CryptArenaResume();
+
+	/* nested scopes, and a block that outlives them */
+	CryptArenaBegin();
+	kept = crypt_malloc(32);
+	memset(kept, 0x5a, 32);
+	CryptArenaEnd();
+	CryptArenaEnd();
+	p = crypt_malloc(32);
+	check(in_arena(kept) && !in_arena(p),
+	      "allocations after the outermost scope go to the pool");
+	crypt_free(p);
+
+	CryptArenaBegin();
+	p = crypt_malloc(32);
+	check(p != kept, "an arena block still in use is not handed out again");
+	memset(p, 0xa5, 32);
+	for (i = 0; i < 32; i++)
+		if (kept[i] != 0x5a)
+			break;
+	check(i == 32, "an arena block that outlived its scope was overwritten");
+	crypt_free(kept);
+	crypt_free(p);
+	CryptArenaEnd();
+
+	/*
+	 * a block that outlives its scope holds on to its own space, but not
+	 * to that of the blocks after it that were freed
+	 */
+	CryptArenaBegin();
+	kept = crypt_malloc(32);
+	for (i = 0; i < 100; i++)
+		blocks[i] = crypt_malloc(100);
+	for (i = 0; i < 100; i++)
+		crypt_free(blocks[i]);
+	CryptArenaEnd();
+	CryptArenaBegin();
+	p = crypt_malloc(32);
+	check(p == blocks[0],
+	      "the arena rewinds to the last block in use when the scope ends");
+	crypt_free(p);
+	crypt_free(kept);
+	CryptArenaEnd();
+	check(mArenaTop == 0, "the arena is empty once the kept block is freed");
+}
+
+/*
+ * Random mallocs, reallocs and frees, in and out of arena scopes, with
+ * every block holding a pattern that is checked before it is resized or
+ * freed, so that any two live blocks overlapping shows up
+ */
+static void
+test_stress(void)
+{
+	static UINT8 *blocks[STRESS_BLOCKS];
+	static UINTN sizes[STRESS_BLOCKS];
+	CRYPT_ALLOCATION_STATS stats;
+	unsigned int round, corrupt = 0, failed = 0, arena = 0;
+	UINTN i, j, size, keep;
+	UINT8 *p;
+
+	srand(1);
+	for (round = 0; round < STRESS_ROUNDS; round++) {
+		if (rand() % 1000 == 0) {
+			if (arena && rand() % 2) {
+				CryptArenaEnd();
+				arena--;
+			} else if (arena < 3) {
+				CryptArenaBegin();
+				arena++;
+			}
+		}
+
+		i = rand() % STRESS_BLOCKS;
+		if (blocks[i]) {
+			for (j = 0; j < sizes[i]; j++)
+				if (blocks[i][j] != (UINT8)(i + j))
+					break;
+			if (j != sizes[i])
+				corrupt++;
+		}
+
+		size = rand() % 4 ? rand() % 512 : rand() % 40000;
+		switch (blocks[i] ? rand() % 2 : 0) {
+		case 0:
+			if (blocks[i]) {
+				crypt_free(blocks[i]);
+				blocks[i] = NULL;
+				break;
+			}
+			blocks[i] = crypt_malloc(size);
+			if (!blocks[i]) {
+				failed++;
+				break;
+			}
+			sizes[i] = size;
+			for (j = 0; j < size; j++)
+				blocks[i][j] = i + j;
+			break;
+		case 1:
+			p = crypt_realloc(blocks[i], size);
+			if (!p) {
+				failed++;
+				break;
+			}
+			keep = size < sizes[i] ? size : sizes[i];
+			for (j = 0; j < keep; j++)
+				if (p[j] != (UINT8)(i + j))
+					break;
+			if (j != keep)
+				corrupt++;
+			blocks[i] = p;
+			sizes[i] = size;
+			for (j = keep; j < size; j++)
+				p[j] = i + j;
+			break;
+		}
+	}
+
+	for (i = 0; i < STRESS_BLOCKS; i++)
+		crypt_free(blocks[i]);
+	while (arena--)
+		CryptArenaEnd();
+
+	check(corrupt == 0, "%u blocks were corrupted by random use", corrupt);
+	check(failed == 0, "%u random allocations failed", failed);
+	CryptGetAllocationStats(&stats);
+	check(stats.BytesInUse == 0 && stats.Allocations == stats.Frees,
+	      "counters balance after random use (%u bytes in use, %u allocations, %u frees)",
+	      (UINT32)stats.BytesInUse, (UINT32)stats.Allocations,
+	      (UINT32)stats.Frees);
+	check(mArenaTop == 0 && mArenaLive == 0,
+	      "the arena is empty after random use");
+	check(pool_live() == 1, "%u pool blocks leaked", pool_live() - 1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Roughly the pattern of decoding a certificate chain: thousands of small
+ * blocks, some of them grown, all freed at the end
+ */
+static void
+bench(const char *mode, BOOLEAN use_arena)
+{
+	static UINT8 *blocks[BENCH_BLOCKS];
+	unsigned int round, calls = pool_allocations + pool_frees;
+	double start, elapsed;
+	UINTN i;
+
+	srand(2);
+	start = now();
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		if (use_arena)
+			CryptArenaBegin();
+		for (i = 0; i < BENCH_BLOCKS; i++) {
+			blocks[i] = crypt_malloc(16 + rand() % 200);
+			if (i % 8 == 0)
+				blocks[i] = crypt_realloc(blocks[i], 400);
+		}
+		for (i = 0; i < BENCH_BLOCKS; i++)
+			crypt_free(blocks[i]);
+		if (use_arena)
+			CryptArenaEnd();
+	}
+	elapsed = now() - start;
+
+	printf("%-10s %6.1f ns per allocation, %8.1f pool calls per %u allocations\n",
+	       mode, elapsed * 1e9 / BENCH_ROUNDS / BENCH_BLOCKS,
+	       (double)(pool_allocations + pool_frees - calls) / BENCH_ROUNDS,
+	       BENCH_BLOCKS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	BOOLEAN benchmark = FALSE;
+	int c;
+
+	while ((c = getopt(argc, argv, "b")) != -1) {
+		if (c != 'b') {
+			fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+			return 1;
+		}
+		benchmark = TRUE;
+	}
+
+	test_pool();
+	test_arena();
+	test_stress();
+
+	if (failures) {
+		printf("test-arena: %u failures\n", failures);
+		return 1;
+	}
+	printf("test-arena: all allocator tests passed\n");
+
+	if (benchmark) {
+		bench("pool", FALSE);
+		bench("arena", TRUE);
+	}
+
+	return 0;
+}
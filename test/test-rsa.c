@@ -0,0 +1,542 @@
+/*
+ * Known answer tests for the RSA public key operation in
+ * Cryptlib/Pk/CryptRsaFastVerify.c, with the portable multiply-accumulate
+ * rows and, on processors that have them, the MULX/ADCX/ADOX ones, and a
+ * benchmark of both.  The vectors are SHA-256 PKCS#1 v1.5 signatures of
+ * "abc" made with "openssl dgst -sha256 -sign" by RSA-2048 and RSA-4096
+ * keys with the public exponent 65537; raising each signature to 65537
+ * must give the padded digest.
+ *
+ * usage: test-rsa [-b]
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * CryptRsaFastVerify.c is written against the OpenSSL 1.0.2 in Cryptlib,
+ * whose structures the host's OpenSSL hides.  Keep the host's headers out
+ * and provide the few parts of the old interface that it uses here.
+ */
+#define OPENSSL_BN_H
+#define OPENSSL_RSA_H
+#define HEADER_BN_H
+#define HEADER_RSA_H
+
+#if defined(__LP64__)
+#define BN_ULONG	unsigned long
+#define BN_BITS2	64
+#else
+#define BN_ULONG	unsigned int
+#define BN_BITS2	32
+#endif
+
+#define RSA_F4		0x10001L
+
+typedef struct {
+	BN_ULONG *d;
+	int top;
+	int dmax;
+	int neg;
+	int flags;
+} BIGNUM;
+
+typedef struct {
+	int ri;
+	BIGNUM RR;
+} BN_MONT_CTX;
+
+typedef struct bn_ctx_st BN_CTX;
+
+typedef struct {
+	const char *name;
+	int (*bn_mod_exp)(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
+			  const BIGNUM *m, BN_CTX *ctx, BN_MONT_CTX *m_ctx);
+} RSA_METHOD;
+
+#define BN_is_odd(a)		((a)->top > 0 && ((a)->d[0] & 1))
+#define BN_is_negative(a)	((a)->neg != 0)
+#define BN_is_word(a, w)	((a)->top == 1 && (a)->d[0] == (BN_ULONG)(w) && \
+				 !(a)->neg)
+#define bn_correct_top(a)					\
+	do {							\
+		while ((a)->top > 0 && (a)->d[(a)->top - 1] == 0)	\
+			(a)->top--;				\
+	} while (0)
+
+static int BN_ucmp(const BIGNUM *a, const BIGNUM *b);
+static int BN_num_bits(const BIGNUM *a);
+static BIGNUM *bn_wexpand(BIGNUM *a, int words);
+static int BN_mod_exp_mont(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
+			   const BIGNUM *m, BN_CTX *ctx, BN_MONT_CTX *m_ctx);
+static const RSA_METHOD *RSA_PKCS1_SSLeay(void);
+static void RSA_set_default_method(const RSA_METHOD *meth);
+
+#include "Pk/CryptRsaFastVerify.c"
+
+#define MAX_LIMBS	RSA_FAST_MAX_LIMBS
+#define BENCH_SECONDS	1.0
+
+static const struct {
+	unsigned int bits;
+	const char *modulus;
+	const char *signature;
+	const char *encoded;
+} kats[] = {
+	{ 2048,
+	  "e284e18b6b60127820cc67ad77486f3703292a71412fa6686ab4128e8921833f"
+	  "b84c3a43bb7cbfc5823bef75339c999bac86118514ea92415542ee4294d34c1c"
+	  "fd66ba474f7a7d9ad578e38188323c2708f9bce87ffc1b451e906667249f84a1"
+	  "ad257262f1ec0abf3f2b4a27b384af596bccb5f40a18a9da665f0e5957c3966a"
+	  "99e9f6bab5e72e3ff154dd6f9da42c0f807afa28bb9fb07730a2c41d5c13c177"
+	  "71379c3c8cb0e7bf5bdefde4c0c0ba1788c67b87d84fff5067b0a901731910c1"
+	  "f5ed7bede4f54f5aa46c66cbd82425f033e55d0585ce4cad7f52e0f6bc83b58a"
+	  "d80c9c909eb63a519fd7d6e3cffdcf7b5530f0c2e9a3e629efbc4e9753e56e75",
+	  "16aadea5ae1a67aa41bcce85073d9e1ad520cae7b0e78233958c3c33d3e6ca19"
+	  "3586222a909cce98c0e5869f3380c4d4c4329bced75fa57f99f70d45452d7e6d"
+	  "9879e067beafc8ede9ed0bbfac16096ca76b5691a9c199895ab9bb38e7807ac6"
+	  "7aab90795605ebc916ea93ff63488277b5341b4523364bfcf9cb66c77a261913"
+	  "ef93275f1d135b4208bf47de330dfbee6e4214869b44632f00f730325f6a54ed"
+	  "b9f82ab1eb87fd67d69f9c92d2ab2caf264a2eb8c0c8f429d54863ba460613a6"
+	  "751d948b487762437f78bcae4c2bd683b33461fee2028ff3c1b902b31a46ca67"
+	  "cbe26428278760d280ca1e946dad68575a57ff1ec934f106034bd4f0d72123cb",
+	  "0001ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffff003031300d060960864801650304020105000420"
+	  "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ 4096,
+	  "be2255b623cef7b753eaf55b8c4d771be4cc9eeed12382476658c65455942834"
+	  "6fb8d13fa6129251047c92ca581727065d2c1d357464f3b555f7e1db5a102dc6"
+	  "87b8b724c96bc056c2501c0a3dd89606413edacf95ffb563c97ebb2fc32f2f1d"
+	  "2a998cc25b0748784b4046e0213dfea123597bfceef1a39b2c007b8a51537954"
+	  "b735195f6aacbf78d68b6d79ec3013ab7d4c7afc2a2bae54ff8656726ada179c"
+	  "fa1b21504c12c4181c511a672aec925af194985e14d77a2e521f3954055744c8"
+	  "cd830fcdd75c73c513d6f27c781aba5ff192564df191c937db990b4a18766ba2"
+	  "613fb99973dc1a29d4c3f4df850313f3c3d1bdb2c1749818c7e05dee37d73997"
+	  "2cc4336e778784060c6a43f2a8d7c17ad9017881e0de92582124a2efe776af0f"
+	  "c00cb74a96ee53accd68728fc34c8fb5cd91f40cb7bee42f59d77b6c8394b351"
+	  "3010cbb8f1debd42dcb68f27ca625e3afe9a5874923e4b71baf58d73d67b409b"
+	  "2d40cb8705b69740859e973bb76bbb32753a0b17bd1842612d3f90ee35650bde"
+	  "e94e94f1e2a195039d8039d6980946657e7b29aeba0c20b33032b028f1d5b59a"
+	  "b9435fbd0490172b16bff1620dbc8f7ba63dab9339841e3cabb8c4d8af588c8c"
+	  "f545ecf69d4c2ab5897a0b001ee01ad20b93cd1e75e8957a93018d7413477ebf"
+	  "940b83cbbd846c45e231b47f8afdef46b95d7c57b5222a03628952bdee3ab6f5",
+	  "5324abb61d0524c19c45da9acd74458e8a68512814195f4eb0029063d7979cfb"
+	  "f94ba4d4b0413ce30760265a05ec227f1383cbe2593f7499dd6b8285057e438b"
+	  "a84fc221787410ae987ff4f713c693d2b1e69a1e70e77e88fc9c040e61b3ed43"
+	  "f2f363934470cb3f39279ffaedfb9a299247930e37834cbbaabd9f2c1f52dec3"
+	  "c9fdbf44b3d9cd24f5abd5b003aca9b0b55d0b86428fb6147d63b2ecc301c30e"
+	  "29f73cc9b7af40bfcb4335c00e0267f14e49c5eb022d0fb5a6fe7f29126abc5f"
+	  "91b0991363d28a59b9a986455634ac95eec7857440589e580940ef8a81fdca9b"
+	  "dd6c6d5c54ec1b2e69878fddf5060fdc3fd1f1688a02db51314cffd895191dd9"
+	  "b0338fd1be0af64f0a2c15693566c8f1b7d1b53c66c7493836de568e038c1890"
+	  "44639f7165b4ab4408e4e31b419fe7708d34fd2bbde31d7a941fcef4490a4b39"
+	  "90018cb8ceee5720ba7b1ff3b9bc06d297c868ecdfb2dc1328be166e4972229a"
+	  "5017e8edb426cf9dbe30582859051ff51d37b9df03d022023cca98793183fccf"
+	  "b9501e99eea1b9bbfa859e2a84426e24407bd90efb2d2fc2acb08f03083cb6c9"
+	  "93f565a3892ad363c035c6a72e18beb1914e0b569c511c94195fcce3ff94d2fe"
+	  "7cb9d8a45e99900add197ad4c870fa70fb5ee86d4393459c2d8db1e8d4df81ce"
+	  "9f1e28e70f3262194c7068997079f8e0f2924212b8afde68a204e0c7d872e9f0",
+	  "0001ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	  "ffffffffffffffffffffffff003031300d060960864801650304020105000420"
+	  "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+};
+
+static const RSA_METHOD ssleay_method = { "stub PKCS#1 RSA", NULL };
+static const RSA_METHOD *default_method;
+static unsigned int fallbacks;
+static unsigned int failures;
+
+static int
+BN_ucmp(const BIGNUM *a, const BIGNUM *b)
+{
+	int i;
+
+	if (a->top != b->top)
+		return a->top - b->top;
+	for (i = a->top - 1; i >= 0; i--) {
+		if (a->d[i] != b->d[i])
+			return a->d[i] > b->d[i] ? 1 : -1;
+	}
+	return 0;
+}
+
+static int
+BN_num_bits(const BIGNUM *a)
+{
+	BN_ULONG top;
+	int bits;
+
+	if (a->top == 0)
+		return 0;
+	bits = (a->top - 1) * BN_BITS2;
+	for (top = a->d[a->top - 1]; top; top >>= 1)
+		bits++;
+	return bits;
+}
+
+static BIGNUM *
+bn_wexpand(BIGNUM *a, int words)
+{
+	return words <= a->dmax ? a : NULL;
+}
+
+/* Only counts the calls; the tests check which inputs get here */
+static int
+BN_mod_exp_mont(BIGNUM *r, const BIGNUM *a, const BIGNUM *p,
+		const BIGNUM *m, BN_CTX *ctx, BN_MONT_CTX *m_ctx)
+{
+	fallbacks++;
+	r->top = 0;
+	return 1;
+}
+
+static const RSA_METHOD *
+RSA_PKCS1_SSLeay(void)
+{
+	return &ssleay_method;
+}
+
+static void
+RSA_set_default_method(const RSA_METHOD *meth)
+{
+	default_method = meth;
+}
+
+/* Big endian hex to little endian limbs, returning the number of limbs */
+static UINTN
+from_hex(const char *hex, BN_ULONG *limbs)
+{
+	size_t len = strlen(hex), i;
+	unsigned int nibble;
+	char c;
+
+	memset(limbs, 0, MAX_LIMBS * sizeof(*limbs));
+	if (len > MAX_LIMBS * sizeof(*limbs) * 2)
+		errx(1, "test vector too long");
+	for (i = 0; i < len; i++) {
+		c = hex[len - 1 - i];
+		nibble = c <= '9' ? c - '0' : c - 'a' + 10;
+		limbs[i / (BN_BITS2 / 4)] |=
+			(BN_ULONG)nibble << (i % (BN_BITS2 / 4) * 4);
+	}
+	return (len + BN_BITS2 / 4 - 1) / (BN_BITS2 / 4);
+}
+
+/*
+ * RR = 2^(2 * K * BN_BITS2) mod N, the slow way, so that it doesn't depend
+ * on anything being tested
+ */
+static void
+compute_rr(BN_ULONG *rr, const BN_ULONG *n, UINTN k)
+{
+	BN_ULONG x[MAX_LIMBS + 1], borrow, diff;
+	UINTN bit, i;
+	BOOLEAN ge;
+
+	memset(x, 0, sizeof(x));
+	x[0] = 1;
+	for (bit = 0; bit < 2 * k * BN_BITS2; bit++) {
+		for (i = k; i > 0; i--)
+			x[i] = x[i] << 1 | x[i - 1] >> (BN_BITS2 - 1);
+		x[0] <<= 1;
+
+		ge = x[k] != 0;
+		if (!ge) {
+			ge = TRUE;
+			for (i = k; i-- > 0; ) {
+				if (x[i] != n[i]) {
+					ge = x[i] > n[i];
+					break;
+				}
+			}
+		}
+		if (!ge)
+			continue;
+
+		borrow = 0;
+		for (i = 0; i < k; i++) {
+			diff = x[i] - n[i] - borrow;
+			borrow = x[i] < n[i] || (x[i] == n[i] && borrow);
+			x[i] = diff;
+		}
+		x[k] = 0;
+	}
+	memcpy(rr, x, k * sizeof(*rr));
+}
+
+static void
+check_limbs(const char *what, const BN_ULONG *got, const BN_ULONG *expected,
+	    UINTN k)
+{
+	if (memcmp(got, expected, k * sizeof(*got)) == 0)
+		return;
+	printf("FAIL: %s\n", what);
+	failures++;
+}
+
+static void
+run_kats(const char *mode)
+{
+	BN_ULONG n[MAX_LIMBS], s[MAX_LIMBS], em[MAX_LIMBS];
+	BN_ULONG rr[MAX_LIMBS], result[MAX_LIMBS];
+	char what[128];
+	size_t i;
+	UINTN k;
+
+	for (i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+		k = from_hex(kats[i].modulus, n);
+		from_hex(kats[i].signature, s);
+		from_hex(kats[i].encoded, em);
+		compute_rr(rr, n, k);
+
+		RsaModExpF4(result, s, n, rr, k);
+		snprintf(what, sizeof(what), "%s RSA-%u signature^65537",
+			 mode, kats[i].bits);
+		check_limbs(what, result, em, k);
+	}
+}
+
+/*
+ * Random bases below each modulus, with the portable rows as the reference
+ * for the MULX/ADX ones
+ */
+static void
+run_random(void)
+{
+#if defined(MDE_CPU_X64)
+	BN_ULONG n[MAX_LIMBS], rr[MAX_LIMBS], a[MAX_LIMBS];
+	BN_ULONG generic[MAX_LIMBS], adx[MAX_LIMBS];
+	unsigned int round;
+	char what[128];
+	size_t i, j;
+	UINTN k;
+
+	srand(1);
+	for (i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+		k = from_hex(kats[i].modulus, n);
+		compute_rr(rr, n, k);
+		for (round = 0; round < 200; round++) {
+			for (j = 0; j < k * sizeof(BN_ULONG); j++)
+				((UINT8 *)a)[j] = rand();
+			a[k - 1] %= n[k - 1];
+			if (round == 0)
+				memset(a, 0xff, (k - 1) * sizeof(BN_ULONG));
+
+			mRsaMulAddRow = RsaMulAddRowGeneric;
+			RsaModExpF4(generic, a, n, rr, k);
+			mRsaMulAddRow = RsaMulAddRowAdx;
+			RsaModExpF4(adx, a, n, rr, k);
+
+			snprintf(what, sizeof(what),
+				 "RSA-%u random base %u, MULX/ADX vs portable",
+				 kats[i].bits, round);
+			check_limbs(what, adx, generic, k);
+		}
+	}
+#endif
+}
+
+static void
+set_bn(BIGNUM *bn, BN_ULONG *limbs, UINTN k)
+{
+	bn->d = limbs;
+	bn->top = k;
+	bn->dmax = MAX_LIMBS;
+	bn->neg = 0;
+	bn_correct_top(bn);
+}
+
+static void
+expect_fallback(const char *what, BIGNUM *a, BIGNUM *p, BIGNUM *m,
+		BN_MONT_CTX *mont)
+{
+	BN_ULONG limbs[MAX_LIMBS];
+	unsigned int before = fallbacks;
+	BIGNUM r;
+
+	set_bn(&r, limbs, 0);
+	if (RsaFastBnModExp(&r, a, p, m, NULL, mont) == 1 &&
+	    fallbacks == before + 1)
+		return;
+	printf("FAIL: %s was not handed to BN_mod_exp_mont()\n", what);
+	failures++;
+}
+
+/*
+ * The checks that decide whether RsaFastBnModExp() does the work or hands
+ * it to OpenSSL, and RsaFastVerifyInit() installing it
+ */
+static void
+run_bn_mod_exp(void)
+{
+	BN_ULONG n[MAX_LIMBS], s[MAX_LIMBS], em[MAX_LIMBS], rr[MAX_LIMBS];
+	BN_ULONG result[MAX_LIMBS], e[1], big[MAX_LIMBS + 1];
+	BIGNUM bn_n, bn_s, bn_e, bn_r, bn_big;
+	BN_MONT_CTX mont;
+	UINTN k;
+
+	k = from_hex(kats[0].modulus, n);
+	from_hex(kats[0].signature, s);
+	from_hex(kats[0].encoded, em);
+	compute_rr(rr, n, k);
+
+	set_bn(&bn_n, n, k);
+	set_bn(&bn_s, s, k);
+	e[0] = RSA_F4;
+	set_bn(&bn_e, e, 1);
+	mont.ri = k * BN_BITS2;
+	set_bn(&mont.RR, rr, k);
+	set_bn(&bn_r, result, 0);
+
+	fallbacks = 0;
+	if (RsaFastBnModExp(&bn_r, &bn_s, &bn_e, &bn_n, NULL, &mont) != 1 ||
+	    fallbacks != 0 || bn_r.top != (int)k ||
+	    memcmp(result, em, k * sizeof(*em))) {
+		printf("FAIL: RsaFastBnModExp() with RSA-%u\n", kats[0].bits);
+		failures++;
+	}
+
+	e[0] = 3;
+	expect_fallback("exponent 3", &bn_s, &bn_e, &bn_n, &mont);
+	e[0] = RSA_F4;
+
+	expect_fallback("no Montgomery context", &bn_s, &bn_e, &bn_n, NULL);
+
+	mont.ri -= BN_BITS2;
+	expect_fallback("a Montgomery context for another size", &bn_s, &bn_e,
+			&bn_n, &mont);
+	mont.ri += BN_BITS2;
+
+	set_bn(&bn_big, n, k);
+	expect_fallback("a base equal to the modulus", &bn_big, &bn_e, &bn_n,
+			&mont);
+	bn_s.neg = 1;
+	expect_fallback("a negative base", &bn_s, &bn_e, &bn_n, &mont);
+	bn_s.neg = 0;
+
+	n[0] ^= 1;
+	expect_fallback("an even modulus", &bn_s, &bn_e, &bn_n, &mont);
+	n[0] ^= 1;
+
+	memset(big, 0, sizeof(big));
+	big[0] = 1;
+	big[MAX_LIMBS] = 1;
+	set_bn(&bn_big, big, MAX_LIMBS + 1);
+	expect_fallback("a modulus over 4096 bits", &bn_s, &bn_e, &bn_big,
+			&mont);
+
+	if (!RsaFastVerifyInit() || !default_method ||
+	    default_method->bn_mod_exp != RsaFastBnModExp) {
+		printf("FAIL: RsaFastVerifyInit() did not install RsaFastBnModExp()\n");
+		failures++;
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const char *mode)
+{
+	BN_ULONG n[MAX_LIMBS], s[MAX_LIMBS], rr[MAX_LIMBS], result[MAX_LIMBS];
+	unsigned int count;
+	double start, elapsed;
+	size_t i;
+	UINTN k;
+
+	for (i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+		k = from_hex(kats[i].modulus, n);
+		from_hex(kats[i].signature, s);
+		compute_rr(rr, n, k);
+
+		count = 0;
+		start = now();
+		do {
+			RsaModExpF4(result, s, n, rr, k);
+			count++;
+			elapsed = now() - start;
+		} while (elapsed < BENCH_SECONDS);
+
+		printf("%-10s RSA-%u %10.0f verifies/s\n", mode,
+		       kats[i].bits, count / elapsed);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	BOOLEAN benchmark = FALSE, adx = FALSE;
+	int c;
+
+	while ((c = getopt(argc, argv, "b")) != -1) {
+		if (c != 'b') {
+			fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+			return 1;
+		}
+		benchmark = TRUE;
+	}
+
+	mRsaMulAddRow = RsaMulAddRowGeneric;
+	run_kats("portable");
+	run_bn_mod_exp();
+
+#if defined(MDE_CPU_X64)
+	adx = RsaAdxProbe();
+	if (adx) {
+		mRsaMulAddRow = RsaMulAddRowAdx;
+		run_kats("MULX/ADX");
+		run_random();
+	} else {
+		printf("test-rsa: no BMI2 and ADX on this CPU, only the portable rows were tested\n");
+	}
+#endif
+
+	if (failures) {
+		printf("test-rsa: %u failures\n", failures);
+		return 1;
+	}
+	printf("test-rsa: all RSA tests passed%s\n",
+	       adx ? " with the portable and MULX/ADX rows" : "");
+
+	if (benchmark) {
+		mRsaMulAddRow = RsaMulAddRowGeneric;
+		bench("portable");
+#if defined(MDE_CPU_X64)
+		if (adx) {
+			mRsaMulAddRow = RsaMulAddRowAdx;
+			bench("MULX/ADX");
+		}
+#endif
+	}
+
+	return 0;
+}
@@ -0,0 +1,429 @@
+/*
+ * Known answer tests for the SHA-1 and SHA-256 update routines in
+ * Cryptlib/Hash/CryptShaAccel.c and for the one-pass MultiHash wrapper in
+ * Cryptlib/Hash/CryptMultiHash.c, run with the CPU's hash instructions when
+ * it has them and without them either way, and a throughput benchmark of
+ * the two, and of MultiHash against separate SHA-256 and SHA-1 passes.
+ * The host's libcrypto is the reference for the random tests and does the
+ * work when the hash instructions are not used, so the benchmark's first
+ * line is the host's own (usually assembly) implementation rather than the
+ * portable C that the firmware build falls back to.
+ *
+ * usage: test-sha [-b]
+ *
+ * This program is licensed under the GNU Public License version 2.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "Hash/CryptShaAccel.c"
+#include "Hash/CryptMultiHash.c"
+
+#if defined(MDE_CPU_X64)
+#define ACCEL_NAME	"SHA-NI"
+#elif defined(MDE_CPU_AARCH64)
+#define ACCEL_NAME	"ARMv8 Crypto Extensions"
+#else
+#define ACCEL_NAME	"hash instructions"
+#endif
+
+#define BENCH_SIZE	(64 * 1024 * 1024)
+#define BENCH_CHUNK	(1024 * 1024)
+
+VOID *
+AllocatePool(UINTN size)
+{
+	return malloc(size);
+}
+
+VOID
+FreePool(VOID *buf)
+{
+	free(buf);
+}
+
+/* FIPS 180-2 appendix A and B */
+static const struct {
+	const char *message;
+	unsigned int repeat;
+	const char *sha1;
+	const char *sha256;
+	const char *sha384;
+	const char *sha512;
+} kats[] = {
+	{ "abc", 1,
+	  "a9993e364706816aba3e25717850c26c9cd0d89d",
+	  "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+	  "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded1631a8b605a43ff5bed8086072ba1e7cc2358baeca134c825a7",
+	  "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+	  "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f" },
+	{ "", 1,
+	  "da39a3ee5e6b4b0d3255bfef95601890afd80709",
+	  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+	  "38b060a751ac96384cd9327eb1b1e36a21fdb71114be07434c0cc7bf63f6e1da274edebfe76f65fbd51ad2f14898b95b",
+	  "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
+	  "47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+	  "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+	  "3391fdddfc8dc7393707a65b1b4709397cf8b1d162af05abfe8f450de5f36bc6b0455a8520bc4e6f5fe95b1fe3c8452b",
+	  "204a8fc6dda82f0a0ced7beb8e08a41657c16ef468b228a8279be331a703c335"
+	  "96fd15c13b1b07f9aa1d3bea57789ca031ad85c7a71dd70354ec631238ca3445" },
+	{ "a", 1000000,
+	  "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+	  "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+	  "9d0e1809716474cb086e834e310a4a1ced149e9c00f248527972cec5704c2a5b07b8b3dc38ecc4ebae97ddd87f3d8985",
+	  "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973eb"
+	  "de0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b" },
+};
+
+static unsigned int failures;
+
+static void
+to_hex(const UINT8 *digest, size_t size, char *hex)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static void
+check_digest(const char *what, const UINT8 *digest, size_t size,
+	     const char *expected)
+{
+	char hex[SHA512_DIGEST_SIZE * 2 + 1];
+
+	to_hex(digest, size, hex);
+	if (strcmp(hex, expected) == 0)
+		return;
+
+	printf("FAIL: %s\n  got      %s\n  expected %s\n", what, hex,
+	       expected);
+	failures++;
+}
+
+static BOOLEAN
+set_accel(BOOLEAN on)
+{
+#if defined(SHA_ACCEL_SUPPORTED)
+	mShaAccelFeatures = SHA_ACCEL_PROBED;
+	if (on)
+		mShaAccelFeatures |= ShaAccelProbe();
+	return (mShaAccelFeatures & SHA_ACCEL_SHA256) != 0;
+#else
+	return FALSE;
+#endif
+}
+
+static unsigned char *
+kat_message(size_t i, size_t *len)
+{
+	unsigned char *message;
+	size_t done;
+
+	*len = strlen(kats[i].message) * kats[i].repeat;
+	message = malloc(*len + 1);
+	if (!message)
+		err(1, "Could not allocate memory");
+	for (done = 0; done < *len; done += strlen(kats[i].message))
+		memcpy(message + done, kats[i].message,
+		       strlen(kats[i].message));
+	return message;
+}
+
+/*
+ * Feed a message to both algorithms in pieces of the given size, so that
+ * the block functions see both aligned and unaligned runs of blocks
+ */
+static void
+run_kats(const char *mode, size_t piece)
+{
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+	UINT8 digest1[SHA1_DIGEST_SIZE], digest256[SHA256_DIGEST_SIZE];
+	char what[128];
+	unsigned char *message;
+	size_t i, len, done, n;
+
+	for (i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+		message = kat_message(i, &len);
+
+		SHA1_Init(&sha1);
+		SHA256_Init(&sha256);
+		done = 0;
+		do {
+			n = len - done < piece ? len - done : piece;
+			if (!CryptSha1Update(&sha1, message + done, n) ||
+			    !CryptSha256Update(&sha256, message + done, n))
+				errx(1, "update failed");
+			done += n;
+		} while (done < len);
+		SHA1_Final(digest1, &sha1);
+		SHA256_Final(digest256, &sha256);
+
+		snprintf(what, sizeof(what), "%s SHA-1 of \"%.16s\" x%u in %zu byte pieces",
+			 mode, kats[i].message, kats[i].repeat, piece);
+		check_digest(what, digest1, sizeof(digest1), kats[i].sha1);
+		snprintf(what, sizeof(what), "%s SHA-256 of \"%.16s\" x%u in %zu byte pieces",
+			 mode, kats[i].message, kats[i].repeat, piece);
+		check_digest(what, digest256, sizeof(digest256),
+			     kats[i].sha256);
+
+		free(message);
+	}
+}
+
+/*
+ * The same messages through MultiHash with every digest selected.  The
+ * pieces straddle both block sizes and MULTI_HASH_STEP_SIZE, so that the
+ * contexts carry partial blocks from one step and one update to the next.
+ */
+static void
+run_multi_kats(const char *mode, size_t piece)
+{
+	static const char *names[] = { "SHA-1", "SHA-256", "SHA-384", "SHA-512" };
+	MULTI_HASH_VALUE value;
+	const UINT8 *digests[4];
+	const char *expected[4];
+	size_t sizes[4];
+	char what[128];
+	unsigned char *message;
+	VOID *ctx;
+	size_t i, j, len, done, n;
+
+	ctx = malloc(MultiHashGetContextSize());
+	if (!ctx)
+		err(1, "Could not allocate memory");
+
+	digests[0] = value.Sha1;
+	digests[1] = value.Sha256;
+	digests[2] = value.Sha384;
+	digests[3] = value.Sha512;
+	sizes[0] = sizeof(value.Sha1);
+	sizes[1] = sizeof(value.Sha256);
+	sizes[2] = sizeof(value.Sha384);
+	sizes[3] = sizeof(value.Sha512);
+
+	for (i = 0; i < sizeof(kats) / sizeof(kats[0]); i++) {
+		message = kat_message(i, &len);
+
+		if (!MultiHashInit(ctx, HASH_ALG_ALL))
+			errx(1, "MultiHashInit failed");
+		done = 0;
+		do {
+			n = len - done < piece ? len - done : piece;
+			if (!MultiHashUpdate(ctx, message + done, n))
+				errx(1, "MultiHashUpdate failed");
+			done += n;
+		} while (done < len);
+		if (!MultiHashFinal(ctx, &value))
+			errx(1, "MultiHashFinal failed");
+
+		expected[0] = kats[i].sha1;
+		expected[1] = kats[i].sha256;
+		expected[2] = kats[i].sha384;
+		expected[3] = kats[i].sha512;
+		for (j = 0; j < 4; j++) {
+			snprintf(what, sizeof(what), "%s MultiHash %s of \"%.16s\" x%u in %zu byte pieces",
+				 mode, names[j], kats[i].message,
+				 kats[i].repeat, piece);
+			check_digest(what, digests[j], sizes[j], expected[j]);
+		}
+
+		free(message);
+	}
+	free(ctx);
+}
+
+/*
+ * Random messages split at random points, against the host's libcrypto
+ */
+static void
+run_random(const char *mode)
+{
+	static unsigned char message[8192];
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+	UINT8 digest1[SHA1_DIGEST_SIZE], digest256[SHA256_DIGEST_SIZE];
+	UINT8 want1[SHA1_DIGEST_SIZE], want256[SHA256_DIGEST_SIZE];
+	size_t len, done, n;
+	unsigned int round;
+
+	srand(1);
+	for (round = 0; round < 2000; round++) {
+		len = rand() % sizeof(message);
+		for (n = 0; n < len; n++)
+			message[n] = rand();
+
+		SHA1_Init(&sha1);
+		SHA256_Init(&sha256);
+		for (done = 0; done < len; done += n) {
+			n = rand() % (len - done) + 1;
+			CryptSha1Update(&sha1, message + done, n);
+			CryptSha256Update(&sha256, message + done, n);
+		}
+		SHA1_Final(digest1, &sha1);
+		SHA256_Final(digest256, &sha256);
+
+		SHA1(message, len, want1);
+		SHA256(message, len, want256);
+		if (memcmp(digest1, want1, sizeof(want1)) ||
+		    memcmp(digest256, want256, sizeof(want256))) {
+			printf("FAIL: %s random message %u (%zu bytes)\n",
+			       mode, round, len);
+			failures++;
+		}
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const char *mode)
+{
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+	UINT8 digest[SHA256_DIGEST_SIZE];
+	unsigned char *buf;
+	size_t done;
+	double start, sha1_time, sha256_time;
+
+	buf = calloc(1, BENCH_CHUNK);
+	if (!buf)
+		err(1, "Could not allocate memory");
+
+	start = now();
+	SHA1_Init(&sha1);
+	for (done = 0; done < BENCH_SIZE; done += BENCH_CHUNK)
+		CryptSha1Update(&sha1, buf, BENCH_CHUNK);
+	SHA1_Final(digest, &sha1);
+	sha1_time = now() - start;
+
+	start = now();
+	SHA256_Init(&sha256);
+	for (done = 0; done < BENCH_SIZE; done += BENCH_CHUNK)
+		CryptSha256Update(&sha256, buf, BENCH_CHUNK);
+	SHA256_Final(digest, &sha256);
+	sha256_time = now() - start;
+
+	printf("%-28s SHA-1 %8.1f MB/s   SHA-256 %8.1f MB/s\n", mode,
+	       BENCH_SIZE / sha1_time / 1e6, BENCH_SIZE / sha256_time / 1e6);
+	free(buf);
+}
+
+/*
+ * SHA-1 and SHA-256 of one buffer too big for the cache, the way
+ * generate_hash() used to do it with a pass per digest, and with MultiHash
+ */
+static void
+bench_multi(const char *mode)
+{
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+	MULTI_HASH_VALUE value;
+	UINT8 digest[SHA256_DIGEST_SIZE];
+	unsigned char *buf;
+	VOID *ctx;
+	size_t i;
+	double start, two_time, multi_time;
+
+	buf = malloc(BENCH_SIZE);
+	ctx = malloc(MultiHashGetContextSize());
+	if (!buf || !ctx)
+		err(1, "Could not allocate memory");
+	for (i = 0; i < BENCH_SIZE; i++)
+		buf[i] = i * 7;
+
+	start = now();
+	SHA256_Init(&sha256);
+	SHA1_Init(&sha1);
+	CryptSha256Update(&sha256, buf, BENCH_SIZE);
+	CryptSha1Update(&sha1, buf, BENCH_SIZE);
+	SHA256_Final(digest, &sha256);
+	SHA1_Final(digest, &sha1);
+	two_time = now() - start;
+
+	start = now();
+	if (!MultiHashInit(ctx, HASH_ALG_SHA1 | HASH_ALG_SHA256) ||
+	    !MultiHashUpdate(ctx, buf, BENCH_SIZE) ||
+	    !MultiHashFinal(ctx, &value))
+		errx(1, "MultiHash failed");
+	multi_time = now() - start;
+
+	printf("%-28s two passes %8.1f MB/s   MultiHash %8.1f MB/s\n", mode,
+	       BENCH_SIZE / two_time / 1e6, BENCH_SIZE / multi_time / 1e6);
+	free(ctx);
+	free(buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const size_t pieces[] = { 1000000, 1, 63, 64, 65, 1000 };
+	static const size_t multi_pieces[] = {
+		1000000, 1, 63, 65, 127, 129, 2047, 2049
+	};
+	BOOLEAN benchmark = FALSE, accel;
+	size_t i;
+	int c;
+
+	while ((c = getopt(argc, argv, "b")) != -1) {
+		if (c != 'b') {
+			fprintf(stderr, "usage: %s [-b]\n", argv[0]);
+			return 1;
+		}
+		benchmark = TRUE;
+	}
+
+	set_accel(FALSE);
+	for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+		run_kats("portable", pieces[i]);
+	for (i = 0; i < sizeof(multi_pieces) / sizeof(multi_pieces[0]); i++)
+		run_multi_kats("portable", multi_pieces[i]);
+	run_random("portable");
+
+	accel = set_accel(TRUE);
+	if (accel) {
+		for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+			run_kats(ACCEL_NAME, pieces[i]);
+		for (i = 0; i < sizeof(multi_pieces) / sizeof(multi_pieces[0]); i++)
+			run_multi_kats(ACCEL_NAME, multi_pieces[i]);
+		run_random(ACCEL_NAME);
+	} else {
+		printf("test-sha: no %s on this CPU, only the portable path was tested\n",
+		       ACCEL_NAME);
+	}
+
+	if (failures) {
+		printf("test-sha: %u failures\n", failures);
+		return 1;
+	}
+	printf("test-sha: all SHA and MultiHash tests passed%s\n",
+	       accel ? " with and without " ACCEL_NAME : "");
+
+	if (benchmark) {
+		set_accel(FALSE);
+		bench("without (host libcrypto)");
+		bench_multi("without (host libcrypto)");
+		if (set_accel(TRUE)) {
+			bench(ACCEL_NAME);
+			bench_multi(ACCEL_NAME);
+		}
+	}
+
+	return 0;
+}
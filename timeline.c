@@ -0,0 +1,79 @@
+/*
+ * timeline.c - record when shim reaches each step of booting
+ *
+ * See timeline.h for what is recorded and how the OS gets to see it.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "shim.h"
+
+#include <timestamp.h>
+
+static timeline_entry_t timeline[TIMELINE_ENTRIES];
+static UINT32 timeline_count;
+
+/*
+ * Note that the step called name starts now.  This only reads a counter, so
+ * is cheap enough to call anywhere.
+ */
+void timeline_mark(const char *name)
+{
+	UINT64 now = read_timestamp();
+	timeline_entry_t *entry;
+	UINTN i;
+
+	if (timeline_count == TIMELINE_ENTRIES)
+		timeline_count--;
+
+	entry = &timeline[timeline_count++];
+	entry->ticks = now;
+	for (i = 0; i < TIMELINE_NAME_SIZE - 1 && name[i]; i++)
+		entry->name[i] = name[i];
+	entry->name[i] = '\0';
+}
+
+/*
+ * Publish the timeline so far, replacing any earlier copy
+ */
+void timeline_export(void)
+{
+	timeline_header_t *header;
+	UINT64 frequency = timestamp_frequency();
+	UINT8 *data;
+	UINTN size;
+	UINT32 i;
+	EFI_STATUS efi_status;
+
+	if (!frequency)
+		return;
+
+	for (i = 0; i < timeline_count; i++)
+		dprint(L"%a: %d us\n", timeline[i].name,
+		       (UINT32)((timeline[i].ticks - timeline[0].ticks) *
+				1000000 / frequency));
+
+	size = sizeof(*header) + timeline_count * sizeof(timeline[0]);
+	data = AllocateZeroPool(size);
+	if (!data) {
+		LogError(L"Could not allocate the boot timeline\n");
+		return;
+	}
+
+	header = (timeline_header_t *)data;
+	header->version = TIMELINE_VERSION;
+	header->count = timeline_count;
+	header->ticks_per_second = frequency;
+	CopyMem(header + 1, timeline, timeline_count * sizeof(timeline[0]));
+
+	efi_status = set_variable(TIMELINE_VARIABLE, &SHIM_LOCK_GUID,
+				  EFI_VARIABLE_BOOTSERVICE_ACCESS
+				  | EFI_VARIABLE_RUNTIME_ACCESS,
+				  size, data);
+	if (efi_status != EFI_SUCCESS)
+		LogError(L"Could not write %s: %r\n", TIMELINE_VARIABLE,
+			 efi_status);
+
+	FreePool(data);
+}
@@ -0,0 +1,42 @@
+#ifndef SHIM_TIMELINE_H
+#define SHIM_TIMELINE_H
+
+#include <efi.h>
+#include <efilib.h>
+
+/*
+ * When shim reaches each step of booting, it records the time in a
+ * timeline.  Just before starting the next stage it leaves the timeline
+ * for the OS in the volatile variable ShimBootTimeline under SHIM_LOCK_GUID,
+ * with boot services and runtime access, in the same spirit as
+ * systemd-boot's LoaderTimeInitUSec and LoaderTimeExecUSec.  showtimeline
+ * prints it from efivarfs.
+ *
+ * The variable holds a timeline_header_t followed by count
+ * timeline_entry_t, all little endian, in the order they were recorded.
+ * Each entry names the step that starts at that time, so a step lasts
+ * until the next entry.  Times are in read_timestamp() ticks, which count
+ * from reset, and ticks_per_second says how fast they run; see
+ * timestamp.h.  Only TIMELINE_ENTRIES are kept; once it is full, the last
+ * entry is replaced by each newer one.
+ */
+#define TIMELINE_VARIABLE	L"ShimBootTimeline"
+#define TIMELINE_VERSION	1
+#define TIMELINE_ENTRIES	64
+#define TIMELINE_NAME_SIZE	24
+
+typedef struct {
+	UINT32 version;
+	UINT32 count;
+	UINT64 ticks_per_second;
+} __attribute__((packed)) timeline_header_t;
+
+typedef struct {
+	UINT64 ticks;
+	CHAR8 name[TIMELINE_NAME_SIZE];	/* NUL terminated */
+} __attribute__((packed)) timeline_entry_t;
+
+void timeline_mark(const char *name);
+void timeline_export(void);
+
+#endif /* SHIM_TIMELINE_H */
@@ -1,5 +1,6 @@
 #include <efi.h>
 #include <efilib.h>
+#include "fwtrace.h"
 #include <string.h>
 #include <stdint.h>
 
@@ -254,6 +255,21 @@ static EFI_STATUS tpm_log_event_raw(EFI_PHYSICAL_ADDRESS buf, UINTN size,
 	return EFI_SUCCESS;
 }
 
+/*
+ * A TPM 1.2 has to be handed the SHA-1 Authenticode digest of the PE images
+ * tpm_log_pe() measures, while TPM 2.0 firmware calculates its own digests.
+ */
+BOOLEAN tpm_needs_sha1_digest(void)
+{
+	efi_tpm_protocol_t *tpm;
+	efi_tpm2_protocol_t *tpm2;
+
+	if (tpm_locate_protocol(&tpm, &tpm2, NULL, NULL) != EFI_SUCCESS)
+		return FALSE;
+
+	return tpm != NULL;
+}
+
 EFI_STATUS tpm_log_event(EFI_PHYSICAL_ADDRESS buf, UINTN size, UINT8 pcr,
 			 const CHAR8 *description)
 {
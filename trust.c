@@ -0,0 +1,641 @@
+/*
+ * trust.c - the certificates shim verifies images against, parsed once
+ *
+ * check_db_cert() used to read db or MokList with get_variable() for every
+ * image, then decode each certificate in it once for the EKU check and
+ * again inside AuthenticodeVerify().  Here every list is read and every
+ * certificate decoded and prechecked when shim starts, and the resulting
+ * X509 objects are handed straight to AuthenticodeContextVerify().
+ *
+ * The SHA-1 and SHA-256 hashes in each list are likewise copied into
+ * sorted indexes, so that looking an image up in a dbx or MokListX with
+ * thousands of entries is a binary search rather than a linear scan.
+ *
+ * When shim is built with VENDOR_DBX_FILE, the hashes in it are sorted at
+ * build time by dbxtable, which also generates a Bloom filter over them, so
+ * that most images can be ruled out of vendor_dbx without a search at all.
+ *
+ * An image's signature is decoded once, and rather than being verified
+ * against every certificate in a list, it is only verified against the
+ * ones that could be in its chain - the ones that issued or are one of the
+ * certificates it carries.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "shim.h"
+
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/objects.h>
+
+#include <Library/BaseCryptLib.h>
+
+#ifdef VENDOR_DBX_TABLE
+#include "vendor_dbx_table.h"
+#endif
+
+#define OID_EKU_MODSIGN "1.3.6.1.4.1.2312.16.1.2"
+
+static trust_list_t trust_lists[TRUST_LIST_COUNT];
+static BOOLEAN trust_store_loaded;
+static UINT32 trust_generation;
+
+/*
+ * Whether the EFI_SIGNATURE_LIST at the start of a buffer of the given size
+ * is complete
+ */
+static BOOLEAN esl_fits(EFI_SIGNATURE_LIST *CertList, UINTN size)
+{
+	if (size < sizeof(*CertList))
+		return FALSE;
+	if (CertList->SignatureListSize < sizeof(*CertList) +
+					  CertList->SignatureHeaderSize)
+		return FALSE;
+	if (CertList->SignatureListSize > size)
+		return FALSE;
+	return TRUE;
+}
+
+#define for_each_esl(CertList, db, dbsize, size)			\
+	for (CertList = (EFI_SIGNATURE_LIST *)(db), size = (dbsize);	\
+	     esl_fits(CertList, size);					\
+	     size -= CertList->SignatureListSize,			\
+	     CertList = (EFI_SIGNATURE_LIST *)((UINT8 *)CertList +	\
+				CertList->SignatureListSize))
+
+static UINTN esl_entries(EFI_SIGNATURE_LIST *CertList)
+{
+	if (CertList->SignatureSize == 0)
+		return 0;
+
+	return (CertList->SignatureListSize - sizeof (EFI_SIGNATURE_LIST) -
+		CertList->SignatureHeaderSize) / CertList->SignatureSize;
+}
+
+static BOOLEAN verify_x509(UINT8 *Cert, UINTN CertSize)
+{
+	UINTN length;
+
+	if (!Cert || CertSize < 4)
+		return FALSE;
+
+	/*
+	 * A DER encoding x509 certificate starts with SEQUENCE(0x30),
+	 * the number of length bytes, and the number of value bytes.
+	 * The size of a x509 certificate is usually between 127 bytes
+	 * and 64KB. For convenience, assume the number of value bytes
+	 * is 2, i.e. the second byte is 0x82.
+	 */
+	if (Cert[0] != 0x30 || Cert[1] != 0x82)
+		return FALSE;
+
+	length = Cert[2]<<8 | Cert[3];
+	if (length != (CertSize - 4))
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Certificates for kernel module signing must not be trusted for images
+ */
+static BOOLEAN verify_eku(X509 *x509, ASN1_OBJECT *module_signing)
+{
+	EXTENDED_KEY_USAGE *eku;
+	BOOLEAN ret = TRUE;
+	int i;
+
+	eku = X509_get_ext_d2i(x509, NID_ext_key_usage, NULL, NULL);
+	if (!eku)
+		return TRUE;
+
+	for (i = 0; i < sk_ASN1_OBJECT_num(eku); i++) {
+		ASN1_OBJECT *key_usage = sk_ASN1_OBJECT_value(eku, i);
+
+		if (OBJ_cmp(module_signing, key_usage) == 0) {
+			ret = FALSE;
+			break;
+		}
+	}
+	EXTENDED_KEY_USAGE_free(eku);
+
+	return ret;
+}
+
+static BOOLEAN add_anchor(trust_list_t *list, UINT8 *der, UINTN der_size)
+{
+	UINT8 *x509 = NULL;
+
+	if (!X509ConstructCertificate(der, der_size, &x509))
+		return FALSE;
+
+	/*
+	 * Work out the cached extension flags now, rather than the first
+	 * time each certificate is used to verify something.
+	 */
+	X509_check_purpose((X509 *)x509, -1, 0);
+
+	list->anchors[list->count].x509 = x509;
+	list->anchors[list->count].der = der;
+	list->anchors[list->count].der_size = der_size;
+	list->count++;
+
+	return TRUE;
+}
+
+static void swap_digests(UINT8 *a, UINT8 *b, UINTN size)
+{
+	UINT8 tmp;
+
+	while (size--) {
+		tmp = *a;
+		*a++ = *b;
+		*b++ = tmp;
+	}
+}
+
+/*
+ * Heapsort, since the lists come from outside and may be hostile
+ */
+static void sort_digests(UINT8 *digests, UINTN count, UINTN size)
+{
+	UINTN start, end, root, child;
+
+	if (count < 2)
+		return;
+
+	for (start = count / 2; start-- > 0; ) {
+		for (root = start; (child = 2 * root + 1) < count; root = child) {
+			if (child + 1 < count &&
+			    CompareMem(digests + child * size,
+				       digests + (child + 1) * size, size) < 0)
+				child++;
+			if (CompareMem(digests + root * size,
+				       digests + child * size, size) >= 0)
+				break;
+			swap_digests(digests + root * size,
+				     digests + child * size, size);
+		}
+	}
+
+	for (end = count - 1; end > 0; end--) {
+		swap_digests(digests, digests + end * size, size);
+		for (root = 0; (child = 2 * root + 1) < end; root = child) {
+			if (child + 1 < end &&
+			    CompareMem(digests + child * size,
+				       digests + (child + 1) * size, size) < 0)
+				child++;
+			if (CompareMem(digests + root * size,
+				       digests + child * size, size) >= 0)
+				break;
+			swap_digests(digests + root * size,
+				     digests + child * size, size);
+		}
+	}
+}
+
+/*
+ * Collect every hash of one type from an EFI_SIGNATURE_LIST buffer into a
+ * sorted index
+ */
+static EFI_STATUS build_digest_index(trust_digest_index_t *index, UINT8 *db,
+				     UINTN dbsize, EFI_GUID type, UINTN size)
+{
+	EFI_SIGNATURE_LIST *CertList;
+	EFI_SIGNATURE_DATA *Cert;
+	UINTN remaining, count = 0, i, n;
+	UINT8 *p;
+
+	for_each_esl(CertList, db, dbsize, remaining) {
+		if (CompareGuid(&CertList->SignatureType, &type) == 0 &&
+		    CertList->SignatureSize >= sizeof(EFI_GUID) + size)
+			count += esl_entries(CertList);
+	}
+	if (count == 0)
+		return EFI_SUCCESS;
+
+	index->digests = AllocatePool(count * size);
+	if (!index->digests)
+		return EFI_OUT_OF_RESOURCES;
+
+	p = index->digests;
+	for_each_esl(CertList, db, dbsize, remaining) {
+		if (CompareGuid(&CertList->SignatureType, &type) != 0 ||
+		    CertList->SignatureSize < sizeof(EFI_GUID) + size)
+			continue;
+
+		Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) CertList + sizeof (EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize);
+		n = esl_entries(CertList);
+		for (i = 0; i < n; i++) {
+			CopyMem(p, Cert->SignatureData, size);
+			p += size;
+			Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) Cert + CertList->SignatureSize);
+		}
+	}
+
+	index->count = count;
+	sort_digests(index->digests, count, size);
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Parse the X509 certificates in an EFI_SIGNATURE_LIST buffer.  As before,
+ * only the first certificate of each list is used.
+ */
+static EFI_STATUS load_signature_certs(trust_list_t *list, UINT8 *db,
+				       UINTN dbsize,
+				       ASN1_OBJECT *module_signing)
+{
+	EFI_SIGNATURE_LIST *CertList;
+	EFI_SIGNATURE_DATA *Cert;
+	EFI_GUID CertType = X509_GUID;
+	UINTN CertSize, size, count = 0;
+
+	for_each_esl(CertList, db, dbsize, size) {
+		if (CompareGuid(&CertList->SignatureType, &CertType) == 0)
+			count++;
+	}
+	if (count == 0)
+		return EFI_SUCCESS;
+
+	list->anchors = AllocateZeroPool(count * sizeof(*list->anchors));
+	if (!list->anchors)
+		return EFI_OUT_OF_RESOURCES;
+
+	for_each_esl(CertList, db, dbsize, size) {
+		X509 *x509;
+
+		if (CompareGuid(&CertList->SignatureType, &CertType) != 0 ||
+		    esl_entries(CertList) == 0)
+			continue;
+
+		Cert = (EFI_SIGNATURE_DATA *) ((UINT8 *) CertList + sizeof (EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize);
+		CertSize = CertList->SignatureSize - sizeof(EFI_GUID);
+		if (!verify_x509(Cert->SignatureData, CertSize)) {
+			if (verbose)
+				console_notify(L"Not a DER encoding x.509 Certificate");
+			continue;
+		}
+
+		/*
+		 * A certificate that can't be parsed could never have
+		 * verified anything, so it is simply left out.
+		 */
+		if (!add_anchor(list, Cert->SignatureData, CertSize))
+			continue;
+
+		x509 = list->anchors[list->count - 1].x509;
+		if (!verify_eku(x509, module_signing)) {
+			list->count--;
+			X509Free(x509);
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Index the hashes in an EFI_SIGNATURE_LIST buffer and parse its
+ * certificates
+ */
+static EFI_STATUS load_signature_list(trust_list_t *list, UINT8 *db,
+				      UINTN dbsize,
+				      ASN1_OBJECT *module_signing)
+{
+	EFI_STATUS efi_status;
+
+	efi_status = build_digest_index(&list->sha1, db, dbsize,
+					EFI_CERT_SHA1_GUID, SHA1_DIGEST_SIZE);
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+
+	efi_status = build_digest_index(&list->sha256, db, dbsize,
+					EFI_CERT_SHA256_GUID,
+					SHA256_DIGEST_SIZE);
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+
+	return load_signature_certs(list, db, dbsize, module_signing);
+}
+
+/*
+ * vendor_dbx's hashes were already sorted by dbxtable, so only its
+ * certificates need parsing
+ */
+static EFI_STATUS load_vendor_dbx(trust_list_t *list, UINT8 *db,
+				  UINTN dbsize, ASN1_OBJECT *module_signing)
+{
+	list->source = db;
+	list->source_size = dbsize;
+
+#ifdef VENDOR_DBX_TABLE
+	list->builtin = TRUE;
+	list->sha1.digests = (UINT8 *)vendor_dbx_sha1;
+	list->sha1.count = VENDOR_DBX_SHA1_COUNT;
+	list->sha256.digests = (UINT8 *)vendor_dbx_sha256;
+	list->sha256.count = VENDOR_DBX_SHA256_COUNT;
+	list->bloom = vendor_dbx_bloom;
+	list->bloom_bits = VENDOR_DBX_BLOOM_BITS;
+	list->bloom_hashes = VENDOR_DBX_BLOOM_HASHES;
+
+	return load_signature_certs(list, db, dbsize, module_signing);
+#else
+	return load_signature_list(list, db, dbsize, module_signing);
+#endif
+}
+
+static EFI_STATUS load_variable_list(trust_list_t *list,
+				     ASN1_OBJECT *module_signing)
+{
+	EFI_STATUS efi_status;
+	UINTN dbsize = 0;
+
+	efi_status = get_variable(list->name, &list->data, &dbsize,
+				  list->guid);
+	if (efi_status != EFI_SUCCESS) {
+		list->data = NULL;
+		return EFI_SUCCESS;
+	}
+	list->source = list->data;
+	list->source_size = dbsize;
+
+	return load_signature_list(list, list->data, dbsize, module_signing);
+}
+
+static EFI_STATUS load_cert(trust_list_t *list, UINT8 *cert, UINTN size)
+{
+	if (!cert || !size)
+		return EFI_SUCCESS;
+
+	list->source = cert;
+	list->source_size = size;
+
+	list->anchors = AllocateZeroPool(sizeof(*list->anchors));
+	if (!list->anchors)
+		return EFI_OUT_OF_RESOURCES;
+
+	add_anchor(list, cert, size);
+
+	return EFI_SUCCESS;
+}
+
+static void init_list(trust_list_id_t id, CHAR16 *name, EFI_GUID guid)
+{
+	trust_lists[id].name = name;
+	trust_lists[id].guid = guid;
+}
+
+/*
+ * Read and parse every certificate list, replacing anything loaded before
+ */
+EFI_STATUS trust_store_init(UINT8 *vendor_cert, UINTN vendor_cert_size,
+			    UINT8 *vendor_dbx, UINTN vendor_dbx_size,
+			    UINT8 *shim_cert, UINTN shim_cert_size)
+{
+	EFI_STATUS efi_status;
+	ASN1_OBJECT *module_signing;
+
+	trust_store_free();
+	trust_generation++;
+
+	init_list(TRUST_VENDOR_DBX, L"dbx", SIG_DB);
+	init_list(TRUST_DBX, L"dbx", SIG_DB);
+	init_list(TRUST_MOK_LIST_X, L"MokListX", SHIM_LOCK_GUID);
+	init_list(TRUST_DB, L"db", SIG_DB);
+	init_list(TRUST_MOK_LIST, L"MokList", SHIM_LOCK_GUID);
+	init_list(TRUST_SHIM_CERT, L"Shim", SHIM_LOCK_GUID);
+	init_list(TRUST_VENDOR_CERT, L"Shim", SHIM_LOCK_GUID);
+
+	module_signing = OBJ_nid2obj(OBJ_create(OID_EKU_MODSIGN, NULL, NULL));
+
+	efi_status = load_vendor_dbx(&trust_lists[TRUST_VENDOR_DBX],
+				     vendor_dbx, vendor_dbx_size,
+				     module_signing);
+	if (efi_status == EFI_SUCCESS)
+		efi_status = load_variable_list(&trust_lists[TRUST_DBX],
+						module_signing);
+	if (efi_status == EFI_SUCCESS)
+		efi_status = load_variable_list(&trust_lists[TRUST_MOK_LIST_X],
+						module_signing);
+	if (efi_status == EFI_SUCCESS)
+		efi_status = load_variable_list(&trust_lists[TRUST_DB],
+						module_signing);
+	if (efi_status == EFI_SUCCESS)
+		efi_status = load_variable_list(&trust_lists[TRUST_MOK_LIST],
+						module_signing);
+	if (efi_status == EFI_SUCCESS)
+		efi_status = load_cert(&trust_lists[TRUST_SHIM_CERT],
+				       shim_cert, shim_cert_size);
+	if (efi_status == EFI_SUCCESS)
+		efi_status = load_cert(&trust_lists[TRUST_VENDOR_CERT],
+				       vendor_cert, vendor_cert_size);
+
+	OBJ_cleanup();
+
+	if (efi_status != EFI_SUCCESS) {
+		trust_store_free();
+		return efi_status;
+	}
+
+	trust_store_loaded = TRUE;
+	dprint(L"Trust store: %d db, %d MokList, %d dbx, %d MokListX certificates\n",
+	       (UINT32)trust_lists[TRUST_DB].count,
+	       (UINT32)trust_lists[TRUST_MOK_LIST].count,
+	       (UINT32)(trust_lists[TRUST_DBX].count +
+			trust_lists[TRUST_VENDOR_DBX].count),
+	       (UINT32)trust_lists[TRUST_MOK_LIST_X].count);
+	dprint(L"Trust store: %d db, %d MokList, %d dbx, %d MokListX SHA-256 hashes\n",
+	       (UINT32)trust_lists[TRUST_DB].sha256.count,
+	       (UINT32)trust_lists[TRUST_MOK_LIST].sha256.count,
+	       (UINT32)(trust_lists[TRUST_DBX].sha256.count +
+			trust_lists[TRUST_VENDOR_DBX].sha256.count),
+	       (UINT32)trust_lists[TRUST_MOK_LIST_X].sha256.count);
+
+	return EFI_SUCCESS;
+}
+
+void trust_store_free(void)
+{
+	trust_list_t *list;
+	UINTN i;
+	int id;
+
+	for (id = 0; id < TRUST_LIST_COUNT; id++) {
+		list = &trust_lists[id];
+
+		for (i = 0; i < list->count; i++)
+			X509Free(list->anchors[i].x509);
+		if (list->anchors)
+			FreePool(list->anchors);
+		if (list->sha1.digests && !list->builtin)
+			FreePool(list->sha1.digests);
+		if (list->sha256.digests && !list->builtin)
+			FreePool(list->sha256.digests);
+		if (list->data)
+			FreePool(list->data);
+		ZeroMem(list, sizeof(*list));
+	}
+
+	trust_store_loaded = FALSE;
+}
+
+/*
+ * Changes every time the store is loaded, so that results worked out from
+ * an earlier store can be told apart
+ */
+UINT32 trust_store_generation(void)
+{
+	return trust_generation;
+}
+
+/*
+ * Hash everything the store was loaded from, so that anything remembered
+ * about it can be tied to this exact set of lists.  Each list's size is
+ * hashed along with its contents, so data can't shift from one list into
+ * the next without changing the result.
+ */
+BOOLEAN trust_store_fingerprint(UINT8 *hash)
+{
+	trust_list_t *list;
+	UINT64 size;
+	void *ctx;
+	BOOLEAN ok;
+	int id;
+
+	if (!trust_store_loaded)
+		return FALSE;
+
+	ctx = AllocatePool(Sha256GetContextSize());
+	if (!ctx)
+		return FALSE;
+
+	ok = Sha256Init(ctx);
+	for (id = 0; ok && id < TRUST_LIST_COUNT; id++) {
+		list = &trust_lists[id];
+		size = list->source_size;
+		ok = Sha256Update(ctx, &size, sizeof(size));
+		if (ok && size)
+			ok = Sha256Update(ctx, list->source,
+					  list->source_size);
+	}
+	if (ok)
+		ok = Sha256Final(ctx, hash);
+
+	FreePool(ctx);
+	return ok;
+}
+
+/*
+ * Returns NULL if the store hasn't been loaded
+ */
+trust_list_t *trust_store_get(trust_list_id_t id)
+{
+	if (!trust_store_loaded || id >= TRUST_LIST_COUNT)
+		return NULL;
+
+	return &trust_lists[id];
+}
+
+/*
+ * Whether a hash might be in a list with a Bloom filter.  Each of the
+ * filter's hash functions is one 32-bit word of the hash itself, which
+ * must match what dbxtable does.
+ */
+static BOOLEAN bloom_may_contain(trust_list_t *list, UINT8 *digest)
+{
+	UINT32 bit;
+	UINTN k;
+
+	for (k = 0; k < list->bloom_hashes; k++) {
+		bit = digest[k * 4] | digest[k * 4 + 1] << 8 |
+		      digest[k * 4 + 2] << 16 | (UINT32)digest[k * 4 + 3] << 24;
+		bit &= list->bloom_bits - 1;
+		if (!(list->bloom[bit / 32] & (1U << (bit % 32))))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Look a hash up in a list's index for its type
+ */
+BOOLEAN trust_list_has_digest(trust_list_t *list, EFI_GUID type,
+			      UINT8 *digest, UINTN size)
+{
+	trust_digest_index_t *index;
+	UINTN lo, hi, mid;
+	INTN cmp;
+
+	if (size == SHA256_DIGEST_SIZE &&
+	    CompareGuid(&type, &EFI_CERT_SHA256_GUID) == 0)
+		index = &list->sha256;
+	else if (size == SHA1_DIGEST_SIZE &&
+		 CompareGuid(&type, &EFI_CERT_SHA1_GUID) == 0)
+		index = &list->sha1;
+	else
+		return FALSE;
+
+	if (index->count == 0)
+		return FALSE;
+	if (list->bloom && !bloom_may_contain(list, digest))
+		return FALSE;
+
+	lo = 0;
+	hi = index->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = CompareMem(digest, index->digests + mid * size, size);
+		if (cmp == 0)
+			return TRUE;
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Decode an image's signature and check it was made over sha256hash, once
+ * for all of the lists it is checked against
+ */
+void trust_signature_init(trust_signature_t *sig, UINT8 *data, UINTN size,
+			  UINT8 *sha256hash)
+{
+	sig->context = AuthenticodeContextCreate(data, size, sha256hash,
+						 SHA256_DIGEST_SIZE);
+}
+
+void trust_signature_free(trust_signature_t *sig)
+{
+	AuthenticodeContextFree(sig->context);
+	sig->context = NULL;
+}
+
+/*
+ * Whether a trust anchor could end the signature's chain: whether it is
+ * one of the certificates the signature carries, or their issuer.  A
+ * signature that couldn't be decoded or doesn't match the image can't be
+ * verified by anything.
+ */
+BOOLEAN trust_anchor_may_verify(trust_signature_t *sig,
+				trust_anchor_t *anchor)
+{
+	if (!sig->context)
+		return FALSE;
+
+	return AuthenticodeContextMayChainTo(sig->context, anchor->x509);
+}
+
+BOOLEAN trust_anchor_verify(trust_signature_t *sig, trust_anchor_t *anchor)
+{
+	if (!sig->context)
+		return FALSE;
+
+	return AuthenticodeContextVerify(sig->context, anchor->x509);
+}
@@ -0,0 +1,76 @@
+#ifndef SHIM_TRUST_H
+#define SHIM_TRUST_H
+
+#include <efi.h>
+#include <efilib.h>
+
+/*
+ * The certificate lists that image signatures are checked against.  They
+ * are read and parsed once by trust_store_init() instead of for every image.
+ */
+typedef enum {
+	TRUST_VENDOR_DBX,
+	TRUST_DBX,
+	TRUST_MOK_LIST_X,
+	TRUST_DB,
+	TRUST_MOK_LIST,
+	TRUST_SHIM_CERT,
+	TRUST_VENDOR_CERT,
+	TRUST_LIST_COUNT
+} trust_list_id_t;
+
+typedef struct {
+	void *x509;		/* from X509ConstructCertificate() */
+	UINT8 *der;		/* the certificate as it appears in its list */
+	UINTN der_size;
+} trust_anchor_t;
+
+/*
+ * The hashes of one type from a list, sorted so they can be binary searched
+ */
+typedef struct {
+	UINT8 *digests;
+	UINTN count;
+} trust_digest_index_t;
+
+typedef struct {
+	CHAR16 *name;		/* what a match is measured as */
+	EFI_GUID guid;
+	UINT8 *data;		/* our copy of the variable, if it is one */
+	UINT8 *source;		/* what the list was loaded from */
+	UINTN source_size;
+	trust_anchor_t *anchors;
+	UINTN count;
+	trust_digest_index_t sha1;
+	trust_digest_index_t sha256;
+	BOOLEAN builtin;	/* the indexes were generated when shim was built */
+	UINT32 *bloom;		/* filter checked before the indexes, if any */
+	UINTN bloom_bits;
+	UINTN bloom_hashes;
+} trust_list_t;
+
+/*
+ * An image's Authenticode signature, decoded and checked against the
+ * image's hash
+ */
+typedef struct {
+	void *context;		/* from AuthenticodeContextCreate(), or NULL */
+} trust_signature_t;
+
+EFI_STATUS trust_store_init(UINT8 *vendor_cert, UINTN vendor_cert_size,
+			    UINT8 *vendor_dbx, UINTN vendor_dbx_size,
+			    UINT8 *shim_cert, UINTN shim_cert_size);
+void trust_store_free(void);
+trust_list_t *trust_store_get(trust_list_id_t id);
+BOOLEAN trust_store_fingerprint(UINT8 *hash);
+UINT32 trust_store_generation(void);
+BOOLEAN trust_list_has_digest(trust_list_t *list, EFI_GUID type,
+			      UINT8 *digest, UINTN size);
+void trust_signature_init(trust_signature_t *sig, UINT8 *data, UINTN size,
+			  UINT8 *sha256hash);
+void trust_signature_free(trust_signature_t *sig);
+BOOLEAN trust_anchor_may_verify(trust_signature_t *sig,
+				trust_anchor_t *anchor);
+BOOLEAN trust_anchor_verify(trust_signature_t *sig, trust_anchor_t *anchor);
+
+#endif /* SHIM_TRUST_H */
@@ -0,0 +1,182 @@
+/*
+ * verify_cache.c - remember which images have already been verified
+ *
+ * Checking an Authenticode signature against the trust store means
+ * building and verifying its certificate chain, and on most boots shim
+ * does that for the same grub and kernel it verified last time.  When shim
+ * is built with ENABLE_VERIFY_CACHE, the SHA-256 of each image whose
+ * signature verified is kept in a boot services only variable, along with
+ * the anchor that verified it, and an image found there only needs hashing.
+ *
+ * The OS can't create or change a variable without runtime access, so one
+ * that has it was not written by us and is deleted unread, the same way
+ * verify_mok() treats MokList.  Entries are only valid for the exact trust
+ * store they were made with: a change to any of the lists, to MokSBState or
+ * MokDBState, or to shim itself changes the fingerprint and drops them all.
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "shim.h"
+
+#include <Library/BaseCryptLib.h>
+
+#define VERIFY_CACHE_NAME L"ShimVerifyCache"
+#define VERIFY_CACHE_ATTRIBUTES (EFI_VARIABLE_NON_VOLATILE | \
+				 EFI_VARIABLE_BOOTSERVICE_ACCESS)
+
+static verify_cache_header_t cache;
+static verify_cache_entry_t cache_entries[VERIFY_CACHE_ENTRIES];
+static BOOLEAN cache_ready;
+
+static BOOLEAN cache_fingerprint(UINT8 insecure_mode, UINT8 ignore_db,
+				 UINT8 *hash)
+{
+	UINT8 store[SHA256_DIGEST_SIZE];
+	void *ctx;
+	BOOLEAN ok;
+
+	if (!trust_store_fingerprint(store))
+		return FALSE;
+
+	ctx = AllocatePool(Sha256GetContextSize());
+	if (!ctx)
+		return FALSE;
+
+	ok = Sha256Init(ctx) &&
+	     Sha256Update(ctx, shim_version, strlena(shim_version)) &&
+	     Sha256Update(ctx, &insecure_mode, sizeof(insecure_mode)) &&
+	     Sha256Update(ctx, &ignore_db, sizeof(ignore_db)) &&
+	     Sha256Update(ctx, store, sizeof(store)) &&
+	     Sha256Final(ctx, hash);
+
+	FreePool(ctx);
+	return ok;
+}
+
+/*
+ * Load the entries that are still valid for the trust store that was just
+ * loaded.  Must be called again whenever the store is reloaded.
+ */
+void verify_cache_init(UINT8 insecure_mode, UINT8 ignore_db)
+{
+	UINT8 *data = NULL;
+	UINTN size = 0;
+	UINT32 attributes;
+	verify_cache_header_t *header;
+	EFI_STATUS efi_status;
+
+	cache_ready = FALSE;
+	ZeroMem(&cache, sizeof(cache));
+	cache.version = VERIFY_CACHE_VERSION;
+
+	if (!cache_fingerprint(insecure_mode, ignore_db, cache.fingerprint)) {
+		LogError(L"Could not fingerprint the trust store\n");
+		return;
+	}
+	cache_ready = TRUE;
+
+	efi_status = get_variable_attr(VERIFY_CACHE_NAME, &data, &size,
+				       SHIM_LOCK_GUID, &attributes);
+	if (efi_status != EFI_SUCCESS)
+		return;
+
+	if (attributes != VERIFY_CACHE_ATTRIBUTES) {
+		LogError(L"%s has the wrong attributes, deleting it\n",
+			 VERIFY_CACHE_NAME);
+		delete_variable(VERIFY_CACHE_NAME, &SHIM_LOCK_GUID);
+		goto done;
+	}
+
+	header = (verify_cache_header_t *)data;
+	if (size < sizeof(*header) ||
+	    header->version != VERIFY_CACHE_VERSION ||
+	    header->count > VERIFY_CACHE_ENTRIES ||
+	    size != sizeof(*header) + header->count * sizeof(cache_entries[0])) {
+		dprint(L"Ignoring malformed %s\n", VERIFY_CACHE_NAME);
+		goto done;
+	}
+
+	if (CompareMem(header->fingerprint, cache.fingerprint,
+		       sizeof(cache.fingerprint))) {
+		dprint(L"Trust store has changed, dropping %d cached images\n",
+		       header->count);
+		goto done;
+	}
+
+	cache.count = header->count;
+	CopyMem(cache_entries, header + 1,
+		cache.count * sizeof(cache_entries[0]));
+	dprint(L"%d verified images cached\n", cache.count);
+
+done:
+	FreePool(data);
+}
+
+BOOLEAN verify_cache_lookup(UINT8 *sha256hash, trust_list_id_t *id,
+			    UINTN *anchor)
+{
+	UINT32 i;
+
+	if (!cache_ready)
+		return FALSE;
+
+	for (i = 0; i < cache.count; i++) {
+		if (CompareMem(cache_entries[i].sha256hash, sha256hash,
+			       SHA256_DIGEST_SIZE))
+			continue;
+
+		*id = cache_entries[i].list;
+		*anchor = cache_entries[i].anchor;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Remember that an image verified against an anchor, dropping the oldest
+ * entry if the cache is full
+ */
+void verify_cache_add(UINT8 *sha256hash, trust_list_id_t id, UINTN anchor)
+{
+	trust_list_id_t cached_id;
+	UINTN cached_anchor;
+	verify_cache_entry_t *entry;
+	UINT8 *data;
+	UINTN size;
+	EFI_STATUS efi_status;
+
+	if (!cache_ready ||
+	    verify_cache_lookup(sha256hash, &cached_id, &cached_anchor))
+		return;
+
+	if (cache.count == VERIFY_CACHE_ENTRIES) {
+		CopyMem(&cache_entries[0], &cache_entries[1],
+			(VERIFY_CACHE_ENTRIES - 1) * sizeof(cache_entries[0]));
+		cache.count--;
+	}
+
+	entry = &cache_entries[cache.count++];
+	CopyMem(entry->sha256hash, sha256hash, SHA256_DIGEST_SIZE);
+	entry->list = id;
+	entry->anchor = anchor;
+
+	size = sizeof(cache) + cache.count * sizeof(cache_entries[0]);
+	data = AllocatePool(size);
+	if (!data)
+		return;
+
+	CopyMem(data, &cache, sizeof(cache));
+	CopyMem(data + sizeof(cache), cache_entries,
+		cache.count * sizeof(cache_entries[0]));
+
+	efi_status = set_variable(VERIFY_CACHE_NAME, &SHIM_LOCK_GUID,
+				  VERIFY_CACHE_ATTRIBUTES, size, data);
+	if (efi_status != EFI_SUCCESS)
+		LogError(L"Could not write %s: %r\n", VERIFY_CACHE_NAME,
+			 efi_status);
+
+	FreePool(data);
+}
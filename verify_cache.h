@@ -0,0 +1,41 @@
+#ifndef SHIM_VERIFY_CACHE_H
+#define SHIM_VERIFY_CACHE_H
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "trust.h"
+
+/*
+ * The images whose signatures have verified, kept in the boot services only
+ * NV variable ShimVerifyCache under SHIM_LOCK_GUID, which holds a
+ * verify_cache_header_t followed by count verify_cache_entry_t.  All
+ * integers are little endian.
+ *
+ * The fingerprint is a SHA-256 over shim's version string, the MokSBState
+ * and MokDBState settings, and every list in the trust store.  An image
+ * whose Authenticode SHA-256 is in the cache was verified against the
+ * anchor given by list and anchor in a trust store with that fingerprint;
+ * if the fingerprint no longer matches, every entry is dropped.
+ */
+#define VERIFY_CACHE_VERSION	1
+#define VERIFY_CACHE_ENTRIES	32
+
+typedef struct {
+	UINT32 version;
+	UINT32 count;
+	UINT8 fingerprint[SHA256_DIGEST_SIZE];
+} __attribute__((packed)) verify_cache_header_t;
+
+typedef struct {
+	UINT8 sha256hash[SHA256_DIGEST_SIZE];
+	UINT32 list;		/* a trust_list_id_t */
+	UINT32 anchor;		/* index into that list's anchors */
+} __attribute__((packed)) verify_cache_entry_t;
+
+void verify_cache_init(UINT8 insecure_mode, UINT8 ignore_db);
+BOOLEAN verify_cache_lookup(UINT8 *sha256hash, trust_list_id_t *id,
+			    UINTN *anchor);
+void verify_cache_add(UINT8 *sha256hash, trust_list_id_t id, UINTN anchor);
+
+#endif /* SHIM_VERIFY_CACHE_H */